@@ -117,6 +117,15 @@
 #define ARM64_ERRATUM_1530923
 #define MAX_VM_NUM 4
 #define MAX_OS_NUM 3
+#define RT_HYPERVISOR_FDT_ADDR 0x0
+#define RT_HYPERVISOR_MEM_POOL_ADDR 0x50000000
+#define RT_HYPERVISOR_MEM_POOL_SIZE 0
+#define RT_HYPERVISOR_MEM_BUDGET 64
+#define RT_HYPERVISOR_MEM_MERGE_MS 0
+#define RT_HYPERVISOR_MEM_MERGE_COPY 32
+#define RT_HYPERVISOR_CACHE_COLORS 0
+#define RT_HYPERVISOR_HALT_POLL_NS 200000
+#define RT_HYPERVISOR_VC_LOG_SIZE 4096
 
 /* RT-Thread online packages */
 
@@ -0,0 +1,527 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-11-14     Suqier       first version
+ * 2022-12-06     Suqier       cache coloring benchmark
+ * 2022-12-08     Suqier       guest RAM regions
+ */
+
+#include <rtthread.h>
+#include <stdlib.h>
+#include <gtimer.h>
+
+#include "hypervisor.h"
+#include "switch.h"
+#include "stage2.h"
+#include "vdev.h"
+#include "vgic.h"
+#include "os.h"
+#include "vm.h"
+#include "mem_color.h"
+#include "hyp_bench.h"
+
+#ifdef RT_USING_UTEST
+#include <utest.h>
+#endif
+
+#define BENCH_TIMEOUT   (RT_TICK_PER_SECOND * 30)
+
+extern const rt_uint8_t bench_guest_start[];
+extern const rt_uint8_t bench_guest_end[];
+extern const rt_uint8_t bench_llc_guest_start[];
+extern const rt_uint8_t bench_llc_guest_end[];
+
+/* All result rows, world switch first and then guest phases */
+enum
+{
+    BENCH_ROW_H2G = 0,
+    BENCH_ROW_G2H,
+    BENCH_ROW_HVC,
+    BENCH_ROW_MMIO_WR,
+    BENCH_ROW_MMIO_RD,
+    BENCH_ROW_VIRQ,
+    BENCH_ROW_VTIMER,
+    BENCH_ROW_NUM,
+};
+
+static const char *bench_row_str[BENCH_ROW_NUM] =
+{
+    "switch h2g", "switch g2h", "hvc null", "mmio write",
+    "mmio read", "virq inject", "vtimer jitter",
+};
+
+/* Victim working set runs of the cache coloring benchmark */
+enum
+{
+    BENCH_LLC_ALONE = 0,
+    BENCH_LLC_NOISY,
+    BENCH_LLC_COLORED,
+    BENCH_LLC_NUM,
+};
+
+static const char *bench_llc_str[BENCH_LLC_NUM] =
+{
+    "llc alone", "llc noisy", "llc colored",
+};
+
+static struct os_desc bench_os;
+static struct os_desc bench_llc_os[2];
+static struct bench_stat bench_llc_stats[BENCH_LLC_NUM];
+static struct vdev bench_vdev;
+static struct rt_semaphore bench_sem;
+static struct rt_timer bench_virq_timer;
+static struct bench_mailbox *bench_mb;
+static vm_t bench_vm;
+
+static rt_uint32_t bench_scratch;
+static rt_uint32_t bench_phase_done;
+static volatile rt_bool_t bench_running = RT_FALSE;
+
+static rt_uint64_t sw_samples[BENCH_SW_NUM][BENCH_MAX_SAMPLES];
+static volatile rt_uint32_t sw_count[BENCH_SW_NUM];
+static rt_uint64_t row_samples[BENCH_MAX_SAMPLES];
+static struct bench_stat bench_stats[BENCH_ROW_NUM];
+
+/*
+ * Called by switch_hook() with the cycles it spends on save/restore.
+ */
+void hyp_bench_switch_record(rt_uint8_t type, struct vcpu *vcpu, rt_uint64_t cycles)
+{
+    rt_uint8_t idx;
+
+    if (!bench_running || vcpu == RT_NULL || vcpu->vm != bench_vm)
+        return;
+
+    if (type == HOST_TO_GUEST)
+        idx = BENCH_SW_H2G;
+    else if (type == GUEST_TO_HOST)
+        idx = BENCH_SW_G2H;
+    else
+        return;
+
+    if (sw_count[idx] < BENCH_MAX_SAMPLES)
+        sw_samples[idx][sw_count[idx]++] = cycles;
+}
+
+static void bench_doorbell(rt_uint32_t val)
+{
+    rt_uint32_t cmd = val >> BENCH_DB_CMD_SHIFT;
+    rt_uint32_t phase = val & BENCH_DB_PHASE_MASK;
+
+    switch (cmd)
+    {
+    case BENCH_DB_PHASE_DONE:
+        bench_phase_done |= (1UL << phase);
+        break;
+    case BENCH_DB_VIRQ_ARM:
+        rt_timer_start(&bench_virq_timer);
+        break;
+    case BENCH_DB_ALL_DONE:
+        rt_sem_release(&bench_sem);
+        break;
+
+    default:
+        rt_kprintf("[Error] Bench: unknown doorbell 0x%08x\n", val);
+        break;
+    }
+}
+
+static void bench_mmio_handler(vdev_t vdev, gp_regs_t regs, access_info_t acc)
+{
+    unsigned long long *val = regs_xn(regs, acc.srt);
+    rt_uint64_t off = acc.addr - BENCH_MMIO_IPA;
+
+    switch (off)
+    {
+    case BENCH_MMIO_SCRATCH:
+        if (acc.is_write)
+            bench_scratch = (rt_uint32_t)*val;
+        else
+            *val = bench_scratch;
+        break;
+    case BENCH_MMIO_DOORBELL:
+        if (acc.is_write)
+            bench_doorbell((rt_uint32_t)*val);
+        else
+            *val = bench_phase_done;
+        break;
+
+    default:
+        if (!acc.is_write)
+            *val = 0;
+        break;
+    }
+}
+
+const static struct vdev_ops bench_vdev_ops =
+{
+    .mmio = bench_mmio_handler,
+};
+
+/* Hard timer: stamp in guest virtual count and inject the bench SPI. */
+static void bench_virq_timeout(void *parameter)
+{
+    vcpu_t vcpu = bench_vm->vcpus[0];
+    rt_uint64_t cntvoff;
+
+    GET_SYS_REG(CNTVOFF_EL2, cntvoff);
+    bench_mb->t0 = rt_hw_get_cntpct_val() - cntvoff;
+    rt_hw_cpu_dcache_ops(RT_HW_CACHE_FLUSH, (void *)&bench_mb->t0, sizeof(rt_uint64_t));
+    vcpu->vm->vgic->ops->inject(vcpu, vgic_get_virq(vcpu, BENCH_VIRQ_SPI));
+}
+
+static void bench_os_init(void)
+{
+    rt_memset(&bench_os, 0, sizeof(struct os_desc));
+
+    bench_os.img.addr = (rt_uint64_t)bench_guest_start;
+    bench_os.img.size = (rt_uint64_t)(bench_guest_end - bench_guest_start);
+    bench_os.img.ep   = BENCH_GUEST_IPA;
+    bench_os.img.type = OS_TYPE_OTHER;
+    bench_os.cpu.num  = 1;
+    bench_os.mem.region[0].addr = BENCH_GUEST_IPA;
+    bench_os.mem.region[0].size = BENCH_GUEST_MEM;
+    bench_os.mem.num  = 1;
+    bench_os.devs.num = 0;      /* no pass-through device, no vConsole */
+
+    /* vGIC layout of the QEMU virt board */
+    bench_os.arch = os_img[0].arch;
+}
+
+static void bench_vdev_init(vm_t vm)
+{
+    rt_memset(&bench_vdev, 0, sizeof(struct vdev));
+
+    bench_vdev.dev = RT_NULL;
+    bench_vdev.mmap_num = 1;
+    bench_vdev.region[0].vaddr_start = BENCH_MMIO_IPA;
+    bench_vdev.region[0].vaddr_end   = BENCH_MMIO_IPA + BENCH_MMIO_SIZE;
+    bench_vdev.region[0].paddr_start = 0;
+    bench_vdev.region[0].attr        = DEVICE_MEM;
+    bench_vdev.ops = &bench_vdev_ops;
+    bench_vdev.is_open = RT_TRUE;
+    vdev_register(vm, &bench_vdev);
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    rt_uint64_t x = *(const rt_uint64_t *)a;
+    rt_uint64_t y = *(const rt_uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void bench_stat_calc(struct bench_stat *s, rt_uint64_t *samples, rt_uint32_t n)
+{
+    rt_uint64_t sum = 0;
+
+    rt_memset(s, 0, sizeof(struct bench_stat));
+    if (n == 0)
+        return;
+
+    qsort(samples, n, sizeof(rt_uint64_t), bench_cmp);
+    for (rt_size_t i = 0; i < n; i++)
+        sum += samples[i];
+
+    s->count = n;
+    s->min = samples[0];
+    s->max = samples[n - 1];
+    s->avg = sum / n;
+    s->p99 = samples[(n * 99 - 1) / 100];
+}
+
+/* Timer phase reports |interval - expected period| between two vIRQs. */
+static rt_uint32_t bench_jitter_samples(rt_uint64_t *out, rt_uint32_t n)
+{
+    rt_uint64_t period = rt_hw_get_gtimer_frq() / RT_TICK_PER_SECOND;
+    rt_uint32_t i;
+
+    for (i = 1; i < n; i++)
+    {
+        rt_uint64_t interval = bench_mb->samples[BENCH_PHASE_VTIMER][i]
+                             - bench_mb->samples[BENCH_PHASE_VTIMER][i - 1];
+        out[i - 1] = (interval > period) ? interval - period : period - interval;
+    }
+
+    return (n > 0) ? n - 1 : 0;
+}
+
+/*
+ *  msh >hyp_bench
+ *  item             count      min      avg      p99      max
+ *  ---------------- ----- -------- -------- -------- --------
+ *  hvc null           256       53       60       91      120
+ */
+static void bench_print(const char **str, const struct bench_stat *stats, rt_size_t num)
+{
+    rt_kprintf("[Info] Bench: unit is counter cycles, %d Hz\n",
+            (rt_uint32_t)rt_hw_get_gtimer_frq());
+    rt_kprintf("%-*s count      min      avg      p99      max\n",
+            VM_NAME_SIZE, "item");
+    for (rt_size_t i = 0; i < VM_NAME_SIZE; i++)
+        rt_kprintf("-");
+    rt_kprintf(" ----- -------- -------- -------- --------\n");
+
+    for (rt_size_t i = 0; i < num; i++)
+    {
+        const struct bench_stat *s = &stats[i];
+        rt_kprintf("%-*.*s %5d %8d %8d %8d %8d\n", VM_NAME_SIZE, VM_NAME_SIZE,
+                str[i], s->count, (rt_uint32_t)s->min, (rt_uint32_t)s->avg,
+                (rt_uint32_t)s->p99, (rt_uint32_t)s->max);
+    }
+}
+
+static void bench_report(void)
+{
+    static const rt_uint32_t phase_samples[BENCH_PHASE_NUM] =
+    {
+        BENCH_HVC_SAMPLES, BENCH_MMIO_SAMPLES, BENCH_MMIO_SAMPLES,
+        BENCH_VIRQ_SAMPLES, BENCH_VTIMER_SAMPLES,
+    };
+
+    for (rt_size_t i = 0; i < BENCH_SW_NUM; i++)
+    {
+        rt_memcpy(row_samples, sw_samples[i], sizeof(rt_uint64_t) * sw_count[i]);
+        bench_stat_calc(&bench_stats[BENCH_ROW_H2G + i], row_samples, sw_count[i]);
+    }
+
+    for (rt_size_t p = 0; p < BENCH_PHASE_NUM; p++)
+    {
+        rt_uint32_t n = 0;
+
+        if (bench_phase_done & (1UL << p))
+        {
+            if (p == BENCH_PHASE_VTIMER)
+                n = bench_jitter_samples(row_samples, phase_samples[p]);
+            else
+            {
+                n = phase_samples[p];
+                for (rt_size_t i = 0; i < n; i++)
+                    row_samples[i] = bench_mb->samples[p][i];
+            }
+        }
+        bench_stat_calc(&bench_stats[BENCH_ROW_HVC + p], row_samples, n);
+    }
+
+    bench_print(bench_row_str, bench_stats, BENCH_ROW_NUM);
+}
+
+int hyp_bench_run(void)
+{
+    rt_err_t ret;
+    rt_ubase_t mb_pa;
+    rt_uint8_t prev_vm_idx = rt_hyp.curr_vm_idx;
+
+    if (bench_running)
+    {
+        rt_kputs("[Error] Bench: already running\n");
+        return -RT_EBUSY;
+    }
+
+    bench_os_init();
+    bench_vm = vm_create(&bench_os, MAX_OS_NUM, "bench");
+    if (bench_vm == RT_NULL)
+        return -RT_ERROR;
+
+    bench_vdev_init(bench_vm);
+    bench_scratch = 0;
+    bench_phase_done = 0;
+    for (rt_size_t i = 0; i < BENCH_SW_NUM; i++)
+        sw_count[i] = 0;
+
+    rt_sem_init(&bench_sem, "bench", 0, RT_IPC_FLAG_FIFO);
+    rt_timer_init(&bench_virq_timer, "bench", bench_virq_timeout, RT_NULL, 1,
+                RT_TIMER_FLAG_ONE_SHOT | RT_TIMER_FLAG_HARD_TIMER);
+
+    /* vCPU has lower priority than shell, it won't run until we block. */
+    ret = run_vm();
+    if (ret == RT_EOK)
+        ret = s2_translate(bench_vm->mm, BENCH_MAILBOX_IPA, &mb_pa);
+
+    if (ret == RT_EOK)
+    {
+        /* Guest runs with stage 1 off, its mailbox accesses are non-cacheable. */
+        bench_mb = (struct bench_mailbox *)mb_pa;
+        rt_hw_cpu_dcache_ops(RT_HW_CACHE_FLUSH, bench_mb, sizeof(struct bench_mailbox));
+        bench_running = RT_TRUE;
+
+        ret = rt_sem_take(&bench_sem, BENCH_TIMEOUT);
+        bench_running = RT_FALSE;
+        if (ret != RT_EOK)
+            rt_kprintf("[Error] Bench: guest timeout, phases done 0x%02x\n",
+                    bench_phase_done);
+        rt_hw_cpu_dcache_ops(RT_HW_CACHE_INVALIDATE, bench_mb, sizeof(struct bench_mailbox));
+        bench_report();
+    }
+
+    rt_timer_stop(&bench_virq_timer);
+    rt_timer_detach(&bench_virq_timer);
+    rt_sem_detach(&bench_sem);
+
+    rt_hyp.curr_vm_idx = bench_vm->id;
+    delete_vm();
+    rt_hyp.curr_vm_idx = prev_vm_idx;
+    bench_vm = RT_NULL;
+
+    return ret;
+}
+
+static void bench_llc_stop(vm_t vm)
+{
+    rt_hyp.curr_vm_idx = vm->id;
+    delete_vm();
+}
+
+/* A running cache coloring guest, its mailbox filled and @mb pointing to it. */
+static vm_t bench_llc_start(rt_uint32_t role, rt_uint32_t colors, rt_size_t size,
+                            struct bench_llc_mailbox **mb)
+{
+    struct os_desc *os = &bench_llc_os[role];
+    rt_ubase_t pa;
+    vm_t vm;
+
+    rt_memset(os, 0, sizeof(struct os_desc));
+    os->img.addr = (rt_uint64_t)bench_llc_guest_start;
+    os->img.size = (rt_uint64_t)(bench_llc_guest_end - bench_llc_guest_start);
+    os->img.ep   = BENCH_LLC_GUEST_IPA;
+    os->img.type = OS_TYPE_OTHER;
+    os->cpu.num  = 1;
+    os->mem.region[0].addr = BENCH_LLC_GUEST_IPA;
+    os->mem.region[0].size = BENCH_LLC_GUEST_MEM;
+    os->mem.region[0].colors = colors;
+    os->mem.num  = 1;
+    os->arch = os_img[0].arch;
+
+    vm = vm_create(os, MAX_OS_NUM, role == BENCH_LLC_ROLE_VICTIM ? "llc victim" : "llc noise");
+    if (vm == RT_NULL)
+        return RT_NULL;
+
+    /* the guest spins on GO with its MMU off, nothing may sit in the cache */
+    if (run_vm() != RT_EOK || s2_translate(vm->mm, BENCH_LLC_MAILBOX_IPA, &pa) != RT_EOK)
+    {
+        bench_llc_stop(vm);
+        return RT_NULL;
+    }
+    *mb = (struct bench_llc_mailbox *)pa;
+    (*mb)->role = role;
+    (*mb)->size = size;
+    (*mb)->passes = BENCH_LLC_SAMPLES;
+    rt_hw_cpu_dcache_ops(RT_HW_CACHE_FLUSH, *mb, sizeof(struct bench_llc_mailbox));
+    (*mb)->go = 1;
+    rt_hw_cpu_dcache_ops(RT_HW_CACHE_FLUSH, (void *)&(*mb)->go, sizeof(rt_uint64_t));
+
+    return vm;
+}
+
+static rt_err_t bench_llc_row(rt_uint32_t row, rt_size_t size, rt_uint32_t colors,
+                              rt_uint32_t noise_colors)
+{
+    struct bench_llc_mailbox *mb, *noise_mb;
+    vm_t vm, noise = RT_NULL;
+    rt_tick_t start;
+    rt_err_t ret = -RT_ETIMEOUT;
+
+    if (row != BENCH_LLC_ALONE)
+    {
+        noise = bench_llc_start(BENCH_LLC_ROLE_NOISE, noise_colors, BENCH_LLC_BUF_MAX, &noise_mb);
+        if (noise == RT_NULL)
+            return -RT_ERROR;
+    }
+
+    vm = bench_llc_start(BENCH_LLC_ROLE_VICTIM, colors, size, &mb);
+    if (vm == RT_NULL)
+        ret = -RT_ERROR;
+
+    /* the guest caches its mailbox once its MMU is on, reads are coherent */
+    start = rt_tick_get();
+    while (vm && !mb->done && rt_tick_get() - start < BENCH_TIMEOUT)
+        rt_thread_mdelay(10);
+
+    if (vm && mb->done)
+    {
+        for (rt_size_t i = 0; i < BENCH_LLC_SAMPLES; i++)
+            row_samples[i] = mb->samples[i];
+        bench_stat_calc(&bench_llc_stats[row], row_samples, BENCH_LLC_SAMPLES);
+        ret = RT_EOK;
+    }
+    else if (vm)
+        rt_kprintf("[Error] Bench: %s guest timeout\n", bench_llc_str[row]);
+
+    if (vm)
+        bench_llc_stop(vm);
+    if (noise)
+        bench_llc_stop(noise);
+    return ret;
+}
+
+/*
+ * Worst case of a victim chasing pointers through @size bytes, alone, next
+ * to a noise VM, then with the two VMs in disjoint halves of the cache
+ * colors. The gap between the last two rows is the interference coloring
+ * removes. Both VMs must run at once, on different cores sharing the LLC.
+ */
+int hyp_bench_llc_run(rt_size_t size)
+{
+    rt_uint8_t prev_vm_idx = rt_hyp.curr_vm_idx;
+    rt_size_t colors = mem_color_num(), num = BENCH_LLC_NUM;
+    rt_uint32_t half = (rt_uint32_t)((1UL << (colors / 2)) - 1);
+    rt_err_t ret;
+
+    if (size < RT_MM_PAGE_SIZE || size > BENCH_LLC_BUF_MAX || (size & (size - 1)))
+    {
+        rt_kprintf("[Error] Bench: working set %d bytes, a power of 2 up to 4MB expected\n", size);
+        return -RT_EINVAL;
+    }
+
+    rt_memset(bench_llc_stats, 0, sizeof(bench_llc_stats));
+    ret = bench_llc_row(BENCH_LLC_ALONE, size, 0, 0);
+    if (ret == RT_EOK)
+        ret = bench_llc_row(BENCH_LLC_NOISY, size, 0, 0);
+    if (ret == RT_EOK && colors >= 2)
+        ret = bench_llc_row(BENCH_LLC_COLORED, size, half, half << (colors / 2));
+    else if (ret == RT_EOK)
+    {
+        rt_kputs("[Info] Bench: cache coloring is off, no colored run\n");
+        num = BENCH_LLC_COLORED;
+    }
+    rt_hyp.curr_vm_idx = prev_vm_idx;
+
+    if (ret == RT_EOK)
+        bench_print(bench_llc_str, bench_llc_stats, num);
+    return ret;
+}
+
+#if defined(RT_USING_FINSH)
+static void hyp_bench(void)
+{
+    hyp_bench_run();
+}
+MSH_CMD_EXPORT(hyp_bench, run hypervisor microbenchmark);
+
+static void hyp_bench_llc(int argc, char **argv)
+{
+    rt_size_t kb = (argc > 1) ? atoi(argv[1]) : 256;
+
+    hyp_bench_llc_run(kb << 10);
+}
+MSH_CMD_EXPORT(hyp_bench_llc, run cache coloring benchmark: hyp_bench_llc [working set KB]);
+#endif  /* RT_USING_FINSH */
+
+#ifdef RT_USING_UTEST
+static void test_hyp_bench(void)
+{
+    uassert_int_equal(hyp_bench_run(), RT_EOK);
+    uassert_int_equal(bench_phase_done, (1UL << BENCH_PHASE_NUM) - 1);
+    uassert_true(bench_stats[BENCH_ROW_HVC].count == BENCH_HVC_SAMPLES);
+}
+
+static void testcase(void)
+{
+    UTEST_UNIT_RUN(test_hyp_bench);
+}
+UTEST_TC_EXPORT(testcase, "components.hypervisor.bench", RT_NULL, RT_NULL, 60);
+#endif  /* RT_USING_UTEST */
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-11-14     Suqier       first version
+ * 2022-12-06     Suqier       cache coloring benchmark
+ */
+
+#ifndef __HYP_BENCH_H__
+#define __HYP_BENCH_H__
+
+#include <hypercall.h>
+
+/* 
+ * Shared by the host side (hyp_bench.c) and the guest payload (bench_guest.S), 
+ * so only plain constants above the __ASSEMBLY__ guard.
+ */
+
+/* Guest physical layout of the benchmark VM */
+#define BENCH_GUEST_IPA         0x40000000
+#define BENCH_GUEST_MEM         2           /* MB */
+#define BENCH_GUEST_STACK       0x40080000
+#define BENCH_MAILBOX_IPA       0x40100000
+
+/* Benchmark MMIO device, only be emulated by host */
+#define BENCH_MMIO_IPA          0x0B000000
+#define BENCH_MMIO_SIZE         0x1000
+#define BENCH_MMIO_SCRATCH      0x00
+#define BENCH_MMIO_DOORBELL     0x04
+
+/* vGIC layout and interrupts used by the payload */
+#define BENCH_GICD_IPA          0x08000000
+#define BENCH_GICR_IPA          0x080A0000
+#define BENCH_GICR_SGI_IPA      (BENCH_GICR_IPA + 0x10000)
+#define BENCH_VIRQ_SPI          40
+#define BENCH_PTIMER_PPI        30
+#define BENCH_IRQ_PRIO          0xA0
+
+/* answered by the hypercall fast path in vector_low_sync */
+#define BENCH_HVC_NULL          HVC_FN64_BENCH_NULL
+
+/* Phases and samples */
+#define BENCH_PHASE_HVC         0
+#define BENCH_PHASE_MMIO_WR     1
+#define BENCH_PHASE_MMIO_RD     2
+#define BENCH_PHASE_VIRQ        3
+#define BENCH_PHASE_VTIMER      4
+#define BENCH_PHASE_NUM         5
+
+#define BENCH_HVC_SAMPLES       256
+#define BENCH_MMIO_SAMPLES      256
+#define BENCH_VIRQ_SAMPLES      64
+#define BENCH_VTIMER_SAMPLES    64
+#define BENCH_MAX_SAMPLES       256
+
+/* Doorbell value is (cmd << 8 | phase) */
+#define BENCH_DB_CMD_SHIFT      8
+#define BENCH_DB_PHASE_MASK     0xFF
+#define BENCH_DB_PHASE_DONE     1
+#define BENCH_DB_VIRQ_ARM       2
+#define BENCH_DB_ALL_DONE       3
+
+/* Mailbox in guest RAM, offset from BENCH_MAILBOX_IPA */
+#define BENCH_MB_CURSOR         0x00    /* samples taken by IRQ handler */
+#define BENCH_MB_T0             0x08    /* host stamp when vIRQ injected */
+#define BENCH_MB_SAMPLES        0x40
+#define BENCH_MB_PHASE_STRIDE   (BENCH_MAX_SAMPLES * 8)
+#define BENCH_MB_PHASE(p)       (BENCH_MB_SAMPLES + (p) * BENCH_MB_PHASE_STRIDE)
+
+/* 
+ * Cache coloring guest (bench_llc_guest.S). A victim chases pointers through
+ * its working set and times each pass, a noise VM writes its whole buffer 
+ * over and over. The victim's worst pass shows how much LLC it lost.
+ */
+#define BENCH_LLC_GUEST_IPA     0x40000000
+#define BENCH_LLC_GUEST_MEM     8           /* MB */
+#define BENCH_LLC_PGTBL_IPA     0x40010000
+#define BENCH_LLC_MAILBOX_IPA   0x40020000
+#define BENCH_LLC_BUF_IPA       0x40100000
+#define BENCH_LLC_BUF_MAX       0x00700000
+#define BENCH_LLC_LINE_SHIFT    6
+#define BENCH_LLC_LINE          (1 << BENCH_LLC_LINE_SHIFT)
+#define BENCH_LLC_SAMPLES       256
+
+#define BENCH_LLC_ROLE_VICTIM   0
+#define BENCH_LLC_ROLE_NOISE    1
+
+/* Mailbox, offset from BENCH_LLC_MAILBOX_IPA, the guest waits for GO */
+#define BENCH_LLC_MB_GO         0x00
+#define BENCH_LLC_MB_ROLE       0x08
+#define BENCH_LLC_MB_SIZE       0x10    /* bytes, a power of 2 for the victim */
+#define BENCH_LLC_MB_PASSES     0x18
+#define BENCH_LLC_MB_DONE       0x20
+#define BENCH_LLC_MB_SAMPLES    0x40
+
+/* Guest stage 1: identity map in 1GB blocks, device below RAM */
+#define BENCH_LLC_MAIR          0xFF00      /* attr0 device nGnRnE, attr1 normal WB */
+#define BENCH_LLC_TCR           0x803520    /* T0SZ 32, WB WA inner shareable, EPD1 */
+#define BENCH_LLC_PTE_DEVICE    0x401       /* AF, attr0, block */
+#define BENCH_LLC_PTE_NORMAL    0x705       /* AF, inner shareable, attr1, block */
+#define BENCH_LLC_LCG_A         1103515245  /* next line = (A * line + C) % lines */
+#define BENCH_LLC_LCG_C         12345
+
+#ifndef __ASSEMBLY__
+
+#include <rtdef.h>
+
+enum
+{
+    BENCH_SW_H2G = 0,
+    BENCH_SW_G2H,
+    BENCH_SW_NUM,
+};
+
+struct bench_mailbox
+{
+    volatile rt_uint64_t cursor;
+    volatile rt_uint64_t t0;
+    rt_uint64_t reserved[6];
+    volatile rt_uint64_t samples[BENCH_PHASE_NUM][BENCH_MAX_SAMPLES];
+};
+
+struct bench_llc_mailbox
+{
+    volatile rt_uint64_t go;
+    rt_uint64_t role;
+    rt_uint64_t size;
+    rt_uint64_t passes;
+    volatile rt_uint64_t done;
+    rt_uint64_t reserved[3];
+    volatile rt_uint64_t samples[BENCH_LLC_SAMPLES];
+};
+
+struct bench_stat
+{
+    rt_uint32_t count;
+    rt_uint64_t min;
+    rt_uint64_t avg;
+    rt_uint64_t p99;
+    rt_uint64_t max;
+};
+
+struct vcpu;
+
+void hyp_bench_switch_record(rt_uint8_t type, struct vcpu *vcpu, rt_uint64_t cycles);
+int hyp_bench_run(void);
+int hyp_bench_llc_run(rt_size_t size);
+
+#endif  /* __ASSEMBLY__ */
+
+#endif  /* __HYP_BENCH_H__ */
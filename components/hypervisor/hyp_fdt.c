@@ -6,6 +6,767 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-10-27     Suqier       first version
+ * 2022-11-29     Suqier       parse VM partitions, generate guest DTB
+ * 2022-12-06     Suqier       cache-colors of guest RAM
+ * 2022-12-08     Suqier       guest RAM regions
+ * 2022-12-10     Suqier       memory-limit of a VM
  */
 
+#include <rtthread.h>
+
 #include "hyp_fdt.h"
+#include "mm.h"
+
+#define FDT_ALIGN(x)        (((x) + 3) & ~3)
+#define FDT_RSVMAP_OFF      (sizeof(struct fdt_header))
+#define FDT_STRUCT_OFF      (FDT_RSVMAP_OFF + 16)   /* one empty rsvmap entry */
+
+#define GIC_SPI             (0)
+#define GIC_PPI             (1)
+#define IRQ_TYPE_LEVEL_HIGH (4)
+#define GICD_FRAME_SIZE     (0x10000)
+#define GICR_FRAME_SIZE     (0x20000)   /* RD_base and SGI_base */
+#define GUEST_GIC_PHANDLE   (1)
+
+/*
+ * Reader
+ */
+rt_inline const struct fdt_header *fdt_hdr(const void *fdt)
+{
+    return (const struct fdt_header *)fdt;
+}
+
+rt_inline const rt_uint8_t *fdt_struct(const void *fdt)
+{
+    return (const rt_uint8_t *)fdt + fdt32_to_cpu(fdt_hdr(fdt)->off_dt_struct);
+}
+
+rt_inline const char *fdt_string(const void *fdt, rt_uint32_t off)
+{
+    return (const char *)fdt + fdt32_to_cpu(fdt_hdr(fdt)->off_dt_strings) + off;
+}
+
+rt_inline rt_uint32_t fdt_cell(const void *p)
+{
+    return fdt32_to_cpu(*(const rt_uint32_t *)p);
+}
+
+rt_err_t hyp_fdt_check(const void *fdt)
+{
+    const struct fdt_header *h = fdt_hdr(fdt);
+
+    if (fdt == RT_NULL || ((rt_ubase_t)fdt & 0x3))
+        return -RT_EINVAL;
+    if (fdt32_to_cpu(h->magic) != FDT_MAGIC
+    || fdt32_to_cpu(h->last_comp_version) > FDT_VERSION
+    || fdt32_to_cpu(h->off_dt_struct) + fdt32_to_cpu(h->size_dt_struct) > fdt32_to_cpu(h->totalsize)
+    || fdt32_to_cpu(h->off_dt_strings) + fdt32_to_cpu(h->size_dt_strings) > fdt32_to_cpu(h->totalsize))
+        return -RT_ERROR;
+
+    return RT_EOK;
+}
+
+/* Token at @off, @next gets the offset of the following one. */
+static rt_uint32_t fdt_tag(const void *fdt, int off, int *next)
+{
+    const rt_uint8_t *p = fdt_struct(fdt) + off;
+    rt_uint32_t size = fdt32_to_cpu(fdt_hdr(fdt)->size_dt_struct);
+    rt_uint32_t tag;
+    int n = off + 4;
+
+    if (off < 0 || off + 4 > size)
+        return FDT_END;
+
+    tag = fdt_cell(p);
+    if (tag == FDT_BEGIN_NODE)
+        n += rt_strnlen((const char *)p + 4, size - off - 4) + 1;
+    else if (tag == FDT_PROP)
+        n += 8 + fdt_cell(p + 4);
+
+    *next = FDT_ALIGN(n);
+    return (*next > size) ? FDT_END : tag;
+}
+
+/* The node after @node in DFS order, @depth follows the nesting. */
+static int fdt_next_node(const void *fdt, int node, int *depth)
+{
+    int off, next;
+
+    if (fdt_tag(fdt, node, &next) != FDT_BEGIN_NODE)
+        return -1;
+
+    while (1)
+    {
+        off = next;
+        switch (fdt_tag(fdt, off, &next))
+        {
+        case FDT_PROP:
+        case FDT_NOP:
+            break;
+        case FDT_BEGIN_NODE:
+            (*depth)++;
+            return off;
+        case FDT_END_NODE:
+            if (--(*depth) < 0)
+                return -1;
+            break;
+        default:
+            return -1;
+        }
+    }
+}
+
+int hyp_fdt_first_subnode(const void *fdt, int node)
+{
+    int depth = 0;
+
+    node = fdt_next_node(fdt, node, &depth);
+    return (node >= 0 && depth == 1) ? node : -1;
+}
+
+int hyp_fdt_next_subnode(const void *fdt, int node)
+{
+    int depth = 1;
+
+    do
+    {
+        node = fdt_next_node(fdt, node, &depth);
+        if (node < 0 || depth < 1)
+            return -1;
+    } while (depth > 1);
+
+    return node;
+}
+
+const char *hyp_fdt_name(const void *fdt, int node)
+{
+    return (const char *)fdt_struct(fdt) + node + 4;
+}
+
+/* @name without unit address matches any "name@unit" */
+int hyp_fdt_subnode(const void *fdt, int node, const char *name)
+{
+    rt_size_t len = rt_strlen(name);
+    int sub;
+
+    for (sub = hyp_fdt_first_subnode(fdt, node); sub >= 0;
+         sub = hyp_fdt_next_subnode(fdt, sub))
+    {
+        const char *n = hyp_fdt_name(fdt, sub);
+
+        if (rt_strncmp(n, name, len) == 0 && (n[len] == '\0' || n[len] == '@'))
+            return sub;
+    }
+
+    return -1;
+}
+
+const void *hyp_fdt_getprop(const void *fdt, int node, const char *name, int *len)
+{
+    int off, next;
+
+    if (fdt_tag(fdt, node, &next) != FDT_BEGIN_NODE)
+        return RT_NULL;
+
+    while (1)
+    {
+        const rt_uint8_t *p;
+
+        off = next;
+        switch (fdt_tag(fdt, off, &next))
+        {
+        case FDT_NOP:
+            break;
+        case FDT_PROP:
+            p = fdt_struct(fdt) + off;
+            if (rt_strcmp(fdt_string(fdt, fdt_cell(p + 8)), name) == 0)
+            {
+                if (len)
+                    *len = fdt_cell(p + 4);
+                return p + 12;
+            }
+            break;
+        default:
+            return RT_NULL;     /* properties come before subnodes */
+        }
+    }
+}
+
+rt_uint64_t hyp_fdt_read_cells(const rt_uint32_t *cell, int num)
+{
+    rt_uint64_t val = 0;
+
+    while (num--)
+        val = (val << 32) | fdt32_to_cpu(*cell++);
+    return val;
+}
+
+/*
+ * Writer
+ */
+static void *fdt_wr_grab(struct hyp_fdt_wr *wr, rt_size_t len)
+{
+    rt_size_t end = FDT_ALIGN(wr->off + len);
+    void *p;
+
+    /* keep room for FDT_END and the strings block */
+    if (wr->err || end + 4 + wr->strings_len > wr->size)
+    {
+        wr->err = -RT_ENOMEM;
+        return RT_NULL;
+    }
+
+    p = wr->buf + wr->off;
+    rt_memset(p, 0, end - wr->off);
+    wr->off = end;
+    return p;
+}
+
+static void fdt_wr_u32(struct hyp_fdt_wr *wr, rt_uint32_t val)
+{
+    rt_uint32_t *p = fdt_wr_grab(wr, 4);
+
+    if (p)
+        *p = cpu_to_fdt32(val);
+}
+
+static int fdt_wr_string(struct hyp_fdt_wr *wr, const char *name)
+{
+    rt_size_t len = rt_strlen(name) + 1;
+    rt_size_t off = 0;
+
+    while (off < wr->strings_len)
+    {
+        if (rt_strcmp(&wr->strings[off], name) == 0)
+            return off;
+        off += rt_strlen(&wr->strings[off]) + 1;
+    }
+
+    if (wr->strings_len + len > HYP_FDT_STRINGS_MAX)
+    {
+        wr->err = -RT_ENOMEM;
+        return 0;
+    }
+    rt_memcpy(&wr->strings[off], name, len);
+    wr->strings_len += len;
+    return off;
+}
+
+void hyp_fdt_wr_init(struct hyp_fdt_wr *wr, void *buf, rt_size_t size)
+{
+    wr->buf = (rt_uint8_t *)buf;
+    wr->size = size;
+    wr->off = FDT_STRUCT_OFF;
+    wr->depth = 0;
+    wr->err = (size < FDT_STRUCT_OFF) ? -RT_ENOMEM : RT_EOK;
+    wr->strings_len = 0;
+}
+
+void hyp_fdt_wr_begin_node(struct hyp_fdt_wr *wr, const char *name)
+{
+    rt_size_t len = rt_strlen(name) + 1;
+    rt_uint8_t *p = fdt_wr_grab(wr, 4 + len);
+
+    if (p)
+    {
+        *(rt_uint32_t *)p = cpu_to_fdt32(FDT_BEGIN_NODE);
+        rt_memcpy(p + 4, name, len);
+        wr->depth++;
+    }
+}
+
+void hyp_fdt_wr_end_node(struct hyp_fdt_wr *wr)
+{
+    fdt_wr_u32(wr, FDT_END_NODE);
+    wr->depth--;
+}
+
+void hyp_fdt_wr_prop(struct hyp_fdt_wr *wr, const char *name, const void *val, rt_size_t len)
+{
+    int nameoff = fdt_wr_string(wr, name);
+    rt_uint8_t *p = fdt_wr_grab(wr, 12 + len);
+
+    if (p)
+    {
+        ((rt_uint32_t *)p)[0] = cpu_to_fdt32(FDT_PROP);
+        ((rt_uint32_t *)p)[1] = cpu_to_fdt32(len);
+        ((rt_uint32_t *)p)[2] = cpu_to_fdt32(nameoff);
+        if (len)
+            rt_memcpy(p + 12, val, len);
+    }
+}
+
+void hyp_fdt_wr_prop_u32(struct hyp_fdt_wr *wr, const char *name, rt_uint32_t val)
+{
+    val = cpu_to_fdt32(val);
+    hyp_fdt_wr_prop(wr, name, &val, 4);
+}
+
+void hyp_fdt_wr_prop_u64(struct hyp_fdt_wr *wr, const char *name, rt_uint64_t val)
+{
+    rt_uint32_t cell[2] = { cpu_to_fdt32(val >> 32), cpu_to_fdt32(val) };
+
+    hyp_fdt_wr_prop(wr, name, cell, sizeof(cell));
+}
+
+void hyp_fdt_wr_prop_str(struct hyp_fdt_wr *wr, const char *name, const char *str)
+{
+    hyp_fdt_wr_prop(wr, name, str, rt_strlen(str) + 1);
+}
+
+/* Close the blob, total size or the first error. */
+int hyp_fdt_wr_finish(struct hyp_fdt_wr *wr)
+{
+    struct fdt_header *h = (struct fdt_header *)wr->buf;
+    rt_size_t struct_end;
+
+    if (wr->depth != 0 && wr->err == RT_EOK)
+        wr->err = -RT_ERROR;
+    fdt_wr_u32(wr, FDT_END);
+    if (wr->err)
+        return wr->err;
+
+    struct_end = wr->off;
+    rt_memcpy(wr->buf + struct_end, wr->strings, wr->strings_len);
+    rt_memset(wr->buf + FDT_RSVMAP_OFF, 0, FDT_STRUCT_OFF - FDT_RSVMAP_OFF);
+
+    h->magic             = cpu_to_fdt32(FDT_MAGIC);
+    h->totalsize         = cpu_to_fdt32(struct_end + wr->strings_len);
+    h->off_dt_struct     = cpu_to_fdt32(FDT_STRUCT_OFF);
+    h->off_dt_strings    = cpu_to_fdt32(struct_end);
+    h->off_mem_rsvmap    = cpu_to_fdt32(FDT_RSVMAP_OFF);
+    h->version           = cpu_to_fdt32(FDT_VERSION);
+    h->last_comp_version = cpu_to_fdt32(FDT_LAST_COMP_VER);
+    h->boot_cpuid_phys   = 0;
+    h->size_dt_strings   = cpu_to_fdt32(wr->strings_len);
+    h->size_dt_struct    = cpu_to_fdt32(struct_end - FDT_STRUCT_OFF);
+
+    return struct_end + wr->strings_len;
+}
+
+/*
+ * VM partitions
+ */
+static const char *os_type_name[OS_TYPE_OTHER + 1] =
+{
+    "linux", "rt-thread", "zephyr", "other"
+};
+
+/* a property of @num 64-bit values, each in 2 cells */
+static rt_err_t fdt_get_u64s(const void *fdt, int node, const char *name,
+                            rt_uint64_t *val, int num)
+{
+    const rt_uint32_t *cell;
+    int len;
+
+    cell = hyp_fdt_getprop(fdt, node, name, &len);
+    if (cell == RT_NULL || len != num * 8)
+        return -RT_ERROR;
+
+    for (int i = 0; i < num; i++)
+        val[i] = hyp_fdt_read_cells(&cell[i * 2], 2);
+    return RT_EOK;
+}
+
+static rt_uint32_t fdt_get_u32(const void *fdt, int node, const char *name, rt_uint32_t def)
+{
+    const rt_uint32_t *cell;
+    int len;
+
+    cell = hyp_fdt_getprop(fdt, node, name, &len);
+    return (cell && len == 4) ? fdt32_to_cpu(*cell) : def;
+}
+
+static const struct
+{
+    const char *name;
+    rt_uint64_t flag;
+} fdt_mem_attrs[] =
+{
+    { "wb", VM_NORMAL_WB }, { "nc", VM_NORMAL_NC }, { "wt", VM_NORMAL_WT },
+    { "exec", VM_EXEC }, { "shared", VM_SHARED },
+};
+
+/* "nc,shared" to VM_* flags of a RAM region, write back if no type given */
+static rt_err_t fdt_parse_mem_attrs(const char *str, rt_uint64_t *flag)
+{
+    *flag = VM_RW;
+    while (*str)
+    {
+        rt_size_t len = 0, i;
+
+        while (str[len] && str[len] != ',')
+            len++;
+        for (i = 0; i < sizeof(fdt_mem_attrs) / sizeof(fdt_mem_attrs[0]); i++)
+        {
+            if (rt_strlen(fdt_mem_attrs[i].name) == len
+             && rt_strncmp(str, fdt_mem_attrs[i].name, len) == 0)
+                break;
+        }
+        if (i == sizeof(fdt_mem_attrs) / sizeof(fdt_mem_attrs[0]))
+            return -RT_ERROR;
+
+        *flag |= fdt_mem_attrs[i].flag;
+        str += len + (str[len] == ',');
+    }
+
+    if ((*flag & VM_MEMATTR_MASK) == 0)
+        *flag |= VM_NORMAL_WB;
+    return RT_EOK;
+}
+
+static rt_err_t fdt_parse_mem(const void *fdt, int node, struct mem_info *mem)
+{
+    const rt_uint32_t *cell, *colors, *limit;
+    const char *attrs;
+    int len, attrs_len, colors_len, limit_len;
+
+    cell = hyp_fdt_getprop(fdt, node, "memory", &len);
+    if (cell == RT_NULL || len == 0 || len % 16 || len / 16 > MAX_MEM_REGION)
+        return -RT_ERROR;
+    mem->num = len / 16;
+
+    attrs = hyp_fdt_getprop(fdt, node, "memory-attrs", &attrs_len);
+    colors = hyp_fdt_getprop(fdt, node, "cache-colors", &colors_len);
+    if (colors && colors_len != 4 && colors_len != mem->num * 4)
+        return -RT_ERROR;
+
+    limit = hyp_fdt_getprop(fdt, node, "memory-limit", &limit_len);
+    if (limit && limit_len != 4)
+        return -RT_ERROR;
+    mem->limit = limit ? fdt32_to_cpu(*limit) : 0;
+
+    for (rt_size_t i = 0; i < mem->num; i++)
+    {
+        struct mem_region *rg = &mem->region[i];
+        rt_uint64_t size = hyp_fdt_read_cells(&cell[i * 4 + 2], 2);
+
+        if (size == 0 || (size & (BYTE(1UL) - 1)))
+            return -RT_ERROR;
+        rg->addr = hyp_fdt_read_cells(&cell[i * 4], 2);
+        rg->size = MB(size);
+        rg->colors = colors ? fdt32_to_cpu(colors[colors_len == 4 ? 0 : i]) : 0;
+
+        /* the i-th string of the list, none left keeps the default */
+        rg->flag = 0;
+        if (attrs && attrs_len > 0)
+        {
+            int n = rt_strnlen(attrs, attrs_len) + 1;
+
+            if (fdt_parse_mem_attrs(attrs, &rg->flag) != RT_EOK)
+                return -RT_ERROR;
+            attrs += n;
+            attrs_len -= n;
+        }
+    }
+
+    return RT_EOK;
+}
+
+static void fdt_free_devs(struct devs_info *devs)
+{
+    for (rt_size_t i = 0; devs->dev && i < devs->num; i++)
+        rt_free(devs->dev[i].interrupts);
+    rt_free(devs->dev);
+    devs->dev = RT_NULL;
+    devs->num = 0;
+}
+
+static rt_err_t fdt_parse_dev(const void *fdt, int node, struct dev_info *dev)
+{
+    const rt_uint32_t *irq;
+    rt_uint64_t reg[2];
+    int len;
+
+    if (fdt_get_u64s(fdt, node, "reg", reg, 2) != RT_EOK)
+        return -RT_ERROR;
+
+    dev->name  = hyp_fdt_name(fdt, node);
+    dev->paddr = reg[0];
+    dev->size  = reg[1];
+    if (fdt_get_u64s(fdt, node, "virt-reg", &dev->vaddr, 1) != RT_EOK)
+        dev->vaddr = dev->paddr;    /* flat mapping */
+
+    dev->compatible = hyp_fdt_getprop(fdt, node, "compatible", &len);
+    dev->compatible_len = dev->compatible ? len : 0;
+
+    dev->interrupt_num = 0;
+    dev->interrupts = RT_NULL;
+    irq = hyp_fdt_getprop(fdt, node, "interrupts", &len);
+    if (irq && len >= 4)
+    {
+        dev->interrupt_num = len / 4;
+        dev->interrupts = (rt_uint64_t *)rt_malloc(sizeof(rt_uint64_t) * dev->interrupt_num);
+        if (dev->interrupts == RT_NULL)
+            return -RT_ENOMEM;
+        for (rt_size_t i = 0; i < dev->interrupt_num; i++)
+            dev->interrupts[i] = fdt32_to_cpu(irq[i]);
+    }
+
+    return RT_EOK;
+}
+
+static rt_err_t fdt_parse_vm(const void *fdt, int node, struct os_desc *os)
+{
+    const rt_uint32_t *cell;
+    const char *type;
+    rt_uint64_t val[4];
+    rt_size_t num = 0;
+    int len, sub;
+
+    rt_memset(os, 0, sizeof(struct os_desc));
+    os->img.type = OS_TYPE_OTHER;
+    type = hyp_fdt_getprop(fdt, node, "os-type", RT_NULL);
+    for (rt_size_t i = 0; type && i <= OS_TYPE_OTHER; i++)
+    {
+        if (rt_strcmp(type, os_type_name[i]) == 0)
+            os->img.type = i;
+    }
+
+    /* preloaded in memory, or a file read at VM creation */
+    os->img.path = hyp_fdt_getprop(fdt, node, "image-path", RT_NULL);
+    if (fdt_get_u64s(fdt, node, "image", val, 2) == RT_EOK)
+    {
+        os->img.addr = val[0];
+        os->img.size = val[1];
+    }
+    else if (os->img.path == RT_NULL)
+        return -RT_ERROR;
+
+    if (fdt_parse_mem(fdt, node, &os->mem) != RT_EOK)
+        return -RT_ERROR;
+
+    if (fdt_get_u64s(fdt, node, "entry", &os->img.ep, 1) != RT_EOK)
+        os->img.ep = os->mem.region[0].addr;
+    if (fdt_get_u64s(fdt, node, "dtb", &os->img.dtb, 1) != RT_EOK)
+        os->img.dtb = os->mem.region[0].addr + BYTE(os->mem.region[0].size) - HYP_FDT_GUEST_SIZE;
+
+    cell = hyp_fdt_getprop(fdt, node, "cpus", &len);
+    if (cell == RT_NULL || len == 0 || len % 8 || len / 8 > MAX_VCPU_NUM)
+        return -RT_ERROR;
+    os->cpu.num = len / 8;
+    for (rt_size_t i = 0; i < os->cpu.num; i++)
+        os->cpu.affinity[i] = hyp_fdt_read_cells(&cell[i * 2], 2);
+
+    if (fdt_get_u64s(fdt, node, "vgic", val, 2) != RT_EOK)
+        return -RT_ERROR;
+    os->arch.vgic.gicd_addr = val[0];
+    os->arch.vgic.gicr_addr = val[1];
+    os->arch.vgic.maintenance_id = fdt_get_u32(fdt, node, "vgic-maintenance", 25);
+    os->arch.vgic.virq_num = fdt_get_u32(fdt, node, "vgic-virqs", 127);
+
+    /* every subnode with reg is a device of the VM */
+    for (sub = hyp_fdt_first_subnode(fdt, node); sub >= 0; sub = hyp_fdt_next_subnode(fdt, sub))
+        num++;
+    if (num == 0)
+        return RT_EOK;
+
+    os->devs.dev = (struct dev_info *)rt_malloc(sizeof(struct dev_info) * num);
+    if (os->devs.dev == RT_NULL)
+        return -RT_ENOMEM;
+    rt_memset(os->devs.dev, 0, sizeof(struct dev_info) * num);
+
+    for (sub = hyp_fdt_first_subnode(fdt, node); sub >= 0; sub = hyp_fdt_next_subnode(fdt, sub))
+    {
+        rt_err_t ret = fdt_parse_dev(fdt, sub, &os->devs.dev[os->devs.num]);
+
+        os->devs.num++;
+        if (ret != RT_EOK)
+        {
+            fdt_free_devs(&os->devs);
+            return ret;
+        }
+    }
+
+    return RT_EOK;
+}
+
+/*
+ * Fill @os with at most @max partitions of /hypervisor. Strings of the
+ * descriptors point into @fdt, so the blob must stay in memory.
+ */
+int hyp_fdt_parse_vms(const void *fdt, struct os_desc *os, rt_size_t max)
+{
+    int hyp, node, num = 0;
+
+    if (hyp_fdt_check(fdt) != RT_EOK)
+        return -RT_EINVAL;
+
+    hyp = hyp_fdt_subnode(fdt, 0, "hypervisor");
+    if (hyp < 0)
+        return -RT_EEMPTY;
+
+    for (node = hyp_fdt_first_subnode(fdt, hyp); node >= 0 && num < max;
+         node = hyp_fdt_next_subnode(fdt, node))
+    {
+        const char *compat = hyp_fdt_getprop(fdt, node, "compatible", RT_NULL);
+
+        if (compat == RT_NULL || rt_strcmp(compat, "rt-thread,vm") != 0)
+            continue;
+
+        if (fdt_parse_vm(fdt, node, &os[num]) != RT_EOK)
+        {
+            rt_kprintf("[Error] FDT: bad partition %s, skipped\n", hyp_fdt_name(fdt, node));
+            continue;
+        }
+        num++;
+    }
+
+    return num;
+}
+
+/* RAM the guest may use as any other, write back and its own */
+static rt_bool_t fdt_mem_plain(const struct mem_region *rg)
+{
+    return rg->flag == 0
+        || ((rg->flag & VM_MEMATTR_MASK) == VM_NORMAL_WB && !(rg->flag & VM_SHARED));
+}
+
+/*
+ * Minimal guest DTB: CPUs, memory, GICv3, generic timer and the devices
+ * of @os. The image gets its address in x0 of vCPU 0.
+ */
+int hyp_fdt_gen_guest(const struct os_desc *os, void *buf, rt_size_t size)
+{
+    struct hyp_fdt_wr *wr;
+    const struct vgic_info *gic = &os->arch.vgic;
+    rt_uint32_t cell[12 + 4 * MAX_MEM_REGION];  /* room for every RAM region */
+    rt_size_t special = 0;
+    char name[32];
+    int ret;
+
+    /* the strings table is too big for a thread stack */
+    wr = (struct hyp_fdt_wr *)rt_malloc(sizeof(struct hyp_fdt_wr));
+    if (wr == RT_NULL)
+        return -RT_ENOMEM;
+
+    hyp_fdt_wr_init(wr, buf, size);
+    hyp_fdt_wr_begin_node(wr, "");
+    hyp_fdt_wr_prop_u32(wr, "#address-cells", 2);
+    hyp_fdt_wr_prop_u32(wr, "#size-cells", 2);
+    hyp_fdt_wr_prop_str(wr, "compatible", "linux,dummy-virt");
+    hyp_fdt_wr_prop_u32(wr, "interrupt-parent", GUEST_GIC_PHANDLE);
+
+    hyp_fdt_wr_begin_node(wr, "cpus");
+    hyp_fdt_wr_prop_u32(wr, "#address-cells", 1);
+    hyp_fdt_wr_prop_u32(wr, "#size-cells", 0);
+    for (rt_size_t i = 0; i < os->cpu.num; i++)
+    {
+        rt_snprintf(name, sizeof(name), "cpu@%x", (rt_uint32_t)os->cpu.affinity[i]);
+        hyp_fdt_wr_begin_node(wr, name);
+        hyp_fdt_wr_prop_str(wr, "device_type", "cpu");
+        hyp_fdt_wr_prop_str(wr, "compatible", "arm,armv8");
+        hyp_fdt_wr_prop_u32(wr, "reg", (rt_uint32_t)os->cpu.affinity[i]);
+        hyp_fdt_wr_end_node(wr);
+    }
+    hyp_fdt_wr_end_node(wr);
+
+    rt_snprintf(name, sizeof(name), "memory@%lx", (unsigned long)os->mem.region[0].addr);
+    hyp_fdt_wr_begin_node(wr, name);
+    hyp_fdt_wr_prop_str(wr, "device_type", "memory");
+    for (rt_size_t i = 0; i < os->mem.num; i++)
+    {
+        const struct mem_region *rg = &os->mem.region[i];
+
+        cell[i * 4 + 0] = cpu_to_fdt32(rg->addr >> 32);
+        cell[i * 4 + 1] = cpu_to_fdt32(rg->addr);
+        cell[i * 4 + 2] = cpu_to_fdt32(BYTE(rg->size) >> 32);
+        cell[i * 4 + 3] = cpu_to_fdt32(BYTE(rg->size));
+        if (!fdt_mem_plain(rg))
+            special++;
+    }
+    hyp_fdt_wr_prop(wr, "reg", cell, os->mem.num * 16);
+    hyp_fdt_wr_end_node(wr);
+
+    /* DMA and shared regions stay out of the guest page allocator */
+    if (special)
+    {
+        hyp_fdt_wr_begin_node(wr, "reserved-memory");
+        hyp_fdt_wr_prop_u32(wr, "#address-cells", 2);
+        hyp_fdt_wr_prop_u32(wr, "#size-cells", 2);
+        hyp_fdt_wr_prop(wr, "ranges", RT_NULL, 0);
+        for (rt_size_t i = 0; i < os->mem.num; i++)
+        {
+            const struct mem_region *rg = &os->mem.region[i];
+            rt_bool_t shared = !!(rg->flag & VM_SHARED);
+
+            if (fdt_mem_plain(rg))
+                continue;
+            rt_snprintf(name, sizeof(name), "%s@%lx", shared ? "shmem" : "dma", (unsigned long)rg->addr);
+            hyp_fdt_wr_begin_node(wr, name);
+            hyp_fdt_wr_prop_str(wr, "compatible", shared ? "rt-thread,shmem" : "shared-dma-pool");
+            hyp_fdt_wr_prop(wr, "reg", &cell[i * 4], 16);
+            hyp_fdt_wr_prop(wr, "no-map", RT_NULL, 0);
+            hyp_fdt_wr_end_node(wr);
+        }
+        hyp_fdt_wr_end_node(wr);
+    }
+
+    rt_snprintf(name, sizeof(name), "intc@%lx", (unsigned long)gic->gicd_addr);
+    hyp_fdt_wr_begin_node(wr, name);
+    hyp_fdt_wr_prop_str(wr, "compatible", "arm,gic-v3");
+    hyp_fdt_wr_prop_u32(wr, "#interrupt-cells", 3);
+    hyp_fdt_wr_prop(wr, "interrupt-controller", RT_NULL, 0);
+    cell[0] = cpu_to_fdt32(gic->gicd_addr >> 32);
+    cell[1] = cpu_to_fdt32(gic->gicd_addr);
+    cell[2] = 0;
+    cell[3] = cpu_to_fdt32(GICD_FRAME_SIZE);
+    cell[4] = cpu_to_fdt32(gic->gicr_addr >> 32);
+    cell[5] = cpu_to_fdt32(gic->gicr_addr);
+    cell[6] = 0;
+    cell[7] = cpu_to_fdt32(GICR_FRAME_SIZE * os->cpu.num);
+    hyp_fdt_wr_prop(wr, "reg", cell, 32);
+    hyp_fdt_wr_prop_u32(wr, "phandle", GUEST_GIC_PHANDLE);
+    hyp_fdt_wr_end_node(wr);
+
+    /* secure, non-secure, virtual and hypervisor timer PPIs */
+    hyp_fdt_wr_begin_node(wr, "timer");
+    hyp_fdt_wr_prop_str(wr, "compatible", "arm,armv8-timer");
+    for (rt_size_t i = 0; i < 4; i++)
+    {
+        static const rt_uint32_t ppi[4] = { 13, 14, 11, 10 };
+
+        cell[i * 3 + 0] = cpu_to_fdt32(GIC_PPI);
+        cell[i * 3 + 1] = cpu_to_fdt32(ppi[i]);
+        cell[i * 3 + 2] = cpu_to_fdt32(IRQ_TYPE_LEVEL_HIGH);
+    }
+    hyp_fdt_wr_prop(wr, "interrupts", cell, 48);
+    hyp_fdt_wr_end_node(wr);
+
+    for (rt_size_t i = 0; i < os->devs.num; i++)
+    {
+        const struct dev_info *dev = &os->devs.dev[i];
+        rt_uint32_t irq[3 * 4];
+        rt_size_t n = dev->interrupt_num > 4 ? 4 : dev->interrupt_num;
+        const char *base = dev->name ? dev->name : "dev";
+        rt_size_t len = 0;
+
+        for (len = 0; base[len] && base[len] != '@' && len < 16; len++)
+            name[len] = base[len];
+        rt_snprintf(&name[len], sizeof(name) - len, "@%lx", (unsigned long)dev->vaddr);
+        hyp_fdt_wr_begin_node(wr, name);
+        if (dev->compatible)
+            hyp_fdt_wr_prop(wr, "compatible", dev->compatible, dev->compatible_len);
+        cell[0] = cpu_to_fdt32(dev->vaddr >> 32);
+        cell[1] = cpu_to_fdt32(dev->vaddr);
+        cell[2] = cpu_to_fdt32(dev->size >> 32);
+        cell[3] = cpu_to_fdt32(dev->size);
+        hyp_fdt_wr_prop(wr, "reg", cell, 16);
+        for (rt_size_t j = 0; j < n; j++)
+        {
+            rt_uint64_t intid = dev->interrupts[j];
+
+            irq[j * 3 + 0] = cpu_to_fdt32(intid >= 32 ? GIC_SPI : GIC_PPI);
+            irq[j * 3 + 1] = cpu_to_fdt32(intid >= 32 ? intid - 32 : intid - 16);
+            irq[j * 3 + 2] = cpu_to_fdt32(IRQ_TYPE_LEVEL_HIGH);
+        }
+        if (n)
+            hyp_fdt_wr_prop(wr, "interrupts", irq, n * 12);
+        hyp_fdt_wr_end_node(wr);
+    }
+
+    hyp_fdt_wr_end_node(wr);
+    ret = hyp_fdt_wr_finish(wr);
+    rt_free(wr);
+    return ret;
+}
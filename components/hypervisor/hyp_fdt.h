@@ -6,13 +6,121 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-10-27     Suqier       first version
+ * 2022-11-29     Suqier       parse VM partitions, generate guest DTB
+ * 2022-12-06     Suqier       cache-colors of guest RAM
+ * 2022-12-08     Suqier       guest RAM regions
+ * 2022-12-10     Suqier       memory-limit of a VM
  */
 
 #ifndef __HYP_FDT_H__
 #define __HYP_FDT_H__
 
-#include <fdt.h>
+#include <rtdef.h>
 
+#include "os.h"
 
+/*
+ * Flattened device tree, enough of the v17 format to read the partition
+ * description handed to the hypervisor and to write one small DTB per VM.
+ * All values in the blob are big endian.
+ */
+#define FDT_MAGIC           (0xD00DFEED)
+#define FDT_VERSION         (17)
+#define FDT_LAST_COMP_VER   (16)
+
+#define FDT_BEGIN_NODE      (0x1)
+#define FDT_END_NODE        (0x2)
+#define FDT_PROP            (0x3)
+#define FDT_NOP             (0x4)
+#define FDT_END             (0x9)
+
+struct fdt_header
+{
+    rt_uint32_t magic;
+    rt_uint32_t totalsize;
+    rt_uint32_t off_dt_struct;
+    rt_uint32_t off_dt_strings;
+    rt_uint32_t off_mem_rsvmap;
+    rt_uint32_t version;
+    rt_uint32_t last_comp_version;
+    rt_uint32_t boot_cpuid_phys;
+    rt_uint32_t size_dt_strings;
+    rt_uint32_t size_dt_struct;
+};
+
+rt_inline rt_uint32_t fdt32_to_cpu(rt_uint32_t v) { return __builtin_bswap32(v); }
+rt_inline rt_uint32_t cpu_to_fdt32(rt_uint32_t v) { return __builtin_bswap32(v); }
+
+/* reader, offsets point at the FDT_BEGIN_NODE token of a node */
+rt_err_t hyp_fdt_check(const void *fdt);
+int hyp_fdt_first_subnode(const void *fdt, int node);
+int hyp_fdt_next_subnode(const void *fdt, int node);
+int hyp_fdt_subnode(const void *fdt, int node, const char *name);
+const char *hyp_fdt_name(const void *fdt, int node);
+const void *hyp_fdt_getprop(const void *fdt, int node, const char *name, int *len);
+rt_uint64_t hyp_fdt_read_cells(const rt_uint32_t *cell, int num);
+
+/* writer, sequential like libfdt's fdt_sw */
+#define HYP_FDT_STRINGS_MAX (512)
+
+struct hyp_fdt_wr
+{
+    rt_uint8_t *buf;
+    rt_size_t   size;
+    rt_size_t   off;        /* end of the struct block */
+    int         depth;
+    rt_err_t    err;        /* sticky, the first failure */
+
+    rt_size_t   strings_len;
+    char        strings[HYP_FDT_STRINGS_MAX];
+};
+
+void hyp_fdt_wr_init(struct hyp_fdt_wr *wr, void *buf, rt_size_t size);
+void hyp_fdt_wr_begin_node(struct hyp_fdt_wr *wr, const char *name);
+void hyp_fdt_wr_end_node(struct hyp_fdt_wr *wr);
+void hyp_fdt_wr_prop(struct hyp_fdt_wr *wr, const char *name, const void *val, rt_size_t len);
+void hyp_fdt_wr_prop_u32(struct hyp_fdt_wr *wr, const char *name, rt_uint32_t val);
+void hyp_fdt_wr_prop_u64(struct hyp_fdt_wr *wr, const char *name, rt_uint64_t val);
+void hyp_fdt_wr_prop_str(struct hyp_fdt_wr *wr, const char *name, const char *str);
+int hyp_fdt_wr_finish(struct hyp_fdt_wr *wr);
+
+/*
+ * Partitions live under /hypervisor, one node per VM, every address and
+ * size takes 2 cells:
+ *
+ *  hypervisor {
+ *      compatible = "rt-thread,hypervisor";
+ *      vm@0 {
+ *          compatible = "rt-thread,vm";
+ *          os-type = "rt-thread";              "linux", "zephyr", "other"
+ *          image = <0x0 0x45000000 0x0 0x29cd0>;
+ *          image-path = "/sd/rtthread.bin.lz4";    instead of image, in DFS
+ *          entry = <0x0 0x40008000>;
+ *          cpus = <0x0 0x1>;                   MPIDR affinity, one per vCPU
+ *          memory = <0x0 0x40000000 0x0 0x800000   RAM regions, MB granular,
+ *                    0x0 0x50000000 0x0 0x100000>; the first holds image, DTB
+ *          memory-attrs = "wb,exec", "nc";     optional, one per region of
+ *                                              wb, nc or wt, exec, shared
+ *          cache-colors = <0xff>;              optional, LLC colors of RAM,
+ *                                              for all or one per region
+ *          memory-limit = <64>;                optional, MB of host memory
+ *                                              the VM may take, RAM included
+ *          dtb = <0x0 0x407f0000>;             optional, default end of RAM
+ *          vgic = <0x0 0x8000000 0x0 0x80a0000>;
+ *          vgic-maintenance = <25>;
+ *          vgic-virqs = <127>;
+ *          uart@9000000 {
+ *              compatible = "arm,pl011", "arm,primecell";
+ *              reg = <0x0 0x9000000 0x0 0x1000>;
+ *              virt-reg = <0x0 0x9000000>;     optional, default flat
+ *              interrupts = <33>;              INTID
+ *          };
+ *      };
+ *  };
+ */
+#define HYP_FDT_GUEST_SIZE  (0x10000)   /* room for a guest DTB */
+
+int hyp_fdt_parse_vms(const void *fdt, struct os_desc *os, rt_size_t max);
+int hyp_fdt_gen_guest(const struct os_desc *os, void *buf, rt_size_t size);
 
 #endif  /* __HYP_FDT_H__ */
@@ -6,14 +6,41 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-05-30     Suqier       first version
+ * 2022-12-03     Suqier       add snapshot_vm and restore_vm
+ * 2022-12-04     Suqier       add clone_vm
+ * 2022-12-05     Suqier       start same-page merging
+ * 2022-12-06     Suqier       cache coloring of guest RAM
+ * 2022-12-07     Suqier       add balloon_vm
+ * 2022-12-08     Suqier       guest RAM regions
+ * 2022-12-10     Suqier       guest memory budget, memory of VMs in list_vm
  */
 
 #include "bitmap.h"
 #include "hypervisor.h"
 #include "switch.h"
 #include "os.h"
+#include "vconsole.h"
+#include "mem_pool.h"
+#include "mem_merge.h"
+#include "mem_color.h"
+#include "mem_quota.h"
+#include "vm_snap.h"
 
 #include <vgic.h>
+#include <gtimer.h>
+
+#ifndef RT_HYPERVISOR_MEM_POOL_SIZE
+#define RT_HYPERVISOR_MEM_POOL_ADDR 0x0
+#define RT_HYPERVISOR_MEM_POOL_SIZE 0
+#endif
+
+#ifndef RT_HYPERVISOR_MEM_MERGE_MS
+#define RT_HYPERVISOR_MEM_MERGE_MS  0
+#endif
+
+#ifndef RT_HYPERVISOR_CACHE_COLORS
+#define RT_HYPERVISOR_CACHE_COLORS  0
+#endif
 
 #ifndef RT_USING_SMP
 #define RT_CPUS_NR      1
@@ -26,7 +53,6 @@ static struct rt_thread hyp_cpu_init[RT_CPUS_NR];
 static rt_uint8_t hyp_stack[RT_CPUS_NR][2048];
 static int parameter[RT_CPUS_NR];
 
-extern const struct os_desc os_img[MAX_OS_NUM];
 extern const char* vm_status_str[VM_STATUS_UNKNOWN + 1];
 extern const char* os_type_str[OS_TYPE_OTHER + 1];
 
@@ -36,9 +62,6 @@ int rt_hyp_init(void)
 {
     rt_hyp.total_vm = 0;
 
-    rt_hyp.phy_mem_size = HYP_MEM_SIZE;
-    rt_hyp.phy_mem_used = 0;
-
     rt_hyp.next_vm_idx = 0;
     bitmap_init(&rt_hyp.vm_bitmap);
     rt_hyp.curr_vm_idx = MAX_VM_NUM;
@@ -53,7 +76,9 @@ int rt_hyp_init(void)
 
     rt_hyp.arch.hyp_init_ok = RT_FALSE;
 
-    rt_hyp.curr_vc_idx = MAX_VM_NUM;    /* MAX_VM_NUM == Host using UART */
+    rt_hyp.curr_vc_idx = MAX_VM_NUM;    /* MAX_VM_NUM == input to Host finsh */
+
+    os_img_fdt_init();
 
     rt_kprintf("[Info] RT_H: rt_hyp init OK.\n");
     return RT_EOK;
@@ -179,6 +204,30 @@ rt_err_t rt_hypervisor_init(void)
     if (ret != RT_EOK)
         return ret;
 
+    ret = vdev_coalesced_init();
+    if (ret != RT_EOK)
+        return ret;
+
+    ret = mem_pool_init((void *)RT_HYPERVISOR_MEM_POOL_ADDR, BYTE((rt_uint64_t)RT_HYPERVISOR_MEM_POOL_SIZE));
+    if (ret != RT_EOK)
+        return ret;
+
+    ret = mem_quota_init(HYP_MEM_SIZE);
+    if (ret != RT_EOK)
+        return ret;
+
+    ret = mem_merge_init(rt_hyp.vms, MAX_VM_NUM, RT_HYPERVISOR_MEM_MERGE_MS);
+    if (ret != RT_EOK)
+        return ret;
+
+    ret = mem_color_init(RT_HYPERVISOR_CACHE_COLORS);
+    if (ret != RT_EOK)
+        return ret;
+
+    ret = vc_server_init();
+    if (ret != RT_EOK)
+        return ret;
+
     rt_scheduler_sethook(switch_hook);
 
     rt_kprintf("[Info] RT-Hypervisor init over\n");
@@ -190,44 +239,60 @@ void help_vm(void)
     rt_kprintf("RT-Hypervisor shell command:\n");    
     rt_kprintf("%2s- %s\n", "help_vm", "print hypervisor related command.");
     rt_kprintf("%2s- %s\n", "list_vm", "list all vm details.");
+    rt_kprintf("%2s- %s\n", "list_vcpu", "list all vcpu status and WFI/WFE exit stats.");
     rt_kprintf("%2s- %s\n", "create_vm", "create new vm.");
+    rt_kprintf("%2s- %s\n", "boot_vm", "create and run a vm for every os, in parallel.");
+    rt_kprintf("%2s- %s\n", "dirty_vm", "start|stop|show dirty page logging of picked vm.");
+    rt_kprintf("%2s- %s\n", "snapshot_vm", "save paused picked vm to a file, -f path.");
+    rt_kprintf("%2s- %s\n", "restore_vm", "create and run a vm from a snapshot, -f path [-n name].");
+    rt_kprintf("%2s- %s\n", "clone_vm", "create and run a copy-on-write copy of paused picked vm, [-n name].");
+    rt_kprintf("%2s- %s\n", "balloon_vm", "ask picked vm to give back [MB] of its memory.");
 }
 
-rt_err_t create_vm(int argc, char **argv)
+/*
+ * Allocate a VM slot for OS description @os. The VM keeps VM_STATUS_NEVER_RUN
+ * until run_vm() allocates the rest of resource for it.
+ */
+vm_t vm_create(const struct os_desc *os, rt_uint8_t os_idx, const char *name)
 {
     rt_err_t ret = RT_EOK;
-    rt_uint8_t vm_idx, os_idx;
+    rt_uint8_t vm_idx;
     vm_t new_vm;
     struct mm_struct *mm;
     vgic_t vgic;
-    char *arg;
-    int opt;
-    struct optparse options;
 
     /* First time to create vm need to init all hyp system. */
     if (!rt_hyp.arch.hyp_init_ok)
     {
         ret = rt_hypervisor_init();
         if (ret != RT_EOK)
-            return ret;
+            return RT_NULL;
         else
             rt_hyp.arch.hyp_init_ok = RT_TRUE;
     }
 
-    /* new vm: allcate memory and index */
-    if (rt_hyp.total_vm == MAX_VM_NUM)
-    {
-        rt_kprintf("[Error] The number of VMs is full.\n");
-        return -RT_ERROR;
-    }
-    else
+    /* new vm: reserve an index, then allocate memory */
+#ifdef RT_USING_SMP
+    rt_hw_spin_lock(&rt_hyp.hyp_lock);
+#endif
+    vm_idx = MAX_VM_NUM;
+    if (rt_hyp.total_vm < MAX_VM_NUM)
     {
         vm_idx = bitmap_find_next(&rt_hyp.vm_bitmap);   /* 0 ~ 31 */
         bitmap_set_bit(&rt_hyp.vm_bitmap, vm_idx);
+        rt_hyp.total_vm++;
+    }
+#ifdef RT_USING_SMP
+    rt_hw_spin_unlock(&rt_hyp.hyp_lock);
+#endif
+
+    if (vm_idx == MAX_VM_NUM)
+    {
+        rt_kprintf("[Error] The number of VMs is full.\n");
+        return RT_NULL;
     }
 
     new_vm = (vm_t)rt_malloc(sizeof(struct vm));
-    rt_kprintf("0x%08x - 0x%08x\n", new_vm, new_vm + sizeof(struct vm));
     mm = (struct mm_struct *)rt_malloc(sizeof(struct mm_struct));
     vgic = vgic_create();
     if (new_vm == RT_NULL || mm == RT_NULL || vgic == RT_NULL)
@@ -235,8 +300,17 @@ rt_err_t create_vm(int argc, char **argv)
         rt_kprintf("[Error] Allocate memory for new VM failure.\n");
         rt_free(new_vm);
         rt_free(mm);
-        vgic_free(vgic);
-        return -RT_ENOMEM;
+        if (vgic)
+            vgic_free(vgic);
+#ifdef RT_USING_SMP
+        rt_hw_spin_lock(&rt_hyp.hyp_lock);
+#endif
+        bitmap_clr_bit(&rt_hyp.vm_bitmap, vm_idx);
+        rt_hyp.total_vm--;
+#ifdef RT_USING_SMP
+        rt_hw_spin_unlock(&rt_hyp.hyp_lock);
+#endif
+        return RT_NULL;
     }
     else
     {
@@ -248,27 +322,58 @@ rt_err_t create_vm(int argc, char **argv)
         new_vm->vgic = vgic;
     }
 
+    new_vm->os = os;
+    new_vm->os_idx = os_idx;
+    if (name)
+        strncpy(new_vm->name, name, VM_NAME_SIZE);
+
+    vm_config_init(new_vm, vm_idx);
+
+#ifdef RT_USING_SMP
+    rt_hw_spin_lock(&rt_hyp.hyp_lock);
+#endif
+
+    rt_hyp.vms[vm_idx] = new_vm;
+    rt_hyp.curr_vm_idx = vm_idx;
+
+#ifdef RT_USING_SMP
+    rt_hw_spin_unlock(&rt_hyp.hyp_lock);
+#endif
+
+    return new_vm;
+}
+
+rt_err_t create_vm(int argc, char **argv)
+{
+    rt_uint8_t os_idx = MAX_OS_NUM;
+    char *name = RT_NULL;
+    char *path = RT_NULL;
+    char *arg;
+    int opt;
+    struct optparse options;
+
     /* 
-     * "i" for os type and "n" for vm name. for example:
-     * -i os_img_type -n test_1
+     * "i" for os type, "n" for vm name and "f" for image file. for example:
+     * -i os_img_type -n test_1 -f /sd/rtthread.bin
      */
     optparse_init(&options, argv);
-    while ((opt = optparse(&options, "i:n:")) != -1) 
+    while ((opt = optparse(&options, "i:n:f:")) != -1) 
     {
         switch (opt) 
         {
         case 'i':
             os_idx = strtol((const char *)options.optarg, NULL, 10);
-            if(os_idx < 0 || os_idx >= MAX_OS_NUM)
+            if(os_idx >= os_img_num)
             {
                 rt_kprintf("[Error] OS_type %d is out of scope\n", os_idx);
                 return -RT_EINVAL;
             }
-            new_vm->os = &os_img[os_idx];
-            new_vm->os_idx = os_idx;
             break;
         case 'n':
-            strncpy(new_vm->name, options.optarg, VM_NAME_SIZE);
+            name = options.optarg;
+            break;
+        case 'f':
+            path = options.optarg;
             break;
         case '?':
             rt_kprintf("[Error] %s: %s.\n", argv[0], options.errmsg);
@@ -280,21 +385,30 @@ rt_err_t create_vm(int argc, char **argv)
     while ((arg = optparse_arg(&options)))
         printf("%s\n", arg);
 
-    vm_config_init(new_vm, vm_idx);
-
-#ifdef RT_USING_SMP
-    rt_hw_spin_lock(&rt_hyp.hyp_lock);
-#endif
+    if (os_idx == MAX_OS_NUM)
+    {
+        rt_kprintf("[Error] %s: OS type is not set, using -i os_idx.\n", argv[0]);
+        return -RT_EINVAL;
+    }
 
-    rt_hyp.vms[vm_idx] = new_vm;
-    rt_hyp.curr_vm_idx = vm_idx;
-    rt_hyp.total_vm++;
+    if (path)
+    {
+#ifdef RT_USING_DFS
+        /* swap the image of this OS type, kept for later VMs too */
+        static char img_path[MAX_OS_NUM][VM_IMG_PATH_SIZE];
 
-#ifdef RT_USING_SMP
-    rt_hw_spin_unlock(&rt_hyp.hyp_lock);
+        rt_strncpy(img_path[os_idx], path, VM_IMG_PATH_SIZE - 1);
+        os_img[os_idx].img.path = img_path[os_idx];
+#else
+        rt_kprintf("[Error] %s: Image file needs RT_USING_DFS.\n", argv[0]);
+        return -RT_EINVAL;
 #endif
+    }
 
-    return ret;
+    if (vm_create(&os_img[os_idx], os_idx, name) == RT_NULL)
+        return -RT_ERROR;
+
+    return RT_EOK;
 }
 
 void pick_vm(int argc, char **argv)
@@ -423,6 +537,128 @@ rt_err_t run_vm(void)
     return ret;
 }
 
+/*
+ * boot_vm: create a VM for every OS description and bring all of them up
+ * at once. vm_init() of each VM runs on a worker thread bound to its own
+ * core, and a VM starts as soon as its worker is done.
+ */
+#define VM_BOOT_STACK_SIZE  4096
+
+struct vm_boot
+{
+    vm_t vm;
+    rt_err_t ret;
+    rt_uint64_t start;      /* generic counter */
+    rt_uint64_t end;
+    struct rt_semaphore *done;
+};
+
+static void vm_boot_entry(void *parameter)
+{
+    struct vm_boot *boot = (struct vm_boot *)parameter;
+
+    boot->start = rt_hw_get_cntpct_val();
+    boot->ret = vm_init(boot->vm);
+    if (boot->ret == RT_EOK)
+    {
+        boot->vm->status = VM_STATUS_ONLINE;
+        vm_go(boot->vm);
+    }
+    boot->end = rt_hw_get_cntpct_val();
+    rt_sem_release(boot->done);
+}
+
+rt_inline rt_uint64_t vm_boot_us(rt_uint64_t cnt)
+{
+    return cnt * 1000000UL / rt_hw_get_gtimer_frq();
+}
+
+static void vm_boot_report(struct vm_boot *boot, rt_size_t num, rt_uint64_t start)
+{
+    rt_uint64_t serial = 0, end = start;
+
+    /*
+     *  msh >boot_vm
+     *  vm  status      mem     vcpu      dev      img      dtb    total (us)
+     *  --- ------ -------- -------- -------- -------- -------- --------
+     *  000 ok          812       95       40    13210       31    14188
+     */
+    rt_kprintf("vm  status      mem     vcpu      dev      img      dtb    total (us)\n");
+    rt_kprintf("--- ------ -------- -------- -------- -------- -------- --------\n");
+    for (rt_size_t i = 0; i < num; i++)
+    {
+        vm_t vm = boot[i].vm;
+
+        rt_kprintf("%03d %-6s", vm->id, boot[i].ret ? "fail" : "ok");
+        for (rt_size_t j = 0; j < VM_BOOT_PHASE_NUM; j++)
+            rt_kprintf(" %8d", (int)(vm->boot_ns[j] / 1000));
+        rt_kprintf(" %8d\n", (int)vm_boot_us(boot[i].end - boot[i].start));
+
+        serial += boot[i].end - boot[i].start;
+        if (boot[i].end > end)
+            end = boot[i].end;
+    }
+
+    rt_kprintf("[Info] %d VMs ready in %d us, %d us one by one\n",
+            num, (int)vm_boot_us(end - start), (int)vm_boot_us(serial));
+}
+
+rt_err_t boot_vm(void)
+{
+    struct vm_boot boot[MAX_OS_NUM];
+    struct rt_semaphore done;
+    rt_size_t num = 0, started = 0;
+    rt_uint64_t start;
+    char name[VM_NAME_SIZE];
+
+    /* slots first, one by one, vm_create() sets up the hypervisor once */
+    for (rt_size_t i = 0; i < os_img_num; i++)
+    {
+        rt_snprintf(name, VM_NAME_SIZE, "boot_%d", i);
+        boot[num].vm = vm_create(&os_img[i], i, name);
+        if (boot[num].vm == RT_NULL)
+            break;
+        boot[num].ret = -RT_ERROR;
+        boot[num].start = boot[num].end = 0;
+        boot[num].done = &done;
+        num++;
+    }
+
+    if (num == 0)
+    {
+        rt_kputs("[Error] boot_vm: No VM created\n");
+        return -RT_ERROR;
+    }
+
+    rt_sem_init(&done, "vm_boot", 0, RT_IPC_FLAG_FIFO);
+    start = rt_hw_get_cntpct_val();
+    for (rt_size_t i = 0; i < num; i++)
+    {
+        rt_thread_t tid;
+
+        rt_snprintf(name, VM_NAME_SIZE, "boot_%d", boot[i].vm->id);
+        tid = rt_thread_create(name, vm_boot_entry, &boot[i], 
+                        VM_BOOT_STACK_SIZE, FINSH_THREAD_PRIORITY + 1, THREAD_TIMESLICE);
+        if (tid == RT_NULL)
+        {
+            rt_kprintf("[Error] %dth VM: Create boot thread failure\n", boot[i].vm->id);
+            continue;
+        }
+#ifdef RT_USING_SMP
+        rt_thread_control(tid, RT_THREAD_CTRL_BIND_CPU, (void *)(i % RT_CPUS_NR));
+#endif
+        rt_thread_startup(tid);
+        started++;
+    }
+
+    while (started--)
+        rt_sem_take(&done, RT_WAITING_FOREVER);
+    rt_sem_detach(&done);
+
+    vm_boot_report(boot, num, start);
+    return RT_EOK;
+}
+
 rt_err_t pause_vm(void)
 {
     /* 
@@ -478,9 +714,20 @@ rt_err_t delete_vm(void)
         if (!ret)
         {
             struct vm *del_vm = rt_hyp.vms[vm_idx];
+
+            /* out of sight of the merge scanner before it goes */
+            mem_merge_lock();
+#ifdef RT_USING_SMP
+            rt_hw_spin_lock(&rt_hyp.hyp_lock);
+#endif
             rt_hyp.vms[vm_idx] = RT_NULL;
-            vm_free(del_vm);
             bitmap_clr_bit(&rt_hyp.vm_bitmap, vm_idx);
+            rt_hyp.total_vm--;
+#ifdef RT_USING_SMP
+            rt_hw_spin_unlock(&rt_hyp.hyp_lock);
+#endif
+            mem_merge_unlock();
+            vm_free(del_vm);
             rt_kprintf("[Info] Delete %dth VM success.\n", vm_idx);
             return RT_EOK;
         }
@@ -497,6 +744,293 @@ rt_err_t delete_vm(void)
     }
 }
 
+/* Harvest the dirty page log of guest RAM and count what was written. */
+static rt_err_t dirty_vm_show(vm_t vm)
+{
+    rt_ubase_t bitmap[VM_DIRTY_WORDS(MEM_BLOCK_SIZE)];
+    struct rt_list_node *pos;
+    rt_size_t dirty = 0, total = 0;
+    rt_err_t ret;
+
+    rt_list_for_each(pos, &vm->mm->vm_area_used)
+    {
+        struct vm_area *vma = rt_list_entry(pos, struct vm_area, node);
+
+        if (!VM_MAP_IS_RAM(vma->flag))
+            continue;
+
+        for (rt_uint64_t ipa = vma->desc.vaddr_start; ipa < vma->desc.vaddr_end; ipa += MEM_BLOCK_SIZE)
+        {
+            ret = vm_dirty_log_get(vm->mm, ipa, MEM_BLOCK_SIZE, bitmap);
+            if (ret)
+            {
+                rt_kprintf("[Error] %dth VM: Dirty page logging is off\n", vm->id);
+                return ret;
+            }
+
+            for (rt_size_t i = 0; i < VM_DIRTY_WORDS(MEM_BLOCK_SIZE); i++)
+                dirty += __builtin_popcountl(bitmap[i]);
+            total += MEM_BLOCK_SIZE >> S2_PTE_SHIFT;
+        }
+    }
+
+    rt_kprintf("[Info] %dth VM: %d of %d pages dirty, %d KB\n",
+            vm->id, dirty, total, dirty << (S2_PTE_SHIFT - 10));
+    return RT_EOK;
+}
+
+rt_err_t dirty_vm(int argc, char **argv)
+{
+    rt_err_t ret = vm_idx_check();
+    if (ret)
+        return ret;
+
+    vm_t vm = rt_hyp.vms[rt_hyp.curr_vm_idx];
+    if (vm == RT_NULL || vm->status == VM_STATUS_NEVER_RUN)
+    {
+        rt_kprintf("[Error] %dth VM is not running.\n", rt_hyp.curr_vm_idx);
+        return -RT_EINVAL;
+    }
+
+    if (argc == 2 && !rt_strcmp(argv[1], "start"))
+        return vm_dirty_log_start(vm->mm);
+    if (argc == 2 && !rt_strcmp(argv[1], "stop"))
+    {
+        vm_dirty_log_stop(vm->mm);
+        return RT_EOK;
+    }
+    if (argc == 2 && !rt_strcmp(argv[1], "show"))
+        return dirty_vm_show(vm);
+
+    rt_kputs("Usage: dirty_vm start|stop|show\n");
+    return -RT_EINVAL;
+}
+
+/* Run a VM built on saved state, vCPUs that never ran wait for the guest. */
+static void vm_resume_new(vm_t vm)
+{
+    vm->status = VM_STATUS_ONLINE;
+    for (rt_size_t i = 0; i < vm->nr_vcpus; i++)
+    {
+        if (vm->vcpus[i]->status == VCPU_STATUS_OFFLINE)
+            vcpu_go(vm->vcpus[i]);
+    }
+}
+
+rt_err_t snapshot_vm(int argc, char **argv)
+{
+    char *path = RT_NULL;
+    int opt;
+    struct optparse options;
+
+    rt_err_t ret = vm_idx_check();
+    if (ret)
+        return ret;
+
+    optparse_init(&options, argv);
+    while ((opt = optparse(&options, "f:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            path = options.optarg;
+            break;
+        case '?':
+            rt_kprintf("[Error] %s: %s.\n", argv[0], options.errmsg);
+            return -RT_ERROR;
+        }
+    }
+
+    if (path == RT_NULL)
+    {
+        rt_kputs("Usage: snapshot_vm -f path\n");
+        return -RT_EINVAL;
+    }
+
+    vm_t vm = rt_hyp.vms[rt_hyp.curr_vm_idx];
+    if (vm == RT_NULL)
+    {
+        rt_kprintf("[Error] %dth VM is not set.\n", rt_hyp.curr_vm_idx);
+        return -RT_EINVAL;
+    }
+
+#ifdef RT_USING_DFS
+    return vm_snapshot(vm, path);
+#else
+    rt_kprintf("[Error] %s: Snapshot file needs RT_USING_DFS.\n", argv[0]);
+    return -RT_EINVAL;
+#endif
+}
+
+/*
+ * restore_vm: a new VM with the vCPUs, vGIC, vTimer and RAM of a snapshot.
+ * It skips image and DTB loading, zero pages come from the memory pool.
+ */
+rt_err_t restore_vm(int argc, char **argv)
+{
+    char *name = RT_NULL;
+    char *path = RT_NULL;
+    int opt;
+    struct optparse options;
+
+    optparse_init(&options, argv);
+    while ((opt = optparse(&options, "f:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            path = options.optarg;
+            break;
+        case 'n':
+            name = options.optarg;
+            break;
+        case '?':
+            rt_kprintf("[Error] %s: %s.\n", argv[0], options.errmsg);
+            return -RT_ERROR;
+        }
+    }
+
+    if (path == RT_NULL)
+    {
+        rt_kputs("Usage: restore_vm -f path [-n name]\n");
+        return -RT_EINVAL;
+    }
+
+#ifdef RT_USING_DFS
+    struct vm_snap_hdr hdr;
+    rt_uint64_t start = rt_hw_get_cntpct_val();
+    rt_err_t ret;
+    vm_t vm;
+
+    if (vm_snap_read_hdr(path, &hdr) || hdr.os_idx >= os_img_num)
+    {
+        rt_kprintf("[Error] %s: %s is not a VM snapshot.\n", argv[0], path);
+        return -RT_EINVAL;
+    }
+
+    vm = vm_create(&os_img[hdr.os_idx], hdr.os_idx, name);
+    if (vm == RT_NULL)
+        return -RT_ERROR;
+
+    ret = vm_init_bare(vm, RT_NULL);
+    if (ret == RT_EOK)
+        ret = vm_restore(vm, path);
+    if (ret)
+    {
+        /* half built, only delete_vm is left for it */
+        vm->status = VM_STATUS_UNKNOWN;
+        rt_kprintf("[Error] %dth VM: Restore failure\n", vm->id);
+        return ret;
+    }
+
+    vm_resume_new(vm);
+    rt_kprintf("[Info] %dth VM: Restored and running in %d us\n",
+            vm->id, (int)vm_boot_us(rt_hw_get_cntpct_val() - start));
+    return RT_EOK;
+#else
+    rt_kprintf("[Error] %s: Snapshot file needs RT_USING_DFS.\n", argv[0]);
+    return -RT_EINVAL;
+#endif
+}
+
+/*
+ * clone_vm: a new VM on the guest RAM of the paused picked VM, shared
+ * copy-on-write, with a copy of its vCPU, vGIC and vTimer state. Both run
+ * on from there, the new one costs only the pages it writes.
+ */
+rt_err_t clone_vm(int argc, char **argv)
+{
+    char *name = RT_NULL;
+    int opt;
+    struct optparse options;
+    rt_uint64_t start = rt_hw_get_cntpct_val();
+    vm_t parent, vm;
+
+    rt_err_t ret = vm_idx_check();
+    if (ret)
+        return ret;
+
+    optparse_init(&options, argv);
+    while ((opt = optparse(&options, "n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            name = options.optarg;
+            break;
+        case '?':
+            rt_kprintf("[Error] %s: %s.\n", argv[0], options.errmsg);
+            return -RT_ERROR;
+        }
+    }
+
+    parent = rt_hyp.vms[rt_hyp.curr_vm_idx];
+    if (parent == RT_NULL || parent->status != VM_STATUS_SUSPEND)
+    {
+        rt_kprintf("[Error] %s: Pause %dth VM first.\n", argv[0], rt_hyp.curr_vm_idx);
+        return -RT_EBUSY;
+    }
+
+    vm = vm_create(parent->os, parent->os_idx, name);
+    if (vm == RT_NULL)
+        return -RT_ERROR;
+
+    /* the scanner would share blocks of @parent under us */
+    mem_merge_lock();
+    ret = vm_init_bare(vm, parent);
+    mem_merge_unlock();
+    if (ret == RT_EOK)
+        ret = vm_snap_copy(vm, parent);
+    if (ret)
+    {
+        /* half built, only delete_vm is left for it */
+        vm->status = VM_STATUS_UNKNOWN;
+        rt_kprintf("[Error] %dth VM: Clone %dth VM failure\n", vm->id, parent->id);
+        return ret;
+    }
+
+    vm_resume_new(vm);
+    rt_kprintf("[Info] %dth VM: Cloned from %dth VM and running in %d us\n",
+            vm->id, parent->id, (int)vm_boot_us(rt_hw_get_cntpct_val() - start));
+    return RT_EOK;
+}
+
+/*
+ * balloon_vm: ask the picked VM to give back MB of its RAM, its balloon
+ * driver gets there in its own time. Without MB, show how far it got.
+ */
+rt_err_t balloon_vm(int argc, char **argv)
+{
+    rt_err_t ret = vm_idx_check();
+    long size;
+    vm_t vm;
+
+    if (ret)
+        return ret;
+
+    vm = rt_hyp.vms[rt_hyp.curr_vm_idx];
+    if (vm == RT_NULL || vm->status == VM_STATUS_NEVER_RUN)
+    {
+        rt_kprintf("[Error] %dth VM is not running.\n", rt_hyp.curr_vm_idx);
+        return -RT_EINVAL;
+    }
+
+    if (argc == 2)
+    {
+        size = strtol(argv[1], NULL, 10);
+        if (size < 0 || size > vm->mm->mem_size)
+        {
+            rt_kprintf("[Error] %s: 0 to %dMB.\n", argv[0], vm->mm->mem_size);
+            return -RT_EINVAL;
+        }
+        vm->mm->balloon_target = BYTE((rt_uint64_t)size);
+    }
+
+    rt_kprintf("[Info] %dth VM: Balloon %dMB, target %dMB\n", vm->id,
+            MB(vm->mm->balloon), MB(vm->mm->balloon_target));
+    return RT_EOK;
+}
+
 #if defined(RT_USING_FINSH)
 rt_inline void object_split(int len)
 {
@@ -518,14 +1052,15 @@ void list_os_img(void)
     object_split(maxlen);
     rt_kprintf(" ----- ---- ------\n");
 
-    for (rt_size_t i = 0; i < MAX_OS_NUM; i++)
+    for (rt_size_t i = 0; i < os_img_num; i++)
     {
         const struct os_desc *os = &os_img[i];
-        if (os)
-        {
-            rt_kprintf("%-*.*s %5d %4.1d %6d\n", maxlen, VM_NAME_SIZE, 
-                    os_type_str[os->img.type], i, os->cpu.num, os->mem.size);
-        }
+        rt_uint64_t mem_size = 0;
+
+        for (rt_size_t j = 0; j < os->mem.num; j++)
+            mem_size += os->mem.region[j].size;
+        rt_kprintf("%-*.*s %5d %4.1d %6d\n", maxlen, VM_NAME_SIZE, 
+                os_type_str[os->img.type], i, os->cpu.num, mem_size);
     }
 }
 
@@ -533,33 +1068,88 @@ void list_vm(void)
 {
     const char *item_title = "vm name";
     int maxlen = VM_NAME_SIZE;
+    struct mem_quota_stat stat;
     char *fmt;
 
     /*
      *  msh >list_vm
-     *  vm name           vm id status       OS     vcpu  mem(M)
-     *  ---------------- ------ -------- ---------- ---- -------
-     *  linux_test_1        001 offline  Linux         4      64
-     *  Zephyr_test         002 never    Zephyr        1      64
+     *  vm name           vm id status       OS     vcpu  mem(M) balloon(M)  ram(K) pgtbl(K) vgic(K) vcpu(K) limit(M)
+     *  ---------------- ------ -------- ---------- ---- -------- ---------- ------- -------- ------- ------- --------
+     *  linux_test_1        001 offline  Linux         4      64         16   49152       28      77      90      128
+     *  Zephyr_test         002 never    Zephyr        1      64          0   65536       12      21      22        0
+     *  guest memory: 131282KB of 262144KB budget, RAM 131072KB vGIC 98KB vCPU 112KB, 0 denied
      */
-    rt_kprintf("%-*.s  vm id status   OS type    vcpu  mem(M)\n", 
+    rt_kprintf("%-*.s  vm id status   OS type    vcpu  mem(M) balloon(M)  ram(K) pgtbl(K) vgic(K) vcpu(K) limit(M)\n", 
             maxlen, item_title);
     object_split(maxlen);
-    rt_kprintf(" ------ -------- ---------- ---- --------\n");
+    rt_kprintf(" ------ -------- ---------- ---- -------- ---------- ------- -------- ------- ------- --------\n");
 
     for (rt_size_t i = 0; i < MAX_VM_NUM; i++)
     {
         vm_t vm = rt_hyp.vms[i];
         if (vm)
         {
+            struct mem_quota *quota = &vm->mm->quota;
+
             if (i == rt_hyp.curr_vm_idx)
-                fmt = "\033[34m%-*.*s %6.3d %-8.s %-10s %4.1d %8d\n\033[0m";
+                fmt = "\033[34m%-*.*s %6.3d %-8.s %-10s %4.1d %8d %10d %7d %8d %7d %7d %8d\n\033[0m";
             else
-                fmt = "%-*.*s %6.3d %-8.s %-10s %4.1d %8d\n";
+                fmt = "%-*.*s %6.3d %-8.s %-10s %4.1d %8d %10d %7d %8d %7d %7d %8d\n";
             
             rt_kprintf(fmt, maxlen, VM_NAME_SIZE, vm->name, vm->id,
                     vm_status_str[vm->status], os_type_str[vm->os->img.type],
-                    vm->os->cpu.num, vm->mm->mem_size);
+                    vm->os->cpu.num, vm->mm->mem_size, MB(vm->mm->balloon),
+                    vm->mm->mem_used >> 10, s2_table_size(vm->id) >> 10,
+                    quota->used[VM_MEM_VGIC] >> 10, quota->used[VM_MEM_VCPU] >> 10,
+                    MB(quota->limit));
+        }
+    }
+
+    /* RAM is charged whole per region, shared regions once */
+    mem_quota_get_stat(&stat);
+    rt_kprintf("guest memory: %dKB of %dKB budget, RAM %dKB vGIC %dKB vCPU %dKB, %d denied\n",
+            (stat.used[VM_MEM_RAM] + stat.used[VM_MEM_VGIC] + stat.used[VM_MEM_VCPU]) >> 10,
+            stat.budget >> 10, stat.used[VM_MEM_RAM] >> 10, stat.used[VM_MEM_VGIC] >> 10,
+            stat.used[VM_MEM_VCPU] >> 10, stat.denied);
+}
+
+void list_vcpu(void)
+{
+    /*
+     *  msh >list_vcpu
+     *  vm  vcpu status   poll(ns)  wfi exits    poll ok  poll fail     wakeup
+     *  --- ---- -------- -------- ---------- ---------- ---------- ----------
+     *  000    0 online      40000       1234       1100        134        120
+     *           wfe exits      yield       miss  yield(us)
+     *           ---------- ---------- ---------- ----------
+     *                  567        480         87       9600
+     */
+    rt_kprintf("vm  vcpu status   poll(ns)  wfi exits    poll ok  poll fail     wakeup\n");
+    rt_kprintf("--- ---- -------- -------- ---------- ---------- ---------- ----------\n");
+
+    for (rt_size_t i = 0; i < MAX_VM_NUM; i++)
+    {
+        vm_t vm = rt_hyp.vms[i];
+        if (vm == RT_NULL || vm->status == VM_STATUS_NEVER_RUN)
+            continue;
+
+        for (rt_size_t j = 0; j < vm->nr_vcpus; j++)
+        {
+            vcpu_t vcpu = vm->vcpus[j];
+            if (vcpu == RT_NULL)
+                continue;
+
+            rt_kprintf("%03d %4d %-8s %8d %10d %10d %10d %10d\n", vm->id, vcpu->id,
+                    vcpu->halted ? "halted" : vm_status_str[vcpu->status],
+                    vcpu->halt_poll_ns, (rt_uint32_t)vcpu->stat.halt_exits,
+                    (rt_uint32_t)vcpu->stat.halt_poll_success,
+                    (rt_uint32_t)vcpu->stat.halt_poll_fail,
+                    (rt_uint32_t)vcpu->stat.halt_wakeup);
+            rt_kprintf("%9s%10s %10s %10s %10s\n", "", "wfe exits", "yield", "miss", "yield(us)");
+            rt_kprintf("%9s%10d %10d %10d %10d\n", "", (rt_uint32_t)vcpu->stat.wfe_exits,
+                    (rt_uint32_t)vcpu->stat.directed_yield,
+                    (rt_uint32_t)vcpu->stat.yield_miss,
+                    (rt_uint32_t)(vcpu->stat.yield_ns / 1000));
         }
     }
 }
@@ -594,12 +1184,19 @@ void dump_virq(void)
 MSH_CMD_EXPORT(print_el, print current EL);
 MSH_CMD_EXPORT(list_os_img, list all os support);
 MSH_CMD_EXPORT(list_vm, list all vm detail);
+MSH_CMD_EXPORT(list_vcpu, list vcpu status and WFI/WFE exit stats);
 MSH_CMD_EXPORT(help_vm, print hypervisor help info);
 MSH_CMD_EXPORT(create_vm, create new vm);
 MSH_CMD_EXPORT(pick_vm, change current picking vm);
 MSH_CMD_EXPORT(run_vm, run vm by index);
+MSH_CMD_EXPORT(boot_vm, create and run all vms in parallel);
 MSH_CMD_EXPORT(pause_vm, pause vm by index);
 MSH_CMD_EXPORT(halt_vm, halt vm by index);
 MSH_CMD_EXPORT(delete_vm, delete vm by index);
+MSH_CMD_EXPORT(dirty_vm, log pages written by picked vm);
+MSH_CMD_EXPORT(snapshot_vm, save paused picked vm to a file);
+MSH_CMD_EXPORT(restore_vm, run a vm from a snapshot file);
+MSH_CMD_EXPORT(clone_vm, run a copy-on-write copy of paused picked vm);
+MSH_CMD_EXPORT(balloon_vm, ask picked vm to give back memory);
 MSH_CMD_EXPORT(dump_virq, for test);
 #endif /* RT_USING_FINSH */
\ No newline at end of file
@@ -6,6 +6,7 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-05-30     Suqier       first version
+ * 2022-12-10     Suqier       guest memory budget
  */
 
 #ifndef __HYPERVISOR_H__
@@ -32,16 +33,15 @@
 #define MAX_VM_NUM  8
 #endif
 
-/*
- * Need change these macro to CONFIG_XXX.
- */
-#define HYP_MEM_SIZE    64 * (1024) * (1024)
+#ifndef RT_HYPERVISOR_MEM_BUDGET
+#define RT_HYPERVISOR_MEM_BUDGET    64      /* MB */
+#endif
+
+/* host memory all VMs may take, accounted by mem_quota.c */
+#define HYP_MEM_SIZE    ((rt_uint64_t)RT_HYPERVISOR_MEM_BUDGET * (1024) * (1024))
 
 struct hypervisor
 {
-    rt_uint64_t phy_mem_size;
-    rt_uint64_t phy_mem_used;
-
 #ifdef RT_USING_SMP
     rt_hw_spinlock_t hyp_lock;
 #endif
@@ -63,12 +63,20 @@ rt_err_t rt_hypervisor_init(void);
 
 void list_os_img(void);
 void list_vm(void);
+void list_vcpu(void);
 void help_vm(void);
+vm_t vm_create(const struct os_desc *os, rt_uint8_t os_idx, const char *name);
 rt_err_t create_vm(int argc, char **argv);
 void pick_vm(int argc, char **argv);
 rt_err_t run_vm(void);
+rt_err_t boot_vm(void);
 rt_err_t pause_vm(void);
 rt_err_t halt_vm(void);
 rt_err_t delete_vm(void);
+rt_err_t dirty_vm(int argc, char **argv);
+rt_err_t snapshot_vm(int argc, char **argv);
+rt_err_t restore_vm(int argc, char **argv);
+rt_err_t clone_vm(int argc, char **argv);
+rt_err_t balloon_vm(int argc, char **argv);
 
 #endif  /* __HYPERVISOR_H__ */ 
\ No newline at end of file
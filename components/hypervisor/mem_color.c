@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-12-06     Suqier       first version
+ * 2022-12-08     Suqier       uncolored 4K guest RAM
+ */
+
+#include <rthw.h>
+#include <rtthread.h>
+
+#include "mm.h"
+#include "mem_pool.h"
+#include "mem_color.h"
+
+/*
+ * Free pages are linked through their first word, the rest of a free page
+ * is zero. A mem_block taken from the pool stays carved into pages.
+ */
+static struct
+{
+    rt_size_t num;
+    void *head[MEM_COLOR_MAX];
+    struct mem_color_stat stat;
+} mem_color;
+
+static void color_push(rt_uint32_t color, void *page)
+{
+    *(void **)page = mem_color.head[color];
+    mem_color.head[color] = page;
+    mem_color.stat.free[color]++;
+}
+
+static void *color_pop(rt_uint32_t color)
+{
+    void *page = mem_color.head[color];
+
+    if (page)
+    {
+        mem_color.head[color] = *(void **)page;
+        mem_color.stat.free[color]--;
+    }
+    return page;
+}
+
+/*
+ * Use @nr_colors colors, a power of 2 up to MEM_COLOR_MAX: LLC way size
+ * divided by the page size. 0 turns coloring off, every page is of color 0
+ * then. Free pages of an earlier call are dropped.
+ */
+rt_err_t mem_color_init(rt_size_t nr_colors)
+{
+    rt_base_t level;
+
+    if (nr_colors > MEM_COLOR_MAX || (nr_colors & (nr_colors - 1)))
+    {
+        rt_kprintf("[Error] %d cache colors, a power of 2 up to %d expected\n",
+                nr_colors, MEM_COLOR_MAX);
+        return -RT_EINVAL;
+    }
+
+    level = rt_hw_interrupt_disable();
+    rt_memset(&mem_color, 0, sizeof(mem_color));
+    mem_color.num = mem_color.stat.colors = nr_colors;
+    rt_hw_interrupt_enable(level);
+
+    if (nr_colors)
+        rt_kprintf("[Info] Cache coloring: %d colors\n", nr_colors);
+    return RT_EOK;
+}
+
+rt_size_t mem_color_num(void)
+{
+    return mem_color.num;
+}
+
+rt_uint32_t mem_color_of(void *page)
+{
+    return mem_color.num ? ((rt_ubase_t)page >> S2_PTE_SHIFT) & (mem_color.num - 1) : 0;
+}
+
+/* A zeroed 4K page of @color, RT_NULL when guest RAM runs out. */
+void *mem_color_alloc(rt_uint32_t color)
+{
+    rt_base_t level;
+    rt_uint8_t *block;
+    void *page;
+
+    if (color >= (mem_color.num ? mem_color.num : 1))
+        return RT_NULL;
+
+    level = rt_hw_interrupt_disable();
+    while ((page = color_pop(color)) == RT_NULL)
+    {
+        rt_hw_interrupt_enable(level);
+        block = (rt_uint8_t *)mem_pool_alloc();
+        if (block == RT_NULL)
+            return RT_NULL;
+
+        /* every color gets MEM_BLOCK_SIZE / num pages */
+        level = rt_hw_interrupt_disable();
+        for (rt_size_t off = 0; off < MEM_BLOCK_SIZE; off += S2_PTE_SIZE)
+            color_push(mem_color_of(block + off), block + off);
+        mem_color.stat.blocks++;
+    }
+    rt_hw_interrupt_enable(level);
+
+    *(void **)page = RT_NULL;
+    rt_hw_cpu_dcache_ops(RT_HW_CACHE_FLUSH, page, sizeof(void *));
+    return page;
+}
+
+void mem_color_free(void *page)
+{
+    rt_base_t level;
+
+    if (page == RT_NULL)
+        return;
+
+    /* guests may boot with caches off, zeros must reach memory */
+    rt_memset(page, 0, S2_PTE_SIZE);
+    rt_hw_cpu_dcache_ops(RT_HW_CACHE_FLUSH, page, S2_PTE_SIZE);
+
+    level = rt_hw_interrupt_disable();
+    color_push(mem_color_of(page), page);
+    rt_hw_interrupt_enable(level);
+}
+
+void mem_color_get_stat(struct mem_color_stat *stat)
+{
+    rt_base_t level = rt_hw_interrupt_disable();
+    *stat = mem_color.stat;
+    rt_hw_interrupt_enable(level);
+}
+
+#if defined(RT_USING_FINSH)
+void list_mem_color(void)
+{
+    struct mem_color_stat stat;
+
+    mem_color_get_stat(&stat);
+    if (stat.colors == 0)
+    {
+        rt_kputs("Cache coloring is off\n");
+        return;
+    }
+
+    rt_kprintf("%d colors, %d mem_blocks carved into pages\n", stat.colors, stat.blocks);
+    rt_kprintf("color  free pages\n");
+    rt_kprintf("-----  ----------\n");
+    for (rt_size_t i = 0; i < stat.colors; i++)
+        rt_kprintf("%5d  %10d\n", i, stat.free[i]);
+}
+MSH_CMD_EXPORT(list_mem_color, list free guest pages of each cache color);
+#endif
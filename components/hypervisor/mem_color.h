@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-12-06     Suqier       first version
+ * 2022-12-08     Suqier       uncolored 4K guest RAM
+ */
+
+#ifndef __MEM_COLOR_H__
+#define __MEM_COLOR_H__
+
+#include <rtdef.h>
+
+/*
+ * Last level cache coloring. A physical page maps to the LLC sets picked by
+ * the address bits above the page offset and below the way size, its color.
+ * VMs given disjoint colors never evict each other from the LLC. Colored
+ * guest RAM is built from 4K pages, carved from mem_blocks of the pool and
+ * kept in one free list per color. With coloring off the one list of color
+ * 0 feeds guest RAM regions that are not 2M aligned.
+ */
+#define MEM_COLOR_MAX           32      /* bits of mem_info.colors */
+
+struct mem_color_stat
+{
+    rt_size_t colors;                   /* 0: coloring off */
+    rt_size_t blocks;                   /* mem_blocks carved into pages */
+    rt_size_t free[MEM_COLOR_MAX];      /* free pages of each color */
+};
+
+rt_err_t mem_color_init(rt_size_t nr_colors);
+rt_size_t mem_color_num(void);
+rt_uint32_t mem_color_of(void *page);
+void *mem_color_alloc(rt_uint32_t color);
+void mem_color_free(void *page);
+void mem_color_get_stat(struct mem_color_stat *stat);
+
+#endif  /* __MEM_COLOR_H__ */
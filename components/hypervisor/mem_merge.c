@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-12-05     Suqier       first version
+ * 2022-12-08     Suqier       every guest RAM region
+ */
+
+#include <rthw.h>
+#include <rtthread.h>
+
+#include "mm.h"
+#include "mem_merge.h"
+
+#ifndef RT_HYPERVISOR_MEM_MERGE_COPY
+#define RT_HYPERVISOR_MEM_MERGE_COPY    32
+#endif
+
+#define MEM_MERGE_STACK_SIZE    2048
+#define MEM_MERGE_PRIORITY      (RT_THREAD_PRIORITY_MAX - 2)   /* above idle */
+#define MEM_MERGE_PAGES         (MEM_BLOCK_SIZE / S2_PTE_SIZE)
+
+#define MEM_MERGE_LANES         8
+#define MEM_MERGE_PRIME32       (0x9E3779B1U)
+#define MEM_MERGE_PRIME64       (0x9E3779B97F4A7C15UL)
+
+static struct
+{
+    vm_t       *vms;
+    rt_size_t   num;
+    rt_uint32_t period;     /* ms */
+    rt_uint64_t *hash;      /* page hashes of two blocks */
+    struct mem_merge_stat stat;
+} mem_merge;
+
+static struct rt_thread merge_thread;
+static rt_uint8_t merge_stack[MEM_MERGE_STACK_SIZE];
+static struct rt_mutex merge_lock;
+static rt_bool_t merge_thread_up = RT_FALSE;
+
+/*
+ * Hash of a 4K page. Words go round robin to independent lanes, which the
+ * compiler keeps in vector registers. Only a hint, merging compares pages.
+ */
+rt_uint64_t mem_merge_hash(const void *page)
+{
+    const rt_uint32_t *w = (const rt_uint32_t *)page;
+    rt_uint32_t lane[MEM_MERGE_LANES];
+    rt_uint64_t h = 0;
+
+    for (rt_size_t l = 0; l < MEM_MERGE_LANES; l++)
+        lane[l] = l + 1;
+
+    for (rt_size_t i = 0; i < S2_PTE_SIZE / sizeof(rt_uint32_t); i += MEM_MERGE_LANES)
+    {
+        for (rt_size_t l = 0; l < MEM_MERGE_LANES; l++)
+            lane[l] = (lane[l] ^ w[i + l]) * MEM_MERGE_PRIME32;
+    }
+
+    for (rt_size_t l = 0; l < MEM_MERGE_LANES; l++)
+        h = (h ^ lane[l]) * MEM_MERGE_PRIME64;
+    return h;
+}
+
+static void merge_hash_block(const void *block, rt_uint64_t *hash)
+{
+    for (rt_size_t i = 0; i < MEM_MERGE_PAGES; i++)
+        hash[i] = mem_merge_hash((const rt_uint8_t *)block + i * S2_PTE_SIZE);
+}
+
+static rt_bool_t merge_vm_ready(vm_t vm)
+{
+    return vm && vm->mm
+        && (vm->status == VM_STATUS_ONLINE || vm->status == VM_STATUS_SUSPEND);
+}
+
+/* Merge the block at @ipa of the @a-th VM with those of the VMs after it. */
+static rt_size_t merge_block_at(rt_size_t a, rt_uint64_t ipa)
+{
+    rt_uint64_t *ha = mem_merge.hash, *hb = ha + MEM_MERGE_PAGES;
+    vm_t va = mem_merge.vms[a];
+    rt_size_t merged = 0, diff, copied;
+    rt_bool_t hashed = RT_FALSE;
+    void *pa, *pb;
+
+    pa = vm_memory_block(va->mm, ipa);
+    for (rt_size_t b = a + 1; b < mem_merge.num && pa; b++)
+    {
+        vm_t vb = mem_merge.vms[b];
+
+        if (!merge_vm_ready(vb))
+            continue;
+        pb = vm_memory_block(vb->mm, ipa);
+        if (pb == RT_NULL || pb == pa)
+            continue;
+
+        if (!hashed)
+            merge_hash_block(pa, ha);
+        hashed = RT_TRUE;
+        merge_hash_block(pb, hb);
+
+        diff = 0;
+        for (rt_size_t i = 0; i < MEM_MERGE_PAGES; i++)
+            diff += (ha[i] != hb[i]);
+        if (diff > RT_HYPERVISOR_MEM_MERGE_COPY)
+            continue;
+
+        if (vm_memory_merge(vb->mm, va->mm, ipa, diff, &copied) != RT_EOK)
+            continue;
+
+        merged++;
+        mem_merge.stat.blocks++;
+        mem_merge.stat.copied += copied;
+        mem_merge.stat.shared += MEM_MERGE_PAGES - copied;
+
+        /* the block of @vb may have been kept */
+        if (vm_memory_block(va->mm, ipa) != pa)
+        {
+            pa = vm_memory_block(va->mm, ipa);
+            hashed = RT_FALSE;
+        }
+    }
+
+    return merged;
+}
+
+/* One pass over every pair of VMs, the number of blocks merged. */
+rt_size_t mem_merge_scan(void)
+{
+    rt_size_t merged = 0;
+    struct rt_list_node *pos;
+
+    if (mem_merge.hash == RT_NULL)
+        return 0;
+
+    rt_mutex_take(&merge_lock, RT_WAITING_FOREVER);
+    for (rt_size_t a = 0; a + 1 < mem_merge.num; a++)
+    {
+        if (!merge_vm_ready(mem_merge.vms[a]))
+            continue;
+
+        /* private RAM in 2M blocks, VM_SHARED regions are one already */
+        rt_list_for_each(pos, &mem_merge.vms[a]->mm->vm_area_used)
+        {
+            struct vm_area *vma = rt_list_entry(pos, struct vm_area, node);
+
+            if ((vma->flag & (VM_MAP_TYPE_MASK | VM_SHARED)) != VM_MAP_BK)
+                continue;
+            for (rt_uint64_t ipa = vma->desc.vaddr_start; ipa < vma->desc.vaddr_end; ipa += MEM_BLOCK_SIZE)
+                merged += merge_block_at(a, ipa);
+        }
+    }
+    mem_merge.stat.scans++;
+    rt_mutex_release(&merge_lock);
+
+    if (merged)
+        rt_kprintf("[Info] Same-page merging: %d mem_blocks freed\n", merged);
+    return merged;
+}
+
+static void mem_merge_entry(void *parameter)
+{
+    while (1)
+    {
+        rt_thread_mdelay(mem_merge.period);
+        mem_merge_scan();
+    }
+}
+
+/*
+ * Scan @vms, the VM table of @num slots, every @period_ms. 0 leaves the
+ * scanner thread off, mem_merge_scan() still runs a pass when called.
+ */
+rt_err_t mem_merge_init(vm_t *vms, rt_size_t num, rt_uint32_t period_ms)
+{
+    rt_err_t ret;
+
+    if (mem_merge.hash == RT_NULL)
+    {
+        mem_merge.hash = (rt_uint64_t *)rt_malloc(2 * MEM_MERGE_PAGES * sizeof(rt_uint64_t));
+        if (mem_merge.hash == RT_NULL)
+            return -RT_ENOMEM;
+        rt_mutex_init(&merge_lock, "vmmerge", RT_IPC_FLAG_PRIO);
+    }
+
+    mem_merge.vms = vms;
+    mem_merge.num = num;
+    mem_merge.period = period_ms;
+    if (period_ms == 0 || merge_thread_up)
+        return RT_EOK;
+
+    ret = rt_thread_init(&merge_thread, "vmmerge", mem_merge_entry, RT_NULL,
+                        merge_stack, sizeof(merge_stack),
+                        MEM_MERGE_PRIORITY, THREAD_TIMESLICE);
+    if (ret == RT_EOK)
+        ret = rt_thread_startup(&merge_thread);
+    if (ret != RT_EOK)
+    {
+        rt_kprintf("[Error] Init same-page merging thread failure\n");
+        return ret;
+    }
+    merge_thread_up = RT_TRUE;
+
+    rt_kprintf("[Info] Same-page merging every %dms\n", period_ms);
+    return RT_EOK;
+}
+
+/* Hold off the scanner while a VM comes or goes. */
+void mem_merge_lock(void)
+{
+    if (mem_merge.hash)
+        rt_mutex_take(&merge_lock, RT_WAITING_FOREVER);
+}
+
+void mem_merge_unlock(void)
+{
+    if (mem_merge.hash)
+        rt_mutex_release(&merge_lock);
+}
+
+void mem_merge_get_stat(struct mem_merge_stat *stat)
+{
+    rt_base_t level = rt_hw_interrupt_disable();
+    *stat = mem_merge.stat;
+    rt_hw_interrupt_enable(level);
+}
+
+#if defined(RT_USING_FINSH)
+void list_mem_merge(void)
+{
+    struct mem_merge_stat stat;
+    struct vm_cow_stat cow;
+
+    mem_merge_get_stat(&stat);
+    vm_cow_get_stat(&cow);
+
+    rt_kprintf("scans   merged  shared  copied  | cow 4K  cow 2M  taken\n");
+    rt_kprintf("------- ------- ------- ------- | ------- ------- -------\n");
+    rt_kprintf("%7d %7d %7d %7d | %7d %7d %7d\n", stat.scans, stat.blocks,
+            stat.shared, stat.copied, cow.pages, cow.blocks, cow.taken);
+}
+MSH_CMD_EXPORT(list_mem_merge, list same-page merging and copy-on-write stats);
+#endif
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-12-05     Suqier       first version
+ */
+
+#ifndef __MEM_MERGE_H__
+#define __MEM_MERGE_H__
+
+#include <rtdef.h>
+
+#include "vm.h"
+
+/*
+ * Same-page merging. A low priority thread hashes the 4K pages of guest
+ * RAM blocks at the same IPA in two VMs, VMs of one image keep the same
+ * text and data there. A pair close enough is merged by vm_memory_merge():
+ * one block is freed, equal pages are shared read only and copied again on
+ * the first write, see vm_cow_fault().
+ */
+struct mem_merge_stat
+{
+    rt_size_t scans;        /* passes over all VMs */
+    rt_size_t blocks;       /* mem_blocks freed by merging */
+    rt_size_t shared;       /* 4K pages mapped to a page of another VM */
+    rt_size_t copied;       /* 4K pages that differed, copied at merge */
+};
+
+rt_err_t mem_merge_init(vm_t *vms, rt_size_t num, rt_uint32_t period_ms);
+rt_size_t mem_merge_scan(void);
+rt_uint64_t mem_merge_hash(const void *page);
+void mem_merge_lock(void);
+void mem_merge_unlock(void);
+void mem_merge_get_stat(struct mem_merge_stat *stat);
+
+#endif  /* __MEM_MERGE_H__ */
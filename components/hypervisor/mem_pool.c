@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-12-01     Suqier       first version
+ */
+
+#include <rthw.h>
+#include <rtthread.h>
+
+#include "mm.h"
+#include "mem_pool.h"
+
+#define MEM_POOL_STACK_SIZE     2048
+#define MEM_POOL_PRIORITY       (RT_THREAD_PRIORITY_MAX - 2)   /* above idle */
+#define MEM_POOL_NONE           (-1)
+
+/* free blocks are linked by index, in two lists */
+static struct
+{
+    rt_ubase_t  base;
+    rt_size_t   num;
+    rt_int32_t *next;
+    rt_int32_t  clean;
+    rt_int32_t  dirty;
+    struct mem_pool_stat stat;
+} mem_pool;
+
+static struct rt_thread pool_thread;
+static rt_uint8_t pool_stack[MEM_POOL_STACK_SIZE];
+static struct rt_semaphore pool_sem;
+static rt_bool_t pool_thread_up = RT_FALSE;
+
+static void *pool_block(rt_int32_t idx)
+{
+    return (void *)(mem_pool.base + (rt_ubase_t)idx * MEM_BLOCK_SIZE);
+}
+
+static rt_bool_t pool_owns(void *ptr)
+{
+    rt_ubase_t addr = (rt_ubase_t)ptr;
+
+    return mem_pool.num && addr >= mem_pool.base
+        && addr < mem_pool.base + mem_pool.num * MEM_BLOCK_SIZE;
+}
+
+static rt_int32_t pool_pop(rt_int32_t *head, rt_size_t *nr)
+{
+    rt_int32_t idx = *head;
+
+    if (idx != MEM_POOL_NONE)
+    {
+        *head = mem_pool.next[idx];
+        (*nr)--;
+    }
+    return idx;
+}
+
+static void pool_push(rt_int32_t *head, rt_size_t *nr, rt_int32_t idx)
+{
+    mem_pool.next[idx] = *head;
+    *head = idx;
+    (*nr)++;
+}
+
+/* guests may boot with caches off, zeros must reach memory */
+static void pool_zero(void *ptr)
+{
+    rt_memset(ptr, 0, MEM_BLOCK_SIZE);
+    rt_hw_cpu_dcache_ops(RT_HW_CACHE_FLUSH, ptr, MEM_BLOCK_SIZE);
+}
+
+/* Zero one dirty block, RT_FALSE when there is none. */
+rt_bool_t mem_pool_scrub(void)
+{
+    rt_base_t level;
+    rt_int32_t idx;
+
+    level = rt_hw_interrupt_disable();
+    idx = mem_pool.num ? pool_pop(&mem_pool.dirty, &mem_pool.stat.dirty) : MEM_POOL_NONE;
+    rt_hw_interrupt_enable(level);
+    if (idx == MEM_POOL_NONE)
+        return RT_FALSE;
+
+    pool_zero(pool_block(idx));
+
+    level = rt_hw_interrupt_disable();
+    pool_push(&mem_pool.clean, &mem_pool.stat.clean, idx);
+    rt_hw_interrupt_enable(level);
+    return RT_TRUE;
+}
+
+static void mem_pool_entry(void *parameter)
+{
+    while (1)
+    {
+        rt_sem_take(&pool_sem, RT_WAITING_FOREVER);
+        while (mem_pool_scrub());
+    }
+}
+
+/*
+ * Take over [@base, @base + @size) for guest RAM, @base 2M aligned. Its
+ * content is unknown, so every block starts dirty. Size 0 leaves guest
+ * RAM to the system heap.
+ */
+rt_err_t mem_pool_init(void *base, rt_size_t size)
+{
+    rt_size_t num = size / MEM_BLOCK_SIZE;
+    rt_int32_t *next = RT_NULL, *old;
+    rt_base_t level;
+
+    if ((rt_ubase_t)base & (MEM_BLOCK_SIZE - 1))
+    {
+        rt_kprintf("[Error] Memory pool 0x%lx is not mem_block aligned\n", (unsigned long)base);
+        return -RT_EINVAL;
+    }
+
+    if (num)
+    {
+        next = (rt_int32_t *)rt_malloc(sizeof(rt_int32_t) * num);
+        if (next == RT_NULL)
+            return -RT_ENOMEM;
+    }
+
+    level = rt_hw_interrupt_disable();
+    old = mem_pool.next;
+    rt_memset(&mem_pool, 0, sizeof(mem_pool));
+    mem_pool.base = (rt_ubase_t)base;
+    mem_pool.next = next;
+    mem_pool.clean = mem_pool.dirty = MEM_POOL_NONE;
+    for (rt_int32_t i = num - 1; i >= 0; i--)
+        pool_push(&mem_pool.dirty, &mem_pool.stat.dirty, i);
+    mem_pool.num = mem_pool.stat.total = num;
+    rt_hw_interrupt_enable(level);
+    rt_free(old);
+
+    if (num == 0)
+        return RT_EOK;
+
+    if (!pool_thread_up)
+    {
+        rt_err_t ret;
+
+        rt_sem_init(&pool_sem, "vmpool", 0, RT_IPC_FLAG_FIFO);
+        ret = rt_thread_init(&pool_thread, "vmpool", mem_pool_entry, RT_NULL,
+                            pool_stack, sizeof(pool_stack),
+                            MEM_POOL_PRIORITY, THREAD_TIMESLICE);
+        if (ret == RT_EOK)
+            ret = rt_thread_startup(&pool_thread);
+        if (ret != RT_EOK)
+        {
+            rt_kprintf("[Error] Init memory pool thread failure\n");
+            return ret;
+        }
+        pool_thread_up = RT_TRUE;
+    }
+
+    rt_sem_release(&pool_sem);
+    rt_kprintf("[Info] Memory pool: %d mem_blocks at 0x%lx\n", num, (unsigned long)base);
+    return RT_EOK;
+}
+
+/* A zeroed mem_block, RT_NULL when guest RAM runs out. */
+void *mem_pool_alloc(void)
+{
+    rt_base_t level;
+    rt_int32_t idx;
+    rt_bool_t dirty = RT_FALSE;
+    void *ptr;
+
+    if (mem_pool.num == 0)
+    {
+        ptr = rt_malloc_align(MEM_BLOCK_SIZE, MEM_BLOCK_SIZE);
+        if (ptr)
+            pool_zero(ptr);
+        return ptr;
+    }
+
+    level = rt_hw_interrupt_disable();
+    idx = pool_pop(&mem_pool.clean, &mem_pool.stat.clean);
+    if (idx == MEM_POOL_NONE)
+    {
+        /* the scrub thread is behind, do its work */
+        idx = pool_pop(&mem_pool.dirty, &mem_pool.stat.dirty);
+        dirty = (idx != MEM_POOL_NONE);
+        mem_pool.stat.sync_zero += dirty;
+    }
+    rt_hw_interrupt_enable(level);
+
+    if (idx == MEM_POOL_NONE)
+        return RT_NULL;
+
+    ptr = pool_block(idx);
+    if (dirty)
+        pool_zero(ptr);
+    return ptr;
+}
+
+void mem_pool_free(void *ptr)
+{
+    rt_base_t level;
+
+    if (ptr == RT_NULL)
+        return;
+
+    if (!pool_owns(ptr))
+    {
+        rt_free_align(ptr);
+        return;
+    }
+
+    level = rt_hw_interrupt_disable();
+    pool_push(&mem_pool.dirty, &mem_pool.stat.dirty,
+            ((rt_ubase_t)ptr - mem_pool.base) / MEM_BLOCK_SIZE);
+    rt_hw_interrupt_enable(level);
+
+    rt_sem_release(&pool_sem);
+}
+
+void mem_pool_get_stat(struct mem_pool_stat *stat)
+{
+    rt_base_t level = rt_hw_interrupt_disable();
+    *stat = mem_pool.stat;
+    rt_hw_interrupt_enable(level);
+}
+
+#if defined(RT_USING_FINSH)
+void list_mem_pool(void)
+{
+    struct mem_pool_stat stat;
+
+    mem_pool_get_stat(&stat);
+    if (stat.total == 0)
+    {
+        rt_kputs("Guest RAM comes from the system heap\n");
+        return;
+    }
+
+    rt_kprintf("total  clean  dirty  in use  sync zero\n");
+    rt_kprintf("------ ------ ------ ------ ----------\n");
+    rt_kprintf("%6d %6d %6d %6d %10d\n", stat.total, stat.clean, stat.dirty,
+            stat.total - stat.clean - stat.dirty, stat.sync_zero);
+}
+MSH_CMD_EXPORT(list_mem_pool, list guest memory pool);
+#endif
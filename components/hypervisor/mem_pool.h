@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-12-01     Suqier       first version
+ */
+
+#ifndef __MEM_POOL_H__
+#define __MEM_POOL_H__
+
+#include <rtdef.h>
+
+/*
+ * Guest RAM in 2M mem_blocks, carved from a region reserved for VMs
+ * instead of the system heap. Blocks come back dirty and are zeroed by a
+ * low priority thread, so allocation hands out clean memory in constant
+ * time while the pool keeps up.
+ */
+struct mem_pool_stat
+{
+    rt_size_t total;
+    rt_size_t clean;        /* zeroed, ready */
+    rt_size_t dirty;        /* freed, waiting for the scrub thread */
+    rt_size_t sync_zero;    /* allocations that had to zero a block */
+};
+
+rt_err_t mem_pool_init(void *base, rt_size_t size);
+void *mem_pool_alloc(void);
+void mem_pool_free(void *ptr);
+rt_bool_t mem_pool_scrub(void);
+void mem_pool_get_stat(struct mem_pool_stat *stat);
+
+#endif  /* __MEM_POOL_H__ */
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-12-10     Suqier       first version
+ */
+
+#include <rthw.h>
+#include <rtthread.h>
+
+#include "mm.h"
+#include "mem_quota.h"
+
+static const char *mem_quota_name[VM_MEM_NR] =
+{
+    "RAM", "vGIC", "vCPU"
+};
+
+static struct mem_quota_stat mem_quota;
+
+#ifdef RT_USING_SMP
+static rt_hw_spinlock_t quota_lock;
+#endif
+
+static rt_base_t quota_lock_take(void)
+{
+    rt_base_t level = rt_hw_interrupt_disable();
+#ifdef RT_USING_SMP
+    rt_hw_spin_lock(&quota_lock);
+#endif
+    return level;
+}
+
+static void quota_lock_release(rt_base_t level)
+{
+#ifdef RT_USING_SMP
+    rt_hw_spin_unlock(&quota_lock);
+#endif
+    rt_hw_interrupt_enable(level);
+}
+
+static rt_uint64_t quota_total(const rt_uint64_t *used)
+{
+    rt_uint64_t total = 0;
+
+    for (rt_size_t i = 0; i < VM_MEM_NR; i++)
+        total += used[i];
+    return total;
+}
+
+/*
+ * Let VMs take @budget bytes of host memory in all, 0 for no budget.
+ * Charges made so far are kept.
+ */
+rt_err_t mem_quota_init(rt_uint64_t budget)
+{
+    rt_base_t level;
+
+#ifdef RT_USING_SMP
+    static rt_bool_t lock_up = RT_FALSE;
+
+    if (!lock_up)
+    {
+        rt_hw_spin_lock_init(&quota_lock);
+        lock_up = RT_TRUE;
+    }
+#endif
+
+    level = quota_lock_take();
+    mem_quota.budget = budget;
+    quota_lock_release(level);
+
+    if (budget)
+        rt_kprintf("[Info] Guest memory budget: %dMB\n", MB(budget));
+    return RT_EOK;
+}
+
+/*
+ * Charge @size bytes of @type to @mm, RT_NULL for memory of no VM, before
+ * allocating them. -RT_ENOMEM leaves every count as it was.
+ */
+rt_err_t mem_quota_charge(struct mm_struct *mm, rt_uint32_t type, rt_uint64_t size)
+{
+    struct mem_quota *quota = mm ? &mm->quota : RT_NULL;
+    rt_uint64_t total, vm_total = 0;
+    rt_base_t level;
+    rt_err_t ret = RT_EOK;
+
+    RT_ASSERT(type < VM_MEM_NR);
+
+    level = quota_lock_take();
+    total = quota_total(mem_quota.used) + size;
+    if (quota)
+        vm_total = mem_quota_used(quota) + size;
+
+    if ((mem_quota.budget && total > mem_quota.budget)
+     || (quota && quota->limit && vm_total > quota->limit))
+    {
+        mem_quota.denied++;
+        ret = -RT_ENOMEM;
+    }
+    else
+    {
+        mem_quota.used[type] += size;
+        if (quota)
+            quota->used[type] += size;
+    }
+    quota_lock_release(level);
+
+    if (ret == RT_EOK)
+        return RT_EOK;
+
+    if (quota && quota->limit && vm_total > quota->limit)
+        rt_kprintf("[Error] %dth VM: %dKB of %s over its limit of %dKB\n",
+                mm->vm->id, size >> 10, mem_quota_name[type], quota->limit >> 10);
+    else
+        rt_kprintf("[Error] %dKB of %s over the guest memory budget, %dKB of %dKB used\n",
+                size >> 10, mem_quota_name[type], (total - size) >> 10, mem_quota.budget >> 10);
+    return ret;
+}
+
+void mem_quota_uncharge(struct mm_struct *mm, rt_uint32_t type, rt_uint64_t size)
+{
+    rt_base_t level;
+
+    RT_ASSERT(type < VM_MEM_NR);
+
+    level = quota_lock_take();
+    RT_ASSERT(mem_quota.used[type] >= size);
+    mem_quota.used[type] -= size;
+    if (mm)
+    {
+        RT_ASSERT(mm->quota.used[type] >= size);
+        mm->quota.used[type] -= size;
+    }
+    quota_lock_release(level);
+}
+
+/* Uncharge whatever @mm still holds, when the VM is gone. */
+void mem_quota_release(struct mm_struct *mm)
+{
+    rt_base_t level = quota_lock_take();
+
+    for (rt_size_t i = 0; i < VM_MEM_NR; i++)
+    {
+        mem_quota.used[i] -= mm->quota.used[i];
+        mm->quota.used[i] = 0;
+    }
+    quota_lock_release(level);
+}
+
+/* bytes charged to a VM */
+rt_uint64_t mem_quota_used(const struct mem_quota *quota)
+{
+    return quota_total(quota->used);
+}
+
+void mem_quota_get_stat(struct mem_quota_stat *stat)
+{
+    rt_base_t level = quota_lock_take();
+    *stat = mem_quota;
+    quota_lock_release(level);
+}
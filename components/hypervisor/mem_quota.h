@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-12-10     Suqier       first version
+ */
+
+#ifndef __MEM_QUOTA_H__
+#define __MEM_QUOTA_H__
+
+#include <rtdef.h>
+
+/*
+ * Memory VMs take from the host, charged before it is allocated against a
+ * global budget and the limit of each VM. Guest RAM is charged whole for
+ * every region when the VM gets its RAM, so later copy-on-write breaks and
+ * balloon deflation never run out. VM_SHARED regions are charged once, to
+ * no VM. Stage 2 tables come from static groups, see s2_table_size().
+ */
+enum
+{
+    VM_MEM_RAM = 0,
+    VM_MEM_VGIC,
+    VM_MEM_VCPU,
+    VM_MEM_NR,
+};
+
+struct mem_quota
+{
+    rt_uint64_t limit;              /* bytes, 0: the global budget only */
+    rt_uint64_t used[VM_MEM_NR];
+};
+
+struct mem_quota_stat
+{
+    rt_uint64_t budget;             /* bytes, 0: unlimited */
+    rt_uint64_t used[VM_MEM_NR];    /* of all VMs and shared RAM */
+    rt_size_t denied;               /* charges over budget or limit */
+};
+
+struct mm_struct;
+
+rt_err_t mem_quota_init(rt_uint64_t budget);
+rt_err_t mem_quota_charge(struct mm_struct *mm, rt_uint32_t type, rt_uint64_t size);
+void mem_quota_uncharge(struct mm_struct *mm, rt_uint32_t type, rt_uint64_t size);
+void mem_quota_release(struct mm_struct *mm);
+rt_uint64_t mem_quota_used(const struct mem_quota *quota);
+void mem_quota_get_stat(struct mem_quota_stat *stat);
+
+#endif  /* __MEM_QUOTA_H__ */
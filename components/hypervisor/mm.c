@@ -6,15 +6,50 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-06-21     Suqier       first version
+ * 2022-12-02     Suqier       dirty page logging
+ * 2022-12-04     Suqier       copy-on-write guest RAM for cloned VMs
+ * 2022-12-05     Suqier       same-page merging of guest RAM blocks
+ * 2022-12-06     Suqier       cache colored guest RAM in 4K pages
+ * 2022-12-07     Suqier       memory balloon
+ * 2022-12-08     Suqier       guest RAM regions
+ * 2022-12-09     Suqier       copy to and from guest RAM
+ * 2022-12-10     Suqier       charge guest RAM to the memory quota
+ * 2022-12-11     Suqier       free the whole mm_struct of a deleted VM
+ * 2022-12-12     Suqier       copy a copy-on-write block with the lock dropped
+ * 2022-12-12     Suqier       compare blocks to merge with the locks dropped
+ * 2022-12-12     Suqier       reject RAM whose stage 2 tables do not fit
+ * 2022-12-12     Suqier       write guest RAM under the lock
  */
 
 #include <rtdef.h>
 
 #include "os.h"
 #include "mm.h"
+#include "mem_pool.h"
+#include "mem_color.h"
+#include "mem_quota.h"
+
+#define VM_SHM_NUM      8       /* VM_SHARED regions of all VMs */
 
 extern void *alloc_vm_pgd(rt_uint8_t vm_idx);
 
+static struct vm_cow_stat cow_stat;
+
+/*
+ * RAM of a VM_SHARED region. The first VM declaring it allocates it, VMs
+ * declaring the same range map the same memory, the last one frees it.
+ * It counts in the mem_used and the quota of no VM.
+ */
+static struct vm_shm
+{
+    rt_uint64_t start;
+    rt_uint64_t end;
+    rt_uint64_t type;       /* VM_MAP_BK or VM_MAP_PG */
+    mem_block_t *mb_head;
+    rt_uint32_t users;      /* 0: free slot */
+    rt_bool_t ready;        /* mb_head is allocated */
+} vm_shm[VM_SHM_NUM];
+
 struct vm_area *vm_area_init(struct mm_struct *mm, rt_uint64_t start, rt_uint64_t end)
 {
     struct vm_area *va = (struct vm_area *)rt_malloc(sizeof(struct vm_area));
@@ -28,15 +63,93 @@ struct vm_area *vm_area_init(struct mm_struct *mm, rt_uint64_t start, rt_uint64_
     va->desc.vaddr_end = end;
     va->desc.attr = 0UL;    /* for stage 2 translate */
     va->flag = 0UL;         /* for programmer manage */
+    va->colors = 0;
     va->mm = mm;
+    va->mb_head = RT_NULL;  /* filled by vm_memory_init() */
+    va->dirty = RT_NULL;
+    va->page_head = RT_NULL;
 
     return va;
 }
 
+/* vm_area of a guest RAM region, in IPA order in the list */
+static rt_err_t vm_ram_area_init(struct mm_struct *mm, const struct mem_region *rg)
+{
+    rt_uint64_t start = rg->addr, end = rg->addr + BYTE(rg->size);
+    rt_uint64_t flag = rg->flag ? rg->flag : (VM_NORMAL | VM_RWX);
+    rt_uint64_t attr = flag & VM_MEMATTR_MASK;
+    struct rt_list_node *pos;
+    struct vm_area *va;
+
+    if (rg->size == 0 || !IS_4K_ALIGN(start) || end > S2_IPA_SIZE
+     || (attr != VM_NORMAL_WB && attr != VM_NORMAL_NC && attr != VM_NORMAL_WT))
+    {
+        rt_kprintf("[Error] %dth VM: Bad MEM region 0x%08x\n", mm->vm->id, start);
+        return -RT_EINVAL;
+    }
+
+    rt_list_for_each(pos, &mm->vm_area_used)
+    {
+        struct vm_area *vma = rt_list_entry(pos, struct vm_area, node);
+
+        if (start < vma->desc.vaddr_end && vma->desc.vaddr_start < end)
+        {
+            rt_kprintf("[Error] %dth VM: MEM region 0x%08x overlaps 0x%08x\n",
+                    mm->vm->id, start, vma->desc.vaddr_start);
+            return -RT_EINVAL;
+        }
+        if (vma->desc.vaddr_start > start)
+            break;
+    }
+
+    va = vm_area_init(mm, start, end);
+    if (!va)
+        return -RT_ENOMEM;
+    va->flag = flag & (VM_MEMATTR_MASK | VM_RWX_MASK | VM_SHARED);
+    va->colors = rg->colors;
+    rt_list_insert_before(pos, &(va->node));
+
+    return RT_EOK;
+}
+
+/*
+ * Stage 2 table pages the RAM regions of @mm take once mapped: a pmd table
+ * for each 1G they touch, a pte table for each 2M mapped in 4K pages. A VM
+ * has MMU_TBL_PAGE_NR_MAX of them, about 60MB of RAM in pages.
+ */
+static rt_size_t vm_s2_table_pages(struct mm_struct *mm)
+{
+    rt_uint64_t pud_next = 0, pmd_next = 0, va;
+    struct rt_list_node *pos;
+    rt_size_t nr = 0;
+
+    rt_list_for_each(pos, &mm->vm_area_used)
+    {
+        struct vm_area *vma = rt_list_entry(pos, struct vm_area, node);
+        rt_uint64_t start = vma->desc.vaddr_start, end = vma->desc.vaddr_end;
+
+        /* regions are in IPA order, a table two of them share counts once */
+        va = RT_ALIGN_DOWN(start, S2_PUD_SIZE);
+        for (va = va < pud_next ? pud_next : va; va < end; va += S2_PUD_SIZE)
+            nr++;
+        pud_next = RT_ALIGN(end, S2_PUD_SIZE);
+
+        if (!vma->colors && IS_2M_ALIGN(start) && IS_2M_ALIGN(end))
+            continue;   /* 2M blocks, see alloc_vma() */
+        va = RT_ALIGN_DOWN(start, S2_PMD_SIZE);
+        for (va = va < pmd_next ? pmd_next : va; va < end; va += S2_PMD_SIZE)
+            nr++;
+        pmd_next = RT_ALIGN(end, S2_PMD_SIZE);
+    }
+
+    return nr;
+}
+
 rt_err_t vm_mm_struct_init(struct mm_struct *mm)
 {
     mm->pgd_tbl = RT_NULL;
     rt_list_init(&(mm->vm_area_used));
+    s2_tc_init(mm);
 
 #ifdef RT_USING_SMP
     rt_hw_spin_lock_init(&mm->lock);
@@ -49,18 +162,34 @@ rt_err_t vm_mm_struct_init(struct mm_struct *mm)
         mm->pgd_tbl = (pud_t *)(MMU_TYPE_TABLE 
                     | ((rt_uint64_t)mm->pgd_tbl & TABLE_ADDR_MASK));
     // rt_kprintf("[Info] mm->pgd_tbl&attr=0x%08x\n", mm->pgd_tbl);
-    /* 
-     * TBD
-     * We adjust ipa_start and ipa_end by getting OS img information.
-     * Currently only supports a memory case.
-     */
-    rt_uint64_t ipa_start = vm->os->mem.addr;
-    rt_uint64_t ipa_end = ipa_start + BYTE(vm->os->mem.size);
-    struct vm_area *va = vm_area_init(mm, ipa_start, ipa_end);
-    if (!va)
-        return -RT_ENOMEM;
-    else
-        rt_list_insert_after(&(mm->vm_area_used), &(va->node));
+
+    /* one vm_area for each guest RAM region of the OS */
+    const struct mem_info *mem = &vm->os->mem;
+    if (mem->num == 0 || mem->num > MAX_MEM_REGION)
+    {
+        rt_kprintf("[Error] %dth VM: %d MEM regions, 1 to %d expected\n",
+                vm->id, mem->num, MAX_MEM_REGION);
+        return -RT_EINVAL;
+    }
+
+    mm->quota.limit = BYTE(mem->limit);
+    mm->mem_size = 0;
+    for (rt_size_t i = 0; i < mem->num; i++)
+    {
+        rt_err_t ret = vm_ram_area_init(mm, &mem->region[i]);
+        if (ret)
+            return ret;
+        mm->mem_size += mem->region[i].size;
+    }
+
+    /* fail here, not half way through map_vm_memory() */
+    rt_size_t nr = vm_s2_table_pages(mm);
+    if (nr > MMU_TBL_PAGE_NR_MAX)
+    {
+        rt_kprintf("[Error] %dth VM: MEM needs %d stage 2 table pages, %d at most\n",
+                vm->id, nr, MMU_TBL_PAGE_NR_MAX);
+        return -RT_EINVAL;
+    }
 
     rt_kprintf("[Info] %dth VM: Init mm_struct success\n", vm->id);
     return RT_EOK;
@@ -69,37 +198,101 @@ rt_err_t vm_mm_struct_init(struct mm_struct *mm)
 mem_block_t *alloc_mem_block(void)
 {
     mem_block_t *mb = (mem_block_t *)rt_malloc(sizeof(mem_block_t));
-    
+    if (mb == RT_NULL)
+    {
+        rt_kprintf("[Error] Allocate mem_block failure.\n");
+        return RT_NULL;
+    }
+
     /* 
-     * return phy addr. It must align.
+     * return phy addr. It must align, and it is zeroed.
      */
-    mb->ptr = rt_malloc_align(MEM_BLOCK_SIZE, MEM_BLOCK_SIZE);  
+    mb->ptr = mem_pool_alloc();
     if (mb->ptr == RT_NULL)
     {
+        rt_free(mb);
         rt_kprintf("[Error] Allocate mem_block failure.\n");
         return RT_NULL;
     }
+    mb->ref = RT_NULL;
     mb->next = RT_NULL;
     return mb;
 }
 
-rt_err_t alloc_vm_memory(struct mm_struct *mm)
+void free_mem_block(mem_block_t *mb)
 {
-    vm_t vm = mm->vm;
-    vm_area_t vma = rt_list_entry(mm->vm_area_used.next, struct vm_area, node);
-    rt_uint64_t va_start = vma->desc.vaddr_start;
-    mem_block_t *mb;
+    /* a block shared by clone_vm goes with its last user */
+    if (mb->ref == RT_NULL || __atomic_sub_fetch(mb->ref, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        rt_free(mb->ref);
+        mem_pool_free(mb->ptr);     /* zeroed in background */
+    }
+    rt_free(mb);
+}
+
+/* colors @vma takes its pages from, 0 if none is left */
+static rt_uint32_t vma_colors(struct vm_area *vma)
+{
+    rt_size_t nr = mem_color_num();
+
+    if (nr == 0)
+        return vma->colors ? 0 : 1;     /* coloring off, every page is of color 0 */
+    return (vma->colors ? vma->colors : ~0U) & (rt_uint32_t)((1UL << nr) - 1);
+}
+
+/*
+ * Guest RAM in 4K pages in IPA order, of the colors of @vma only. Colors go
+ * round robin, consecutive guest pages fall in different LLC sets.
+ */
+static rt_err_t alloc_vma_pages(struct mm_struct *mm, struct vm_area *vma)
+{
+    rt_size_t nr = mem_color_num() ? mem_color_num() : 1;
+    rt_size_t count = (vma->desc.vaddr_end - vma->desc.vaddr_start) >> S2_PTE_SHIFT;
+    rt_uint32_t colors = vma_colors(vma), color = 0;
+    mem_block_t *mb, **tail = &vma->mb_head;
 
-    rt_uint64_t start = RT_ALIGN_DOWN(va_start, MEM_BLOCK_SIZE);
-    if (start != va_start)
+    if (colors == 0)
     {
-		rt_kprintf("[Error] MEM 0x%08x not mem_block aligned\n", va_start);
-		return -RT_EINVAL;
+        rt_kprintf("[Error] %dth VM: No cache color of %d to use\n", mm->vm->id, mem_color_num());
+        return -RT_EINVAL;
     }
 
-    vma->mb_head = RT_NULL;
+    vma->flag |= VM_MAP_PG;
+    for (rt_size_t i = 0; i < count; i++)
+    {
+        while (!(colors & (1UL << color)))
+            color = (color + 1) % nr;
+
+        mb = (mem_block_t *)rt_malloc(sizeof(mem_block_t));
+        if (mb == RT_NULL)
+            return -RT_ENOMEM;
+        mb->ptr = mem_color_alloc(color);
+        if (mb->ptr == RT_NULL)
+        {
+            rt_free(mb);
+            rt_kprintf("[Error] Allocate page of color %d failure.\n", color);
+            return -RT_ENOMEM;
+        }
+        mb->ref = RT_NULL;
+        mb->next = RT_NULL;
+
+        *tail = mb;     /* tail insert, IPA order */
+        tail = &mb->next;
+        mm->mem_used += S2_PTE_SIZE;
+        color = (color + 1) % nr;
+    }
+
+    rt_kprintf("[Info] %dth VM: Alloc %dMB memory at 0x%08x in 4K pages, colors 0x%08x\n",
+            mm->vm->id, MB(count << S2_PTE_SHIFT), vma->desc.vaddr_start, colors);
+    return RT_EOK;
+}
+
+static rt_err_t alloc_vma_blocks(struct mm_struct *mm, struct vm_area *vma)
+{
+    rt_size_t count = (vma->desc.vaddr_end - vma->desc.vaddr_start) >> MEM_BLOCK_SHIFT;
+    mem_block_t *mb;
+
     vma->flag |= VM_MAP_BK;
-    rt_size_t count = BYTE(mm->mem_size) >> MEM_BLOCK_SHIFT;
 
     /* Allocate virtual memory from Host OS. Still not map memory yet. */
     for (rt_size_t i = 0; i < count; i++)
@@ -113,8 +306,185 @@ rt_err_t alloc_vm_memory(struct mm_struct *mm)
         mm->mem_used += MEM_BLOCK_SIZE;
     }
 
-    rt_kprintf("[Info] %dth VM: Alloc %dMB memory\n", vm->id, MB(mm->mem_used));
-    
+    rt_kprintf("[Info] %dth VM: Alloc %dMB memory at 0x%08x\n",
+            mm->vm->id, MB(count << MEM_BLOCK_SHIFT), vma->desc.vaddr_start);
+    return RT_EOK;
+}
+
+/* 2M blocks where the region allows, 4K pages otherwise or when colored */
+static rt_err_t alloc_vma(struct mm_struct *mm, struct vm_area *vma)
+{
+    vma->mb_head = RT_NULL;
+    if (vma->colors || !IS_2M_ALIGN(vma->desc.vaddr_start) || !IS_2M_ALIGN(vma->desc.vaddr_end))
+        return alloc_vma_pages(mm, vma);
+    return alloc_vma_blocks(mm, vma);
+}
+
+/* Give back a mem_block list, the bytes of it that were not shared. */
+static rt_size_t free_mb_list(mem_block_t *mb, rt_bool_t paged)
+{
+    rt_size_t size = 0;
+    mem_block_t *next;
+
+    for (; mb; mb = next)
+    {
+        next = mb->next;
+        if (mb->ptr == RT_NULL)
+            rt_free(mb);    /* ballooned */
+        else if (paged)
+        {
+            mem_color_free(mb->ptr);
+            rt_free(mb);
+            size += S2_PTE_SIZE;
+        }
+        else
+        {
+            if (mb->ref == RT_NULL)
+                size += MEM_BLOCK_SIZE;
+            free_mem_block(mb);
+        }
+    }
+
+    return size;
+}
+
+/* Join the VM_SHARED region of @vma, allocated by the first VM to get it. */
+static rt_err_t vma_shm_get(struct mm_struct *mm, struct vm_area *vma)
+{
+    rt_uint64_t start = vma->desc.vaddr_start, end = vma->desc.vaddr_end;
+    rt_uint64_t used = mm->mem_used;
+    struct vm_shm *shm = RT_NULL;
+    rt_base_t level;
+    rt_err_t ret;
+
+    level = rt_hw_interrupt_disable();
+    for (rt_size_t i = 0; i < VM_SHM_NUM && shm == RT_NULL; i++)
+    {
+        if (vm_shm[i].users && start < vm_shm[i].end && vm_shm[i].start < end)
+            shm = &vm_shm[i];
+    }
+
+    if (shm)
+    {
+        if (shm->start != start || shm->end != end)
+            ret = -RT_EINVAL;
+        else if (!shm->ready)
+            ret = -RT_EBUSY;    /* another VM is allocating it */
+        else
+        {
+            shm->users++;
+            vma->mb_head = shm->mb_head;
+            vma->flag |= shm->type;
+            ret = RT_EOK;
+        }
+        rt_hw_interrupt_enable(level);
+
+        if (ret)
+            rt_kprintf("[Error] %dth VM: Shared MEM 0x%08x differs from the one of other VMs\n",
+                    mm->vm->id, start);
+        return ret;
+    }
+
+    for (rt_size_t i = 0; i < VM_SHM_NUM && shm == RT_NULL; i++)
+    {
+        if (vm_shm[i].users == 0)
+        {
+            shm = &vm_shm[i];
+            shm->start = start;
+            shm->end = end;
+            shm->users = 1;
+            shm->ready = RT_FALSE;
+        }
+    }
+    rt_hw_interrupt_enable(level);
+
+    if (shm == RT_NULL)
+    {
+        rt_kprintf("[Error] %dth VM: More than %d shared MEM regions\n", mm->vm->id, VM_SHM_NUM);
+        return -RT_EFULL;
+    }
+
+    ret = mem_quota_charge(RT_NULL, VM_MEM_RAM, end - start);
+    if (ret == RT_EOK)
+    {
+        ret = alloc_vma(mm, vma);
+        if (ret)
+            mem_quota_uncharge(RT_NULL, VM_MEM_RAM, end - start);
+    }
+    mm->mem_used = used;
+    if (ret)
+    {
+        free_mb_list(vma->mb_head, (vma->flag & VM_MAP_TYPE_MASK) == VM_MAP_PG);
+        vma->mb_head = RT_NULL;
+        vma->flag &= ~VM_MAP_TYPE_MASK;
+    }
+
+    level = rt_hw_interrupt_disable();
+    if (ret)
+        shm->users = 0;
+    else
+    {
+        shm->mb_head = vma->mb_head;
+        shm->type = vma->flag & VM_MAP_TYPE_MASK;
+        shm->ready = RT_TRUE;
+    }
+    rt_hw_interrupt_enable(level);
+
+    return ret;
+}
+
+static void vma_shm_put(struct vm_area *vma)
+{
+    mem_block_t *head = RT_NULL;
+    rt_bool_t paged = RT_FALSE;
+    rt_base_t level;
+
+    level = rt_hw_interrupt_disable();
+    for (rt_size_t i = 0; i < VM_SHM_NUM; i++)
+    {
+        struct vm_shm *shm = &vm_shm[i];
+
+        if (shm->users && shm->start == vma->desc.vaddr_start && shm->end == vma->desc.vaddr_end)
+        {
+            if (--shm->users == 0)
+            {
+                head = shm->mb_head;
+                paged = (shm->type == VM_MAP_PG);
+                shm->mb_head = RT_NULL;
+                shm->ready = RT_FALSE;
+            }
+            break;
+        }
+    }
+    rt_hw_interrupt_enable(level);
+
+    if (head)
+        mem_quota_uncharge(RT_NULL, VM_MEM_RAM, vma->desc.vaddr_end - vma->desc.vaddr_start);
+    free_mb_list(head, paged);
+    vma->mb_head = RT_NULL;
+}
+
+/* Guest RAM of every region, not mapped yet. */
+rt_err_t alloc_vm_memory(struct mm_struct *mm)
+{
+    struct rt_list_node *pos;
+    rt_err_t ret;
+
+    rt_list_for_each(pos, &mm->vm_area_used)
+    {
+        struct vm_area *vma = rt_list_entry(pos, struct vm_area, node);
+
+        if (vma->flag & VM_MAP_TYPE_MASK)
+            continue;   /* allocated already */
+
+        if (vma->flag & VM_SHARED)
+            ret = vma_shm_get(mm, vma);
+        else
+            ret = alloc_vma(mm, vma);
+        if (ret)
+            return ret;
+    }
+
     return RT_EOK;
 }
 
@@ -127,17 +497,23 @@ rt_err_t create_vm_mmap(struct mm_struct *mm, struct mem_desc *desc)
     rt_hw_spin_lock(&mm->lock);
 #endif
 
-    desc->vaddr_end = RT_ALIGN(desc->vaddr_end, MEM_BLOCK_SIZE);
-    desc->vaddr_start = RT_ALIGN_DOWN(desc->vaddr_start, MEM_BLOCK_SIZE);
+    /* pages are mapped as they are, anything else in 2M blocks */
+    if ((desc->attr & MMU_TYPE_MASK) != MMU_TYPE_PAGE)
+    {
+        desc->vaddr_end = RT_ALIGN(desc->vaddr_end, MEM_BLOCK_SIZE);
+        desc->vaddr_start = RT_ALIGN_DOWN(desc->vaddr_start, MEM_BLOCK_SIZE);
+    }
     mmap_size = desc->vaddr_end - desc->vaddr_start;
     if (mmap_size == 0)
     {
         rt_kprintf("[Error] Memory map size = 0\n");
-        return -RT_EINVAL;    
+        ret = -RT_EINVAL;
+    }
+    else
+    {
+        /* map memory: build stage 2 page table and translate GPA to HPA */
+        ret = s2_map(mm, desc);
     }
-
-    /* map memory: build stage 2 page table and translate GPA to HPA */
-    ret = s2_map(mm, desc);
     /*
      * TBD 
      * if (ret == RT_EOK)
@@ -151,6 +527,32 @@ rt_err_t create_vm_mmap(struct mm_struct *mm, struct mem_desc *desc)
     return ret;
 }
 
+/* stage 2 attributes of the RAM of @vma, as its region asks */
+static rt_uint64_t vma_s2_attr(struct vm_area *vma, rt_bool_t page)
+{
+    rt_uint64_t attr;
+
+    switch (vma->flag & VM_MEMATTR_MASK)
+    {
+    case VM_NORMAL_NC:
+        attr = page ? S2_PAGE_NORMAL_NC : S2_BLOCK_NORMAL_NC;
+        break;
+
+    case VM_NORMAL_WT:
+        attr = page ? S2_PAGE_NORMAL_WT : S2_BLOCK_NORMAL_WT;
+        break;
+
+    default:
+        attr = page ? S2_PAGE_NORMAL : S2_BLOCK_NORMAL;
+        break;
+    }
+
+    /* S2_XN_EL01 of the normal attributes is 0 */
+    if (!(vma->flag & VM_EXEC))
+        attr |= S2_XN_NONE;
+    return vma->desc.attr | attr;
+}
+
 /* 
  * According VM's memory type flag, map vm_area separately. 
  */
@@ -168,19 +570,48 @@ static rt_err_t map_vma_bk(struct mm_struct *mm, struct vm_area *vma)
     while (mb)
     {
         desc.paddr_start = (rt_uint64_t)mb->ptr;
-        desc.attr = vma->desc.attr | S2_BLOCK_NORMAL;
+        desc.attr = vma_s2_attr(vma, RT_FALSE);
 
-        ret = create_vm_mmap(mm, &desc);
+        /* a block given back by the balloon driver stays a hole */
+        ret = mb->ptr ? create_vm_mmap(mm, &desc) : RT_EOK;
         if (ret)
             return ret;
 
         mb = mb->next;
+        desc.vaddr_start = desc.vaddr_end;
         desc.vaddr_end += MEM_BLOCK_SIZE;
     }
 
     return RT_EOK;
 }
 
+static rt_err_t map_vma_pg(struct mm_struct *mm, struct vm_area *vma)
+{
+    /* colored memory, pages contiguous in host memory are mapped in one go */
+    rt_uint64_t ipa = vma->desc.vaddr_start;
+    mem_block_t *mb = vma->mb_head;
+    struct mem_desc desc;
+    rt_err_t ret;
+
+    while (mb)
+    {
+        desc.vaddr_start = ipa;
+        desc.paddr_start = (rt_uint64_t)mb->ptr;
+        desc.attr = vma_s2_attr(vma, RT_TRUE);
+        for (mb = mb->next, ipa += S2_PTE_SIZE;
+             mb && (rt_uint64_t)mb->ptr == desc.paddr_start + (ipa - desc.vaddr_start);
+             mb = mb->next)
+            ipa += S2_PTE_SIZE;
+        desc.vaddr_end = ipa;
+
+        ret = create_vm_mmap(mm, &desc);
+        if (ret)
+            return ret;
+    }
+
+    return RT_EOK;
+}
+
 static rt_err_t map_vma_pt(struct mm_struct *mm, struct vm_area *vma)
 {
     /* IO memory pass through */
@@ -189,10 +620,8 @@ static rt_err_t map_vma_pt(struct mm_struct *mm, struct vm_area *vma)
 }
 
 /*
- * In mm_struct, we use rt_list_t vm_area_used to manage vm_area, 
- * but we currently only supports a memory case.
- * So there is only 1 normal memory segment 
- * and many device memory segment in this rt_list.
+ * In mm_struct, we use rt_list_t vm_area_used to manage vm_area,
+ * one for each guest RAM region, each mapped in its own granule.
  */
 rt_err_t map_vm_memory(struct mm_struct *mm)
 {
@@ -209,6 +638,10 @@ rt_err_t map_vm_memory(struct mm_struct *mm)
             ret = map_vma_bk(mm, vma);
             break;
 
+        case VM_MAP_PG: /* cache colored normal memory */
+            ret = map_vma_pg(mm, vma);
+            break;
+
         case VM_MAP_PT: /* IO memory */
             vma->desc.paddr_start = vma->desc.vaddr_start;
             ret = map_vma_pt(mm, vma);
@@ -224,10 +657,36 @@ rt_err_t map_vm_memory(struct mm_struct *mm)
     return ret;
 }
 
+/*
+ * Charge the private RAM of every region to the quota, all of it before
+ * the first block is allocated. What is charged already is not again.
+ */
+static rt_err_t vm_ram_charge(struct mm_struct *mm)
+{
+    struct rt_list_node *pos;
+    rt_uint64_t size = 0;
+
+    rt_list_for_each(pos, &mm->vm_area_used)
+    {
+        struct vm_area *vma = rt_list_entry(pos, struct vm_area, node);
+
+        if (!(vma->flag & VM_SHARED))
+            size += vma->desc.vaddr_end - vma->desc.vaddr_start;
+    }
+
+    if (size <= mm->quota.used[VM_MEM_RAM])
+        return RT_EOK;
+    return mem_quota_charge(mm, VM_MEM_RAM, size - mm->quota.used[VM_MEM_RAM]);
+}
+
 rt_err_t vm_memory_init(struct mm_struct *mm)
 {
     rt_err_t ret;
 
+    ret = vm_ram_charge(mm);
+    if (ret)
+        return ret;
+
     /* allocate memory */
     ret = alloc_vm_memory(mm);
     if (ret)
@@ -240,3 +699,1182 @@ rt_err_t vm_memory_init(struct mm_struct *mm)
     
     return RT_EOK;
 }
+
+/* Give back guest RAM of every vm_area, stage 2 tables are left alone. */
+void vm_memory_free(struct mm_struct *mm)
+{
+    struct rt_list_node *pos;
+
+    if (mm->vm_area_used.next == RT_NULL)
+        return;     /* vm_mm_struct_init() never ran */
+
+    rt_list_for_each(pos, &mm->vm_area_used)
+    {
+        struct vm_area *vma = rt_list_entry(pos, struct vm_area, node);
+        mem_block_t *mb;
+
+        if (vma->flag & VM_SHARED)
+        {
+            if (vma->flag & VM_MAP_TYPE_MASK)
+                vma_shm_put(vma);
+            vma->flag &= ~VM_MAP_TYPE_MASK;
+        }
+        else
+            mm->mem_used -= free_mb_list(vma->mb_head, (vma->flag & VM_MAP_TYPE_MASK) == VM_MAP_PG);
+        vma->mb_head = RT_NULL;
+
+        while ((mb = vma->page_head))
+        {
+            vma->page_head = mb->next;
+            rt_free_align(mb->ptr);
+            rt_free(mb);
+            mm->mem_used -= S2_PTE_SIZE;
+        }
+
+        rt_free(vma->dirty);
+        vma->dirty = RT_NULL;
+    }
+
+    mem_quota_uncharge(mm, VM_MEM_RAM, mm->quota.used[VM_MEM_RAM]);
+}
+
+/*
+ * Undo vm_mm_struct_init() and vm_memory_init() of a VM going away: stage 2
+ * tables and TLB first, then guest RAM and the vm_areas.
+ */
+void vm_mm_struct_free(struct mm_struct *mm)
+{
+    rt_list_t *head = &mm->vm_area_used;
+
+    if (mm->pgd_tbl)
+        s2_unmap_all(mm);
+    vm_memory_free(mm);
+
+    while (head->next && head->next != head)
+    {
+        struct vm_area *vma = rt_list_entry(head->next, struct vm_area, node);
+
+        rt_list_remove(&vma->node);
+        rt_free(vma);
+    }
+    mm->pgd_tbl = RT_NULL;
+}
+
+/* vm_area holding @ipa, RT_NULL if @ipa is not mapped. */
+struct vm_area *vm_area_find(struct mm_struct *mm, rt_uint64_t ipa)
+{
+    struct rt_list_node *pos;
+
+    rt_list_for_each(pos, &mm->vm_area_used)
+    {
+        struct vm_area *vma = rt_list_entry(pos, struct vm_area, node);
+
+        if (ipa >= vma->desc.vaddr_start && ipa < vma->desc.vaddr_end)
+            return vma;
+    }
+
+    return RT_NULL;
+}
+
+/* RAM vm_area holding all of [@ipa, @ipa + @size), RT_NULL if none does. */
+struct vm_area *vm_ram_area(struct mm_struct *mm, rt_uint64_t ipa, rt_size_t size)
+{
+    struct vm_area *vma = vm_area_find(mm, ipa);
+
+    if (vma == RT_NULL || !VM_MAP_IS_RAM(vma->flag) || size > vma->desc.vaddr_end - ipa)
+        return RT_NULL;
+    return vma;
+}
+
+/* stage 2 table of a running VM, its vCPUs fault on other cores */
+static rt_base_t mm_lock(struct mm_struct *mm)
+{
+    rt_base_t level = rt_hw_interrupt_disable();
+#ifdef RT_USING_SMP
+    rt_hw_spin_lock(&mm->lock);
+#endif
+    return level;
+}
+
+static void mm_unlock(struct mm_struct *mm, rt_base_t level)
+{
+#ifdef RT_USING_SMP
+    rt_hw_spin_unlock(&mm->lock);
+#endif
+    rt_hw_interrupt_enable(level);
+}
+
+/*
+ * Copy @size bytes between guest RAM at @ipa and @buf, a whole page or
+ * block at a time through the translation cache. The range must be in one
+ * RAM region. A write to a shared or logged page takes the guest's path.
+ * A write goes a page at a time under the lock instead: merging and the
+ * balloon change the mapping under it, a hypervisor store does not fault.
+ */
+static rt_err_t vm_copy_guest(struct mm_struct *mm, rt_uint64_t ipa, void *buf,
+                              rt_size_t size, rt_bool_t write)
+{
+    rt_uint8_t *p = (rt_uint8_t *)buf;
+    rt_bool_t faulted = RT_FALSE;
+    rt_uint64_t leaf, *entry;
+    rt_size_t leaf_size, len;
+    rt_base_t level = 0;
+    rt_ubase_t pa;
+
+    if (size && vm_ram_area(mm, ipa, size) == RT_NULL)
+        return -RT_EINVAL;
+
+    while (size)
+    {
+        if (write)
+        {
+            level = mm_lock(mm);
+            entry = s2_walk(mm, ipa, &leaf_size);
+            leaf = entry ? *entry : 0;
+        }
+        else
+            leaf = s2_lookup(mm, ipa, &leaf_size);
+
+        if (leaf == 0)
+        {
+            if (write)
+                mm_unlock(mm, level);
+            return -RT_ERROR;   /* ballooned */
+        }
+
+        if (write && (leaf & S2_AP_MASK) != S2_AP_RW)
+        {
+            mm_unlock(mm, level);
+            if (faulted || vm_mem_write_fault(mm, ipa) != RT_EOK)
+                return -RT_ERROR;
+            faulted = RT_TRUE;
+            continue;
+        }
+
+        pa = S2_LEAF_PA(leaf, leaf_size, ipa);
+        if (write)
+            leaf_size = S2_PTE_SIZE;
+        len = leaf_size - (ipa & (leaf_size - 1));
+        if (len > size)
+            len = size;
+
+        if (write)
+        {
+            rt_memcpy((void *)pa, p, len);
+            mm_unlock(mm, level);
+        }
+        else
+            rt_memcpy(p, (const void *)pa, len);
+
+        faulted = RT_FALSE;
+        ipa += len;
+        p += len;
+        size -= len;
+    }
+
+    return RT_EOK;
+}
+
+rt_err_t vm_copy_from_guest(struct mm_struct *mm, void *dst, rt_uint64_t ipa, rt_size_t size)
+{
+    return vm_copy_guest(mm, ipa, dst, size, RT_FALSE);
+}
+
+rt_err_t vm_copy_to_guest(struct mm_struct *mm, rt_uint64_t ipa, const void *src, rt_size_t size)
+{
+    return vm_copy_guest(mm, ipa, (void *)src, size, RT_TRUE);
+}
+
+static void vma_dirty_mark(struct vm_area *vma, rt_uint64_t start, rt_size_t size)
+{
+    rt_uint64_t n = (start - vma->desc.vaddr_start) >> S2_PTE_SHIFT;
+
+    for (rt_size_t i = 0; i < (size >> S2_PTE_SHIFT); i++, n++)
+        vma->dirty[n / VM_DIRTY_WORD_BITS] |= 1UL << (n % VM_DIRTY_WORD_BITS);
+}
+
+/* the mem_block behind @ipa, blocks are listed in IPA order */
+static mem_block_t *vma_block(struct vm_area *vma, rt_uint64_t ipa)
+{
+    mem_block_t *mb = vma->mb_head;
+
+    for (rt_size_t n = (ipa - vma->desc.vaddr_start) >> MEM_BLOCK_SHIFT; mb && n; n--)
+        mb = mb->next;
+    return mb;
+}
+
+/* shared blocks are read only, in every VM using them */
+static rt_err_t vma_cow_protect(struct mm_struct *mm, struct vm_area *vma)
+{
+    rt_uint64_t ipa = vma->desc.vaddr_start;
+    rt_err_t ret = RT_EOK;
+
+    if ((vma->flag & VM_MAP_TYPE_MASK) != VM_MAP_BK)
+        return RT_EOK;
+
+    for (mem_block_t *mb = vma->mb_head; mb && ret == RT_EOK; mb = mb->next, ipa += MEM_BLOCK_SIZE)
+    {
+        if (mb->ref)
+            ret = s2_protect(mm, ipa, ipa + MEM_BLOCK_SIZE, S2_AP_RO);
+    }
+
+    return ret;
+}
+
+/*
+ * Dirty page logging. Guest RAM is write protected as it is mapped, in 2M
+ * blocks. The first write to a block splits it and gives write access back
+ * to that page alone, the page is logged. Harvesting the log protects the
+ * logged pages again. Out of page tables, the whole block is logged.
+ * Cache colored guest RAM is in pages from the start.
+ */
+rt_err_t vm_dirty_log_start(struct mm_struct *mm)
+{
+    struct rt_list_node *pos;
+    rt_base_t level;
+    rt_size_t size;
+    rt_err_t ret;
+
+    rt_list_for_each(pos, &mm->vm_area_used)
+    {
+        struct vm_area *vma = rt_list_entry(pos, struct vm_area, node);
+
+        if (!VM_MAP_IS_RAM(vma->flag) || vma->dirty)
+            continue;
+
+        size = VM_DIRTY_WORDS(vma->desc.vaddr_end - vma->desc.vaddr_start) * sizeof(rt_ubase_t);
+        vma->dirty = (rt_ubase_t *)rt_malloc(size);
+        if (vma->dirty == RT_NULL)
+        {
+            vm_dirty_log_stop(mm);
+            return -RT_ENOMEM;
+        }
+        rt_memset(vma->dirty, 0, size);
+
+        level = mm_lock(mm);
+        ret = s2_protect(mm, vma->desc.vaddr_start, vma->desc.vaddr_end, S2_AP_RO);
+        mm_unlock(mm, level);
+        if (ret)
+        {
+            vm_dirty_log_stop(mm);
+            return ret;
+        }
+    }
+
+    rt_kprintf("[Info] %dth VM: Start dirty page logging\n", mm->vm->id);
+    return RT_EOK;
+}
+
+/* Give write access back, and turn split pages into blocks again. */
+void vm_dirty_log_stop(struct mm_struct *mm)
+{
+    struct rt_list_node *pos;
+    rt_base_t level;
+    rt_ubase_t *dirty;
+
+    rt_list_for_each(pos, &mm->vm_area_used)
+    {
+        struct vm_area *vma = rt_list_entry(pos, struct vm_area, node);
+
+        if (vma->dirty == RT_NULL)
+            continue;
+
+        level = mm_lock(mm);
+        s2_protect(mm, vma->desc.vaddr_start, vma->desc.vaddr_end, S2_AP_RW);
+        for (rt_uint64_t va = vma->desc.vaddr_start; va < vma->desc.vaddr_end; va += MEM_BLOCK_SIZE)
+            s2_merge_block(mm, va);
+        vma_cow_protect(mm, vma);
+        dirty = vma->dirty;
+        vma->dirty = RT_NULL;
+        mm_unlock(mm, level);
+
+        rt_free(dirty);
+    }
+}
+
+/*
+ * Copy the log of [@ipa, @ipa + @size) to @bitmap and clear it, pages
+ * logged are write protected again. The range is whole 2M blocks in one
+ * RAM vm_area, @bitmap has VM_DIRTY_WORDS(@size) words.
+ */
+rt_err_t vm_dirty_log_get(struct mm_struct *mm, rt_uint64_t ipa, rt_size_t size, rt_ubase_t *bitmap)
+{
+    struct vm_area *vma = vm_area_find(mm, ipa);
+    rt_size_t words = VM_DIRTY_WORDS(MEM_BLOCK_SIZE);
+    rt_uint64_t end = ipa + size;
+    rt_ubase_t *log, dirty;
+    rt_base_t level;
+    rt_err_t ret = RT_EOK;
+
+    if (vma == RT_NULL || !IS_2M_ALIGN(ipa) || !IS_2M_ALIGN(size)
+     || end > vma->desc.vaddr_end)
+        return -RT_EINVAL;
+
+    /* one block at a time, vCPUs keep running in between */
+    for (; ipa < end && ret == RT_EOK; ipa += MEM_BLOCK_SIZE, bitmap += words)
+    {
+        level = mm_lock(mm);
+        if (vma->dirty == RT_NULL)
+            ret = -RT_ERROR;
+        else
+        {
+            log = vma->dirty + VM_DIRTY_WORDS(ipa - vma->desc.vaddr_start);
+            dirty = 0;
+            for (rt_size_t i = 0; i < words; i++)
+            {
+                bitmap[i] = log[i];
+                dirty |= log[i];
+                log[i] = 0;
+            }
+
+            if (dirty)
+                ret = s2_protect(mm, ipa, ipa + MEM_BLOCK_SIZE, S2_AP_RO);
+        }
+        mm_unlock(mm, level);
+    }
+
+    return ret;
+}
+
+/*
+ * Stage 2 permission fault at @ipa. A write to guest RAM while logging
+ * dirty pages is logged and allowed, the guest retries it. Anything else
+ * is not ours.
+ */
+rt_err_t vm_dirty_log_fault(struct mm_struct *mm, rt_uint64_t ipa)
+{
+    struct vm_area *vma = vm_area_find(mm, ipa);
+    rt_uint64_t *entry, start;
+    rt_base_t level;
+    rt_size_t size;
+    rt_err_t ret = RT_EOK;
+
+    if (vma == RT_NULL || vma->dirty == RT_NULL)
+        return -RT_ERROR;
+
+    level = mm_lock(mm);
+    entry = s2_walk(mm, ipa, &size);
+    if (vma->dirty == RT_NULL || entry == RT_NULL || size > S2_PMD_SIZE)
+        ret = -RT_ERROR;
+    else if ((*entry & S2_AP_MASK) != S2_AP_RW)     /* or a sibling vCPU was first */
+    {
+        if (size == S2_PMD_SIZE && s2_split_block(mm, ipa) == RT_EOK)
+            size = S2_PTE_SIZE;
+
+        start = RT_ALIGN_DOWN(ipa, size);
+        vma_dirty_mark(vma, start, size);
+        ret = s2_protect(mm, start, start + size, S2_AP_RW);
+    }
+    mm_unlock(mm, level);
+
+    return ret;
+}
+
+/* @mb is mapped at @ipa as it was allocated, no page of it was copied */
+static rt_bool_t vma_block_whole(struct mm_struct *mm, mem_block_t *mb, rt_uint64_t ipa)
+{
+    rt_ubase_t pa;
+    rt_size_t size;
+
+    if (s2_walk(mm, ipa, &size) && size == S2_PMD_SIZE)
+        return s2_translate(mm, ipa, &pa) == RT_EOK && pa == (rt_ubase_t)mb->ptr;
+
+    for (rt_size_t off = 0; off < MEM_BLOCK_SIZE; off += S2_PTE_SIZE)
+    {
+        if (s2_translate(mm, ipa + off, &pa) != RT_EOK || pa != (rt_ubase_t)mb->ptr + off)
+            return RT_FALSE;
+    }
+
+    return RT_TRUE;
+}
+
+/* the blocks of @svma in @from shared or copied to @vma of @mm */
+static rt_err_t vma_clone(struct mm_struct *mm, struct vm_area *vma, struct mm_struct *from,
+                          struct vm_area *svma, rt_size_t *shared, rt_size_t *copied)
+{
+    mem_block_t *smb, *mb, **tail = &vma->mb_head;
+    rt_uint64_t ipa = vma->desc.vaddr_start;
+    rt_ubase_t pa;
+    rt_base_t level;
+    rt_err_t ret = RT_EOK;
+
+    vma->mb_head = RT_NULL;
+    vma->flag |= VM_MAP_BK;
+
+    for (smb = svma->mb_head; smb && ret == RT_EOK; smb = smb->next, ipa += MEM_BLOCK_SIZE)
+    {
+        mb = (mem_block_t *)rt_malloc(sizeof(mem_block_t));
+        if (mb == RT_NULL)
+        {
+            ret = -RT_ENOMEM;
+            break;
+        }
+        mb->next = RT_NULL;
+        mb->ref = RT_NULL;
+
+        if (smb->ptr == RT_NULL)
+        {
+            /* the guest driver of the copy has it ballooned too */
+            mb->ptr = RT_NULL;
+            mm->balloon += MEM_BLOCK_SIZE;
+        }
+        else if (vma_block_whole(from, smb, ipa))
+        {
+            if (smb->ref == RT_NULL)
+            {
+                smb->ref = (rt_uint32_t *)rt_malloc(sizeof(rt_uint32_t));
+                if (smb->ref == RT_NULL)
+                {
+                    rt_free(mb);
+                    ret = -RT_ENOMEM;
+                    break;
+                }
+                *smb->ref = 1;
+                from->mem_used -= MEM_BLOCK_SIZE;
+            }
+            __atomic_add_fetch(smb->ref, 1, __ATOMIC_ACQ_REL);
+            mb->ptr = smb->ptr;
+            mb->ref = smb->ref;
+            (*shared)++;
+        }
+        else
+        {
+            mb->ptr = mem_pool_alloc();
+            if (mb->ptr == RT_NULL)
+            {
+                rt_free(mb);
+                ret = -RT_ENOMEM;
+                break;
+            }
+
+            for (rt_size_t off = 0; off < MEM_BLOCK_SIZE; off += S2_PTE_SIZE)
+            {
+                if (s2_translate(from, ipa + off, &pa) == RT_EOK)
+                    rt_memcpy((rt_uint8_t *)mb->ptr + off, (void *)pa, S2_PTE_SIZE);
+            }
+            rt_hw_cpu_dcache_ops(RT_HW_CACHE_FLUSH, mb->ptr, MEM_BLOCK_SIZE);
+            mm->mem_used += MEM_BLOCK_SIZE;
+            (*copied)++;
+        }
+
+        *tail = mb;     /* tail insert, keep the IPA order of @from */
+        tail = &mb->next;
+    }
+
+    /* blocks shared so far, even on failure */
+    level = mm_lock(from);
+    vma_cow_protect(from, svma);
+    mm_unlock(from, level);
+
+    if (ret == RT_EOK)
+        ret = map_vma_bk(mm, vma);
+    if (ret == RT_EOK)
+        ret = vma_cow_protect(mm, vma);
+    return ret;
+}
+
+/*
+ * Guest RAM of @mm shares the mem_blocks of @from, which is paused. Shared
+ * blocks are write protected in both VMs and copied on the first write, see
+ * vm_cow_fault(). A block with pages @from already copied is copied whole.
+ * Shared blocks count in the mem_used of neither VM. VM_SHARED regions are
+ * joined as vm_memory_init() does.
+ */
+rt_err_t vm_memory_clone(struct mm_struct *mm, struct mm_struct *from)
+{
+    struct rt_list_node *pos, *spos = from->vm_area_used.next;
+    rt_size_t shared = 0, copied = 0;
+    rt_err_t ret;
+
+    /* @mm may come to own every block it shares */
+    ret = vm_ram_charge(mm);
+    if (ret)
+        return ret;
+
+    rt_list_for_each(pos, &mm->vm_area_used)
+    {
+        vm_area_t vma = rt_list_entry(pos, struct vm_area, node);
+        vm_area_t svma = rt_list_entry(spos, struct vm_area, node);
+
+        if (spos == &from->vm_area_used
+         || svma->desc.vaddr_start != vma->desc.vaddr_start
+         || svma->desc.vaddr_end != vma->desc.vaddr_end
+         || (svma->flag & VM_SHARED) != (vma->flag & VM_SHARED)
+         || (!(svma->flag & VM_SHARED) && (svma->flag & VM_MAP_TYPE_MASK) != VM_MAP_BK))
+        {
+            rt_kprintf("[Error] %dth VM: MEM differs from %dth VM\n", mm->vm->id, from->vm->id);
+            return -RT_EINVAL;
+        }
+        spos = spos->next;
+
+        if (vma->flag & VM_SHARED)
+        {
+            ret = vma_shm_get(mm, vma);
+            if (ret == RT_EOK)
+                ret = ((vma->flag & VM_MAP_TYPE_MASK) == VM_MAP_PG) ? map_vma_pg(mm, vma)
+                                                                   : map_vma_bk(mm, vma);
+        }
+        else
+            ret = vma_clone(mm, vma, from, svma, &shared, &copied);
+        if (ret)
+        {
+            rt_kprintf("[Error] %dth VM: Clone memory of %dth VM failure\n", mm->vm->id, from->vm->id);
+            return ret;
+        }
+    }
+
+    if (spos != &from->vm_area_used)
+    {
+        rt_kprintf("[Error] %dth VM: MEM differs from %dth VM\n", mm->vm->id, from->vm->id);
+        return -RT_EINVAL;
+    }
+
+    rt_kprintf("[Info] %dth VM: Share %dMB, copy %dMB memory of %dth VM\n", mm->vm->id,
+            MB(shared * MEM_BLOCK_SIZE), MB(copied * MEM_BLOCK_SIZE), from->vm->id);
+    return RT_EOK;
+}
+
+/*
+ * Stage 2 permission fault at @ipa in a shared block. The block is split
+ * and the page is copied, out of page tables the whole block is. The last
+ * VM using a block takes it back. -RT_ERROR if the block is not shared.
+ */
+static rt_err_t vm_cow_fault(struct mm_struct *mm, rt_uint64_t ipa)
+{
+    struct vm_area *vma = vm_area_find(mm, ipa);
+    mem_block_t *mb, *page;
+    rt_uint32_t *ref = RT_NULL;
+    void *block = RT_NULL, *old = RT_NULL;
+    rt_uint64_t *entry, start;
+    rt_bool_t in_block;
+    rt_ubase_t pa, src = 0;
+    rt_base_t level;
+    rt_size_t size;
+    rt_err_t ret = RT_EOK;
+
+    if (vma == RT_NULL || (vma->flag & VM_MAP_TYPE_MASK) != VM_MAP_BK)
+        return -RT_ERROR;
+    mb = vma_block(vma, ipa);
+    if (mb == RT_NULL || mb->ref == RT_NULL)
+        return -RT_ERROR;
+
+    /* no allocation under the lock */
+    page = (mem_block_t *)rt_malloc(sizeof(mem_block_t));
+    if (page)
+        page->ptr = rt_malloc_align(S2_PTE_SIZE, S2_PTE_SIZE);
+    if (page == RT_NULL || page->ptr == RT_NULL)
+    {
+        rt_free(page);
+        return -RT_ENOMEM;
+    }
+
+again:
+    level = mm_lock(mm);
+    entry = s2_walk(mm, ipa, &size);
+    if (entry == RT_NULL || size > S2_PMD_SIZE)
+        ret = -RT_ERROR;
+    else if ((*entry & S2_AP_MASK) == S2_AP_RW)
+        ret = RT_EOK;       /* a sibling vCPU was first */
+    else if (mb->ref == RT_NULL)
+        ret = -RT_ERROR;    /* taken back by a sibling vCPU, logging only */
+    else
+    {
+        start = RT_ALIGN_DOWN(ipa, size);
+        s2_translate(mm, start, &pa);
+        in_block = (pa - (rt_ubase_t)mb->ptr < MEM_BLOCK_SIZE);
+        if (in_block && *mb->ref == 1)
+        {
+            /* the last user takes the block back */
+            ref = mb->ref;
+            mb->ref = RT_NULL;
+            mm->mem_used += MEM_BLOCK_SIZE;
+            __atomic_add_fetch(&cow_stat.taken, 1, __ATOMIC_RELAXED);
+        }
+
+        if (!in_block || mb->ref == RT_NULL)
+        {
+            /* the page is ours already, it is only write protected */
+            if (vma->dirty)
+            {
+                if (size == S2_PMD_SIZE && s2_split_block(mm, ipa) == RT_EOK)
+                    size = S2_PTE_SIZE;
+                start = RT_ALIGN_DOWN(ipa, size);
+                vma_dirty_mark(vma, start, size);
+                ret = s2_protect(mm, start, start + size, S2_AP_RW);
+            }
+            else if (in_block)
+            {
+                start = RT_ALIGN_DOWN(ipa, MEM_BLOCK_SIZE);
+                ret = s2_protect(mm, start, start + MEM_BLOCK_SIZE, S2_AP_RW);
+                s2_merge_block(mm, start);
+            }
+            else
+                ret = s2_protect(mm, start, start + size, S2_AP_RW);
+            goto out;
+        }
+
+        if (size == S2_PMD_SIZE && s2_split_block(mm, ipa) == RT_EOK)
+        {
+            size = S2_PTE_SIZE;
+            start = RT_ALIGN_DOWN(ipa, size);
+            s2_translate(mm, start, &pa);
+        }
+
+        if (size == S2_PTE_SIZE)
+        {
+            rt_memcpy(page->ptr, (void *)pa, S2_PTE_SIZE);
+            rt_hw_cpu_dcache_ops(RT_HW_CACHE_FLUSH, page->ptr, S2_PTE_SIZE);
+            ret = s2_remap(mm, start, (rt_uint64_t)page->ptr, S2_AP_RW);
+            page->next = vma->page_head;
+            vma->page_head = page;
+            page = RT_NULL;
+            mm->mem_used += S2_PTE_SIZE;
+            __atomic_add_fetch(&cow_stat.pages, 1, __ATOMIC_RELAXED);
+        }
+        else if (block == RT_NULL || src != pa)
+        {
+            /*
+             * Out of page tables, copy the block with the lock dropped. Every
+             * user maps it read only while it is shared, a copy of a block
+             * taken back or replaced meanwhile fails the checks above again.
+             */
+            mm_unlock(mm, level);
+            if (block == RT_NULL)
+                block = mem_pool_alloc();
+            if (block == RT_NULL)
+            {
+                ret = -RT_ENOMEM;
+                goto free;
+            }
+            rt_memcpy(block, (void *)pa, MEM_BLOCK_SIZE);
+            rt_hw_cpu_dcache_ops(RT_HW_CACHE_FLUSH, block, MEM_BLOCK_SIZE);
+            src = pa;
+            goto again;
+        }
+        else
+        {
+            /* still shared and still at @src, the copy stands */
+            ret = s2_remap(mm, start, (rt_uint64_t)block, S2_AP_RW);
+            if (__atomic_sub_fetch(mb->ref, 1, __ATOMIC_ACQ_REL) == 0)
+            {
+                ref = mb->ref;
+                old = mb->ptr;
+            }
+            mb->ptr = block;
+            mb->ref = RT_NULL;
+            block = RT_NULL;
+            mm->mem_used += MEM_BLOCK_SIZE;
+            __atomic_add_fetch(&cow_stat.blocks, 1, __ATOMIC_RELAXED);
+        }
+
+        if (vma->dirty)
+            vma_dirty_mark(vma, start, size);
+    }
+out:
+    mm_unlock(mm, level);
+
+free:
+    if (page)
+    {
+        rt_free_align(page->ptr);
+        rt_free(page);
+    }
+    mem_pool_free(block);
+    mem_pool_free(old);
+    rt_free(ref);
+    return ret;
+}
+
+/*
+ * Stage 2 permission fault at @ipa on a write to guest RAM, the first to a
+ * shared or logged page. RT_EOK when the guest can retry the write.
+ */
+rt_err_t vm_mem_write_fault(struct mm_struct *mm, rt_uint64_t ipa)
+{
+    struct vm_area *vma;
+    mem_block_t *mb;
+    rt_uint64_t *entry;
+    rt_base_t level;
+    rt_size_t size;
+    rt_err_t ret = vm_cow_fault(mm, ipa);
+
+    if (ret == -RT_ERROR)
+        ret = vm_dirty_log_fault(mm, ipa);
+    if (ret != -RT_ERROR)
+        return ret;
+
+    /* vm_memory_merge() had the block write protected, look again */
+    vma = vm_area_find(mm, ipa);
+    if (vma == RT_NULL || (vma->flag & VM_MAP_TYPE_MASK) != VM_MAP_BK)
+        return ret;
+
+    level = mm_lock(mm);
+    entry = s2_walk(mm, ipa, &size);
+    mb = vma_block(vma, ipa);
+    if (entry && (*entry & S2_AP_MASK) == S2_AP_RW)
+        ret = RT_EOK;
+    else if (entry && mb && mb->ptr && mb->ref == RT_NULL && !vma->dirty)
+    {
+        /* still its own block, compared right now: the write wins */
+        ipa = RT_ALIGN_DOWN(ipa, MEM_BLOCK_SIZE);
+        ret = s2_protect(mm, ipa, ipa + MEM_BLOCK_SIZE, S2_AP_RW);
+    }
+    mm_unlock(mm, level);
+
+    if (ret != RT_EOK && mb && mb->ref)
+        ret = vm_cow_fault(mm, ipa);
+    return ret;
+}
+
+void vm_cow_get_stat(struct vm_cow_stat *stat)
+{
+    stat->pages  = __atomic_load_n(&cow_stat.pages, __ATOMIC_RELAXED);
+    stat->blocks = __atomic_load_n(&cow_stat.blocks, __ATOMIC_RELAXED);
+    stat->taken  = __atomic_load_n(&cow_stat.taken, __ATOMIC_RELAXED);
+}
+
+/*
+ * Host address of the mem_block at @ipa, to read only, RT_NULL if guest
+ * RAM is not there. The block may change under the caller, who must not
+ * race vm_memory_free().
+ */
+void *vm_memory_block(struct mm_struct *mm, rt_uint64_t ipa)
+{
+    struct vm_area *vma = vm_area_find(mm, ipa);
+    mem_block_t *mb;
+
+    if (vma == RT_NULL || (vma->flag & (VM_MAP_TYPE_MASK | VM_SHARED)) != VM_MAP_BK)
+        return RT_NULL;
+    mb = vma_block(vma, ipa);
+    return mb ? mb->ptr : RT_NULL;
+}
+
+/* every leaf of the block at @ipa is still read only */
+static rt_bool_t vma_block_ro(struct mm_struct *mm, rt_uint64_t ipa)
+{
+    rt_uint64_t *entry;
+    rt_size_t size;
+
+    for (rt_uint64_t va = ipa; va < ipa + MEM_BLOCK_SIZE; va += size)
+    {
+        entry = s2_walk(mm, va, &size);
+        if (entry == RT_NULL || (*entry & S2_AP_MASK) != S2_AP_RO)
+            return RT_FALSE;
+    }
+
+    return RT_TRUE;
+}
+
+/*
+ * Same-page merging of the 2M blocks at @ipa of two VMs, running or not.
+ * The block of @mm goes, unless only that one is shared already, and its
+ * VM maps the other block instead, read only and shared as after a clone.
+ * Pages that differ are copied to 4K pages first, up to @nr_copy, @copied
+ * gets how many. The locks are only taken to write protect both blocks
+ * and to commit, the compare and the copies run without them. A guest
+ * write in between makes its block writable again, or copies a shared
+ * one, and the merge backs off when it looks again.
+ */
+rt_err_t vm_memory_merge(struct mm_struct *mm, struct mm_struct *from, rt_uint64_t ipa,
+                         rt_size_t nr_copy, rt_size_t *copied)
+{
+    struct vm_area *vma = vm_area_find(mm, ipa), *svma = vm_area_find(from, ipa), *tvma;
+    rt_ubase_t diff[VM_DIRTY_WORDS(MEM_BLOCK_SIZE)];
+    mem_block_t *mb, *smb, *tmb, *pages = RT_NULL, *page;
+    mem_block_t *copies = RT_NULL, **copies_tail = &copies;
+    struct mm_struct *first, *second, *tmm;
+    rt_uint32_t *ref, *sref;
+    rt_uint8_t *dst, *src;
+    rt_base_t level, slevel;
+    rt_size_t size, n = 0;
+    void *old = RT_NULL;
+    rt_err_t ret = RT_EOK;
+
+    ipa = RT_ALIGN_DOWN(ipa, MEM_BLOCK_SIZE);
+    if (mm == from || vma == RT_NULL || svma == RT_NULL
+     || (vma->flag & (VM_MAP_TYPE_MASK | VM_SHARED)) != VM_MAP_BK
+     || (svma->flag & (VM_MAP_TYPE_MASK | VM_SHARED)) != VM_MAP_BK)
+        return -RT_EINVAL;
+    mb = vma_block(vma, ipa);
+    smb = vma_block(svma, ipa);
+    if (mb == RT_NULL || smb == RT_NULL)
+        return -RT_EINVAL;
+
+    /* no allocation under the locks */
+    ref = (rt_uint32_t *)rt_malloc(sizeof(rt_uint32_t));
+    for (rt_size_t i = 0; i < nr_copy && ref; i++)
+    {
+        page = (mem_block_t *)rt_malloc(sizeof(mem_block_t));
+        if (page)
+            page->ptr = rt_malloc_align(S2_PTE_SIZE, S2_PTE_SIZE);
+        if (page == RT_NULL || page->ptr == RT_NULL)
+        {
+            rt_free(page);
+            ret = -RT_ENOMEM;
+            break;
+        }
+        page->next = pages;
+        pages = page;
+    }
+    if (ref == RT_NULL || ret)
+    {
+        ret = -RT_ENOMEM;
+        goto free;
+    }
+
+    /* two VMs, always locked in the same order */
+    first = mm->vm->id < from->vm->id ? mm : from;
+    second = first == mm ? from : mm;
+    level = mm_lock(first);
+    slevel = mm_lock(second);
+
+    if (mb->ref && smb->ref == RT_NULL)
+    {
+        /* keep the block that is shared already */
+        tmm = mm, mm = from, from = tmm;
+        tvma = vma, vma = svma, svma = tvma;
+        tmb = mb, mb = smb, smb = tmb;
+    }
+
+    if (mb->ref || mb->ptr == smb->ptr || vma->dirty || svma->dirty
+     || !vma_block_whole(mm, mb, ipa) || !vma_block_whole(from, smb, ipa))
+    {
+        ret = -RT_EBUSY;
+        goto out;
+    }
+
+    /* from here on the guests only read */
+    s2_protect(from, ipa, ipa + MEM_BLOCK_SIZE, S2_AP_RO);
+    s2_protect(mm, ipa, ipa + MEM_BLOCK_SIZE, S2_AP_RO);
+    dst = (rt_uint8_t *)mb->ptr;
+    src = (rt_uint8_t *)smb->ptr;
+    sref = smb->ref;
+    mm_unlock(second, slevel);
+    mm_unlock(first, level);
+
+    /* a block ballooned out meanwhile is only read, the check below drops it */
+    rt_memset(diff, 0, sizeof(diff));
+    for (rt_size_t i = 0; i < MEM_BLOCK_SIZE / S2_PTE_SIZE; i++)
+    {
+        if (rt_memcmp(dst + i * S2_PTE_SIZE, src + i * S2_PTE_SIZE, S2_PTE_SIZE))
+        {
+            diff[i / VM_DIRTY_WORD_BITS] |= 1UL << (i % VM_DIRTY_WORD_BITS);
+            n++;
+        }
+    }
+
+    /* pages that differ are copied in IPA order, while still read only */
+    for (rt_size_t i = 0; n <= nr_copy && i < MEM_BLOCK_SIZE / S2_PTE_SIZE; i++)
+    {
+        if (!(diff[i / VM_DIRTY_WORD_BITS] & (1UL << (i % VM_DIRTY_WORD_BITS))))
+            continue;
+
+        page = pages;
+        pages = page->next;
+        rt_memcpy(page->ptr, dst + i * S2_PTE_SIZE, S2_PTE_SIZE);
+        rt_hw_cpu_dcache_ops(RT_HW_CACHE_FLUSH, page->ptr, S2_PTE_SIZE);
+        page->next = RT_NULL;
+        *copies_tail = page;
+        copies_tail = &page->next;
+    }
+
+    level = mm_lock(first);
+    slevel = mm_lock(second);
+
+    if (mb->ptr != dst || smb->ptr != src || mb->ref || smb->ref != sref
+     || vma->dirty || svma->dirty || !vma_block_ro(mm, ipa) || !vma_block_ro(from, ipa)
+     || !vma_block_whole(mm, mb, ipa) || !vma_block_whole(from, smb, ipa))
+    {
+        /* written, ballooned or logged meanwhile */
+        ret = -RT_EBUSY;
+        goto undo;
+    }
+
+    s2_walk(mm, ipa, &size);
+    if (n > nr_copy || (n && size == S2_PMD_SIZE && s2_split_block(mm, ipa) != RT_EOK))
+    {
+        /* changed since it was hashed, or out of page tables */
+        ret = -RT_EBUSY;
+        goto undo;
+    }
+
+    if (smb->ref == RT_NULL)
+    {
+        smb->ref = ref;
+        *ref = 1;
+        ref = RT_NULL;
+        from->mem_used -= MEM_BLOCK_SIZE;
+    }
+    __atomic_add_fetch(smb->ref, 1, __ATOMIC_ACQ_REL);
+
+    if (size == S2_PMD_SIZE && n == 0)
+        s2_remap(mm, ipa, (rt_uint64_t)src, S2_AP_RO);
+    else
+    {
+        for (rt_size_t i = 0; i < MEM_BLOCK_SIZE / S2_PTE_SIZE; i++)
+        {
+            rt_uint64_t va = ipa + i * S2_PTE_SIZE;
+
+            if (!(diff[i / VM_DIRTY_WORD_BITS] & (1UL << (i % VM_DIRTY_WORD_BITS))))
+            {
+                s2_remap(mm, va, (rt_uint64_t)src + i * S2_PTE_SIZE, S2_AP_RO);
+                continue;
+            }
+
+            page = copies;
+            copies = page->next;
+            s2_remap(mm, va, (rt_uint64_t)page->ptr, S2_AP_RW);
+            page->next = vma->page_head;
+            vma->page_head = page;
+            mm->mem_used += S2_PTE_SIZE;
+        }
+    }
+
+    old = mb->ptr;
+    mb->ptr = smb->ptr;
+    mb->ref = smb->ref;
+    mm->mem_used -= MEM_BLOCK_SIZE;
+    if (copied)
+        *copied = n;
+    goto out;
+
+undo:
+    /* blocks still ours and not logged get their writes back */
+    if (smb->ptr == src && smb->ref == RT_NULL && !svma->dirty)
+        s2_protect(from, ipa, ipa + MEM_BLOCK_SIZE, S2_AP_RW);
+    if (mb->ptr == dst && mb->ref == RT_NULL && !vma->dirty)
+        s2_protect(mm, ipa, ipa + MEM_BLOCK_SIZE, S2_AP_RW);
+
+out:
+    mm_unlock(second, slevel);
+    mm_unlock(first, level);
+
+free:
+    while ((page = pages) || (page = copies))
+    {
+        if (page == pages)
+            pages = page->next;
+        else
+            copies = page->next;
+        rt_free_align(page->ptr);
+        rt_free(page);
+    }
+    mem_pool_free(old);
+    rt_free(ref);
+    return ret;
+}
+
+/*
+ * Memory balloon. The guest driver gives back guest RAM it does not use,
+ * in 2M blocks, or in 4K pages of cache colored RAM. It is unmapped and
+ * goes back to the pool, its mem_block stays in the list without ptr so
+ * the list keeps its IPA order. Deflating maps zeroed memory there again.
+ * The guest must not touch RAM it gave back, a fault there is not handled.
+ */
+static rt_size_t vma_granule(struct vm_area *vma)
+{
+    return ((vma->flag & VM_MAP_TYPE_MASK) == VM_MAP_PG) ? S2_PTE_SIZE : MEM_BLOCK_SIZE;
+}
+
+static mem_block_t *vma_unit(struct vm_area *vma, rt_uint64_t ipa)
+{
+    mem_block_t *mb = vma->mb_head;
+
+    for (rt_size_t n = (ipa - vma->desc.vaddr_start) / vma_granule(vma); mb && n; n--)
+        mb = mb->next;
+    return mb;
+}
+
+/* the color alloc_vma_pages() gave to the @n-th page */
+static rt_uint32_t vma_page_color(struct vm_area *vma, rt_size_t n)
+{
+    rt_uint32_t colors = vma_colors(vma);
+    rt_uint32_t color = 0;
+
+    if (colors == 0)
+        return 0;       /* coloring is off, no page to get */
+    n %= __builtin_popcount(colors);
+    for (;; color++)
+    {
+        if ((colors & (1UL << color)) && n-- == 0)
+            return color;
+    }
+}
+
+/* RAM of @ipa and @size in one vm_area, in whole balloon granules */
+static struct vm_area *vm_balloon_area(struct mm_struct *mm, rt_uint64_t ipa, rt_size_t size)
+{
+    struct vm_area *vma = vm_ram_area(mm, ipa, size);
+
+    if (vma == RT_NULL || size == 0 || (vma->flag & VM_SHARED)
+     || (ipa & (vma_granule(vma) - 1)) || (size & (vma_granule(vma) - 1)))
+        return RT_NULL;
+    return vma;
+}
+
+/* Granule the guest can inflate and deflate any of its RAM in. */
+rt_size_t vm_balloon_granule(struct mm_struct *mm)
+{
+    struct rt_list_node *pos;
+    rt_size_t granule = S2_PTE_SIZE;
+
+    rt_list_for_each(pos, &mm->vm_area_used)
+    {
+        struct vm_area *vma = rt_list_entry(pos, struct vm_area, node);
+
+        if (VM_MAP_IS_RAM(vma->flag) && !(vma->flag & VM_SHARED) && vma_granule(vma) > granule)
+            granule = vma_granule(vma);
+    }
+
+    return granule;
+}
+
+static rt_err_t vma_balloon_give(struct mm_struct *mm, struct vm_area *vma, rt_uint64_t ipa)
+{
+    rt_size_t unit = vma_granule(vma);
+    mem_block_t *mb = vma_unit(vma, ipa), *pages = RT_NULL, *page, **prev;
+    rt_uint32_t *ref = RT_NULL;
+    void *old = RT_NULL;
+    rt_ubase_t pa;
+    rt_base_t level;
+    rt_err_t ret;
+
+    level = mm_lock(mm);
+    if (mb == RT_NULL || mb->ptr == RT_NULL)
+    {
+        mm_unlock(mm, level);
+        return RT_EOK;      /* given back already */
+    }
+
+    /* 4K copies made by copy-on-write or merging go with the block */
+    for (rt_size_t off = 0; vma->page_head && off < unit; off += S2_PTE_SIZE)
+    {
+        if (s2_translate(mm, ipa + off, &pa) || pa - (rt_ubase_t)mb->ptr < unit)
+            continue;
+
+        for (prev = &vma->page_head; (page = *prev); prev = &page->next)
+        {
+            if ((rt_ubase_t)page->ptr == pa)
+            {
+                *prev = page->next;
+                page->next = pages;
+                pages = page;
+                mm->mem_used -= S2_PTE_SIZE;
+                break;
+            }
+        }
+    }
+
+    ret = s2_unmap(mm, ipa, ipa + unit);
+    if (ret == RT_EOK)
+    {
+        if (mb->ref == RT_NULL)
+        {
+            old = mb->ptr;
+            mm->mem_used -= unit;
+        }
+        else if (__atomic_sub_fetch(mb->ref, 1, __ATOMIC_ACQ_REL) == 0)
+        {
+            ref = mb->ref;
+            old = mb->ptr;
+        }
+        mb->ptr = RT_NULL;
+        mb->ref = RT_NULL;
+        mm->balloon += unit;
+        if (vma->dirty)
+            vma_dirty_mark(vma, ipa, unit);
+    }
+    mm_unlock(mm, level);
+
+    while ((page = pages))
+    {
+        pages = page->next;
+        rt_free_align(page->ptr);
+        rt_free(page);
+    }
+    if ((vma->flag & VM_MAP_TYPE_MASK) == VM_MAP_PG)
+        mem_color_free(old);
+    else
+        mem_pool_free(old);
+    rt_free(ref);
+    return ret;
+}
+
+static rt_err_t vma_balloon_take(struct mm_struct *mm, struct vm_area *vma, rt_uint64_t ipa)
+{
+    rt_size_t unit = vma_granule(vma);
+    mem_block_t *mb = vma_unit(vma, ipa);
+    rt_bool_t colored = ((vma->flag & VM_MAP_TYPE_MASK) == VM_MAP_PG);
+    struct mem_desc desc;
+    rt_base_t level;
+    void *ptr;
+    rt_err_t ret = RT_EOK;
+
+    if (mb == RT_NULL || mb->ptr)
+        return RT_EOK;      /* not ballooned */
+
+    /* zeroed, no allocation under the lock */
+    if (colored)
+        ptr = mem_color_alloc(vma_page_color(vma, (ipa - vma->desc.vaddr_start) >> S2_PTE_SHIFT));
+    else
+        ptr = mem_pool_alloc();
+    if (ptr == RT_NULL)
+        return -RT_ENOMEM;
+
+    level = mm_lock(mm);
+    if (mb->ptr == RT_NULL)
+    {
+        desc.vaddr_start = ipa;
+        desc.vaddr_end = ipa + unit;
+        desc.paddr_start = (rt_uint64_t)ptr;
+        desc.attr = vma_s2_attr(vma, colored);
+        ret = s2_map(mm, &desc);
+        if (ret == RT_EOK)
+        {
+            mb->ptr = ptr;
+            ptr = RT_NULL;
+            mm->mem_used += unit;
+            mm->balloon -= unit;
+            if (vma->dirty)
+                vma_dirty_mark(vma, ipa, unit);
+        }
+    }
+    mm_unlock(mm, level);
+
+    if (colored)
+        mem_color_free(ptr);
+    else
+        mem_pool_free(ptr);
+    return ret;
+}
+
+/*
+ * The guest gives back [@ipa, @ipa + @size) of its RAM, in whole granules
+ * of vm_balloon_granule(). Shared blocks go with their last user.
+ */
+rt_err_t vm_balloon_inflate(struct mm_struct *mm, rt_uint64_t ipa, rt_size_t size)
+{
+    struct vm_area *vma = vm_balloon_area(mm, ipa, size);
+    rt_err_t ret = RT_EOK;
+
+    if (vma == RT_NULL)
+        return -RT_EINVAL;
+
+    for (rt_uint64_t end = ipa + size; ipa < end && ret == RT_EOK; ipa += vma_granule(vma))
+        ret = vma_balloon_give(mm, vma, ipa);
+    return ret;
+}
+
+/* The guest takes [@ipa, @ipa + @size) back, zeroed. */
+rt_err_t vm_balloon_deflate(struct mm_struct *mm, rt_uint64_t ipa, rt_size_t size)
+{
+    struct vm_area *vma = vm_balloon_area(mm, ipa, size);
+    rt_err_t ret = RT_EOK;
+
+    if (vma == RT_NULL)
+        return -RT_EINVAL;
+
+    for (rt_uint64_t end = ipa + size; ipa < end && ret == RT_EOK; ipa += vma_granule(vma))
+        ret = vma_balloon_take(mm, vma, ipa);
+    return ret;
+}
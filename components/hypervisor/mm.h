@@ -6,6 +6,15 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-06-01     Suqier       first version
+ * 2022-12-02     Suqier       dirty page logging
+ * 2022-12-04     Suqier       copy-on-write guest RAM for cloned VMs
+ * 2022-12-05     Suqier       same-page merging of guest RAM blocks
+ * 2022-12-06     Suqier       cache colored guest RAM in 4K pages
+ * 2022-12-07     Suqier       memory balloon
+ * 2022-12-08     Suqier       guest RAM regions
+ * 2022-12-09     Suqier       copy to and from guest RAM
+ * 2022-12-10     Suqier       memory quota
+ * 2022-12-11     Suqier       free the whole mm_struct of a deleted VM
  */
 
 #ifndef __MM_H__
@@ -16,6 +25,7 @@
 
 #include <stage2.h>
 #include "vm.h"
+#include "mem_quota.h"
 
 #define DEFAULT_CPU_STACK_SIZE  (0x8000)
 #define MEM_BLOCK_SIZE          (0x200000)
@@ -48,7 +58,10 @@
 #define VM_MAP_TYPE_SHIFT       (16)
 #define VM_MAP_BK   	        (0b0001 << VM_MAP_TYPE_SHIFT)	/* mapped as block */
 #define VM_MAP_PT   	        (0b0010 << VM_MAP_TYPE_SHIFT)	/* mapped as pass though, PFN_MAP */
-#define VM_MAP_TYPE_MASK	    (0b0011 << VM_MAP_TYPE_SHIFT)
+#define VM_MAP_PG               (0b0100 << VM_MAP_TYPE_SHIFT)   /* mapped as cache colored pages */
+#define VM_MAP_TYPE_MASK	    (0b0111 << VM_MAP_TYPE_SHIFT)
+#define VM_MAP_IS_RAM(flag)     (((flag) & VM_MAP_TYPE_MASK) == VM_MAP_BK \
+                              || ((flag) & VM_MAP_TYPE_MASK) == VM_MAP_PG)
 
 #define VM_RO                   (VM_READ)
 #define VM_WO                   (VM_WRITE)
@@ -80,9 +93,15 @@ typedef rt_uint64_t pte_t;
 #define BYTE(n)   ((n) << 20)
 #define MB(n)     ((n) >> 20)
 
+/* dirty page bitmap, bit n is the n-th 4K page from the start address */
+#define VM_DIRTY_WORD_BITS      (sizeof(rt_ubase_t) * 8)
+#define VM_DIRTY_WORDS(size)    (((size) >> S2_PTE_SHIFT) / VM_DIRTY_WORD_BITS)
+
+/* a 2M block of guest RAM, or a 4K page of VM_MAP_PG guest RAM */
 struct mem_block
 {
-    void *ptr;  /* pointer to vitrual memory allocated from Host OS */
+    void *ptr;  /* pointer to vitrual memory allocated from Host OS, RT_NULL if ballooned */
+    rt_uint32_t *ref;   /* VMs sharing ptr after clone, RT_NULL if private */
     struct mem_block *next;
 };
 typedef struct mem_block mem_block_t;
@@ -92,18 +111,57 @@ struct vm_area
     struct mem_desc desc;
 	mem_block_t *mb_head;
     rt_uint64_t flag;
+    rt_uint32_t colors;     /* LLC colors of its pages, see struct mem_region */
+
+    rt_ubase_t *dirty;      /* one bit per 4K page while logging dirty pages */
+    mem_block_t *page_head; /* 4K copies of pages written in shared blocks */
 
     rt_list_t node;
     struct mm_struct *mm;    /* this area belongs to */
 };
 typedef struct vm_area *vm_area_t;
 
+/* copy-on-write breaks of shared blocks, since boot */
+struct vm_cow_stat
+{
+    rt_size_t pages;        /* 4K pages copied */
+    rt_size_t blocks;       /* 2M blocks copied, out of page tables */
+    rt_size_t taken;        /* blocks taken back by their last user */
+};
+
+/*
+ * Translation cache of a VM, the leaves hypervisor code found last when
+ * reaching into guest memory, see s2_lookup(). Any change to the table
+ * drops it all.
+ */
+#define S2_TC_NUM           (16)    /* a power of 2 */
+
+struct s2_tc_entry
+{
+    rt_uint64_t ipa;        /* first IPA of the page or block */
+    rt_uint64_t size;       /* 0: empty */
+    rt_uint64_t leaf;       /* descriptor, output address and attributes */
+};
+
+struct s2_tc
+{
+    struct s2_tc_entry entry[S2_TC_NUM];
+    rt_uint32_t seq;        /* odd while entries change */
+#ifdef RT_USING_SMP
+    rt_hw_spinlock_t lock;
+#endif
+};
+
 struct mm_struct
 {
-    rt_uint64_t mem_size;
+    rt_uint64_t mem_size;       /* MB, all RAM regions */
     rt_uint64_t mem_used;
+    rt_uint64_t balloon;        /* bytes of guest RAM given back by the guest */
+    rt_uint64_t balloon_target; /* bytes the host asks the guest to give back */
+    struct mem_quota quota;     /* host memory charged to the VM */
 
     pud_t *pgd_tbl;     /* start from level 1 */
+    struct s2_tc tc;    /* leaves looked up by the hypervisor */
 
 #ifdef RT_USING_SMP
     rt_hw_spinlock_t lock;
@@ -116,8 +174,32 @@ struct mm_struct
 struct vm_area *vm_area_init(struct mm_struct *mm, rt_uint64_t start, rt_uint64_t end);
 rt_err_t vm_mm_struct_init(struct mm_struct *mm);
 mem_block_t *alloc_mem_block(void);
+void free_mem_block(mem_block_t *mb);
 rt_err_t alloc_vm_memory(struct mm_struct *mm);
 rt_err_t map_vm_memory(struct mm_struct *mm);
 rt_err_t vm_memory_init(struct mm_struct *mm);
+void vm_memory_free(struct mm_struct *mm);
+void vm_mm_struct_free(struct mm_struct *mm);
+struct vm_area *vm_area_find(struct mm_struct *mm, rt_uint64_t ipa);
+struct vm_area *vm_ram_area(struct mm_struct *mm, rt_uint64_t ipa, rt_size_t size);
+rt_err_t vm_copy_from_guest(struct mm_struct *mm, void *dst, rt_uint64_t ipa, rt_size_t size);
+rt_err_t vm_copy_to_guest(struct mm_struct *mm, rt_uint64_t ipa, const void *src, rt_size_t size);
+
+rt_err_t vm_dirty_log_start(struct mm_struct *mm);
+void vm_dirty_log_stop(struct mm_struct *mm);
+rt_err_t vm_dirty_log_get(struct mm_struct *mm, rt_uint64_t ipa, rt_size_t size, rt_ubase_t *bitmap);
+rt_err_t vm_dirty_log_fault(struct mm_struct *mm, rt_uint64_t ipa);
+
+rt_err_t vm_memory_clone(struct mm_struct *mm, struct mm_struct *from);
+rt_err_t vm_mem_write_fault(struct mm_struct *mm, rt_uint64_t ipa);
+void vm_cow_get_stat(struct vm_cow_stat *stat);
+
+void *vm_memory_block(struct mm_struct *mm, rt_uint64_t ipa);
+rt_err_t vm_memory_merge(struct mm_struct *mm, struct mm_struct *from, rt_uint64_t ipa,
+                         rt_size_t nr_copy, rt_size_t *copied);
+
+rt_size_t vm_balloon_granule(struct mm_struct *mm);
+rt_err_t vm_balloon_inflate(struct mm_struct *mm, rt_uint64_t ipa, rt_size_t size);
+rt_err_t vm_balloon_deflate(struct mm_struct *mm, rt_uint64_t ipa, rt_size_t size);
 
 #endif  /* __MM_H__ */
\ No newline at end of file
@@ -6,14 +6,21 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-06-30     Suqier       first version
+ * 2022-11-29     Suqier       descriptions from FDT
+ * 2022-12-08     Suqier       guest RAM regions
  */
 
+#include <rtthread.h>
 #include <rtconfig.h>
 #include "os.h"
+#include "hyp_fdt.h"
 
-#define MAX_OS_NUM  3
+#ifndef RT_HYPERVISOR_FDT_ADDR
+#define RT_HYPERVISOR_FDT_ADDR  0x0
+#endif
 
-const struct os_desc os_img[MAX_OS_NUM] =
+/* built-in descriptions, replaced by the partition FDT if there is one */
+struct os_desc os_img[MAX_OS_NUM] =
 {
     {   /* for QEMU */
         .img = 
@@ -33,8 +40,14 @@ const struct os_desc os_img[MAX_OS_NUM] =
         },
         .mem = 
         {
-            .addr = 0x40000000,
-            .size = 8,          /* default MB */
+            .region = 
+            {
+                {
+                    .addr = 0x40000000,
+                    .size = 8,  /* default MB */
+                },
+            },
+            .num = 1,
         },
         .devs = 
         {
@@ -42,6 +55,9 @@ const struct os_desc os_img[MAX_OS_NUM] =
             .dev = (struct dev_info[]) 
             {
                 {   /* QEMU UART0 */
+                    .name  = "uart",
+                    .compatible = "arm,pl011\0arm,primecell",
+                    .compatible_len = sizeof("arm,pl011\0arm,primecell"),
                     .paddr = 0x09000000,  /* PL011_UART0_BASE */
                     .vaddr = 0x09000000,  /* flat mapping */
                     .size  = 0x00001000,
@@ -80,8 +96,14 @@ const struct os_desc os_img[MAX_OS_NUM] =
         },
         .mem = 
         {
-            .addr = 0x40000000,
-            .size = 8,          /* default MB */
+            .region = 
+            {
+                {
+                    .addr = 0x40000000,
+                    .size = 8,  /* default MB */
+                },
+            },
+            .num = 1,
         },
         .devs = 
         {
@@ -89,6 +111,9 @@ const struct os_desc os_img[MAX_OS_NUM] =
             .dev = (struct dev_info[]) 
             {
                 {   /* RK3568 UART2 */
+                    .name  = "serial",
+                    .compatible = "snps,dw-apb-uart",
+                    .compatible_len = sizeof("snps,dw-apb-uart"),
                     .paddr = 0xFE650000 + 0x10000,
                     .vaddr = 0xFE650000 + 0x10000,
                     .size  = 0x00001000,
@@ -107,3 +132,32 @@ const struct os_desc os_img[MAX_OS_NUM] =
         },
     },
 };
+rt_uint8_t os_img_num = 2;
+
+/*
+ * Boot time, take VM partitions from the FDT the loader put at
+ * RT_HYPERVISOR_FDT_ADDR. The blob has to stay there, descriptions point
+ * into it.
+ */
+int os_img_fdt_init(void)
+{
+    static struct os_desc fdt_os[MAX_OS_NUM];
+    const void *fdt = (const void *)RT_HYPERVISOR_FDT_ADDR;
+    int num;
+
+    if (fdt == RT_NULL)
+        return 0;
+
+    num = hyp_fdt_parse_vms(fdt, fdt_os, MAX_OS_NUM);
+    if (num <= 0)
+    {
+        rt_kprintf("[Info] No VM partition in FDT at 0x%lx, use built-in OS table\n",
+                (unsigned long)RT_HYPERVISOR_FDT_ADDR);
+        return 0;
+    }
+
+    rt_memcpy(os_img, fdt_os, sizeof(struct os_desc) * num);
+    os_img_num = num;
+    rt_kprintf("[Info] %d VM partitions from FDT\n", num);
+    return num;
+}
@@ -6,6 +6,10 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-06-30     Suqier       first version
+ * 2022-11-29     Suqier       descriptions from FDT
+ * 2022-12-06     Suqier       cache colors of guest RAM
+ * 2022-12-08     Suqier       guest RAM regions
+ * 2022-12-10     Suqier       memory limit of a VM
  */
 
 #ifndef __OS_H__
@@ -17,6 +21,7 @@
 #include "vm.h"
 
 #define MAX_VCPU_NUM    4      /* per vm */
+#define MAX_MEM_REGION  4      /* per vm */
 
 enum
 {
@@ -35,13 +40,16 @@ enum
  * -> arch related info
  * -> ......
  * 
- * The device tree format will be used later.
+ * Descriptions come from the partition FDT (hyp_fdt.c) when the board
+ * provides one, otherwise from the built-in table in os.c.
  */
 struct img_info
 {
     rt_uint64_t addr;
     rt_uint64_t size;
     rt_uint64_t ep;      /* OS entry point */
+    rt_uint64_t dtb;     /* IPA of generated guest DTB, 0 for none */
+    const char *path;    /* image file in DFS, RT_NULL: copy from addr */
     rt_uint8_t  type;    /* OS_TYPE_ENUM */
 };
 
@@ -51,14 +59,32 @@ struct cpu_info
     rt_uint8_t  num;
 };
 
-struct mem_info          /* only one memory region supported now */
+/*
+ * A guest RAM region. Regions 2M aligned in address and size are mapped in
+ * 2M blocks, others in 4K pages. @flag takes the VM_* bits of mm.h:
+ * VM_NORMAL_WB/NC/WT, VM_EXEC and VM_SHARED, 0 for VM_NORMAL | VM_RWX.
+ * VMs with a VM_SHARED region of the same address and size share its RAM.
+ */
+struct mem_region
+{
+    rt_uint64_t addr;    /* IPA */
+    rt_uint64_t size;    /* MB */
+    rt_uint64_t flag;
+    rt_uint32_t colors;  /* LLC colors, bit n for color n, 0: any mem_block */
+};
+
+struct mem_info          /* region[0] holds the image and the guest DTB */
 {
-    rt_uint64_t addr;    /* mmap basic address */
-    rt_uint64_t size;    /* default / MB */
+    struct mem_region region[MAX_MEM_REGION];
+    rt_uint8_t num;
+    rt_uint64_t limit;   /* MB of host memory the VM may take, 0: no limit */
 };
 
 struct dev_info
 {
+    const char  *name;
+    const char  *compatible;    /* string list, RT_NULL for none */
+    rt_uint32_t compatible_len;
     rt_uint64_t paddr;
     rt_uint64_t vaddr;
     rt_uint64_t size;
@@ -90,4 +116,9 @@ struct os_desc
     struct os_ops *ops;
 };
 
+extern struct os_desc os_img[MAX_OS_NUM];
+extern rt_uint8_t os_img_num;
+
+int os_img_fdt_init(void);
+
 #endif  /* __OS_H__ */
\ No newline at end of file
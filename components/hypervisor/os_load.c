@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-11-30     Suqier       first version
+ * 2022-12-08     Suqier       load into the RAM region of the entry
+ * 2022-12-09     Suqier       chunks of the stage 2 leaf, through the translation cache
+ */
+
+#include <rtthread.h>
+#include <rtconfig.h>
+
+#ifdef RT_USING_DFS
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <stage2.h>
+
+#include "mm.h"
+#include "vm.h"
+#include "os.h"
+
+/*
+ * Guest images from DFS. The file is read straight into the guest RAM
+ * behind each IPA, one stage 2 page or block at a time, as they are not
+ * contiguous in host memory. LZ4 images (frame and legacy format) are
+ * decompressed on the way: literals are read into place and matches are
+ * copied inside guest RAM, so only a small header buffer sits between
+ * storage and the guest.
+ */
+#define IMG_RD_BUF_SIZE     (256)
+
+#define LZ4_FRAME_MAGIC     (0x184D2204)
+#define LZ4_LEGACY_MAGIC    (0x184C2102)
+#define LZ4_MIN_MATCH       (4)
+
+struct img_rd
+{
+    int         fd;
+    rt_size_t   pos;
+    rt_size_t   len;
+    rt_size_t   left;       /* bytes left in the current LZ4 block */
+    rt_uint8_t  buf[IMG_RD_BUF_SIZE];
+};
+
+struct img_wr
+{
+    struct mm_struct *mm;
+    rt_uint64_t start;      /* entry point, first byte written */
+    rt_uint64_t ipa;        /* next byte */
+    rt_uint64_t end;        /* end of guest RAM */
+};
+
+/* host address of @ipa, and how much of @size fits in its page or block */
+static rt_err_t guest_chunk(struct img_wr *wr, rt_uint64_t ipa, rt_size_t size,
+                        rt_uint8_t **pa, rt_size_t *len)
+{
+    rt_uint64_t leaf;
+    rt_size_t n;
+
+    if (ipa < wr->start || ipa >= wr->end)
+        return -RT_ERROR;
+
+    leaf = s2_lookup(wr->mm, ipa, &n);
+    if (leaf == 0)
+        return -RT_ERROR;
+    *pa = (rt_uint8_t *)S2_LEAF_PA(leaf, n, ipa);
+    n -= ipa & (n - 1);
+
+    if (n > wr->end - ipa)
+        n = wr->end - ipa;
+    *len = size < n ? size : n;
+    return RT_EOK;
+}
+
+static rt_bool_t rd_fill(struct img_rd *rd)
+{
+    int n;
+
+    if (rd->pos < rd->len)
+        return RT_TRUE;
+
+    n = read(rd->fd, rd->buf, IMG_RD_BUF_SIZE);
+    rd->pos = 0;
+    rd->len = n > 0 ? n : 0;
+    return rd->len > 0;
+}
+
+static rt_err_t rd_get(struct img_rd *rd, rt_uint8_t *val)
+{
+    if (rd->left == 0 || !rd_fill(rd))
+        return -RT_ERROR;
+
+    *val = rd->buf[rd->pos++];
+    rd->left--;
+    return RT_EOK;
+}
+
+static rt_err_t rd_le32(struct img_rd *rd, rt_uint32_t *val)
+{
+    rt_uint8_t b;
+
+    *val = 0;
+    for (rt_size_t i = 0; i < 4; i++)
+    {
+        if (rd_get(rd, &b))
+            return -RT_ERROR;
+        *val |= (rt_uint32_t)b << (i * 8);
+    }
+
+    return RT_EOK;
+}
+
+static rt_err_t rd_skip(struct img_rd *rd, rt_size_t size)
+{
+    rt_uint8_t b;
+
+    while (size--)
+    {
+        if (rd_get(rd, &b))
+            return -RT_ERROR;
+    }
+
+    return RT_EOK;
+}
+
+/* @size bytes of the file to the write cursor, buffered ones first */
+static rt_err_t rd_to_guest(struct img_rd *rd, struct img_wr *wr, rt_size_t size)
+{
+    rt_uint8_t *pa;
+    rt_size_t len, n;
+
+    if (size > rd->left)
+        return -RT_ERROR;
+    rd->left -= size;
+
+    while (size)
+    {
+        if (guest_chunk(wr, wr->ipa, size, &pa, &len))
+            return -RT_ERROR;
+
+        n = rd->len - rd->pos;
+        if (n)
+        {
+            n = n < len ? n : len;
+            rt_memcpy(pa, &rd->buf[rd->pos], n);
+            rd->pos += n;
+        }
+        else
+        {
+            int ret = read(rd->fd, pa, len);
+            if (ret <= 0)
+                return -RT_ERROR;
+            n = ret;
+        }
+
+        wr->ipa += n;
+        size -= n;
+    }
+
+    return RT_EOK;
+}
+
+/* plain image, everything up to EOF */
+static rt_err_t img_load_raw(struct img_rd *rd, struct img_wr *wr)
+{
+    rt_uint8_t *pa;
+    rt_size_t len;
+    int n;
+
+    rd->left = (rt_size_t)-1;
+    if (rd->len - rd->pos && rd_to_guest(rd, wr, rd->len - rd->pos))
+        return -RT_ERROR;
+
+    while (wr->ipa < wr->end)
+    {
+        if (guest_chunk(wr, wr->ipa, MEM_BLOCK_SIZE, &pa, &len))
+            return -RT_ERROR;
+
+        n = read(rd->fd, pa, len);
+        if (n < 0)
+            return -RT_ERROR;
+        if (n == 0)
+            return RT_EOK;
+        wr->ipa += n;
+    }
+
+    /* guest RAM is full, so must be the file */
+    return read(rd->fd, rd->buf, 1) == 0 ? RT_EOK : -RT_ERROR;
+}
+
+#ifdef RT_HYPERVISOR_IMG_LZ4
+/* copy @len bytes from @offset back, may overlap the bytes being written */
+static rt_err_t guest_match(struct img_wr *wr, rt_size_t offset, rt_size_t len)
+{
+    rt_uint8_t *src, *dst;
+    rt_size_t n, m;
+
+    if (offset == 0 || offset > wr->ipa - wr->start)
+        return -RT_ERROR;
+
+    while (len)
+    {
+        if (guest_chunk(wr, wr->ipa - offset, len, &src, &n)
+         || guest_chunk(wr, wr->ipa, n, &dst, &m))
+            return -RT_ERROR;
+
+        if (offset >= m)
+            rt_memcpy(dst, src, m);
+        else
+        {
+            for (rt_size_t i = 0; i < m; i++)
+                dst[i] = src[i];
+        }
+
+        wr->ipa += m;
+        len -= m;
+    }
+
+    return RT_EOK;
+}
+
+static rt_err_t lz4_len(struct img_rd *rd, rt_size_t *len)
+{
+    rt_uint8_t b;
+
+    do
+    {
+        if (rd_get(rd, &b))
+            return -RT_ERROR;
+        *len += b;
+    } while (b == 255);
+
+    return RT_EOK;
+}
+
+/* one compressed block of @size bytes, the last sequence has no match */
+static rt_err_t lz4_block(struct img_rd *rd, struct img_wr *wr, rt_size_t size)
+{
+    rt_uint8_t token, b;
+    rt_size_t len, offset;
+
+    rd->left = size;
+    while (rd->left)
+    {
+        if (rd_get(rd, &token))
+            return -RT_ERROR;
+
+        len = token >> 4;
+        if (len == 15 && lz4_len(rd, &len))
+            return -RT_ERROR;
+        if (rd_to_guest(rd, wr, len))
+            return -RT_ERROR;
+        if (rd->left == 0)
+            break;
+
+        if (rd_get(rd, &b))
+            return -RT_ERROR;
+        offset = b;
+        if (rd_get(rd, &b))
+            return -RT_ERROR;
+        offset |= b << 8;
+
+        len = token & 0xF;
+        if (len == 15 && lz4_len(rd, &len))
+            return -RT_ERROR;
+        if (guest_match(wr, offset, len + LZ4_MIN_MATCH))
+            return -RT_ERROR;
+    }
+
+    rd->left = (rt_size_t)-1;
+    return RT_EOK;
+}
+
+/*
+ * LZ4 frame format. Blocks may be linked, matches only look back into
+ * guest RAM. Checksums are skipped, there is no xxHash here.
+ */
+static rt_err_t img_load_lz4(struct img_rd *rd, struct img_wr *wr)
+{
+    rt_uint8_t flg, bd;
+    rt_uint32_t size;
+
+    if (rd_get(rd, &flg) || rd_get(rd, &bd) || (flg >> 6) != 1 || (flg & 0x01))
+        return -RT_ERROR;   /* unknown version or dictionary */
+
+    /* content size and header checksum */
+    if (rd_skip(rd, ((flg & 0x08) ? 8 : 0) + 1))
+        return -RT_ERROR;
+
+    while (rd_le32(rd, &size) == RT_EOK)
+    {
+        if (size == 0)
+            return rd_skip(rd, (flg & 0x04) ? 4 : 0);
+
+        if (size & 0x80000000)
+        {
+            if (rd_to_guest(rd, wr, size & 0x7FFFFFFF))
+                return -RT_ERROR;
+        }
+        else if (lz4_block(rd, wr, size))
+            return -RT_ERROR;
+
+        if (rd_skip(rd, (flg & 0x10) ? 4 : 0))
+            return -RT_ERROR;
+    }
+
+    return -RT_ERROR;   /* no end mark */
+}
+
+/* legacy format of lz4 -l, as used for compressed kernels, ends at EOF */
+static rt_err_t img_load_lz4_legacy(struct img_rd *rd, struct img_wr *wr)
+{
+    rt_uint32_t size;
+
+    while (rd_fill(rd))
+    {
+        if (rd_le32(rd, &size))
+            return -RT_ERROR;
+        if (size == LZ4_LEGACY_MAGIC)
+            continue;       /* concatenated stream */
+        if (lz4_block(rd, wr, size))
+            return -RT_ERROR;
+    }
+
+    return RT_EOK;
+}
+#endif  /* RT_HYPERVISOR_IMG_LZ4 */
+
+/* Load the image at @path to the entry point of @vm. */
+rt_err_t os_img_load_file(vm_t vm, const char *path)
+{
+    struct vm_area *vma = vm_ram_area(vm->mm, vm->os->img.ep, 1);
+    struct img_rd *rd;
+    struct img_wr wr;
+    rt_uint32_t magic = 0;
+    rt_err_t ret;
+
+    if (vma == RT_NULL)
+    {
+        rt_kprintf("[Error] %dth VM: OS entry 0x%08x is not in its RAM\n", vm->id, vm->os->img.ep);
+        return -RT_EINVAL;
+    }
+
+    /* the image stays in the RAM region it starts in */
+    wr.mm = vm->mm;
+    wr.start = wr.ipa = vm->os->img.ep;
+    wr.end = vma->desc.vaddr_end;
+
+    rd = (struct img_rd *)rt_malloc(sizeof(struct img_rd));
+    if (rd == RT_NULL)
+        return -RT_ENOMEM;
+
+    rt_memset(rd, 0, sizeof(struct img_rd));
+    rd->fd = open(path, O_RDONLY, 0);
+    if (rd->fd < 0)
+    {
+        rt_free(rd);
+        rt_kprintf("[Error] %dth VM: Open OS img %s failure\n", vm->id, path);
+        return -RT_EIO;
+    }
+
+    rd->left = (rt_size_t)-1;
+    if (rd_fill(rd) && rd->len >= 4)
+        magic = rd->buf[0] | rd->buf[1] << 8 | rd->buf[2] << 16 | (rt_uint32_t)rd->buf[3] << 24;
+
+    switch (magic)
+    {
+#ifdef RT_HYPERVISOR_IMG_LZ4
+    case LZ4_FRAME_MAGIC:
+        rd->pos = 4;
+        ret = img_load_lz4(rd, &wr);
+        break;
+    case LZ4_LEGACY_MAGIC:
+        rd->pos = 4;
+        ret = img_load_lz4_legacy(rd, &wr);
+        break;
+#endif
+    default:
+        ret = img_load_raw(rd, &wr);
+        break;
+    }
+
+    close(rd->fd);
+    rt_free(rd);
+
+    if (ret)
+    {
+        rt_kprintf("[Error] %dth VM: Load OS img %s failure at 0x%lx\n",
+                vm->id, path, (unsigned long)wr.ipa);
+        return ret;
+    }
+
+    rt_kprintf("[Info] %dth VM: Load OS img %s OK, %d KB\n",
+            vm->id, path, (int)((wr.ipa - wr.start) >> 10));
+    return RT_EOK;
+}
+
+#endif  /* RT_USING_DFS */
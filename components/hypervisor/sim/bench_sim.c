@@ -0,0 +1,409 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-11-20     Suqier       first version
+ * 2022-12-05     Suqier       same-page merging hash
+ * 2022-12-09     Suqier       copies out of guest RAM
+ * 2022-12-11     Suqier       VM teardown
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vgic.h"
+#include "stage2.h"
+#include "mem_merge.h"
+#include "mem_color.h"
+#include "mem_pool.h"
+#include "os.h"
+#include "sim.h"
+
+/*
+ * Throughput of the hot vGIC and stage 2 paths on the mock backend. The
+ * numbers show algorithmic cost only, sysreg/op counts how many trapped
+ * register accesses each operation needs on real hardware.
+ */
+#define SIM_BENCH_ITERS     200000
+
+struct sim_bench_result
+{
+    rt_uint64_t ns;
+    rt_uint64_t ops;
+    rt_uint64_t sysreg;
+};
+
+static void sim_bench_report(const char *name, struct sim_bench_result *r)
+{
+    double ns_op = (double)r->ns / r->ops;
+
+    printf("%-28s %10.1f ns/op %12.0f ops/s %8.1f sysreg/op\n", name,
+           ns_op, 1e9 / ns_op, (double)r->sysreg / r->ops);
+}
+
+static void sim_bench_begin(struct sim_bench_result *r)
+{
+    r->sysreg = sim_stats.sysreg_read + sim_stats.sysreg_write;
+    r->ns = sim_now_ns();
+}
+
+static void sim_bench_end(struct sim_bench_result *r, rt_uint64_t ops)
+{
+    r->ns = sim_now_ns() - r->ns;
+    r->sysreg = sim_stats.sysreg_read + sim_stats.sysreg_write - r->sysreg;
+    r->ops = ops;
+}
+
+/* guest EOIs a vIRQ: its LR goes back to invalid */
+static void sim_guest_eoi_all(rt_uint32_t nr_lr)
+{
+    for (rt_uint32_t i = 0; i < nr_lr; i++)
+        sim_lr_set(i, 0);
+}
+
+static void bench_vgic_inject(rt_uint32_t nr_lr, rt_uint32_t burst)
+{
+    struct sim_bench_result r;
+    char name[64];
+    vm_t vm;
+
+    sim_sysreg_reset(nr_lr);
+    vm = sim_vm_create(0, 1, 8);
+    for (rt_uint32_t i = 0; i < burst; i++)
+    {
+        virq_t virq = vgic_get_virq(vm->vcpus[0], 32 + i);
+        virq->enable = RT_TRUE;
+        virq->prio = 0x80 + (i & 0x3F);
+    }
+
+    sim_bench_begin(&r);
+    for (rt_size_t n = 0; n < SIM_BENCH_ITERS / burst; n++)
+    {
+        for (rt_uint32_t i = 0; i < burst; i++)
+            vgic_inject(vm->vcpus[0], vgic_get_virq(vm->vcpus[0], 32 + i));
+
+        /* drain lr_list as the guest acknowledges vIRQs */
+        while (vm->vgic->gicr[0]->tail)
+        {
+            sim_guest_eoi_all(nr_lr);
+            hook_vgic_context_restore(vm->vcpus[0]);
+        }
+        sim_guest_eoi_all(nr_lr);
+    }
+    sim_bench_end(&r, (SIM_BENCH_ITERS / burst) * burst);
+
+    snprintf(name, sizeof(name), "vgic_inject lr=%u burst=%u", nr_lr, burst);
+    sim_bench_report(name, &r);
+    sim_vm_destroy(vm);
+}
+
+static void bench_vgic_switch(rt_uint32_t nr_lr, rt_uint32_t pending)
+{
+    struct sim_bench_result r;
+    char name[64];
+    vm_t vm;
+
+    sim_sysreg_reset(nr_lr);
+    vm = sim_vm_create(0, 1, 8);
+    for (rt_uint32_t i = 0; i < pending; i++)
+    {
+        virq_t virq = vgic_get_virq(vm->vcpus[0], 32 + i);
+        virq->enable = RT_TRUE;
+        virq->prio = 0x80 + i;
+        vgic_inject(vm->vcpus[0], virq);
+    }
+
+    sim_bench_begin(&r);
+    for (rt_size_t n = 0; n < SIM_BENCH_ITERS; n++)
+    {
+        hook_vgic_context_save(vm->vcpus[0]);
+        hook_vgic_context_restore(vm->vcpus[0]);
+    }
+    sim_bench_end(&r, SIM_BENCH_ITERS);
+
+    snprintf(name, sizeof(name), "vgic_switch lr=%u pending=%u", nr_lr, pending);
+    sim_bench_report(name, &r);
+    sim_vm_destroy(vm);
+}
+
+static void bench_vgic_emulate(void)
+{
+    struct sim_bench_result r;
+    struct rt_hw_exp_stack regs;
+    access_info_t acc;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+    rt_memset(&regs, 0, sizeof(regs));
+    acc.srt = 1;
+    acc.is_write = RT_TRUE;
+
+    sim_bench_begin(&r);
+    for (rt_size_t n = 0; n < SIM_BENCH_ITERS; n++)
+    {
+        acc.addr = vm->vgic->info.gicd_addr + GICD_PRIO_OFF + 32 + (n & 0x3C);
+        regs.x1 = 0xA0A0A0A0;
+        vgic_emulate(&regs, acc, RT_TRUE);
+    }
+    sim_bench_end(&r, SIM_BENCH_ITERS);
+
+    sim_bench_report("vgic_emulate GICD_IPRIORITYR", &r);
+    sim_vm_destroy(vm);
+}
+
+static void bench_vdev_mmio_nop(vdev_t vdev, gp_regs_t regs, access_info_t acc) {}
+
+static const struct vdev_ops bench_vdev_ops = { .mmio = bench_vdev_mmio_nop };
+
+/* MMIO exit routing among @nr_dev devices, @stride 0 hammers one device */
+static void bench_vdev_dispatch(rt_size_t nr_dev, rt_size_t stride)
+{
+    struct sim_bench_result r;
+    struct rt_hw_exp_stack regs;
+    access_info_t acc;
+    char name[64];
+    vdev_t devs;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+    devs = (vdev_t)calloc(nr_dev, sizeof(struct vdev));
+    for (rt_size_t i = 0; i < nr_dev; i++)
+    {
+        devs[i].mmap_num = 1;
+        devs[i].region[0].vaddr_start = 0x10000000 + i * 0x1000;
+        devs[i].region[0].vaddr_end   = 0x10000000 + i * 0x1000 + 0x100;
+        devs[i].ops = &bench_vdev_ops;
+        devs[i].is_open = RT_TRUE;
+        vdev_register(vm, &devs[i]);
+    }
+    rt_memset(&regs, 0, sizeof(regs));
+    acc.srt = 1;
+    acc.is_write = RT_TRUE;
+
+    sim_bench_begin(&r);
+    for (rt_size_t n = 0; n < SIM_BENCH_ITERS; n++)
+    {
+        acc.addr = 0x10000000 + ((n * stride) % nr_dev) * 0x1000 + 0x10;
+        vdev_mmio_dispatch(&regs, acc);
+    }
+    sim_bench_end(&r, SIM_BENCH_ITERS);
+
+    snprintf(name, sizeof(name), "vdev_dispatch dev=%u %s", (rt_uint32_t)nr_dev,
+            stride ? "spread" : "hot");
+    sim_bench_report(name, &r);
+    for (rt_size_t i = 0; i < nr_dev; i++)
+        rt_list_remove(&devs[i].node);
+    free(devs);
+    sim_vm_destroy(vm);
+}
+
+/* write exits into a coalesced zone, the host replays a full ring at a time */
+static void bench_vdev_coalesced(void)
+{
+    struct sim_bench_result r;
+    struct rt_hw_exp_stack regs;
+    access_info_t acc;
+    struct vdev dev;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+    rt_memset(&dev, 0, sizeof(dev));
+    dev.mmap_num = 1;
+    dev.region[0].vaddr_start = 0x10000000;
+    dev.region[0].vaddr_end   = 0x10000100;
+    dev.ops = &bench_vdev_ops;
+    dev.is_open = RT_TRUE;
+    vdev_register(vm, &dev);
+    vdev_coalesced_register(&dev, 0x10000000, 0x10000100);
+    rt_memset(&regs, 0, sizeof(regs));
+    acc.addr = 0x10000010;
+    acc.srt = 1;
+    acc.is_write = RT_TRUE;
+
+    sim_bench_begin(&r);
+    for (rt_size_t n = 0; n < SIM_BENCH_ITERS; n++)
+    {
+        vdev_mmio_dispatch(&regs, acc);
+        if ((n & (VDEV_COALESCED_RING_SIZE - 1)) == VDEV_COALESCED_RING_SIZE - 1)
+            vdev_coalesced_flush(vm);
+    }
+    sim_bench_end(&r, SIM_BENCH_ITERS);
+
+    sim_bench_report("vdev_dispatch coalesced", &r);
+    vdev_unregister(&dev);
+    sim_vm_destroy(vm);
+}
+
+static void bench_s2_map(rt_uint64_t attr, rt_uint64_t size, const char *name)
+{
+    struct sim_bench_result r;
+    struct mem_desc desc;
+    rt_size_t rounds = 64;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+    vm_mm_struct_init(vm->mm);
+
+    sim_bench_begin(&r);
+    for (rt_size_t n = 0; n < rounds; n++)
+    {
+        clear_s2_mmu_table(0);
+        clear_s2_mmu_page_group(0);
+
+        desc.vaddr_start = 0x40000000;
+        desc.vaddr_end = 0x40000000 + size;
+        desc.paddr_start = 0x80000000;
+        desc.attr = attr;
+        RT_ASSERT(s2_map(vm->mm, &desc) == RT_EOK);
+    }
+    sim_bench_end(&r, rounds * (size >> ((attr & MMU_TYPE_MASK) == MMU_TYPE_BLOCK ?
+                                         S2_PMD_SHIFT : S2_PTE_SHIFT)));
+
+    sim_bench_report(name, &r);
+    sim_vm_free_memory(vm);
+    sim_vm_destroy(vm);
+}
+
+static void bench_s2_translate(void)
+{
+    struct sim_bench_result r;
+    struct mem_desc desc;
+    rt_ubase_t pa, sum = 0;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+    vm_mm_struct_init(vm->mm);
+
+    desc.vaddr_start = 0x40000000;
+    desc.vaddr_end = 0x40000000 + (512UL << 20);
+    desc.paddr_start = 0x80000000;
+    desc.attr = S2_BLOCK_NORMAL;
+    s2_map(vm->mm, &desc);
+
+    sim_bench_begin(&r);
+    for (rt_size_t n = 0; n < SIM_BENCH_ITERS * 10; n++)
+    {
+        s2_translate(vm->mm, 0x40000000 + ((n * 0x12345UL) & 0x1FFFFFFFUL), &pa);
+        sum += pa;
+    }
+    sim_bench_end(&r, SIM_BENCH_ITERS * 10);
+
+    sim_bench_report("s2_translate 2M block", &r);
+    if (sum == 0)   /* keep the loop */
+        printf("\n");
+    sim_vm_free_memory(vm);
+    sim_vm_destroy(vm);
+}
+
+/* hypercall sized copies out of guest RAM in 4K pages, one page crossed each */
+static void bench_vm_copy_guest(void)
+{
+    struct mem_info *mem;
+    struct sim_bench_result r;
+    rt_uint8_t buf[256];
+    rt_uint64_t sum = 0;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    mem_color_init(0);
+    vm = sim_vm_create(0, 1, 8);
+    mem = &((struct os_desc *)vm->os)->mem;
+    mem->region[1] = (struct mem_region) { 0x50000000, 1, VM_NORMAL | VM_RW, 0 };
+    mem->num = 2;
+    vm_mm_struct_init(vm->mm);
+    vm_memory_init(vm->mm);
+
+    sim_bench_begin(&r);
+    for (rt_size_t n = 0; n < SIM_BENCH_ITERS; n++)
+    {
+        vm_copy_from_guest(vm->mm, buf, 0x50000F80 + (n & 15) * S2_PTE_SIZE, sizeof(buf));
+        sum += buf[n & 255];
+    }
+    sim_bench_end(&r, SIM_BENCH_ITERS);
+
+    sim_bench_report("vm_copy_from_guest 256B", &r);
+    if (sum == 1)   /* keep the loop */
+        printf("\n");
+    sim_vm_free_memory(vm);
+    sim_vm_destroy(vm);
+    mem->num = 1;
+}
+
+/* guest RAM of a 64MB VM mapped and torn down again, on pool blocks */
+static void bench_vm_teardown(void)
+{
+    rt_uint8_t *region = rt_malloc_align(32 * MEM_BLOCK_SIZE, MEM_BLOCK_SIZE);
+    struct sim_bench_result r;
+    rt_size_t rounds = 32;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    mem_pool_init(region, 32 * MEM_BLOCK_SIZE);
+    vm = sim_vm_create(0, 1, 64);
+
+    sim_bench_begin(&r);
+    for (rt_size_t n = 0; n < rounds; n++)
+    {
+        RT_ASSERT(vm_mm_struct_init(vm->mm) == RT_EOK);
+        RT_ASSERT(vm_memory_init(vm->mm) == RT_EOK);
+        vm_mm_struct_free(vm->mm);
+    }
+    sim_bench_end(&r, rounds);
+
+    sim_bench_report("vm init + teardown 64M", &r);
+    sim_vm_destroy(vm);
+    mem_pool_init(RT_NULL, 0);
+}
+
+static void bench_mem_merge_hash(void)
+{
+    struct sim_bench_result r;
+    rt_uint8_t *pages = (rt_uint8_t *)malloc(64 * 4096);
+    rt_uint64_t sum = 0;
+
+    for (rt_size_t i = 0; i < 64 * 4096; i++)
+        pages[i] = (rt_uint8_t)(i * 7);
+
+    sim_bench_begin(&r);
+    for (rt_size_t n = 0; n < SIM_BENCH_ITERS; n++)
+        sum += mem_merge_hash(pages + (n & 63) * 4096);
+    sim_bench_end(&r, SIM_BENCH_ITERS);
+
+    sim_bench_report("mem_merge_hash 4K page", &r);
+    if (sum == 0)   /* keep the loop */
+        printf("\n");
+    free(pages);
+}
+
+int main(int argc, char **argv)
+{
+    sim_verbose = (argc > 1 && strcmp(argv[1], "-v") == 0);
+
+    bench_vgic_inject(4, 1);
+    bench_vgic_inject(4, 8);
+    bench_vgic_inject(16, 32);
+    bench_vgic_switch(4, 0);
+    bench_vgic_switch(4, 8);
+    bench_vgic_switch(16, 32);
+    bench_vgic_emulate();
+    bench_vdev_dispatch(32, 0);
+    bench_vdev_dispatch(32, 7);
+    bench_vdev_coalesced();
+    bench_s2_map(S2_BLOCK_NORMAL, 1UL << 30, "s2_map 2M block");
+    bench_s2_map(S2_PAGE_NORMAL, 16UL << 20, "s2_map 4K page");
+    bench_s2_translate();
+    bench_vm_copy_guest();
+    bench_vm_teardown();
+    bench_mem_merge_hash();
+
+    return 0;
+}
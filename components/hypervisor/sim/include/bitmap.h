@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-11-20     Suqier       first version
+ */
+
+#ifndef __SIM_BITMAP_H__
+#define __SIM_BITMAP_H__
+
+/*
+ * Host replacement for the bitmap package, only the 32-bit word API used
+ * by the hypervisor is provided.
+ */
+
+#include <rtdef.h>
+
+#define bit_get(v, n)   (((v) >> (n)) & 0x1UL)
+#define BITMASK(off, len)   ((((1UL << (len)) - 1)) << (off))
+
+rt_inline void bitmap_init(rt_uint32_t *map)                { *map = 0; }
+rt_inline void bitmap_set_bit(rt_uint32_t *map, int i)      { *map |=  (1UL << i); }
+rt_inline void bitmap_clr_bit(rt_uint32_t *map, int i)      { *map &= ~(1UL << i); }
+rt_inline int  bitmap_get_bit(rt_uint32_t *map, int i)      { return (*map >> i) & 0x1; }
+
+/* first clear bit, or the last index when the map is full */
+rt_inline int bitmap_find_next(rt_uint32_t *map)
+{
+    for (int i = 0; i < 32; i++)
+        if (!bitmap_get_bit(map, i))
+            return i;
+
+    return 31;
+}
+
+#endif  /* __SIM_BITMAP_H__ */
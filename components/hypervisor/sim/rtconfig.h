@@ -0,0 +1,51 @@
+#ifndef RT_CONFIG_H__
+#define RT_CONFIG_H__
+
+/* RT-Hypervisor host simulation configuration, see Makefile */
+
+#define RT_NAME_MAX 16
+#define RT_ALIGN_SIZE 8
+#define RT_THREAD_PRIORITY_32
+#define RT_THREAD_PRIORITY_MAX 32
+#define RT_TICK_PER_SECOND 100
+#define RT_USING_TIMER_SOFT
+#define RT_DEBUG
+#define RT_KSERVICE_USING_STDLIB
+#define RT_KSERVICE_USING_STDLIB_MEMORY
+
+#define RT_USING_SEMAPHORE
+#define RT_USING_MUTEX
+#define RT_USING_EVENT
+#define RT_USING_HEAP
+#define RT_USING_DEVICE
+#define RT_USING_CONSOLE
+#define RT_CONSOLEBUF_SIZE 128
+#define RT_CONSOLE_DEVICE_NAME "uart0"
+#define RT_VER_NUM 0x40101
+#define ARCH_CPU_64BIT
+#define ARCH_ARMV8
+
+#define FINSH_THREAD_PRIORITY 20
+
+/* open/read/close of the host libc stand in for DFS */
+#define RT_USING_DFS
+
+/* Hypervisor */
+
+#define RT_HYPERVISOR
+#define RT_HYPERVISOR_SIM
+#define RT_USING_NVHE
+#define MAX_VM_NUM 4
+#define MAX_OS_NUM 3
+#define RT_HYPERVISOR_IMG_LZ4
+
+#define BSP_USING_GIC
+#define BSP_USING_GICV3
+
+/* physical GIC MMIO goes to the mock register file as well, see sim_sysreg.c */
+#ifndef __ASSEMBLY__
+unsigned int *sim_mmio32(unsigned long addr);
+#define HWREG32(x)  (*sim_mmio32((unsigned long)(x)))
+#endif
+
+#endif
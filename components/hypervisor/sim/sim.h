@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-11-20     Suqier       first version
+ * 2022-12-07     Suqier       count range TLB flushes
+ */
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <rtthread.h>
+
+#include "vm.h"
+
+#define SIM_NR_LR_DEFAULT   4
+#define SIM_GIC_IRQ_NUM     1020
+
+/* Physical GIC distributor seen through arm_gic_*() */
+struct sim_gic_irq
+{
+    rt_bool_t enable;
+    rt_bool_t pending;
+    rt_uint8_t prio;
+    rt_uint8_t cfg;
+};
+
+struct sim_stats
+{
+    rt_uint64_t sysreg_read;
+    rt_uint64_t sysreg_write;
+    rt_uint64_t tlb_flush;
+    rt_uint64_t tlb_flush_ipa;
+    rt_uint64_t tlb_flush_range;
+    rt_uint64_t vcpu_kick;
+    rt_uint64_t sem_release;
+    rt_uint64_t dcache_flush;
+    rt_uint64_t block_flush_irq_off;    /* 2MB flushed with IRQ masked */
+    rt_uint64_t thread_yield;
+};
+
+extern struct sim_stats sim_stats;
+extern struct sim_gic_irq sim_gic_irqs[SIM_GIC_IRQ_NUM];
+extern rt_bool_t sim_verbose;
+/* runs once when IRQs are unmasked again, as another CPU would */
+extern void (*sim_unlock_hook)(void);
+/* runs once when the caller yields, as a thread on another CPU would */
+extern void (*sim_yield_hook)(void);
+
+/* mock register file, sim_sysreg.c */
+void sim_sysreg_reset(rt_uint32_t nr_lr);
+rt_uint64_t sim_lr_get(rt_uint32_t idx);
+void sim_lr_set(rt_uint32_t idx, rt_uint64_t val);
+
+/* host kernel and VM scaffolding, sim_kernel.c */
+void sim_set_curr_vcpu(vcpu_t vcpu);
+vm_t sim_vm_create(rt_uint8_t vm_idx, rt_uint8_t nr_vcpus, rt_uint64_t mem_mb);
+void sim_vm_destroy(vm_t vm);
+void sim_vm_free_memory(vm_t vm);
+void sim_arena_reset(void);
+rt_uint64_t sim_now_ns(void);
+
+#endif  /* __SIM_H__ */
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-11-20     Suqier       first version
+ * 2022-12-03     Suqier       vCPU arch, vTimer and guest frame for snapshots
+ * 2022-12-05     Suqier       mutex and delay for the merge scanner
+ * 2022-12-07     Suqier       range TLB flush
+ * 2022-12-10     Suqier       uncharge the memory quota of a VM
+ * 2022-12-11     Suqier       vgic_free() and vm_mm_struct_free() do the freeing
+ * 2022-12-12     Suqier       track IRQ masking
+ * 2022-12-12     Suqier       hook on unmasking IRQs
+ * 2022-12-12     Suqier       hook on yield
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "os.h"
+#include "vgic.h"
+#include "vtimer.h"
+#include "stage2.h"
+#include "sim.h"
+
+/*
+ * The little part of RT-Thread kernel and hypervisor that vgic.c, stage2.c 
+ * and mm.c depend on, backed by libc.
+ */
+rt_bool_t sim_verbose = RT_FALSE;
+struct sim_gic_irq sim_gic_irqs[SIM_GIC_IRQ_NUM];
+
+static struct rt_thread sim_thread;
+
+/* 
+ * Guest RAM must sit below S2_PA_SIZE, so mem_block allocations are carved
+ * out of an arena mapped low in the host address space instead of malloc.
+ */
+#define SIM_ARENA_BASE  0x100000000UL   /* 4GB */
+#define SIM_ARENA_SIZE  (512UL << 20)
+
+static rt_uint8_t *sim_arena;
+static rt_size_t sim_arena_off;
+
+static void *sim_arena_alloc(rt_size_t size, rt_size_t align)
+{
+    if (sim_arena == RT_NULL)
+    {
+        void *p = mmap((void *)SIM_ARENA_BASE, SIM_ARENA_SIZE, 
+                       PROT_READ | PROT_WRITE, 
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED || (rt_uint64_t)p + SIM_ARENA_SIZE > S2_PA_SIZE)
+            return RT_NULL;
+        sim_arena = p;
+    }
+
+    rt_size_t off = RT_ALIGN(((rt_uint64_t)sim_arena + sim_arena_off), align) 
+                  - (rt_uint64_t)sim_arena;
+    if (off + size > SIM_ARENA_SIZE)
+        return RT_NULL;
+
+    sim_arena_off = off + size;
+    return sim_arena + off;
+}
+
+static rt_bool_t sim_in_arena(void *ptr)
+{
+    return sim_arena && (rt_uint8_t *)ptr >= sim_arena 
+        && (rt_uint8_t *)ptr < sim_arena + SIM_ARENA_SIZE;
+}
+
+/* release the whole arena, callers must not touch guest RAM afterwards */
+void sim_arena_reset(void)
+{
+    if (sim_arena)
+        madvise(sim_arena, sim_arena_off, MADV_DONTNEED);
+    sim_arena_off = 0;
+}
+
+/* kernel service */
+void *rt_malloc(rt_size_t size)                 { return malloc(size); }
+void rt_free(void *ptr)                         { free(ptr); }
+
+void *rt_malloc_align(rt_size_t size, rt_size_t align)
+{
+    void *ptr = RT_NULL;
+
+    if (size >= MEM_BLOCK_SIZE)
+        return sim_arena_alloc(size, align);
+
+    if (posix_memalign(&ptr, align, size))
+        return RT_NULL;
+    return ptr;
+}
+
+void rt_free_align(void *ptr)
+{
+    if (!sim_in_arena(ptr))
+        free(ptr);
+}
+
+int rt_kprintf(const char *fmt, ...)
+{
+    va_list args;
+    int len;
+
+    if (!sim_verbose)
+        return 0;
+
+    va_start(args, fmt);
+    len = vprintf(fmt, args);
+    va_end(args);
+    return len;
+}
+
+int rt_snprintf(char *buf, rt_size_t size, const char *fmt, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(buf, size, fmt, args);
+    va_end(args);
+    return len;
+}
+
+void rt_kputs(const char *str)
+{
+    if (sim_verbose)
+        fputs(str, stdout);
+}
+
+void rt_assert_handler(const char *ex, const char *func, rt_size_t line)
+{
+    fprintf(stderr, "(%s) assertion failed at function:%s, line number:%d\n", 
+            ex, func, (int)line);
+    abort();
+}
+
+rt_thread_t rt_thread_self(void)    { return &sim_thread; }
+void rt_schedule(void)              {}
+
+/* nesting depth of IRQ masking, i.e. of the CPU lock on SMP */
+static rt_base_t sim_irq_off;
+void (*sim_unlock_hook)(void);
+
+rt_base_t rt_hw_interrupt_disable(void)         { return sim_irq_off++; }
+
+void rt_hw_interrupt_enable(rt_base_t level)
+{
+    void (*hook)(void) = sim_unlock_hook;
+
+    sim_irq_off = level;
+    if (level == 0 && hook)
+    {
+        sim_unlock_hook = RT_NULL;
+        hook();
+    }
+}
+
+/* host threads never run here, a release only counts the wakeup */
+rt_err_t rt_sem_init(rt_sem_t sem, const char *name, rt_uint32_t value, rt_uint8_t flag)
+{
+    return RT_EOK;
+}
+rt_err_t rt_sem_take(rt_sem_t sem, rt_int32_t timeout)  { return -RT_ETIMEOUT; }
+rt_err_t rt_sem_release(rt_sem_t sem)   { sim_stats.sem_release++; return RT_EOK; }
+rt_err_t rt_mutex_init(rt_mutex_t mutex, const char *name, rt_uint8_t flag)   { return RT_EOK; }
+rt_err_t rt_mutex_take(rt_mutex_t mutex, rt_int32_t time)   { return RT_EOK; }
+rt_err_t rt_mutex_release(rt_mutex_t mutex)                 { return RT_EOK; }
+rt_err_t rt_thread_mdelay(rt_int32_t ms)                    { return RT_EOK; }
+
+void (*sim_yield_hook)(void);
+
+rt_err_t rt_thread_yield(void)
+{
+    void (*hook)(void) = sim_yield_hook;
+
+    sim_stats.thread_yield++;
+    sim_yield_hook = RT_NULL;
+    if (hook)
+        hook();
+    return RT_EOK;
+}
+rt_err_t rt_event_send(rt_event_t event, rt_uint32_t set)
+{
+    event->set |= set;
+    return RT_EOK;
+}
+
+rt_err_t rt_thread_init(struct rt_thread *thread, const char *name,
+                        void (*entry)(void *parameter), void *parameter,
+                        void *stack_start, rt_uint32_t stack_size,
+                        rt_uint8_t priority, rt_uint32_t tick)
+{
+    return RT_EOK;
+}
+rt_err_t rt_thread_startup(rt_thread_t thread)          { return RT_EOK; }
+
+void sim_set_curr_vcpu(vcpu_t vcpu) { sim_thread.vcpu = vcpu; }
+
+rt_uint64_t sim_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (rt_uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* generic counter at 1GHz */
+rt_uint64_t rt_hw_get_cntpct_val(void)  { return sim_now_ns(); }
+
+/* physical GIC distributor */
+void arm_gic_umask(rt_uint64_t index, int irq)              { sim_gic_irqs[irq].enable = RT_TRUE; }
+void arm_gic_mask(rt_uint64_t index, int irq)               { sim_gic_irqs[irq].enable = RT_FALSE; }
+void arm_gic_set_pending_irq(rt_uint64_t index, int irq)    { sim_gic_irqs[irq].pending = RT_TRUE; }
+void arm_gic_clear_pending_irq(rt_uint64_t index, int irq)  { sim_gic_irqs[irq].pending = RT_FALSE; }
+
+void arm_gic_set_priority(rt_uint64_t index, int irq, rt_uint64_t priority)
+{
+    sim_gic_irqs[irq].prio = priority;
+}
+
+void arm_gic_set_configuration(rt_uint64_t index, int irq, rt_uint32_t config)
+{
+    sim_gic_irqs[irq].cfg = config;
+}
+
+/* hypervisor, vm.c and virt_arch.c run on the target only */
+void vcpu_kick(vcpu_t vcpu)
+{
+    if (vcpu->halted)
+    {
+        vcpu->halted = RT_FALSE;
+        sim_stats.vcpu_kick++;
+    }
+}
+void flush_vm_all_tlb(vm_t vm)      { sim_stats.tlb_flush++; }
+void flush_vm_ipa_tlb(vm_t vm, rt_uint64_t ipa) { sim_stats.tlb_flush_ipa++; }
+void flush_vm_ipa_range_tlb(vm_t vm, rt_uint64_t ipa, rt_size_t size, rt_size_t stride)
+{
+    sim_stats.tlb_flush_range++;
+}
+
+/* sim vCPUs have no thread stack, the guest frame follows struct vcpu */
+void *vcpu_guest_frame(struct vcpu *vcpu)   { return vcpu + 1; }
+void rt_hw_cpu_dcache_ops(int ops, void *addr, int size)
+{
+    sim_stats.dcache_flush++;
+    if (sim_irq_off && size >= MEM_BLOCK_SIZE)
+        sim_stats.block_flush_irq_off++;
+}
+
+static struct os_desc sim_os =
+{
+    .img  = { .addr = 0, .size = 0, .ep = 0x40000000, .type = OS_TYPE_OTHER },
+    .cpu  = { .affinity = { 0 }, .num = 1 },
+    .mem  = { .region = { { .addr = 0x40000000, .size = 8 } }, .num = 1 },
+    .devs = { .dev = RT_NULL, .num = 0 },
+    .arch = 
+    {
+        .vgic = 
+        {
+            .gicd_addr = 0x08000000,
+            .gicr_addr = 0x080A0000,
+            .maintenance_id = 25,
+            .virq_num  = 127,
+        },
+    },
+};
+
+/* 
+ * Build a VM like create_vm() + vm_init() without threads, stage 2 tables
+ * come from the static group of @vm_idx.
+ */
+vm_t sim_vm_create(rt_uint8_t vm_idx, rt_uint8_t nr_vcpus, rt_uint64_t mem_mb)
+{
+    vm_t vm = (vm_t)calloc(1, sizeof(struct vm));
+    struct mm_struct *mm = (struct mm_struct *)calloc(1, sizeof(struct mm_struct));
+
+    RT_ASSERT(vm && mm && nr_vcpus <= MAX_VCPU_NUM);
+    sim_os.cpu.num = nr_vcpus;
+    sim_os.mem.region[0].size = mem_mb;
+    sim_os.mem.num = 1;
+
+    vm->id = vm_idx;
+    vm->os = &sim_os;
+    vm->mm = mm;
+    mm->vm = vm;
+    mm->mem_size = mem_mb;
+    vm->nr_vcpus = nr_vcpus;
+    rt_list_init(&vm->dev_list);
+    rt_list_init(&vm->ioevent_list);
+
+    vm->vcpus = (vcpu_t *)calloc(nr_vcpus, sizeof(vcpu_t));
+    for (rt_size_t i = 0; i < nr_vcpus; i++)
+    {
+        vcpu_t vcpu = (vcpu_t)calloc(1, sizeof(struct vcpu) + VCPU_GUEST_FRAME_SIZE);
+        vcpu->arch = (struct vcpu_arch *)calloc(1, sizeof(struct vcpu_arch));
+        vcpu->vtc = (struct vtimer_context *)calloc(1, sizeof(struct vtimer_context));
+        vcpu->id = i;
+        vcpu->vm = vm;
+        vcpu->status = VCPU_STATUS_ONLINE;
+        vm->vcpus[i] = vcpu;
+    }
+
+    vm->vgic = vgic_create();
+    vgic_init(vm);
+    vdev_mmio_rebuild(vm);
+    sim_set_curr_vcpu(vm->vcpus[0]);
+
+    clear_s2_mmu_table(vm_idx);
+    clear_s2_mmu_page_group(vm_idx);
+
+    return vm;
+}
+
+void sim_vm_destroy(vm_t vm)
+{
+    for (rt_size_t i = 0; i < vm->nr_vcpus; i++)
+    {
+        free(vm->vcpus[i]->arch);
+        free(vm->vcpus[i]->vtc);
+        free(vm->vcpus[i]);
+    }
+    vdev_coalesced_free(vm);
+    vdev_mmio_free(vm);
+    vgic_free(vm->vgic);
+    mem_quota_release(vm->mm);
+    free(vm->vcpus);
+    free(vm->mm);
+    free(vm);
+}
+
+/* undo vm_mm_struct_init() and vm_memory_init() */
+void sim_vm_free_memory(vm_t vm)
+{
+    vm_mm_struct_free(vm->mm);
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-11-20     Suqier       first version
+ */
+
+#include <string.h>
+
+#include "gicv3.h"
+#include "vgic.h"
+#include "sim.h"
+
+/*
+ * Mock register file behind GET_SYS_REG()/GET_GICV3_REG() in the host build.
+ * Registers are created on first access and keyed by their encoding string,
+ * ICH_ELRSR_EL2 is derived from the List Registers like real hardware does.
+ */
+#define SIM_SYSREG_MAX  128
+
+struct sim_sysreg
+{
+    const char *name;
+    rt_uint64_t val;
+};
+
+static struct sim_sysreg sim_regs[SIM_SYSREG_MAX];
+static rt_size_t sim_reg_num;
+static rt_uint32_t sim_nr_lr = SIM_NR_LR_DEFAULT;
+
+struct sim_stats sim_stats;
+
+static const char *sim_lr_names[MAX_LR_REGS] =
+{
+    ICH_LR0_EL2,  ICH_LR1_EL2,  ICH_LR2_EL2,  ICH_LR3_EL2,
+    ICH_LR4_EL2,  ICH_LR5_EL2,  ICH_LR6_EL2,  ICH_LR7_EL2,
+    ICH_LR8_EL2,  ICH_LR9_EL2,  ICH_LR10_EL2, ICH_LR11_EL2,
+    ICH_LR12_EL2, ICH_LR13_EL2, ICH_LR14_EL2, ICH_LR15_EL2,
+};
+
+static struct sim_sysreg *sim_sysreg_find(const char *name)
+{
+    /* literals are usually merged, so try the pointer before strcmp */
+    for (rt_size_t i = 0; i < sim_reg_num; i++)
+        if (sim_regs[i].name == name)
+            return &sim_regs[i];
+
+    for (rt_size_t i = 0; i < sim_reg_num; i++)
+        if (strcmp(sim_regs[i].name, name) == 0)
+            return &sim_regs[i];
+
+    RT_ASSERT(sim_reg_num < SIM_SYSREG_MAX);
+    sim_regs[sim_reg_num].name = name;
+    sim_regs[sim_reg_num].val = 0;
+    return &sim_regs[sim_reg_num++];
+}
+
+static rt_uint64_t sim_elrsr(void)
+{
+    rt_uint64_t elrsr = 0;
+
+    for (rt_uint32_t i = 0; i < sim_nr_lr; i++)
+        if ((sim_lr_get(i) >> ICH_LR_STAT_OFF) == 0)
+            elrsr |= (1UL << i);
+
+    return elrsr;
+}
+
+rt_uint64_t sim_sysreg_read(const char *reg)
+{
+    sim_stats.sysreg_read++;
+
+    if (strcmp(reg, ICH_ELRSR_EL2) == 0)
+        return sim_elrsr();
+
+    return sim_sysreg_find(reg)->val;
+}
+
+void sim_sysreg_write(const char *reg, rt_uint64_t val)
+{
+    sim_stats.sysreg_write++;
+
+    /* read-only registers */
+    if (strcmp(reg, ICH_ELRSR_EL2) == 0 || strcmp(reg, ICH_VTR_EL2) == 0)
+        return;
+
+    sim_sysreg_find(reg)->val = val;
+}
+
+rt_uint64_t sim_lr_get(rt_uint32_t idx)
+{
+    RT_ASSERT(idx < MAX_LR_REGS);
+    return sim_sysreg_find(sim_lr_names[idx])->val;
+}
+
+void sim_lr_set(rt_uint32_t idx, rt_uint64_t val)
+{
+    RT_ASSERT(idx < MAX_LR_REGS);
+    sim_sysreg_find(sim_lr_names[idx])->val = val;
+}
+
+/* 
+ * Physical GICD and GICR frames of the QEMU virt machine, only read for
+ * identification registers such as IIDR.
+ */
+#define SIM_GICD_BASE   0x08000000UL
+#define SIM_GICR_BASE   0x080A0000UL
+#define SIM_GIC_IIDR    0x0300043B   /* Arm, GICv3 */
+
+static rt_uint32_t sim_gicd[VGIC_GICD_SIZE / 4];
+static rt_uint32_t sim_gicr[VGIC_GICR_SIZE * MAX_VCPU_NUM / 4];
+
+unsigned int *sim_mmio32(unsigned long addr)
+{
+    if (addr >= SIM_GICD_BASE && addr < SIM_GICD_BASE + sizeof(sim_gicd))
+        return &sim_gicd[(addr - SIM_GICD_BASE) / 4];
+
+    if (addr >= SIM_GICR_BASE && addr < SIM_GICR_BASE + sizeof(sim_gicr))
+        return &sim_gicr[(addr - SIM_GICR_BASE) / 4];
+
+    rt_kprintf("[Error] sim: no device at 0x%08lx\n", addr);
+    RT_ASSERT(0);
+    return RT_NULL;
+}
+
+/* Power-on state: @nr_lr List Registers and 5 priority bits. */
+void sim_sysreg_reset(rt_uint32_t nr_lr)
+{
+    RT_ASSERT(nr_lr > 0 && nr_lr <= MAX_LR_REGS);
+
+    sim_reg_num = 0;
+    sim_nr_lr = nr_lr;
+    rt_memset(&sim_stats, 0, sizeof(sim_stats));
+
+    sim_sysreg_find(ICH_VTR_EL2)->val = (4UL << PRI_BITS_SHIFT) | (nr_lr - 1);
+    for (rt_uint32_t i = 0; i < MAX_LR_REGS; i++)
+        sim_lr_set(i, 0);
+
+    rt_memset(sim_gicd, 0, sizeof(sim_gicd));
+    rt_memset(sim_gicr, 0, sizeof(sim_gicr));
+    GIC_DIST_IIDR(SIM_GICD_BASE) = SIM_GIC_IIDR;
+    for (rt_uint32_t i = 0; i < MAX_VCPU_NUM; i++)
+        GIC_RDIST_IIDR(SIM_GICR_BASE + i * VGIC_GICR_SIZE) = SIM_GIC_IIDR;
+}
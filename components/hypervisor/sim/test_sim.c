@@ -0,0 +1,2562 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-11-20     Suqier       first version
+ * 2022-12-03     Suqier       add VM snapshot test
+ * 2022-12-05     Suqier       add VM clone and same-page merging tests
+ * 2022-12-06     Suqier       add cache coloring test
+ * 2022-12-07     Suqier       add stage 2 unmap and memory balloon tests
+ * 2022-12-10     Suqier       add memory quota test
+ * 2022-12-11     Suqier       add VM teardown test
+ * 2022-12-12     Suqier       add coalesced vpl011 output test
+ * 2022-12-12     Suqier       add merge against a guest write test
+ * 2022-12-12     Suqier       add stage 2 table limit test
+ * 2022-12-12     Suqier       add multicall ballooning its own entries test
+ * 2022-12-12     Suqier       check guests trap WFI and WFE
+ * 2022-12-12     Suqier       add MMIO index rebuild against an exit test
+ * 2022-12-12     Suqier       add merge against a hypervisor write test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "vgic.h"
+#include "stage2.h"
+#include "hypercall.h"
+#include "vpl011.h"
+#include "mmio_insn.h"
+#include "hyp_fdt.h"
+#include "vm.h"
+#include "mem_pool.h"
+#include "mem_merge.h"
+#include "mem_color.h"
+#include "mem_quota.h"
+#include "vm_snap.h"
+#include "vtimer.h"
+#include "sim.h"
+
+/*
+ * Unit tests for the vGIC List Register management, vGIC MMIO emulation,
+ * MMIO device models, stage 2 page table and hypercall code running on
+ * the mock backend.
+ */
+static int sim_failed, sim_checked;
+
+#define SIM_CHECK(cond)                                                     \
+    do                                                                      \
+    {                                                                       \
+        sim_checked++;                                                      \
+        if (!(cond))                                                        \
+        {                                                                   \
+            sim_failed++;                                                   \
+            printf("    FAIL %s:%d: %s\n", __func__, __LINE__, #cond);      \
+        }                                                                   \
+    } while (0)
+
+#define SIM_LR_VINT(lr)     ((rt_uint32_t)((lr) & ICH_LR_VINT_MSK))
+#define SIM_LR_STATE(lr)    ((rt_uint32_t)((lr) >> ICH_LR_STAT_OFF))
+
+static vgicr_t sim_gicr(vm_t vm)
+{
+    return vm->vgic->gicr[0];
+}
+
+static virq_t sim_enable_virq(vm_t vm, int ir, rt_uint8_t prio)
+{
+    virq_t virq = vgic_get_virq(vm->vcpus[0], ir);
+
+    virq->enable = RT_TRUE;
+    virq->prio = prio;
+    return virq;
+}
+
+static rt_bool_t sim_virq_in_lr(rt_uint32_t nr_lr, int ir)
+{
+    for (rt_size_t i = 0; i < nr_lr; i++)
+    {
+        rt_uint64_t lr = sim_lr_get(i);
+        if (SIM_LR_STATE(lr) && SIM_LR_VINT(lr) == ir)
+            return RT_TRUE;
+    }
+
+    return RT_FALSE;
+}
+
+static void test_vgic_init(void)
+{
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 2, 8);
+
+    SIM_CHECK(vm->vgic->ctxt.nr_lr == SIM_NR_LR_DEFAULT);
+    SIM_CHECK(vm->vgic->ctxt.ich_hcr_el2 == ICH_HCR_EN);
+    SIM_CHECK(vm->vgic->gicd->virqs[0].vINIID == VIRQ_PRIV_NUM);
+    SIM_CHECK(vm->vgic->gicr[1]->virqs[5].vcpu == vm->vcpus[1]);
+    SIM_CHECK(vm->vgic->gicr[0]->tail == 0);
+
+    sim_vm_destroy(vm);
+}
+
+static void test_vgic_inject_one(void)
+{
+    vm_t vm;
+    rt_uint64_t lr, elrsr;
+    rt_uint64_t kick;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+    kick = sim_stats.vcpu_kick;
+
+    vgic_inject(vm->vcpus[0], sim_enable_virq(vm, 27, 0xA0));
+
+    lr = sim_lr_get(0);
+    SIM_CHECK(SIM_LR_VINT(lr) == 27);
+    SIM_CHECK(SIM_LR_STATE(lr) == VIRQ_STATUS_PENDING);
+    SIM_CHECK(GET_LR_PRIO(lr) == 0xA0);
+    SIM_CHECK(bit_get(lr, ICH_LR_GROUP_OFF));
+    SIM_CHECK(GET_LR_RES0(lr) == 0);    /* the lr_list tag never hits hardware */
+
+    GET_GICV3_REG(ICH_ELRSR_EL2, elrsr);
+    SIM_CHECK((elrsr & 0xF) == 0xE);
+    SIM_CHECK(sim_gicr(vm)->tail == 0);
+    SIM_CHECK(sim_stats.vcpu_kick == kick);     /* running vCPU, no wakeup */
+
+    /* injecting a disabled vIRQ leaves the LRs alone */
+    vgic_inject(vm->vcpus[0], vgic_get_virq(vm->vcpus[0], 28));
+    SIM_CHECK(sim_lr_get(1) == 0);
+    SIM_CHECK(sim_gicr(vm)->tail == 0);
+
+    sim_vm_destroy(vm);
+}
+
+static void test_vgic_inject_priority(void)
+{
+    static const rt_uint8_t prio[] = { 0xF0, 0x20, 0x80, 0x10, 0xC0, 0x40 };
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+
+    /* fill the LRs with the lowest priority vIRQs first */
+    for (rt_size_t i = 0; i < sizeof(prio); i++)
+        vgic_inject(vm->vcpus[0], sim_enable_virq(vm, 40 + i, prio[i]));
+
+    /* 4 LRs and 6 pending, the two least urgent ones wait in lr_list */
+    SIM_CHECK(sim_gicr(vm)->tail == 2);
+    for (rt_size_t i = 0; i < sizeof(prio); i++)
+        SIM_CHECK(sim_virq_in_lr(SIM_NR_LR_DEFAULT, 40 + i) == (prio[i] < 0xC0));
+
+    sim_vm_destroy(vm);
+}
+
+/* WFI wakeup: vIRQ for a blocked vCPU is queued, not written to LRs */
+static void test_vgic_halt_wakeup(void)
+{
+    vcpu_t vcpu;
+    rt_uint64_t kick;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+    vcpu = vm->vcpus[0];
+    kick = sim_stats.vcpu_kick;
+
+    SIM_CHECK(!vgic_vcpu_pending(vcpu));
+
+    /* the HCR_EL2 a guest enters with traps WFI to vcpu_halt(), WFE too */
+    SIM_CHECK((HCR_GUEST_FLAGS | HCR_GUEST_XMO_FLAGS) & HCR_TWI);
+    SIM_CHECK((HCR_GUEST_FLAGS | HCR_GUEST_XMO_FLAGS) & HCR_TWE);
+
+    vcpu->halted = RT_TRUE;
+    vgic_inject(vcpu, sim_enable_virq(vm, 27, 0xA0));
+    SIM_CHECK(sim_lr_get(0) == 0);
+    SIM_CHECK(sim_gicr(vm)->tail == 1);
+    SIM_CHECK(!vcpu->halted);
+    SIM_CHECK(sim_stats.vcpu_kick == kick + 1);
+    SIM_CHECK(vgic_vcpu_pending(vcpu));
+
+    /* switched in, the vIRQ moves to an LR and is still pending there */
+    hook_vgic_context_restore(vcpu);
+    SIM_CHECK(SIM_LR_VINT(sim_lr_get(0)) == 27);
+    SIM_CHECK(sim_gicr(vm)->tail == 0);
+    SIM_CHECK(vgic_vcpu_pending(vcpu));
+
+    /* guest acknowledged it: active only, WFI would not end */
+    sim_lr_set(0, (sim_lr_get(0) & ~(3UL << ICH_LR_STAT_OFF))
+                | ((rt_uint64_t)VIRQ_STATUS_ACTIVE << ICH_LR_STAT_OFF));
+    SIM_CHECK(!vgic_vcpu_pending(vcpu));
+
+    /* injected from a host thread: LRs belong to someone else */
+    sim_set_curr_vcpu(RT_NULL);
+    vgic_inject(vcpu, sim_enable_virq(vm, 28, 0xA0));
+    SIM_CHECK(sim_lr_get(1) == 0);
+    SIM_CHECK(sim_gicr(vm)->tail == 1);
+    sim_set_curr_vcpu(vcpu);
+
+    sim_vm_destroy(vm);
+}
+
+static void test_vgic_lr_list_overflow(void)
+{
+    vm_t vm;
+    rt_uint64_t hcr;
+    rt_size_t n = SIM_NR_LR_DEFAULT + GIC_LR_LIST_NUM;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+
+    for (rt_size_t i = 0; i < n; i++)
+        vgic_inject(vm->vcpus[0], sim_enable_virq(vm, 32 + i, 0x80));
+
+    /* every vIRQ is either in a LR or waiting in lr_list, none is dropped */
+    SIM_CHECK(sim_gicr(vm)->tail == GIC_LR_LIST_NUM);
+    for (rt_size_t i = 0; i < SIM_NR_LR_DEFAULT; i++)
+        SIM_CHECK(SIM_LR_STATE(sim_lr_get(i)) == VIRQ_STATUS_PENDING);
+
+    /* no room left, ask for a maintenance interrupt */
+    SET_GICV3_REG(ICH_HCR_EL2, ICH_HCR_EN);
+    vgic_inject(vm->vcpus[0], sim_enable_virq(vm, 32 + n, 0x80));
+    GET_GICV3_REG(ICH_HCR_EL2, hcr);
+    SIM_CHECK(hcr & ICH_HCR_NPIE);
+    SIM_CHECK(sim_gicr(vm)->tail == GIC_LR_LIST_NUM);
+
+    sim_vm_destroy(vm);
+}
+
+static void test_vgic_context_switch(void)
+{
+    vm_t vm;
+    rt_uint64_t lrs[SIM_NR_LR_DEFAULT];
+    rt_uint64_t hcr, elrsr;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+
+    for (rt_size_t i = 0; i < 3; i++)
+        vgic_inject(vm->vcpus[0], sim_enable_virq(vm, 50 + i, 0x80 + i));
+    for (rt_size_t i = 0; i < SIM_NR_LR_DEFAULT; i++)
+        lrs[i] = sim_lr_get(i);
+
+    /* guest -> host: LRs are drained into lr_list */
+    SET_GICV3_REG(ICH_HCR_EL2, ICH_HCR_EN);
+    hook_vgic_context_save(vm->vcpus[0]);
+    GET_GICV3_REG(ICH_ELRSR_EL2, elrsr);
+    SIM_CHECK((elrsr & 0xF) == 0xF);
+    SIM_CHECK(sim_gicr(vm)->tail == 3);
+    SIM_CHECK(vm->vgic->ctxt.ich_hcr_el2 == ICH_HCR_EN);
+
+    /* another VM owns the CPU interface for a while */
+    SET_GICV3_REG(ICH_HCR_EL2, 0);
+    sim_lr_set(3, ((rt_uint64_t)VIRQ_STATUS_PENDING << ICH_LR_STAT_OFF) | 99);
+    sim_lr_set(3, 0);
+
+    /* host -> guest */
+    hook_vgic_context_restore(vm->vcpus[0]);
+    GET_GICV3_REG(ICH_HCR_EL2, hcr);
+    SIM_CHECK(hcr == ICH_HCR_EN);
+    SIM_CHECK(sim_gicr(vm)->tail == 0);
+    for (rt_size_t i = 0; i < 3; i++)
+        SIM_CHECK(sim_virq_in_lr(SIM_NR_LR_DEFAULT, 50 + i));
+    for (rt_size_t i = 0; i < SIM_NR_LR_DEFAULT; i++)
+        SIM_CHECK(SIM_LR_STATE(sim_lr_get(i)) == SIM_LR_STATE(lrs[i]));
+
+    sim_vm_destroy(vm);
+}
+
+static void sim_mmio_write(vm_t vm, rt_bool_t gicd, rt_uint64_t off, rt_uint64_t val)
+{
+    struct rt_hw_exp_stack regs;
+    access_info_t acc;
+
+    rt_memset(&regs, 0, sizeof(regs));
+    regs.x2 = val;
+    acc.srt = 2;
+    acc.is_write = RT_TRUE;
+    acc.addr = (gicd ? vm->vgic->info.gicd_addr : vm->vgic->info.gicr_addr) + off;
+    vgic_emulate(&regs, acc, gicd);
+}
+
+static rt_uint64_t sim_mmio_read(vm_t vm, rt_bool_t gicd, rt_uint64_t off)
+{
+    struct rt_hw_exp_stack regs;
+    access_info_t acc;
+
+    rt_memset(&regs, 0, sizeof(regs));
+    acc.srt = 3;
+    acc.is_write = RT_FALSE;
+    acc.addr = (gicd ? vm->vgic->info.gicd_addr : vm->vgic->info.gicr_addr) + off;
+    vgic_emulate(&regs, acc, gicd);
+    return regs.x3;
+}
+
+static void test_vgic_emulate(void)
+{
+    vm_t vm;
+    virq_t spi, ppi;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    rt_memset(sim_gic_irqs, 0, sizeof(sim_gic_irqs));
+    vm = sim_vm_create(0, 1, 8);
+
+    /* SPI 40 is backed by physical INTID 40, SPI 41 is purely virtual */
+    spi = vgic_get_virq(vm->vcpus[0], 40);
+    spi->hw = RT_TRUE;
+    spi->pINTID = 40;
+
+    sim_mmio_write(vm, RT_TRUE, GICD_ISEN_OFF + 4, (1UL << 8) | (1UL << 9));
+    SIM_CHECK(spi->enable);
+    SIM_CHECK(vgic_get_virq(vm->vcpus[0], 41)->enable);
+    SIM_CHECK(sim_gic_irqs[40].enable);
+    SIM_CHECK(!sim_gic_irqs[41].enable);
+
+    sim_mmio_write(vm, RT_TRUE, GICD_PRIO_OFF + 40, 0x00C0A0UL);
+    SIM_CHECK(spi->prio == 0xA0);
+    SIM_CHECK(vgic_get_virq(vm->vcpus[0], 41)->prio == 0xC0);
+    SIM_CHECK(sim_gic_irqs[40].prio == 0xA0);
+
+    sim_mmio_write(vm, RT_TRUE, GICD_ICEN_OFF + 4, 1UL << 8);
+    SIM_CHECK(!spi->enable);
+    SIM_CHECK(!sim_gic_irqs[40].enable);
+
+    /* redistributor SGI frame */
+    ppi = vgic_get_virq(vm->vcpus[0], 30);
+    sim_mmio_write(vm, RT_FALSE, GICR_SGI_OFF + GICR_ISEN0_OFF, 1UL << 30);
+    SIM_CHECK(ppi->enable);
+    sim_mmio_write(vm, RT_FALSE, GICR_SGI_OFF + GICR_PRIO_OFF + 28, 0xA0UL << 16);
+    SIM_CHECK(ppi->prio == 0xA0);
+
+    SIM_CHECK(sim_mmio_read(vm, RT_TRUE, GICD_TYPE_OFF) == vm->vgic->gicd->TYPE);
+    SIM_CHECK(sim_mmio_read(vm, RT_FALSE, GICR_TYPE_OFF) == vm->vgic->gicr[0]->TYPE);
+
+    sim_vm_destroy(vm);
+}
+
+static int sim_vdev_hits[2];
+
+static void sim_vdev0_mmio(vdev_t vdev, gp_regs_t regs, access_info_t acc) { sim_vdev_hits[0]++; }
+static void sim_vdev1_mmio(vdev_t vdev, gp_regs_t regs, access_info_t acc) { sim_vdev_hits[1]++; }
+
+static const struct vdev_ops sim_vdev_ops[2] =
+{
+    { .mmio = sim_vdev0_mmio },
+    { .mmio = sim_vdev1_mmio },
+};
+
+static rt_bool_t sim_mmio_access(rt_uint64_t addr)
+{
+    struct rt_hw_exp_stack regs;
+    access_info_t acc = { .addr = addr, .srt = 2, .is_write = RT_FALSE };
+
+    rt_memset(&regs, 0, sizeof(regs));
+    return vdev_mmio_dispatch(&regs, acc);
+}
+
+static vm_t sim_mmio_vm;
+
+/* the exit of another CPU leaves the MMIO index */
+static void sim_mmio_exit_done(void)
+{
+    sim_mmio_vm->mmio_readers--;
+}
+
+static void test_vdev_mmio_dispatch(void)
+{
+    struct vdev dev[2];
+    rt_uint64_t yield;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+    rt_memset(dev, 0, sizeof(dev));
+    rt_memset(sim_vdev_hits, 0, sizeof(sim_vdev_hits));
+
+    /* registered in reverse address order, a second region on dev[1] */
+    dev[0].mmap_num = 1;
+    dev[0].region[0].vaddr_start = 0x0A000000;
+    dev[0].region[0].vaddr_end   = 0x0A001000;
+    dev[0].ops = &sim_vdev_ops[0];
+    dev[1].mmap_num = 2;
+    dev[1].region[0].vaddr_start = 0x09000000;
+    dev[1].region[0].vaddr_end   = 0x09001000;
+    dev[1].region[1].vaddr_start = 0x0C000000;
+    dev[1].region[1].vaddr_end   = 0x0C000100;
+    dev[1].ops = &sim_vdev_ops[1];
+    dev[0].is_open = RT_FALSE;      /* closed device ahead in dev_list */
+    dev[1].is_open = RT_TRUE;
+    vdev_register(vm, &dev[1]);
+    vdev_register(vm, &dev[0]);
+
+    SIM_CHECK(vm->mmio_map->num == 4);
+    for (rt_size_t i = 1; i < vm->mmio_map->num; i++)
+        SIM_CHECK(vm->mmio_map->range[i - 1].end <= vm->mmio_map->range[i].start);
+
+    SIM_CHECK(!sim_mmio_access(0x0A000000));     /* closed */
+    SIM_CHECK(sim_mmio_access(0x09000FFC));
+    SIM_CHECK(sim_mmio_access(0x0C000000));      /* second region */
+    SIM_CHECK(!sim_mmio_access(0x0C000100));
+    SIM_CHECK(sim_vdev_hits[1] == 2);
+
+    dev[0].is_open = RT_TRUE;
+    vdev_mmio_rebuild(vm);
+    SIM_CHECK(sim_mmio_access(0x0A000800));
+    SIM_CHECK(vm->mmio_map->last->vdev == &dev[0]);
+    SIM_CHECK(sim_vdev_hits[0] == 1);
+
+    /* vGIC ranges dispatch to the emulator, not to a vdev */
+    SIM_CHECK(sim_mmio_access(vm->vgic->info.gicd_addr + GICD_TYPE_OFF));
+    SIM_CHECK(vm->mmio_map->last->type == VDEV_MMIO_GICD);
+    SIM_CHECK(sim_mmio_access(vm->vgic->info.gicr_addr + GICR_TYPE_OFF));
+    SIM_CHECK(vm->mmio_map->last->type == VDEV_MMIO_GICR);
+    SIM_CHECK(sim_vdev_hits[0] == 1 && sim_vdev_hits[1] == 2);
+
+    /* an exit on another CPU still in the index, the old one waits for it */
+    sim_mmio_vm = vm;
+    vm->mmio_readers = 1;
+    sim_yield_hook = sim_mmio_exit_done;
+    yield = sim_stats.thread_yield;
+    vdev_unregister(&dev[1]);
+    SIM_CHECK(sim_stats.thread_yield == yield + 1 && vm->mmio_readers == 0);
+    SIM_CHECK(!sim_mmio_access(0x09000000));
+    SIM_CHECK(vm->mmio_map->num == 3);
+    SIM_CHECK(vm->mmio_readers == 0);
+
+    vdev_unregister(&dev[0]);
+    sim_vm_destroy(vm);
+}
+
+#define SIM_LOG_MAX     (VDEV_COALESCED_RING_SIZE * 2)
+
+static rt_uint64_t sim_log[SIM_LOG_MAX];
+static rt_size_t sim_log_num;
+
+static void sim_log_mmio(vdev_t vdev, gp_regs_t regs, access_info_t acc)
+{
+    if (acc.is_write && sim_log_num < SIM_LOG_MAX)
+        sim_log[sim_log_num++] = *regs_xn(regs, acc.srt);
+}
+
+static const struct vdev_ops sim_log_ops = { .mmio = sim_log_mmio };
+
+static void sim_mmio_write_x2(rt_uint64_t addr, rt_uint64_t val)
+{
+    struct rt_hw_exp_stack regs;
+    access_info_t acc = { .addr = addr, .srt = 2, .is_write = RT_TRUE };
+
+    rt_memset(&regs, 0, sizeof(regs));
+    regs.x2 = val;
+    vdev_mmio_dispatch(&regs, acc);
+}
+
+static void test_vdev_coalesced(void)
+{
+    rt_uint64_t base = 0x0B000000, wake;
+    struct vdev dev;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+    rt_memset(&dev, 0, sizeof(dev));
+    dev.mmap_num = 1;
+    dev.region[0].vaddr_start = base;
+    dev.region[0].vaddr_end   = base + 0x1000;
+    dev.ops = &sim_log_ops;
+    dev.is_open = RT_TRUE;
+    vdev_register(vm, &dev);
+    SIM_CHECK(vdev_coalesced_register(&dev, base, base + 0x10) == RT_EOK);
+    sim_log_num = 0;
+    wake = sim_stats.sem_release;
+
+    /* zone writes are queued, the worker is woken once */
+    sim_mmio_write_x2(base, 1);
+    sim_mmio_write_x2(base + 4, 2);
+    SIM_CHECK(sim_log_num == 0);
+    SIM_CHECK(vm->coalesced->queued == 2);
+    SIM_CHECK(sim_stats.sem_release == wake + 1);
+
+    /* out of zone write replays the ring first, order kept */
+    sim_mmio_write_x2(base + 0x20, 3);
+    SIM_CHECK(sim_log_num == 3);
+    SIM_CHECK(sim_log[0] == 1 && sim_log[1] == 2 && sim_log[2] == 3);
+    SIM_CHECK(vm->coalesced->sync_flush == 1);
+
+    /* a read with nothing queued costs no replay */
+    sim_mmio_access(base);
+    SIM_CHECK(vm->coalesced->sync_flush == 1);
+
+    /* a full ring is replayed in the exit */
+    for (rt_size_t i = 0; i < VDEV_COALESCED_RING_SIZE + 1; i++)
+        sim_mmio_write_x2(base + 8, 100 + i);
+    SIM_CHECK(sim_log_num == 3 + VDEV_COALESCED_RING_SIZE);
+    SIM_CHECK(vm->coalesced->sync_flush == 2);
+    vdev_coalesced_flush(vm);
+    SIM_CHECK(sim_log_num == 4 + VDEV_COALESCED_RING_SIZE);
+    SIM_CHECK(sim_log[sim_log_num - 1] == 100 + VDEV_COALESCED_RING_SIZE);
+
+    /* unregistering the device drops its zone */
+    vdev_unregister(&dev);
+    SIM_CHECK(vm->coalesced->zone_num == 0);
+
+    sim_vm_destroy(vm);
+}
+
+static void test_vdev_ioevent(void)
+{
+    rt_uint64_t base = 0x0A000000, wake;
+    struct vdev_ioevent ioev[3];
+    struct rt_semaphore sem;
+    struct rt_event event;
+    struct vdev dev;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+    rt_memset(&dev, 0, sizeof(dev));
+    rt_memset(ioev, 0, sizeof(ioev));
+    rt_memset(&event, 0, sizeof(event));
+    dev.mmap_num = 1;
+    dev.region[0].vaddr_start = base;
+    dev.region[0].vaddr_end   = base + 0x1000;
+    dev.ops = &sim_log_ops;
+    dev.is_open = RT_TRUE;
+    vdev_register(vm, &dev);
+    sim_log_num = 0;
+
+    /* queue notify of a virtio-mmio like device: one doorbell per queue */
+    ioev[0].addr = base + 0x50;
+    ioev[0].datamatch = RT_TRUE;
+    ioev[0].data = 1;
+    ioev[0].type = VDEV_IOEVENT_EVENT;
+    ioev[0].obj.ev.event = &event;
+    ioev[0].obj.ev.set = 1 << 1;
+    ioev[1] = ioev[0];
+    ioev[1].data = 0;
+    ioev[1].obj.ev.set = 1 << 0;
+    ioev[2].addr = 0x0F000000;      /* inter-VM doorbell, no device behind */
+    ioev[2].type = VDEV_IOEVENT_SEM;
+    ioev[2].obj.sem = &sem;
+    SIM_CHECK(vdev_ioevent_register(vm, &ioev[0]) == RT_EOK);
+    SIM_CHECK(vdev_ioevent_register(vm, &ioev[2]) == RT_EOK);
+    SIM_CHECK(vdev_ioevent_register(vm, &ioev[1]) == RT_EOK);
+    SIM_CHECK(vdev_ioevent_register(vm, &ioev[1]) == -RT_EBUSY);
+
+    sim_mmio_write_x2(base + 0x50, 1);
+    SIM_CHECK(event.set == (1 << 1) && ioev[0].count == 1 && ioev[1].count == 0);
+    sim_mmio_write_x2(base + 0x50, 0);
+    SIM_CHECK(event.set == 3 && ioev[1].count == 1);
+    SIM_CHECK(sim_log_num == 0);
+
+    /* no match: the device handler gets the write */
+    sim_mmio_write_x2(base + 0x50, 7);
+    SIM_CHECK(sim_log_num == 1 && sim_log[0] == 7);
+
+    wake = sim_stats.sem_release;
+    sim_mmio_write_x2(0x0F000000, 0xDEAD);
+    SIM_CHECK(sim_stats.sem_release == wake + 1 && ioev[2].count == 1);
+
+    /* queued coalesced writes are replayed ahead of the doorbell */
+    vdev_coalesced_register(&dev, base, base + 0x10);
+    sim_mmio_write_x2(base, 5);
+    SIM_CHECK(sim_log_num == 1);
+    sim_mmio_write_x2(base + 0x50, 0);
+    SIM_CHECK(sim_log_num == 2 && sim_log[1] == 5);
+
+    vdev_ioevent_unregister(&ioev[2]);
+    SIM_CHECK(!sim_mmio_access(0x0F000000));
+    vdev_ioevent_unregister(&ioev[0]);
+    vdev_ioevent_unregister(&ioev[1]);
+    SIM_CHECK(rt_list_isempty(&vm->ioevent_list));
+
+    vdev_unregister(&dev);
+    sim_vm_destroy(vm);
+}
+
+#define SIM_UART_IPA    (0x09000000)
+#define SIM_UART_SPI    (32 + 1)
+
+static rt_uint64_t sim_uart_access(rt_uint64_t off, rt_bool_t is_write, rt_uint64_t val)
+{
+    struct rt_hw_exp_stack regs;
+    access_info_t acc = { .addr = SIM_UART_IPA + off, .srt = 3, .is_write = is_write };
+
+    rt_memset(&regs, 0, sizeof(regs));
+    regs.x3 = val;
+    vdev_mmio_dispatch(&regs, acc);
+    return regs.x3;
+}
+
+static int sim_uart_notify;
+
+static void sim_uart_tx_notify(vpl011_t uart) { sim_uart_notify++; }
+
+/* a plain register file, reads return what was written */
+static rt_uint8_t sim_regfile[0x1000];
+
+static void sim_regfile_mmio(vdev_t vdev, gp_regs_t regs, access_info_t acc)
+{
+    rt_uint64_t off = acc.addr - vdev->region[0].vaddr_start;
+    unsigned long long *val = regs_xn(regs, acc.srt);
+
+    if (acc.is_write)
+    {
+        rt_memcpy(&sim_regfile[off], val, acc.size);
+        if (sim_log_num < SIM_LOG_MAX)
+            sim_log[sim_log_num++] = *val;
+    }
+    else
+    {
+        *val = 0;
+        rt_memcpy(val, &sim_regfile[off], acc.size);
+    }
+}
+
+static const struct vdev_ops sim_regfile_ops = { .mmio = sim_regfile_mmio };
+
+static void test_mmio_insn_decode(void)
+{
+    struct mmio_insn d;
+
+    /* ldp x1, x2, [x3, #16] */
+    SIM_CHECK(mmio_insn_decode(0xA9410861, &d) == RT_EOK);
+    SIM_CHECK(d.flags == (MMIO_INSN_PAIR | MMIO_INSN_LOAD | MMIO_INSN_SF));
+    SIM_CHECK(d.size == 8 && d.rt == 1 && d.rt2 == 2 && d.rn == 3 && d.imm == 16);
+
+    /* stp w4, w5, [x6], #8 */
+    SIM_CHECK(mmio_insn_decode(0x288114C4, &d) == RT_EOK);
+    SIM_CHECK(d.flags == (MMIO_INSN_PAIR | MMIO_INSN_WBACK | MMIO_INSN_POST));
+    SIM_CHECK(d.size == 4 && d.imm == 8);
+
+    /* ldrsb x7, [x8, #1]! */
+    SIM_CHECK(mmio_insn_decode(0x38801D07, &d) == RT_EOK);
+    SIM_CHECK(d.flags == (MMIO_INSN_LOAD | MMIO_INSN_SIGN | MMIO_INSN_SF | MMIO_INSN_WBACK));
+    SIM_CHECK(d.size == 1 && d.rt == 7 && d.rn == 8 && d.imm == 1);
+
+    /* ldrsh w9, [x10, x11] */
+    SIM_CHECK(mmio_insn_decode(0x78EB6949, &d) == RT_EOK);
+    SIM_CHECK(d.flags == (MMIO_INSN_LOAD | MMIO_INSN_SIGN) && d.size == 2);
+
+    /* str q0, [x1], ldr d3, [sp, #-8]! */
+    SIM_CHECK(mmio_insn_decode(0x3D800020, &d) == RT_EOK);
+    SIM_CHECK(d.flags == MMIO_INSN_SIMD && d.size == 16);
+    SIM_CHECK(mmio_insn_decode(0xFC5F8FE3, &d) == RT_EOK);
+    SIM_CHECK(d.flags == (MMIO_INSN_SIMD | MMIO_INSN_LOAD | MMIO_INSN_WBACK));
+    SIM_CHECK(d.size == 8 && d.rn == 31 && d.imm == -8);
+
+    /* prfm, ldadd, ldxr */
+    SIM_CHECK(mmio_insn_decode(0xF9800020, &d) != RT_EOK);
+    SIM_CHECK(mmio_insn_decode(0xF8200020, &d) != RT_EOK);
+    SIM_CHECK(mmio_insn_decode(0xC85F7C20, &d) != RT_EOK);
+
+    /* ISV == 1: ldrsh x12, SAS = half, SSE, SF */
+    mmio_insn_from_esr((1 << 24) | (1 << 22) | (1 << 21) | (12 << 16) | (1 << 15), &d);
+    SIM_CHECK(d.flags == (MMIO_INSN_LOAD | MMIO_INSN_SIGN | MMIO_INSN_SF));
+    SIM_CHECK(d.size == 2 && d.rt == 12);
+}
+
+static void test_mmio_insn_emulate(void)
+{
+    rt_uint64_t base = 0x0D000000, val;
+    struct
+    {
+        struct rt_hw_exp_stack regs;
+        rt_uint64_t fpu_hi[16];     /* Q0 ~ Q7 */
+    } f;
+    gp_regs_t regs = &f.regs;
+    rt_uint8_t *q0 = (rt_uint8_t *)regs->fpu + 15 * 16;
+    rt_uint8_t *q3 = (rt_uint8_t *)regs->fpu + 12 * 16;
+    struct mmio_insn d;
+    struct vdev dev;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+    rt_memset(&dev, 0, sizeof(dev));
+    dev.mmap_num = 1;
+    dev.region[0].vaddr_start = base;
+    dev.region[0].vaddr_end   = base + 0x1000;
+    dev.ops = &sim_regfile_ops;
+    dev.is_open = RT_TRUE;
+    vdev_register(vm, &dev);
+    rt_memset(sim_regfile, 0, sizeof(sim_regfile));
+    rt_memset(&f, 0, sizeof(f));
+    sim_log_num = 0;
+
+    /* ldp x1, x2, [x3, #16] faulting on the second element */
+    val = 0x1111222233334444UL;
+    rt_memcpy(&sim_regfile[0x10], &val, 8);
+    val = 0x5555666677778888UL;
+    rt_memcpy(&sim_regfile[0x18], &val, 8);
+    regs->x3 = base;
+    mmio_insn_decode(0xA9410861, &d);
+    SIM_CHECK(mmio_insn_emulate(regs, &d, base + 0x18, base + 0x18) == RT_EOK);
+    SIM_CHECK(regs->x1 == 0x1111222233334444UL && regs->x2 == 0x5555666677778888UL);
+    SIM_CHECK(regs->x3 == base);
+
+    /* a pair may not leave the page of FAR */
+    regs->x3 = base + 0xFF0;
+    SIM_CHECK(mmio_insn_emulate(regs, &d, base + 0xFF8, base + 0xFF8) != RT_EOK);
+
+    /* stp w4, w5, [x6], #8 stores the low words, then moves the base */
+    regs->x4 = 0xAAAA0000FFFFFFFFUL;
+    regs->x5 = 0x12345678;
+    regs->x6 = base + 0x20;
+    mmio_insn_decode(0x288114C4, &d);
+    SIM_CHECK(mmio_insn_emulate(regs, &d, base + 0x20, base + 0x20) == RT_EOK);
+    SIM_CHECK(sim_log_num == 2 && sim_log[0] == 0xFFFFFFFF && sim_log[1] == 0x12345678);
+    SIM_CHECK(regs->x6 == base + 0x28);
+
+    /* ldrsb x7, [x8, #1]! */
+    sim_regfile[0x30] = 0x80;
+    regs->x8 = base + 0x2F;
+    mmio_insn_decode(0x38801D07, &d);
+    SIM_CHECK(mmio_insn_emulate(regs, &d, base + 0x30, base + 0x30) == RT_EOK);
+    SIM_CHECK(regs->x7 == 0xFFFFFFFFFFFFFF80UL && regs->x8 == base + 0x30);
+
+    /* ldrsh w9, [x10, x11] keeps the upper word clear */
+    sim_regfile[0x40] = 0x01;
+    sim_regfile[0x41] = 0x80;
+    regs->x9 = ~0UL;
+    mmio_insn_decode(0x78EB6949, &d);
+    SIM_CHECK(mmio_insn_emulate(regs, &d, base + 0x40, base + 0x40) == RT_EOK);
+    SIM_CHECK(regs->x9 == 0xFFFF8001UL);
+
+    /* str q0, [x1] goes out as two doublewords */
+    for (rt_size_t i = 0; i < 16; i++)
+        q0[i] = i;
+    sim_log_num = 0;
+    mmio_insn_decode(0x3D800020, &d);
+    SIM_CHECK(mmio_insn_emulate(regs, &d, base + 0x60, base + 0x60) == RT_EOK);
+    SIM_CHECK(sim_log_num == 2 && sim_log[0] == 0x0706050403020100UL);
+    SIM_CHECK(rt_memcmp(&sim_regfile[0x60], q0, 16) == 0);
+
+    /* ldr d3, [sp, #-8]! at EL1h clears the upper half of V3 */
+    rt_memset(q3, 0xFF, 16);
+    regs->spsr = 0x3C5;
+    SET_SYS_REG(SP_EL1, base + 0x68);
+    mmio_insn_decode(0xFC5F8FE3, &d);
+    SIM_CHECK(mmio_insn_emulate(regs, &d, base + 0x60, base + 0x60) == RT_EOK);
+    SIM_CHECK(rt_memcmp(q3, q0, 8) == 0 && q3[8] == 0 && q3[15] == 0);
+    GET_SYS_REG(SP_EL1, val);
+    SIM_CHECK(val == base + 0x60);
+
+    /* V16 and above are not saved by the trap frame */
+    mmio_insn_decode(0x3D800020 | 16, &d);
+    SIM_CHECK(mmio_insn_emulate(regs, &d, base + 0x60, base + 0x60) != RT_EOK);
+
+    vdev_unregister(&dev);
+    sim_vm_destroy(vm);
+}
+
+static void test_mmio_insn_cache(void)
+{
+    struct mmio_insn_cache cache;
+    rt_uint32_t text[2] = { 0xA9410861, 0x288114C4 };
+    const struct mmio_insn *hit;
+    struct mmio_insn d;
+
+    rt_memset(&cache, 0, sizeof(cache));
+    SIM_CHECK(mmio_insn_cache_lookup(&cache, 0xFFFF000000081000UL, 0x1000) == RT_NULL);
+
+    mmio_insn_decode(text[0], &d);
+    mmio_insn_cache_fill(&cache, 0xFFFF000000081000UL, 0x1000, (rt_uint64_t)&text[0], text[0], &d);
+    hit = mmio_insn_cache_lookup(&cache, 0xFFFF000000081000UL, 0x1000);
+    SIM_CHECK(hit && hit->rt2 == 2);
+
+    /* another address space or a patched instruction misses */
+    SIM_CHECK(mmio_insn_cache_lookup(&cache, 0xFFFF000000081000UL, 0x2000) == RT_NULL);
+    text[0] = text[1];
+    SIM_CHECK(mmio_insn_cache_lookup(&cache, 0xFFFF000000081000UL, 0x1000) == RT_NULL);
+    SIM_CHECK(cache.hit == 1 && cache.miss == 3);
+}
+
+static void test_vpl011(void)
+{
+    struct vpl011 uart;
+    rt_uint8_t buf[VPL011_FIFO_SIZE];
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+    sim_enable_virq(vm, SIM_UART_SPI, 0xA0);
+    vpl011_init(&uart, SIM_UART_IPA, 0x1000, SIM_UART_SPI);
+    uart.tx_notify = sim_uart_tx_notify;
+    vdev_register(vm, &uart.vdev);
+    sim_uart_notify = 0;
+
+    SIM_CHECK(sim_uart_access(UART_FR, RT_FALSE, 0) == (UART_FR_TXFE | UART_FR_RXFE));
+    SIM_CHECK(sim_uart_access(UART_ID_OFF + 0x10, RT_FALSE, 0) == 0x0D);
+    SIM_CHECK(sim_uart_access(UART_CR, RT_FALSE, 0) == UART_CR_RESET);
+
+    /* a burst fills the FIFO without the host, only the first byte notifies */
+    for (rt_size_t i = 0; i < VPL011_FIFO_SIZE + 1; i++)
+        sim_uart_access(UART_DR, RT_TRUE, 'a' + (i % 26));
+    SIM_CHECK(sim_uart_notify == 1);
+    SIM_CHECK(sim_uart_access(UART_FR, RT_FALSE, 0) == (UART_FR_TXFF | UART_FR_BUSY | UART_FR_RXFE));
+    SIM_CHECK(!(sim_uart_access(UART_RIS, RT_FALSE, 0) & UART_INT_TX));
+
+    SIM_CHECK(vpl011_tx_drain(&uart, buf, sizeof(buf)) == VPL011_FIFO_SIZE);
+    SIM_CHECK(buf[0] == 'a' && buf[VPL011_FIFO_SIZE - 1] == 'a' + (VPL011_FIFO_SIZE - 1) % 26);
+    SIM_CHECK(sim_uart_access(UART_RIS, RT_FALSE, 0) & UART_INT_TX);
+
+    /* RX vIRQ only while unmasked data is there, on the rising edge */
+    vpl011_rx_push(&uart, (const rt_uint8_t *)"x", 1);
+    SIM_CHECK(!sim_virq_in_lr(SIM_NR_LR_DEFAULT, SIM_UART_SPI));
+    sim_uart_access(UART_IMSC, RT_TRUE, UART_INT_RX | UART_INT_RT);
+    SIM_CHECK(sim_virq_in_lr(SIM_NR_LR_DEFAULT, SIM_UART_SPI));
+    SIM_CHECK(sim_uart_access(UART_MIS, RT_FALSE, 0) == (UART_INT_RX | UART_INT_RT));
+    SIM_CHECK(sim_uart_access(UART_DR, RT_FALSE, 0) == 'x');
+    SIM_CHECK(sim_uart_access(UART_MIS, RT_FALSE, 0) == 0);
+    SIM_CHECK(!uart.irq_line);
+
+    /* ICR cannot clear a level still true */
+    vpl011_rx_push(&uart, (const rt_uint8_t *)"yz", 2);
+    sim_uart_access(UART_ICR, RT_TRUE, UART_INT_ALL);
+    SIM_CHECK(sim_uart_access(UART_MIS, RT_FALSE, 0) & UART_INT_RX);
+    SIM_CHECK(vpl011_rx_space(&uart) == VPL011_FIFO_SIZE - 2);
+
+    /* coalesced output: DR writes queue, polling FR replays them first */
+    vpl011_tx_drain(&uart, buf, sizeof(buf));
+    sim_uart_notify = 0;
+    SIM_CHECK(vpl011_coalesce_tx(&uart) == RT_EOK);
+    sim_uart_access(UART_DR, RT_TRUE, 'o');
+    sim_uart_access(UART_DR, RT_TRUE, 'k');
+    SIM_CHECK(vm->coalesced->queued == 2 && sim_uart_notify == 0);
+    SIM_CHECK(vpl011_tx_drain(&uart, buf, sizeof(buf)) == 0);
+    SIM_CHECK(sim_uart_access(UART_FR, RT_FALSE, 0) == UART_FR_BUSY);
+    SIM_CHECK(vm->coalesced->sync_flush == 1 && sim_uart_notify == 1);
+    SIM_CHECK(vpl011_tx_drain(&uart, buf, sizeof(buf)) == 2 && buf[0] == 'o' && buf[1] == 'k');
+
+    /* a write to another register is emulated at once, after the queue */
+    sim_uart_access(UART_DR, RT_TRUE, '!');
+    sim_uart_access(UART_IMSC, RT_TRUE, 0);
+    SIM_CHECK(vm->coalesced->sync_flush == 2);
+    SIM_CHECK(vpl011_tx_drain(&uart, buf, sizeof(buf)) == 1 && buf[0] == '!');
+
+    vdev_unregister(&uart.vdev);
+    SIM_CHECK(vm->coalesced->zone_num == 0);
+    sim_vm_destroy(vm);
+}
+
+static void test_s2_map_block(void)
+{
+    vm_t vm;
+    struct mem_desc desc;
+    rt_ubase_t pa;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK);
+
+    desc.vaddr_start = 0x40000000;
+    desc.vaddr_end   = 0x40800000;
+    desc.paddr_start = 0x80000000;
+    desc.attr = S2_BLOCK_NORMAL;
+    SIM_CHECK(s2_map(vm->mm, &desc) == RT_EOK);
+
+    SIM_CHECK(s2_translate(vm->mm, 0x40000000, &pa) == RT_EOK && pa == 0x80000000);
+    SIM_CHECK(s2_translate(vm->mm, 0x40234567, &pa) == RT_EOK && pa == 0x80234567);
+    SIM_CHECK(s2_translate(vm->mm, 0x407FFFFF, &pa) == RT_EOK && pa == 0x807FFFFF);
+
+    /* a 1GB aligned region is mapped with a single level 1 block */
+    desc.vaddr_start = 0x80000000;
+    desc.vaddr_end   = 0xC0000000;
+    desc.paddr_start = 0x100000000;
+    desc.attr = S2_BLOCK_NORMAL;
+    SIM_CHECK(s2_map(vm->mm, &desc) == RT_EOK);
+    SIM_CHECK((*S2_PUD_OFFSET((rt_uint64_t)vm->mm->pgd_tbl & TABLE_ADDR_MASK, 0x80000000)
+               & MMU_TYPE_MASK) == MMU_TYPE_BLOCK);
+
+    sim_vm_free_memory(vm);
+    sim_vm_destroy(vm);
+}
+
+/* level 3 entry of @ipa, 0 if it is not mapped by a page */
+static rt_uint64_t sim_walk_pte(struct mm_struct *mm, rt_uint64_t ipa)
+{
+    pud_t *pud = S2_PUD_OFFSET((rt_uint64_t)mm->pgd_tbl & TABLE_ADDR_MASK, ipa);
+    if ((*pud & MMU_TYPE_MASK) != MMU_TYPE_TABLE)
+        return 0;
+
+    pmd_t *pmd = S2_PMD_OFFSET(*pud & TABLE_ADDR_MASK, ipa);
+    if ((*pmd & MMU_TYPE_MASK) != MMU_TYPE_TABLE)
+        return 0;
+
+    return *S2_PTE_OFFSET(*pmd & TABLE_ADDR_MASK, ipa);
+}
+
+static void test_s2_map_page(void)
+{
+    vm_t vm;
+    struct mem_desc desc;
+    rt_uint64_t pte;
+    rt_ubase_t pa;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(1, 1, 8);
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK);
+
+    desc.vaddr_start = 0x09000000;
+    desc.vaddr_end   = 0x09200000;
+    desc.paddr_start = 0x09000000;
+    desc.attr = S2_PAGE_DEVICE;
+    SIM_CHECK(s2_map(vm->mm, &desc) == RT_EOK);
+
+    pte = sim_walk_pte(vm->mm, 0x09000000);
+    SIM_CHECK((pte & S2_VA_MASK) == 0x09000000);
+    SIM_CHECK((pte & MMU_TYPE_MASK) == MMU_TYPE_PAGE);
+    pte = sim_walk_pte(vm->mm, 0x091FF000);
+    SIM_CHECK((pte & S2_VA_MASK) == 0x091FF000);
+    SIM_CHECK(sim_walk_pte(vm->mm, 0x09200000) == 0);
+
+    SIM_CHECK(s2_translate(vm->mm, 0x091FF123, &pa) == RT_EOK && pa == 0x091FF123);
+    SIM_CHECK(s2_translate(vm->mm, 0x09200000, &pa) != RT_EOK);
+
+    sim_vm_free_memory(vm);
+    sim_vm_destroy(vm);
+}
+
+static void test_s2_unmap(void)
+{
+    vm_t vm;
+    struct mem_desc desc;
+    rt_uint64_t base = 0x80000000, flush;
+    rt_ubase_t pa;
+    rt_size_t size;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(1, 1, 8);
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK);
+    desc.vaddr_start = base;
+    desc.vaddr_end   = base + 4 * S2_PMD_SIZE;
+    desc.paddr_start = 0x100000000;
+    desc.attr = S2_BLOCK_NORMAL;
+    SIM_CHECK(s2_map(vm->mm, &desc) == RT_EOK);
+
+    /* a whole block, one TLBI */
+    flush = sim_stats.tlb_flush_range;
+    SIM_CHECK(s2_unmap(vm->mm, base + S2_PMD_SIZE, base + 2 * S2_PMD_SIZE) == RT_EOK);
+    SIM_CHECK(sim_stats.tlb_flush_range == flush + 1);
+    SIM_CHECK(s2_translate(vm->mm, base + S2_PMD_SIZE, &pa) != RT_EOK);
+    SIM_CHECK(s2_translate(vm->mm, base + 2 * S2_PMD_SIZE, &pa) == RT_EOK);
+    SIM_CHECK(s2_walk(vm->mm, base, &size) && size == S2_PMD_SIZE);
+
+    /* a page of a block, the rest stays mapped as pages */
+    SIM_CHECK(s2_unmap(vm->mm, base + 0x5000, base + 0x6000) == RT_EOK);
+    SIM_CHECK(s2_translate(vm->mm, base + 0x5000, &pa) != RT_EOK);
+    SIM_CHECK(s2_translate(vm->mm, base + 0x6010, &pa) == RT_EOK && pa == 0x100006010);
+    SIM_CHECK(sim_walk_pte(vm->mm, base + 0x4000) != 0);
+
+    /* too many leaves flush the VM, an empty table is released */
+    flush = sim_stats.tlb_flush;
+    SIM_CHECK(s2_unmap(vm->mm, base, base + S2_PMD_SIZE) == RT_EOK);
+    SIM_CHECK(sim_stats.tlb_flush == flush + 1);
+    SIM_CHECK(s2_walk(vm->mm, base, &size) == RT_NULL && size == S2_PMD_SIZE);
+
+    /* a hole needs no flush, the tables under the last blocks go too */
+    flush = sim_stats.tlb_flush_range;
+    SIM_CHECK(s2_unmap(vm->mm, base, base + S2_PMD_SIZE) == RT_EOK);
+    SIM_CHECK(sim_stats.tlb_flush_range == flush);
+    SIM_CHECK(s2_unmap(vm->mm, base, base + 4 * S2_PMD_SIZE) == RT_EOK);
+    SIM_CHECK(s2_walk(vm->mm, base, &size) == RT_NULL && size == S2_PUD_SIZE);
+
+    /* tables released can be mapped again */
+    desc.vaddr_start = base;
+    desc.vaddr_end   = base + 0x2000;
+    desc.paddr_start = 0x100000000;
+    desc.attr = S2_PAGE_NORMAL;
+    SIM_CHECK(s2_map(vm->mm, &desc) == RT_EOK);
+    SIM_CHECK(s2_translate(vm->mm, base + 0x1000, &pa) == RT_EOK && pa == 0x100001000);
+
+    sim_vm_free_memory(vm);
+    sim_vm_destroy(vm);
+}
+
+static void test_vm_memory_init(void)
+{
+    vm_t vm;
+    vm_area_t vma;
+    mem_block_t *mb;
+    rt_ubase_t pa;
+    rt_uint64_t ipa;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(2, 1, 16);
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK);
+
+    vma = rt_list_entry(vm->mm->vm_area_used.next, struct vm_area, node);
+    SIM_CHECK(vma->desc.vaddr_start == 0x40000000);
+    SIM_CHECK(vma->desc.vaddr_end == 0x40000000 + BYTE(16UL));
+    SIM_CHECK(vm_memory_init(vm->mm) == RT_EOK);
+    SIM_CHECK(vm->mm->mem_used == BYTE(16UL));
+
+    /* RAM is mapped 2MB by 2MB following the mem_block list */
+    ipa = vma->desc.vaddr_start;
+    for (mb = vma->mb_head; mb; mb = mb->next, ipa += MEM_BLOCK_SIZE)
+    {
+        SIM_CHECK(s2_translate(vm->mm, ipa + 0x1234, &pa) == RT_EOK);
+        SIM_CHECK(pa == (rt_ubase_t)mb->ptr + 0x1234);
+    }
+    SIM_CHECK(ipa == vma->desc.vaddr_end);
+
+    sim_vm_free_memory(vm);
+    sim_vm_destroy(vm);
+    sim_arena_reset();
+}
+
+static rt_uint64_t sim_s2_ap(struct mm_struct *mm, rt_uint64_t ipa, rt_size_t *size)
+{
+    rt_uint64_t *entry = s2_walk(mm, ipa, size);
+    return entry ? (*entry & S2_AP_MASK) : 0;
+}
+
+static void test_dirty_log(void)
+{
+    rt_ubase_t bitmap[VM_DIRTY_WORDS(BYTE(64UL))];
+    rt_size_t words = VM_DIRTY_WORDS(MEM_BLOCK_SIZE);
+    rt_size_t size, nr;
+    rt_ubase_t pa, pa_block;
+    rt_uint64_t ram = 0x40000000, ipa;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(2, 1, 64);
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK);
+    SIM_CHECK(vm_memory_init(vm->mm) == RT_EOK);
+    SIM_CHECK(s2_translate(vm->mm, ram + MEM_BLOCK_SIZE, &pa_block) == RT_EOK);
+
+    /* not logging, a permission fault is someone else's */
+    SIM_CHECK(vm_dirty_log_fault(vm->mm, ram) != RT_EOK);
+
+    SIM_CHECK(vm_dirty_log_start(vm->mm) == RT_EOK);
+    SIM_CHECK(sim_s2_ap(vm->mm, ram, &size) == S2_AP_RO && size == S2_PMD_SIZE);
+    SIM_CHECK(sim_s2_ap(vm->mm, ram + BYTE(64UL) - 1, &size) == S2_AP_RO);
+
+    /* first write splits the block, only its page turns writable */
+    ipa = ram + MEM_BLOCK_SIZE + 0x1008;
+    SIM_CHECK(vm_dirty_log_fault(vm->mm, ipa) == RT_EOK);
+    SIM_CHECK(sim_s2_ap(vm->mm, ipa, &size) == S2_AP_RW && size == S2_PTE_SIZE);
+    SIM_CHECK(sim_s2_ap(vm->mm, ipa + S2_PTE_SIZE, &size) == S2_AP_RO && size == S2_PTE_SIZE);
+    SIM_CHECK(sim_s2_ap(vm->mm, ram, &size) == S2_AP_RO && size == S2_PMD_SIZE);
+    SIM_CHECK(s2_translate(vm->mm, ipa, &pa) == RT_EOK && pa == pa_block + 0x1008);
+    SIM_CHECK(s2_translate(vm->mm, ram + 2 * MEM_BLOCK_SIZE - 1, &pa) == RT_EOK
+              && pa == pa_block + MEM_BLOCK_SIZE - 1);
+
+    /* a sibling vCPU raced us, nothing more to do */
+    SIM_CHECK(vm_dirty_log_fault(vm->mm, ipa) == RT_EOK);
+    SIM_CHECK(vm_dirty_log_fault(vm->mm, 0x09000000) != RT_EOK);
+
+    SIM_CHECK(vm_dirty_log_get(vm->mm, ram + 1, MEM_BLOCK_SIZE, bitmap) == -RT_EINVAL);
+    SIM_CHECK(vm_dirty_log_get(vm->mm, ram, BYTE(66UL), bitmap) == -RT_EINVAL);
+    SIM_CHECK(vm_dirty_log_get(vm->mm, ram, BYTE(64UL), bitmap) == RT_EOK);
+    nr = 0;
+    for (rt_size_t i = 0; i < VM_DIRTY_WORDS(BYTE(64UL)); i++)
+        nr += __builtin_popcountl(bitmap[i]);
+    SIM_CHECK(nr == 1);
+    SIM_CHECK(bitmap[words + 1 / VM_DIRTY_WORD_BITS] & (1UL << 1));
+    SIM_CHECK(sim_s2_ap(vm->mm, ipa, &size) == S2_AP_RO);
+
+    /* harvested, the log starts over */
+    SIM_CHECK(vm_dirty_log_get(vm->mm, ram + MEM_BLOCK_SIZE, MEM_BLOCK_SIZE, bitmap) == RT_EOK);
+    SIM_CHECK(bitmap[0] == 0 && bitmap[words - 1] == 0);
+
+    /* once page tables run out, whole blocks are logged */
+    for (ipa = ram; ipa < ram + BYTE(64UL); ipa += MEM_BLOCK_SIZE)
+        SIM_CHECK(vm_dirty_log_fault(vm->mm, ipa) == RT_EOK);
+    ipa = ram + BYTE(64UL) - MEM_BLOCK_SIZE;
+    SIM_CHECK(sim_s2_ap(vm->mm, ipa, &size) == S2_AP_RW && size == S2_PMD_SIZE);
+    SIM_CHECK(sim_s2_ap(vm->mm, ram, &size) == S2_AP_RW && size == S2_PTE_SIZE);
+    SIM_CHECK(vm_dirty_log_get(vm->mm, ipa, MEM_BLOCK_SIZE, bitmap) == RT_EOK);
+    SIM_CHECK(bitmap[0] == ~0UL && bitmap[words - 1] == ~0UL);
+    SIM_CHECK(sim_s2_ap(vm->mm, ipa, &size) == S2_AP_RO && size == S2_PMD_SIZE);
+
+    /* stop merges the pages back into writable blocks, tables are free again */
+    vm_dirty_log_stop(vm->mm);
+    for (ipa = ram; ipa < ram + BYTE(64UL); ipa += MEM_BLOCK_SIZE)
+        SIM_CHECK(sim_s2_ap(vm->mm, ipa, &size) == S2_AP_RW && size == S2_PMD_SIZE);
+    SIM_CHECK(s2_translate(vm->mm, ram + MEM_BLOCK_SIZE + 0x1008, &pa) == RT_EOK
+              && pa == pa_block + 0x1008);
+    SIM_CHECK(vm_dirty_log_get(vm->mm, ram, MEM_BLOCK_SIZE, bitmap) == -RT_ERROR);
+
+    SIM_CHECK(vm_dirty_log_start(vm->mm) == RT_EOK);
+    ipa = ram + BYTE(64UL) - S2_PTE_SIZE;
+    SIM_CHECK(vm_dirty_log_fault(vm->mm, ipa) == RT_EOK);
+    SIM_CHECK(sim_s2_ap(vm->mm, ipa, &size) == S2_AP_RW && size == S2_PTE_SIZE);
+    vm_dirty_log_stop(vm->mm);
+
+    sim_vm_free_memory(vm);
+    sim_vm_destroy(vm);
+    sim_arena_reset();
+}
+
+static rt_uint64_t sim_hvc_add(rt_uint32_t fn, rt_uint64_t arg0,
+                               rt_uint64_t arg1, rt_uint64_t arg2)
+{
+    return arg0 + arg1 + arg2;
+}
+
+static void test_hvc_dispatch(void)
+{
+    struct rt_hw_exp_stack regs;
+    rt_uint64_t count;
+
+    SIM_CHECK(hvc_call(SMCCC_VERSION_FN, 0, 0, 0) == SMCCC_VERSION_1_1);
+    SIM_CHECK(hvc_call(HVC_FN64_GET_VERSION, 0, 0, 0) == HVC_HYP_VERSION);
+    SIM_CHECK(hvc_call(SMCCC_ARCH_FEATURES_FN, HVC_FN64_MULTICALL, 0, 0) == SMCCC_RET_SUCCESS);
+    SIM_CHECK(hvc_call(SMCCC_ARCH_FEATURES_FN, HVC_FN64_CREATE_VM, 0, 0) == SMCCC_RET_NOT_SUPPORTED);
+    SIM_CHECK(hvc_call(HVC_FN64_CREATE_VM, 0, 0, 0) == SMCCC_RET_NOT_SUPPORTED);
+    SIM_CHECK(hvc_call(0x84000000, 0, 0, 0) == SMCCC_RET_NOT_SUPPORTED);    /* PSCI */
+    SIM_CHECK(hvc_call(HVC_FN64(1) & ~0x80000000U, 0, 0, 0) == SMCCC_RET_NOT_SUPPORTED);
+
+    count = hvc_call(HVC_VENDOR_CALL_COUNT, 0, 0, 0);
+    SIM_CHECK(hvc_register(HVC_FN64(20), sim_hvc_add) == RT_EOK);
+    SIM_CHECK(hvc_register(HVC_FN64(20), sim_hvc_add) == -RT_EBUSY);
+    SIM_CHECK(hvc_register(HVC_FN64(HVC_FN64_NR), sim_hvc_add) == -RT_EINVAL);
+    SIM_CHECK(hvc_call(HVC_VENDOR_CALL_COUNT, 0, 0, 0) == count + 1);
+
+    rt_memset(&regs, 0, sizeof(regs));
+    regs.x0 = HVC_FN64(20);
+    regs.x1 = 1;
+    regs.x2 = 2;
+    regs.x3 = 3;
+    hvc_dispatch(&regs);
+    SIM_CHECK(regs.x0 == 6);
+
+    regs.x0 = HVC_VENDOR_REVISION;
+    hvc_dispatch(&regs);
+    SIM_CHECK(regs.x0 == HVC_HYP_VERSION_MAJOR && regs.x1 == HVC_HYP_VERSION_MINOR);
+
+    hvc_register(HVC_FN64(20), RT_NULL);
+}
+
+static void test_hvc_multicall(void)
+{
+    struct rt_hw_exp_stack regs;
+    struct hvc_multicall *mc;
+    vm_t vm;
+    rt_ubase_t pa;
+    rt_uint64_t ipa = 0x40000000 + MEM_BLOCK_SIZE - 2 * sizeof(*mc);
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(3, 1, 4);
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK);
+    SIM_CHECK(vm_memory_init(vm->mm) == RT_EOK);
+    SIM_CHECK(hvc_register(HVC_FN64(20), sim_hvc_add) == RT_EOK);
+
+    /* the array crosses a 2M mem_block, which are not contiguous in host */
+    for (rt_size_t i = 0; i < 4; i++)
+    {
+        SIM_CHECK(s2_translate(vm->mm, ipa + i * sizeof(*mc), &pa) == RT_EOK);
+        mc = (struct hvc_multicall *)pa;
+        rt_memset(mc, 0, sizeof(*mc));
+        mc->fn = HVC_FN64(20);
+        mc->args[0] = i;
+        mc->args[1] = 100;
+        mc->ret = -100;
+    }
+    SIM_CHECK(s2_translate(vm->mm, ipa + 2 * sizeof(*mc), &pa) == RT_EOK);
+    ((struct hvc_multicall *)pa)->fn = HVC_FN64_MULTICALL;
+    SIM_CHECK(s2_translate(vm->mm, ipa + 3 * sizeof(*mc), &pa) == RT_EOK);
+    ((struct hvc_multicall *)pa)->fn = SMCCC_VERSION_FN;
+
+    rt_memset(&regs, 0, sizeof(regs));
+    regs.x0 = HVC_FN64_MULTICALL;
+    regs.x1 = ipa;
+    regs.x2 = 4;
+    hvc_dispatch(&regs);
+    SIM_CHECK(regs.x0 == 4);
+
+    s2_translate(vm->mm, ipa, &pa);
+    SIM_CHECK(((struct hvc_multicall *)pa)->ret == 100);
+    s2_translate(vm->mm, ipa + sizeof(*mc), &pa);
+    SIM_CHECK(((struct hvc_multicall *)pa)->ret == 101);
+    s2_translate(vm->mm, ipa + 2 * sizeof(*mc), &pa);
+    SIM_CHECK(((struct hvc_multicall *)pa)->ret == SMCCC_RET_INVALID_PARAMETER);
+    s2_translate(vm->mm, ipa + 3 * sizeof(*mc), &pa);
+    SIM_CHECK(((struct hvc_multicall *)pa)->ret == SMCCC_VERSION_1_1);
+
+    /* outside guest RAM, misaligned, too many */
+    SIM_CHECK(hvc_call(HVC_FN64_MULTICALL, 0x09000000, 1, 0) == SMCCC_RET_INVALID_PARAMETER);
+    SIM_CHECK(hvc_call(HVC_FN64_MULTICALL, 0x40000000 + BYTE(4UL) - sizeof(*mc), 2, 0)
+              == SMCCC_RET_INVALID_PARAMETER);
+    SIM_CHECK(hvc_call(HVC_FN64_MULTICALL, ipa + 8, 1, 0) == SMCCC_RET_INVALID_PARAMETER);
+    SIM_CHECK(hvc_call(HVC_FN64_MULTICALL, ipa, HVC_MULTICALL_MAX + 1, 0)
+              == SMCCC_RET_INVALID_PARAMETER);
+
+    /* an entry balloons out the block of the entries after it, then its own */
+    for (rt_size_t i = 0; i < 3; i++)
+    {
+        SIM_CHECK(s2_translate(vm->mm, ipa + i * sizeof(*mc), &pa) == RT_EOK);
+        mc = (struct hvc_multicall *)pa;
+        mc->fn = i ? HVC_FN64(20) : HVC_FN64_BALLOON_INFLATE;
+        mc->args[0] = i ? i : 0x40000000 + MEM_BLOCK_SIZE;
+        mc->args[1] = i ? 100 : MEM_BLOCK_SIZE;
+        mc->ret = -100;
+    }
+    SIM_CHECK(hvc_call(HVC_FN64_MULTICALL, ipa, 3, 0) == 2);
+    SIM_CHECK(vm->mm->balloon == MEM_BLOCK_SIZE);
+    s2_translate(vm->mm, ipa, &pa);
+    SIM_CHECK(((struct hvc_multicall *)pa)->ret == SMCCC_RET_SUCCESS);
+    s2_translate(vm->mm, ipa + sizeof(*mc), &pa);
+    SIM_CHECK(((struct hvc_multicall *)pa)->ret == 101);
+    SIM_CHECK(s2_translate(vm->mm, ipa + 2 * sizeof(*mc), &pa) != RT_EOK);
+
+    SIM_CHECK(hvc_call(HVC_FN64_BALLOON_DEFLATE, 0x40000000 + MEM_BLOCK_SIZE, MEM_BLOCK_SIZE, 0)
+              == SMCCC_RET_SUCCESS);
+    ipa = 0x40000000 + MEM_BLOCK_SIZE;
+    for (rt_size_t i = 0; i < 2; i++)
+    {
+        SIM_CHECK(s2_translate(vm->mm, ipa + i * sizeof(*mc), &pa) == RT_EOK);
+        mc = (struct hvc_multicall *)pa;
+        mc->fn = i ? HVC_FN64(20) : HVC_FN64_BALLOON_INFLATE;
+        mc->args[0] = i ? i : ipa;
+        mc->args[1] = i ? 100 : MEM_BLOCK_SIZE;
+    }
+    SIM_CHECK(hvc_call(HVC_FN64_MULTICALL, ipa, 2, 0) == 1);
+    SIM_CHECK(vm->mm->balloon == MEM_BLOCK_SIZE);
+
+    hvc_register(HVC_FN64(20), RT_NULL);
+    sim_vm_free_memory(vm);
+    sim_vm_destroy(vm);
+    sim_arena_reset();
+}
+
+static void sim_fdt_prop_u64s(struct hyp_fdt_wr *wr, const char *name,
+                        const rt_uint64_t *val, int num)
+{
+    rt_uint32_t cell[8];
+
+    for (int i = 0; i < num; i++)
+    {
+        cell[i * 2] = cpu_to_fdt32(val[i] >> 32);
+        cell[i * 2 + 1] = cpu_to_fdt32(val[i]);
+    }
+    hyp_fdt_wr_prop(wr, name, cell, num * 8);
+}
+
+/* /hypervisor with a 2-vCPU Linux VM, a VM without memory and a non-VM node */
+static int sim_fdt_partitions(void *buf, rt_size_t size)
+{
+    static struct hyp_fdt_wr wr;
+    rt_uint32_t irq[2] = { cpu_to_fdt32(33), cpu_to_fdt32(40) };
+
+    hyp_fdt_wr_init(&wr, buf, size);
+    hyp_fdt_wr_begin_node(&wr, "");
+    hyp_fdt_wr_begin_node(&wr, "hypervisor");
+    hyp_fdt_wr_prop_str(&wr, "compatible", "rt-thread,hypervisor");
+
+    hyp_fdt_wr_begin_node(&wr, "vm@0");
+    hyp_fdt_wr_prop_str(&wr, "compatible", "rt-thread,vm");
+    hyp_fdt_wr_prop_str(&wr, "os-type", "linux");
+    sim_fdt_prop_u64s(&wr, "image", (rt_uint64_t[]) { 0x45000000, 0x29cd0 }, 2);
+    sim_fdt_prop_u64s(&wr, "entry", (rt_uint64_t[]) { 0x40080000 }, 1);
+    sim_fdt_prop_u64s(&wr, "cpus", (rt_uint64_t[]) { 0x0, 0x1 }, 2);
+    sim_fdt_prop_u64s(&wr, "memory", (rt_uint64_t[]) { 0x40000000, 0x800000, 0x50000000, 0x100000 }, 4);
+    hyp_fdt_wr_prop(&wr, "memory-attrs", "wb,exec\0shared,nc", 18);
+    sim_fdt_prop_u64s(&wr, "vgic", (rt_uint64_t[]) { 0x8000000, 0x80a0000 }, 2);
+    hyp_fdt_wr_prop_u32(&wr, "vgic-virqs", 64);
+    hyp_fdt_wr_prop(&wr, "cache-colors", (rt_uint32_t[]) { cpu_to_fdt32(0xF0), 0 }, 8);
+    hyp_fdt_wr_prop_u32(&wr, "memory-limit", 64);
+    hyp_fdt_wr_begin_node(&wr, "uart@9000000");
+    hyp_fdt_wr_prop(&wr, "compatible", "arm,pl011\0arm,primecell", 24);
+    sim_fdt_prop_u64s(&wr, "reg", (rt_uint64_t[]) { 0x9000000, 0x1000 }, 2);
+    sim_fdt_prop_u64s(&wr, "virt-reg", (rt_uint64_t[]) { 0x9100000 }, 1);
+    hyp_fdt_wr_prop(&wr, "interrupts", irq, sizeof(irq));
+    hyp_fdt_wr_end_node(&wr);
+    hyp_fdt_wr_end_node(&wr);
+
+    hyp_fdt_wr_begin_node(&wr, "vm@1");
+    hyp_fdt_wr_prop_str(&wr, "compatible", "rt-thread,vm");
+    sim_fdt_prop_u64s(&wr, "image", (rt_uint64_t[]) { 0x46000000, 0x1000 }, 2);
+    sim_fdt_prop_u64s(&wr, "cpus", (rt_uint64_t[]) { 0x0 }, 1);
+    hyp_fdt_wr_end_node(&wr);
+
+    hyp_fdt_wr_begin_node(&wr, "vm@2");
+    hyp_fdt_wr_prop_str(&wr, "compatible", "rt-thread,vm");
+    hyp_fdt_wr_prop_str(&wr, "os-type", "zephyr");
+    sim_fdt_prop_u64s(&wr, "image", (rt_uint64_t[]) { 0x47000000, 0x1000 }, 2);
+    sim_fdt_prop_u64s(&wr, "cpus", (rt_uint64_t[]) { 0x100 }, 1);
+    sim_fdt_prop_u64s(&wr, "memory", (rt_uint64_t[]) { 0x80000000, 0x200000 }, 2);
+    sim_fdt_prop_u64s(&wr, "dtb", (rt_uint64_t[]) { 0x80100000 }, 1);
+    sim_fdt_prop_u64s(&wr, "vgic", (rt_uint64_t[]) { 0x8000000, 0x80a0000 }, 2);
+    hyp_fdt_wr_end_node(&wr);
+
+    hyp_fdt_wr_begin_node(&wr, "shmem@0");
+    hyp_fdt_wr_prop_str(&wr, "compatible", "rt-thread,shmem");
+    hyp_fdt_wr_end_node(&wr);
+
+    hyp_fdt_wr_end_node(&wr);
+    hyp_fdt_wr_end_node(&wr);
+    return hyp_fdt_wr_finish(&wr);
+}
+
+static void test_fdt_parse_vms(void)
+{
+    static rt_uint8_t blob[4096];
+    struct os_desc os[MAX_OS_NUM];
+    int num;
+
+    SIM_CHECK(sim_fdt_partitions(blob, sizeof(blob)) > 0);
+    SIM_CHECK(hyp_fdt_check(blob) == RT_EOK);
+    SIM_CHECK(sim_fdt_partitions(blob, 128) < 0);
+
+    SIM_CHECK(sim_fdt_partitions(blob, sizeof(blob)) > 0);
+    num = hyp_fdt_parse_vms(blob, os, MAX_OS_NUM);
+    SIM_CHECK(num == 2);    /* vm@1 has no memory */
+
+    SIM_CHECK(os[0].img.type == OS_TYPE_LINUX);
+    SIM_CHECK(os[0].img.addr == 0x45000000 && os[0].img.size == 0x29cd0);
+    SIM_CHECK(os[0].img.ep == 0x40080000);
+    SIM_CHECK(os[0].img.dtb == 0x40800000 - HYP_FDT_GUEST_SIZE);
+    SIM_CHECK(os[0].mem.num == 2 && os[1].mem.num == 1);
+    SIM_CHECK(os[0].mem.region[0].addr == 0x40000000 && os[0].mem.region[0].size == 8);
+    SIM_CHECK(os[0].mem.region[0].flag == (VM_NORMAL_WB | VM_RWX));
+    SIM_CHECK(os[0].mem.region[1].addr == 0x50000000 && os[0].mem.region[1].size == 1);
+    SIM_CHECK(os[0].mem.region[1].flag == (VM_NORMAL_NC | VM_RW | VM_SHARED));
+    SIM_CHECK(os[0].mem.region[0].colors == 0xF0 && os[0].mem.region[1].colors == 0);
+    SIM_CHECK(os[1].mem.region[0].flag == 0 && os[1].mem.region[0].colors == 0);
+    SIM_CHECK(os[0].mem.limit == 64 && os[1].mem.limit == 0);
+    SIM_CHECK(os[0].cpu.num == 2 && os[0].cpu.affinity[1] == 1);
+    SIM_CHECK(os[0].arch.vgic.gicd_addr == 0x8000000);
+    SIM_CHECK(os[0].arch.vgic.gicr_addr == 0x80a0000);
+    SIM_CHECK(os[0].arch.vgic.maintenance_id == 25);
+    SIM_CHECK(os[0].arch.vgic.virq_num == 64);
+    SIM_CHECK(os[0].devs.num == 1);
+    SIM_CHECK(os[0].devs.dev[0].paddr == 0x9000000 && os[0].devs.dev[0].size == 0x1000);
+    SIM_CHECK(os[0].devs.dev[0].vaddr == 0x9100000);
+    SIM_CHECK(os[0].devs.dev[0].compatible_len == 24);
+    SIM_CHECK(strcmp(os[0].devs.dev[0].name, "uart@9000000") == 0);
+    SIM_CHECK(os[0].devs.dev[0].interrupt_num == 2);
+    SIM_CHECK(os[0].devs.dev[0].interrupts[0] == 33 && os[0].devs.dev[0].interrupts[1] == 40);
+
+    SIM_CHECK(os[1].img.type == OS_TYPE_RT_ZEPHYR);
+    SIM_CHECK(os[1].img.ep == 0x80000000 && os[1].img.dtb == 0x80100000);
+    SIM_CHECK(os[1].cpu.num == 1 && os[1].cpu.affinity[0] == 0x100);
+    SIM_CHECK(os[1].devs.num == 0 && os[1].devs.dev == RT_NULL);
+
+    SIM_CHECK(hyp_fdt_parse_vms(blob, os, 1) == 1);
+    blob[0] ^= 0xFF;
+    SIM_CHECK(hyp_fdt_parse_vms(blob, os, MAX_OS_NUM) < 0);
+
+    free(os[0].devs.dev[0].interrupts);
+    free(os[0].devs.dev);
+}
+
+static void test_fdt_gen_guest(void)
+{
+    static rt_uint8_t blob[4096], guest[HYP_FDT_GUEST_SIZE];
+    struct os_desc os[MAX_OS_NUM];
+    const rt_uint32_t *cell;
+    const char *str;
+    int node, len;
+
+    sim_fdt_partitions(blob, sizeof(blob));
+    SIM_CHECK(hyp_fdt_parse_vms(blob, os, MAX_OS_NUM) == 2);
+    SIM_CHECK(hyp_fdt_gen_guest(&os[0], guest, sizeof(guest)) > 0);
+    SIM_CHECK(hyp_fdt_check(guest) == RT_EOK);
+
+    cell = hyp_fdt_getprop(guest, 0, "#address-cells", &len);
+    SIM_CHECK(cell && len == 4 && fdt32_to_cpu(*cell) == 2);
+
+    node = hyp_fdt_subnode(guest, 0, "memory");
+    SIM_CHECK(node >= 0 && strcmp(hyp_fdt_name(guest, node), "memory@40000000") == 0);
+    cell = hyp_fdt_getprop(guest, node, "reg", &len);
+    SIM_CHECK(cell && len == 32);
+    SIM_CHECK(cell && hyp_fdt_read_cells(cell, 2) == 0x40000000);
+    SIM_CHECK(cell && hyp_fdt_read_cells(cell + 2, 2) == 0x800000);
+    SIM_CHECK(cell && hyp_fdt_read_cells(cell + 4, 2) == 0x50000000);
+
+    /* the shared region is kept from the guest allocator */
+    node = hyp_fdt_subnode(guest, 0, "reserved-memory");
+    SIM_CHECK(node >= 0 && hyp_fdt_subnode(guest, node, "dma") < 0);
+    node = node >= 0 ? hyp_fdt_subnode(guest, node, "shmem") : -1;
+    SIM_CHECK(node >= 0 && strcmp(hyp_fdt_name(guest, node), "shmem@50000000") == 0);
+    SIM_CHECK(node >= 0 && hyp_fdt_getprop(guest, node, "no-map", &len) && len == 0);
+    cell = node >= 0 ? hyp_fdt_getprop(guest, node, "reg", &len) : RT_NULL;
+    SIM_CHECK(cell && len == 16 && hyp_fdt_read_cells(cell + 2, 2) == 0x100000);
+
+    node = hyp_fdt_subnode(guest, 0, "cpus");
+    SIM_CHECK(node >= 0 && hyp_fdt_subnode(guest, node, "cpu@1") >= 0);
+    SIM_CHECK(node >= 0 && hyp_fdt_subnode(guest, node, "cpu@2") < 0);
+
+    node = hyp_fdt_subnode(guest, 0, "intc");
+    cell = hyp_fdt_getprop(guest, node, "phandle", &len);
+    SIM_CHECK(node >= 0 && cell && fdt32_to_cpu(*cell) == 1);
+    SIM_CHECK(hyp_fdt_getprop(guest, node, "interrupt-controller", &len) && len == 0);
+
+    /* devices show up at their guest address, INTIDs as SPIs */
+    node = hyp_fdt_subnode(guest, 0, "uart@9100000");
+    SIM_CHECK(node >= 0);
+    str = hyp_fdt_getprop(guest, node, "compatible", &len);
+    SIM_CHECK(str && len == 24 && strcmp(str + 10, "arm,primecell") == 0);
+    cell = hyp_fdt_getprop(guest, node, "interrupts", &len);
+    SIM_CHECK(cell && len == 24);
+    SIM_CHECK(cell && fdt32_to_cpu(cell[1]) == 1 && fdt32_to_cpu(cell[4]) == 8);
+
+    SIM_CHECK(hyp_fdt_gen_guest(&os[0], guest, 256) < 0);
+
+    free(os[0].devs.dev[0].interrupts);
+    free(os[0].devs.dev);
+}
+
+/* lz4 -B4 -BD -BX --content-size and lz4 -l of sim_img_byte(0 ~ 5999) */
+static const rt_uint8_t sim_img_lz4[] =
+{
+    0x04, 0x22, 0x4d, 0x18, 0x7c, 0x40, 0x70, 0x17, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0xe0, 0x6f, 0x00, 0x00, 0x00, 0xff, 0x21, 0x30, 0x30, 0x30,
+    0x31, 0x31, 0x31, 0x32, 0x32, 0x32, 0x33, 0x33, 0x33, 0x34, 0x34, 0x34,
+    0x35, 0x35, 0x35, 0x36, 0x36, 0x36, 0x37, 0x37, 0x37, 0x38, 0x38, 0x38,
+    0x39, 0x39, 0x39, 0x61, 0x61, 0x61, 0x62, 0x62, 0x62, 0x63, 0x63, 0x63,
+    0x64, 0x64, 0x64, 0x65, 0x65, 0x65, 0x66, 0x66, 0x66, 0x30, 0x00, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x94, 0x1f, 0x41, 0x01, 0x00, 0xff,
+    0xff, 0xff, 0xd7, 0xff, 0x06, 0x6f, 0x72, 0x20, 0x72, 0x74, 0x2d, 0x74,
+    0x68, 0x72, 0x65, 0x61, 0x64, 0x20, 0x68, 0x79, 0x70, 0x65, 0x72, 0x76,
+    0x69, 0x73, 0x15, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0x96, 0x50, 0x68, 0x79, 0x70, 0x65, 0x72, 0xa3, 0xc9,
+    0xd7, 0x31, 0x00, 0x00, 0x00, 0x00, 0x88, 0x8c, 0x66, 0x71,
+};
+
+static const rt_uint8_t sim_img_lz4_legacy[] =
+{
+    0x02, 0x21, 0x4c, 0x18, 0x6f, 0x00, 0x00, 0x00, 0xff, 0x21, 0x30, 0x30,
+    0x30, 0x31, 0x31, 0x31, 0x32, 0x32, 0x32, 0x33, 0x33, 0x33, 0x34, 0x34,
+    0x34, 0x35, 0x35, 0x35, 0x36, 0x36, 0x36, 0x37, 0x37, 0x37, 0x38, 0x38,
+    0x38, 0x39, 0x39, 0x39, 0x61, 0x61, 0x61, 0x62, 0x62, 0x62, 0x63, 0x63,
+    0x63, 0x64, 0x64, 0x64, 0x65, 0x65, 0x65, 0x66, 0x66, 0x66, 0x30, 0x00,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x94, 0x1f, 0x41, 0x01, 0x00,
+    0xff, 0xff, 0xff, 0xd7, 0xff, 0x06, 0x6f, 0x72, 0x20, 0x72, 0x74, 0x2d,
+    0x74, 0x68, 0x72, 0x65, 0x61, 0x64, 0x20, 0x68, 0x79, 0x70, 0x65, 0x72,
+    0x76, 0x69, 0x73, 0x15, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0x96, 0x50, 0x68, 0x79, 0x70, 0x65, 0x72,
+};
+
+/* one stored block, no checksums */
+static const rt_uint8_t sim_img_lz4_stored[] =
+{
+    0x04, 0x22, 0x4d, 0x18, 0x60, 0x40, 0x82, 0x05, 0x00, 0x00, 0x80, 0x68,
+    0x65, 0x6c, 0x6c, 0x6f, 0x00, 0x00, 0x00, 0x00,
+};
+
+#define SIM_IMG_SIZE    6000
+
+static rt_uint8_t sim_img_byte(rt_size_t i)
+{
+    if (i < 2000)
+        return "0123456789abcdef"[(i / 3) % 16];
+    if (i < 3000)
+        return 'A';
+    return "rt-thread hypervisor "[i % 21];
+}
+
+static const char *sim_img_file(const void *buf, rt_size_t size)
+{
+    static char path[] = "/tmp/hyp_sim_imgXXXXXX";
+    int fd;
+
+    strcpy(path + sizeof(path) - 7, "XXXXXX");
+    fd = mkstemp(path);
+    if (fd < 0 || write(fd, buf, size) != (ssize_t)size)
+        return RT_NULL;
+    close(fd);
+    return path;
+}
+
+static rt_bool_t sim_img_check(vm_t vm, rt_uint64_t ipa, rt_size_t size)
+{
+    rt_ubase_t pa;
+
+    for (rt_size_t i = 0; i < size; i++)
+    {
+        if (s2_translate(vm->mm, ipa + i, &pa) || *(rt_uint8_t *)pa != sim_img_byte(i))
+            return RT_FALSE;
+    }
+
+    return RT_TRUE;
+}
+
+static void test_os_img_load_file(void)
+{
+    struct os_desc os;
+    rt_uint8_t raw[SIM_IMG_SIZE];
+    const char *path;
+    rt_ubase_t pa;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(3, 1, 4);
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK);
+    SIM_CHECK(vm_memory_init(vm->mm) == RT_EOK);
+
+    /* the image straddles two mem_blocks, matches too */
+    os = *vm->os;
+    os.img.ep = 0x40000000 + MEM_BLOCK_SIZE - 3001;
+    vm->os = &os;
+
+    for (rt_size_t i = 0; i < SIM_IMG_SIZE; i++)
+        raw[i] = sim_img_byte(i);
+    path = sim_img_file(raw, sizeof(raw));
+    SIM_CHECK(path && os_img_load_file(vm, path) == RT_EOK);
+    SIM_CHECK(sim_img_check(vm, os.img.ep, SIM_IMG_SIZE));
+    unlink(path);
+
+    path = sim_img_file(sim_img_lz4, sizeof(sim_img_lz4));
+    s2_translate(vm->mm, os.img.ep, &pa);
+    rt_memset((void *)pa, 0, 3001);
+    SIM_CHECK(path && os_img_load_file(vm, path) == RT_EOK);
+    SIM_CHECK(sim_img_check(vm, os.img.ep, SIM_IMG_SIZE));
+    unlink(path);
+
+    path = sim_img_file(sim_img_lz4_legacy, sizeof(sim_img_lz4_legacy));
+    rt_memset((void *)pa, 0, 3001);
+    SIM_CHECK(path && os_img_load_file(vm, path) == RT_EOK);
+    SIM_CHECK(sim_img_check(vm, os.img.ep, SIM_IMG_SIZE));
+    unlink(path);
+
+    path = sim_img_file(sim_img_lz4_stored, sizeof(sim_img_lz4_stored));
+    SIM_CHECK(path && os_img_load_file(vm, path) == RT_EOK);
+    SIM_CHECK(memcmp((void *)pa, "hello", 5) == 0);
+    unlink(path);
+
+    /* truncated stream, match before the entry point */
+    path = sim_img_file(sim_img_lz4, sizeof(sim_img_lz4) - 20);
+    SIM_CHECK(path && os_img_load_file(vm, path) != RT_EOK);
+    unlink(path);
+    os.img.ep = 0x40000000;
+    path = sim_img_file("\x02\x21\x4c\x18\x03\x00\x00\x00\x00\x01\x00", 11);
+    SIM_CHECK(path && os_img_load_file(vm, path) != RT_EOK);
+    unlink(path);
+
+    /* larger than the rest of guest RAM */
+    os.img.ep = 0x40000000 + BYTE(4UL) - 100;
+    path = sim_img_file(raw, sizeof(raw));
+    SIM_CHECK(path && os_img_load_file(vm, path) != RT_EOK);
+    os.img.ep = 0x40000000 + BYTE(4UL) - SIM_IMG_SIZE;
+    SIM_CHECK(path && os_img_load_file(vm, path) == RT_EOK);
+    SIM_CHECK(sim_img_check(vm, os.img.ep, SIM_IMG_SIZE));
+    unlink(path);
+
+    SIM_CHECK(os_img_load_file(vm, "/nonexistent/rtthread.bin") == -RT_EIO);
+
+    sim_vm_free_memory(vm);
+    sim_vm_destroy(vm);
+    sim_arena_reset();
+}
+
+static void *sim_guest_page(vm_t vm, rt_uint64_t ipa)
+{
+    rt_ubase_t pa = 0;
+
+    s2_translate(vm->mm, ipa, &pa);
+    return (void *)pa;
+}
+
+static void test_vm_snapshot(void)
+{
+    static const rt_uint64_t pages[] =
+    {
+        0x40001000, 0x40000000 + MEM_BLOCK_SIZE - 0x1000,
+        0x40000000 + MEM_BLOCK_SIZE, 0x40000000 + BYTE(8UL) - 0x1000,
+    };
+    rt_uint64_t ram = 0x40000000;
+    const rt_uint64_t *frame;
+    const char *path;
+    struct vm_snap_hdr hdr;
+    struct stat st;
+    vm_t vm, new_vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 2, 8);
+    new_vm = sim_vm_create(1, 2, 8);
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK && vm_memory_init(vm->mm) == RT_EOK);
+    SIM_CHECK(vm_mm_struct_init(new_vm->mm) == RT_EOK && vm_memory_init(new_vm->mm) == RT_EOK);
+
+    /* one page, a run split by the mem_block border, the last page */
+    rt_memset(sim_guest_page(vm, pages[0]), 0x5A, 4096);
+    rt_memset(sim_guest_page(vm, pages[1]), 0x11, 4096);
+    rt_memset(sim_guest_page(vm, pages[2]), 0x22, 4096);
+    *((rt_uint8_t *)sim_guest_page(vm, pages[3]) + 4095) = 0x33;
+
+    for (rt_size_t i = 0; i < VCPU_GUEST_FRAME_SIZE / 8; i++)
+        ((rt_uint64_t *)vcpu_guest_frame(vm->vcpus[0]))[i] = 0x1000 + i;
+    vm->vcpus[0]->arch->vcpu_ctxt.sys_regs[_SCTLR_EL1] = 0x30D00805;
+    vm->vcpus[0]->arch->hcr_el2 = 0x80000018;
+    vm->vcpus[0]->vtc->ptimer.ctl = CNTP_CTL_ENABLE_MASK;
+    vm->vcpus[0]->vtc->ptimer.tval = 1234;
+    vm->vcpus[1]->status = VCPU_STATUS_NEVER_RUN;
+    sim_enable_virq(vm, 27, 0xA0);
+    sim_enable_virq(vm, 48, 0x80);
+    sim_gicr(vm)->lr_list[0] = 0x5A5A;
+    sim_gicr(vm)->tail = 1;
+    vm->vgic->gicd->CTLR = 0x12;
+    vm->vgic->ctxt.ich_vmcr_el2 = 0xF0000001;
+
+    /* a running VM would change under us */
+    path = sim_img_file("", 0);
+    SIM_CHECK(path && vm_snapshot(vm, path) == -RT_EBUSY);
+    vm->status = VM_STATUS_SUSPEND;
+    SIM_CHECK(vm_snapshot(vm, path) == RT_EOK);
+
+    /* zero pages are not in the file */
+    SIM_CHECK(stat(path, &st) == 0);
+    SIM_CHECK(st.st_size == sizeof(struct vm_snap_hdr)
+              + 2 * (sizeof(struct vm_snap_rec) + sizeof(struct vm_snap_vcpu))
+              + sizeof(struct vm_snap_rec) + sizeof(struct vm_snap_vgic)
+              + 4 * (sizeof(struct vm_snap_rec) + 4096) + sizeof(struct vm_snap_rec));
+    SIM_CHECK(vm_snap_read_hdr(path, &hdr) == RT_EOK);
+    SIM_CHECK(hdr.nr_vcpus == 2 && hdr.mem_addr == ram && hdr.mem_size == 8);
+
+    new_vm->vcpus[0]->status = new_vm->vcpus[1]->status = VCPU_STATUS_NEVER_RUN;
+    SIM_CHECK(vm_restore(new_vm, path) == RT_EOK);
+    for (rt_size_t i = 0; i < sizeof(pages) / sizeof(pages[0]); i++)
+        SIM_CHECK(memcmp(sim_guest_page(new_vm, pages[i]), sim_guest_page(vm, pages[i]), 4096) == 0);
+    SIM_CHECK(*(rt_uint8_t *)sim_guest_page(new_vm, ram + 0x2000) == 0);
+
+    frame = (const rt_uint64_t *)vcpu_guest_frame(new_vm->vcpus[0]);
+    SIM_CHECK(frame[0] == 0x1000 && frame[VCPU_GUEST_FRAME_SIZE / 8 - 1] == 0x1000 + VCPU_GUEST_FRAME_SIZE / 8 - 1);
+    SIM_CHECK(new_vm->vcpus[0]->arch->vcpu_ctxt.sys_regs[_SCTLR_EL1] == 0x30D00805);
+    SIM_CHECK(new_vm->vcpus[0]->arch->hcr_el2 == 0x80000018);
+    SIM_CHECK(new_vm->vcpus[0]->vtc->ptimer.ctl == CNTP_CTL_ENABLE_MASK);
+    SIM_CHECK(new_vm->vcpus[0]->vtc->ptimer.tval == 1234);
+    SIM_CHECK(new_vm->vcpus[0]->status == VCPU_STATUS_OFFLINE);
+    SIM_CHECK(new_vm->vcpus[1]->status == VCPU_STATUS_NEVER_RUN);
+    SIM_CHECK(vgic_get_virq(new_vm->vcpus[0], 27)->enable);
+    SIM_CHECK(vgic_get_virq(new_vm->vcpus[0], 27)->prio == 0xA0);
+    SIM_CHECK(vgic_get_virq(new_vm->vcpus[0], 27)->vcpu == new_vm->vcpus[0]);
+    SIM_CHECK(vgic_get_virq(new_vm->vcpus[0], 48)->enable);
+    SIM_CHECK(vgic_get_virq(new_vm->vcpus[0], 48)->prio == 0x80);
+    SIM_CHECK(new_vm->vgic->gicr[0]->lr_list[0] == 0x5A5A && new_vm->vgic->gicr[0]->tail == 1);
+    SIM_CHECK(new_vm->vgic->gicd->CTLR == 0x12);
+    SIM_CHECK(new_vm->vgic->ctxt.ich_vmcr_el2 == 0xF0000001);
+
+    /* cut short, or not a snapshot at all */
+    SIM_CHECK(truncate(path, st.st_size - sizeof(struct vm_snap_rec)) == 0);
+    SIM_CHECK(vm_restore(new_vm, path) != RT_EOK);
+    unlink(path);
+    path = sim_img_file("not a snapshot", 14);
+    SIM_CHECK(vm_snap_read_hdr(path, &hdr) != RT_EOK);
+    SIM_CHECK(vm_restore(new_vm, path) != RT_EOK);
+    unlink(path);
+
+    sim_vm_free_memory(vm);
+    sim_vm_free_memory(new_vm);
+    sim_vm_destroy(vm);
+    sim_vm_destroy(new_vm);
+    sim_arena_reset();
+}
+
+static mem_block_t *sim_mem_block(vm_t vm, rt_uint64_t ipa)
+{
+    vm_area_t vma = vm_area_find(vm->mm, ipa);
+    mem_block_t *mb = vma->mb_head;
+
+    for (rt_size_t n = (ipa - vma->desc.vaddr_start) >> MEM_BLOCK_SHIFT; n; n--)
+        mb = mb->next;
+    return mb;
+}
+
+static void test_vm_clone(void)
+{
+    rt_ubase_t bitmap[VM_DIRTY_WORDS(MEM_BLOCK_SIZE)];
+    rt_uint64_t ram = 0x40000000, last = ram + BYTE(64UL) - MEM_BLOCK_SIZE, ipa, flush;
+    rt_ubase_t pa, ppa, page;
+    rt_size_t size;
+    vm_t vm, child;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 64);
+    child = sim_vm_create(1, 1, 64);
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK && vm_memory_init(vm->mm) == RT_EOK);
+    SIM_CHECK(vm_mm_struct_init(child->mm) == RT_EOK);
+    rt_memset(sim_guest_page(vm, ram + 0x1000), 0x5A, 4096);
+    rt_memset(sim_guest_page(vm, ram + MEM_BLOCK_SIZE + 0x3000), 0x22, 4096);
+
+    /* a block split by dirty logging is still whole, it is shared */
+    SIM_CHECK(vm_dirty_log_start(vm->mm) == RT_EOK);
+    SIM_CHECK(vm_mem_write_fault(vm->mm, ram + MEM_BLOCK_SIZE) == RT_EOK);
+    SIM_CHECK(vm_memory_clone(child->mm, vm->mm) == RT_EOK);
+    SIM_CHECK(vm->mm->mem_used == 0 && child->mm->mem_used == 0);
+    for (ipa = ram; ipa <= last; ipa += MEM_BLOCK_SIZE)
+    {
+        SIM_CHECK(s2_translate(vm->mm, ipa, &ppa) == RT_EOK && s2_translate(child->mm, ipa, &pa) == RT_EOK);
+        SIM_CHECK(pa == ppa && *sim_mem_block(vm, ipa)->ref == 2);
+        SIM_CHECK(sim_s2_ap(child->mm, ipa, &size) == S2_AP_RO && size == S2_PMD_SIZE);
+        SIM_CHECK(sim_s2_ap(vm->mm, ipa, &size) == S2_AP_RO);
+    }
+
+    /* the first write copies the page, the other VM keeps the old one */
+    ipa = ram + 0x1008;
+    SIM_CHECK(vm_mem_write_fault(child->mm, ipa) == RT_EOK);
+    SIM_CHECK(sim_s2_ap(child->mm, ipa, &size) == S2_AP_RW && size == S2_PTE_SIZE);
+    SIM_CHECK(sim_s2_ap(child->mm, ipa + S2_PTE_SIZE, &size) == S2_AP_RO);
+    SIM_CHECK(sim_guest_page(child, ipa) != sim_guest_page(vm, ipa));
+    SIM_CHECK(*(rt_uint8_t *)sim_guest_page(child, ipa) == 0x5A);
+    SIM_CHECK(child->mm->mem_used == S2_PTE_SIZE);
+    rt_memset(sim_guest_page(child, ram + 0x1000), 0xA5, 4096);
+    SIM_CHECK(*(rt_uint8_t *)sim_guest_page(vm, ipa) == 0x5A);
+    SIM_CHECK(vm_mem_write_fault(child->mm, ipa) == RT_EOK);
+    SIM_CHECK(child->mm->mem_used == S2_PTE_SIZE);
+
+    /* the parent copies too, and logs the page */
+    SIM_CHECK(vm_mem_write_fault(vm->mm, ipa) == RT_EOK);
+    SIM_CHECK(vm->mm->mem_used == S2_PTE_SIZE);
+    SIM_CHECK(s2_translate(vm->mm, ipa, &ppa) == RT_EOK);
+    SIM_CHECK(vm_dirty_log_get(vm->mm, ram, MEM_BLOCK_SIZE, bitmap) == RT_EOK && bitmap[0] == 0x2);
+    SIM_CHECK(sim_s2_ap(vm->mm, ipa, &size) == S2_AP_RO);
+    SIM_CHECK(vm_mem_write_fault(vm->mm, ipa) == RT_EOK);
+    SIM_CHECK(sim_s2_ap(vm->mm, ipa, &size) == S2_AP_RW);
+    SIM_CHECK(s2_translate(vm->mm, ipa, &pa) == RT_EOK && pa == ppa);
+    SIM_CHECK(vm->mm->mem_used == S2_PTE_SIZE);
+    page = RT_ALIGN_DOWN(ppa, S2_PTE_SIZE);
+
+    /* stop logging, shared blocks stay read only */
+    vm_dirty_log_stop(vm->mm);
+    SIM_CHECK(sim_s2_ap(vm->mm, ram + 0x2000, &size) == S2_AP_RO);
+    SIM_CHECK(sim_s2_ap(vm->mm, ram + MEM_BLOCK_SIZE, &size) == S2_AP_RO && size == S2_PMD_SIZE);
+
+    /* out of page tables, whole blocks are copied, not under the CPU lock */
+    flush = sim_stats.block_flush_irq_off;
+    for (ipa = ram + 0x3000; ipa <= last + 0x3000; ipa += MEM_BLOCK_SIZE)
+        SIM_CHECK(vm_mem_write_fault(child->mm, ipa) == RT_EOK);
+    SIM_CHECK(sim_stats.block_flush_irq_off == flush);
+    SIM_CHECK(sim_s2_ap(child->mm, last, &size) == S2_AP_RW && size == S2_PMD_SIZE);
+    SIM_CHECK(sim_mem_block(child, last)->ref == RT_NULL && *sim_mem_block(vm, last)->ref == 1);
+    SIM_CHECK(sim_guest_page(child, last) != sim_guest_page(vm, last));
+    SIM_CHECK(memcmp(sim_guest_page(child, ram + MEM_BLOCK_SIZE + 0x3000),
+                     sim_guest_page(vm, ram + MEM_BLOCK_SIZE + 0x3000), 4096) == 0);
+    SIM_CHECK(child->mm->mem_used > MEM_BLOCK_SIZE);
+
+    /* the last user takes the block back, without copying */
+    sim_vm_free_memory(child);
+    SIM_CHECK(child->mm->mem_used == 0 && *sim_mem_block(vm, ram)->ref == 1);
+    ipa = ram + 2 * MEM_BLOCK_SIZE;
+    SIM_CHECK(s2_translate(vm->mm, ipa, &ppa) == RT_EOK);
+    SIM_CHECK(vm_mem_write_fault(vm->mm, ipa + 0x10) == RT_EOK);
+    SIM_CHECK(sim_s2_ap(vm->mm, ipa, &size) == S2_AP_RW && size == S2_PMD_SIZE);
+    SIM_CHECK(s2_translate(vm->mm, ipa, &pa) == RT_EOK && pa == ppa);
+    SIM_CHECK(sim_mem_block(vm, ipa)->ref == RT_NULL);
+    SIM_CHECK(vm->mm->mem_used == MEM_BLOCK_SIZE + S2_PTE_SIZE);
+
+    /* the parent keeps its own copy of a page in a block it took back */
+    SIM_CHECK(vm_mem_write_fault(vm->mm, ram + 0x2000) == RT_EOK);
+    SIM_CHECK(sim_s2_ap(vm->mm, ram + 0x2000, &size) == S2_AP_RW);
+    SIM_CHECK(s2_translate(vm->mm, ram + 0x1000, &pa) == RT_EOK && pa == page);
+    SIM_CHECK(*(rt_uint8_t *)sim_guest_page(vm, ram + 0x1000) == 0x5A);
+    SIM_CHECK(vm_mem_write_fault(vm->mm, 0x09000000) != RT_EOK);
+
+    sim_vm_free_memory(vm);
+    SIM_CHECK(vm->mm->mem_used == 0);
+    sim_vm_destroy(vm);
+    sim_vm_destroy(child);
+    sim_arena_reset();
+}
+
+static vm_t merge_writer;
+static rt_uint64_t merge_write_ipa;
+
+/* the other CPU: a guest writes the block while it is compared */
+static void merge_write(void)
+{
+    SIM_CHECK(vm_mem_write_fault(merge_writer->mm, merge_write_ipa) == RT_EOK);
+}
+
+/* the other CPU: a hypercall writes its result there meanwhile */
+static void merge_copy(void)
+{
+    rt_uint64_t val = 0xC0FFEE;
+
+    SIM_CHECK(vm_copy_to_guest(merge_writer->mm, merge_write_ipa, &val, sizeof(val)) == RT_EOK);
+}
+
+static void test_mem_merge(void)
+{
+    rt_uint64_t ram = 0x40000000, ipa;
+    struct mem_merge_stat stat;
+    struct vm_cow_stat cow, cow0;
+    rt_ubase_t pa, ppa;
+    rt_size_t size, copied;
+    vm_t vms[3];
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vms[0] = sim_vm_create(0, 1, 8);
+    vms[1] = RT_NULL;
+    vms[2] = sim_vm_create(2, 1, 8);
+    SIM_CHECK(vm_mm_struct_init(vms[0]->mm) == RT_EOK && vm_memory_init(vms[0]->mm) == RT_EOK);
+    SIM_CHECK(vm_mm_struct_init(vms[2]->mm) == RT_EOK && vm_memory_init(vms[2]->mm) == RT_EOK);
+    vms[0]->status = vms[2]->status = VM_STATUS_ONLINE;
+
+    /* block 0: the same image but 3 pages, 1 and 2: zero, 3: too different */
+    for (ipa = ram; ipa < ram + MEM_BLOCK_SIZE; ipa += 0x1000)
+    {
+        rt_memset(sim_guest_page(vms[0], ipa), (rt_uint8_t)(ipa >> 12), 4096);
+        rt_memset(sim_guest_page(vms[2], ipa), (rt_uint8_t)(ipa >> 12), 4096);
+    }
+    *(rt_uint8_t *)sim_guest_page(vms[2], ram + 0x5000) = 0xEE;
+    *(rt_uint8_t *)sim_guest_page(vms[2], ram + 0x6FFF) = 0xEE;
+    *(rt_uint8_t *)sim_guest_page(vms[2], ram + 0x1FF000) = 0xEE;
+    for (ipa = ram + 3 * MEM_BLOCK_SIZE; ipa < ram + 3 * MEM_BLOCK_SIZE + 0x100000; ipa += 0x1000)
+        *(rt_uint8_t *)sim_guest_page(vms[2], ipa) = 0xEE;
+
+    SIM_CHECK(mem_merge_hash(sim_guest_page(vms[0], ram)) == mem_merge_hash(sim_guest_page(vms[2], ram)));
+    SIM_CHECK(mem_merge_hash(sim_guest_page(vms[0], ram + 0x5000)) != mem_merge_hash(sim_guest_page(vms[2], ram + 0x5000)));
+
+    /* a guest changed the block after it was hashed */
+    ipa = ram + 3 * MEM_BLOCK_SIZE;
+    SIM_CHECK(vm_memory_merge(vms[2]->mm, vms[0]->mm, ipa, 8, &copied) == -RT_EBUSY);
+    SIM_CHECK(sim_s2_ap(vms[0]->mm, ipa, &size) == S2_AP_RW && size == S2_PMD_SIZE);
+    SIM_CHECK(sim_s2_ap(vms[2]->mm, ipa, &size) == S2_AP_RW && size == S2_PMD_SIZE);
+
+    /* the write wins over a merge that compares without the locks */
+    ipa = ram + 2 * MEM_BLOCK_SIZE;
+    for (int i = 0; i < 2; i++)
+    {
+        merge_writer = vms[i * 2];
+        merge_write_ipa = ipa + 0x3008;
+        sim_unlock_hook = merge_write;
+        SIM_CHECK(vm_memory_merge(vms[2]->mm, vms[0]->mm, ipa, 8, &copied) == -RT_EBUSY);
+        SIM_CHECK(sim_unlock_hook == RT_NULL);
+        SIM_CHECK(sim_s2_ap(vms[0]->mm, ipa, &size) == S2_AP_RW && size == S2_PMD_SIZE);
+        SIM_CHECK(sim_s2_ap(vms[2]->mm, ipa, &size) == S2_AP_RW && size == S2_PMD_SIZE);
+        SIM_CHECK(sim_guest_page(vms[2], ipa) != sim_guest_page(vms[0], ipa));
+    }
+    merge_writer = vms[0];
+    sim_unlock_hook = merge_copy;
+    SIM_CHECK(vm_memory_merge(vms[2]->mm, vms[0]->mm, ipa, 8, &copied) == -RT_EBUSY);
+    SIM_CHECK(*(rt_uint64_t *)sim_guest_page(vms[0], ipa + 0x3008) == 0xC0FFEE);
+    SIM_CHECK(sim_s2_ap(vms[0]->mm, ipa, &size) == S2_AP_RW && size == S2_PMD_SIZE);
+    *(rt_uint64_t *)sim_guest_page(vms[0], ipa + 0x3008) = 0;
+
+    vm_cow_get_stat(&cow0);
+    SIM_CHECK(mem_merge_init(vms, 3, 0) == RT_EOK);
+    SIM_CHECK(mem_merge_scan() == 3);
+    SIM_CHECK(mem_merge_scan() == 0);
+    mem_merge_get_stat(&stat);
+    SIM_CHECK(stat.scans == 2 && stat.blocks == 3 && stat.copied == 3 && stat.shared == 3 * 512 - 3);
+    SIM_CHECK(vms[0]->mm->mem_used == BYTE(2UL) && vms[2]->mm->mem_used == BYTE(2UL) + 3 * S2_PTE_SIZE);
+
+    /* equal pages are one read only page, the others stay private */
+    SIM_CHECK(sim_guest_page(vms[2], ram) == sim_guest_page(vms[0], ram));
+    SIM_CHECK(sim_s2_ap(vms[2]->mm, ram, &size) == S2_AP_RO && size == S2_PTE_SIZE);
+    SIM_CHECK(sim_s2_ap(vms[0]->mm, ram, &size) == S2_AP_RO && size == S2_PMD_SIZE);
+    SIM_CHECK(sim_s2_ap(vms[2]->mm, ram + 0x5000, &size) == S2_AP_RW);
+    SIM_CHECK(sim_guest_page(vms[2], ram + 0x6000) != sim_guest_page(vms[0], ram + 0x6000));
+    SIM_CHECK(*(rt_uint8_t *)sim_guest_page(vms[2], ram + 0x5000) == 0xEE);
+    SIM_CHECK(*((rt_uint8_t *)sim_guest_page(vms[2], ram + 0x6000) + 0xFFF) == 0xEE);
+    SIM_CHECK(*(rt_uint8_t *)sim_guest_page(vms[0], ram + 0x5000) == 0x05);
+    SIM_CHECK(sim_guest_page(vms[2], ram + MEM_BLOCK_SIZE) == sim_guest_page(vms[0], ram + MEM_BLOCK_SIZE));
+    SIM_CHECK(sim_s2_ap(vms[2]->mm, ram + MEM_BLOCK_SIZE, &size) == S2_AP_RO && size == S2_PMD_SIZE);
+    SIM_CHECK(sim_guest_page(vms[2], ram + 3 * MEM_BLOCK_SIZE) != sim_guest_page(vms[0], ram + 3 * MEM_BLOCK_SIZE));
+
+    /* a write breaks the merge for that page alone */
+    ipa = ram + MEM_BLOCK_SIZE + 0x2000;
+    SIM_CHECK(s2_translate(vms[2]->mm, ipa, &ppa) == RT_EOK);
+    SIM_CHECK(vm_mem_write_fault(vms[0]->mm, ipa) == RT_EOK);
+    SIM_CHECK(sim_s2_ap(vms[0]->mm, ipa, &size) == S2_AP_RW && size == S2_PTE_SIZE);
+    SIM_CHECK(s2_translate(vms[0]->mm, ipa, &pa) == RT_EOK && pa != ppa);
+    SIM_CHECK(sim_s2_ap(vms[2]->mm, ipa, &size) == S2_AP_RO);
+    vm_cow_get_stat(&cow);
+    SIM_CHECK(cow.pages == cow0.pages + 1);
+
+    sim_vm_free_memory(vms[0]);
+    sim_vm_free_memory(vms[2]);
+    SIM_CHECK(vms[0]->mm->mem_used == 0 && vms[2]->mm->mem_used == 0);
+    sim_vm_destroy(vms[0]);
+    sim_vm_destroy(vms[2]);
+    sim_arena_reset();
+}
+
+static rt_bool_t sim_block_is(void *ptr, rt_uint8_t val)
+{
+    for (rt_size_t i = 0; i < MEM_BLOCK_SIZE; i += 4096)
+    {
+        if (((rt_uint8_t *)ptr)[i] != val || ((rt_uint8_t *)ptr)[i + 4095] != val)
+            return RT_FALSE;
+    }
+
+    return RT_TRUE;
+}
+
+static void test_mem_pool(void)
+{
+    struct mem_pool_stat stat;
+    rt_uint8_t *region = rt_malloc_align(4 * MEM_BLOCK_SIZE, MEM_BLOCK_SIZE);
+    void *blk[5];
+    vm_t vm;
+
+    SIM_CHECK(mem_pool_init(region + 4096, MEM_BLOCK_SIZE) == -RT_EINVAL);
+
+    /* whatever the region held, it starts dirty */
+    rt_memset(region, 0xAA, 4 * MEM_BLOCK_SIZE);
+    SIM_CHECK(mem_pool_init(region, 4 * MEM_BLOCK_SIZE) == RT_EOK);
+    mem_pool_get_stat(&stat);
+    SIM_CHECK(stat.total == 4 && stat.dirty == 4 && stat.clean == 0);
+
+    SIM_CHECK(mem_pool_scrub() && mem_pool_scrub());
+    mem_pool_get_stat(&stat);
+    SIM_CHECK(stat.dirty == 2 && stat.clean == 2);
+
+    /* clean ones first, then zeroed on the spot, then nothing */
+    for (rt_size_t i = 0; i < 5; i++)
+        blk[i] = mem_pool_alloc();
+    mem_pool_get_stat(&stat);
+    SIM_CHECK(stat.clean == 0 && stat.dirty == 0 && stat.sync_zero == 2);
+    SIM_CHECK(blk[4] == RT_NULL);
+    for (rt_size_t i = 0; i < 4; i++)
+    {
+        SIM_CHECK((rt_uint8_t *)blk[i] >= region && (rt_uint8_t *)blk[i] < region + 4 * MEM_BLOCK_SIZE);
+        SIM_CHECK(sim_block_is(blk[i], 0));
+    }
+
+    /* freed blocks are zeroed by the scrub thread */
+    rt_memset(blk[1], 0x55, MEM_BLOCK_SIZE);
+    mem_pool_free(blk[1]);
+    mem_pool_get_stat(&stat);
+    SIM_CHECK(stat.dirty == 1);
+    SIM_CHECK(mem_pool_scrub() && !mem_pool_scrub());
+    SIM_CHECK(sim_block_is(blk[1], 0));
+    mem_pool_get_stat(&stat);
+    SIM_CHECK(stat.clean == 1 && stat.dirty == 0);
+    for (rt_size_t i = 0; i < 4; i++)
+    {
+        if (i != 1)
+            mem_pool_free(blk[i]);
+    }
+
+    /* guest RAM of a 4MB VM, back on delete */
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(3, 1, 4);
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK);
+    SIM_CHECK(vm_memory_init(vm->mm) == RT_EOK);
+    mem_pool_get_stat(&stat);
+    SIM_CHECK(stat.clean + stat.dirty == 2);
+    sim_vm_free_memory(vm);
+    SIM_CHECK(vm->mm->mem_used == 0);
+    mem_pool_get_stat(&stat);
+    SIM_CHECK(stat.clean + stat.dirty == 4);
+    sim_vm_destroy(vm);
+
+    SIM_CHECK(mem_pool_init(RT_NULL, 0) == RT_EOK);
+    blk[0] = mem_pool_alloc();
+    SIM_CHECK(blk[0] && sim_block_is(blk[0], 0));
+    mem_pool_free(blk[0]);
+    sim_arena_reset();
+}
+
+/* sim VMs share one os_desc, colors apply to the next vm_memory_init() */
+static void sim_set_colors(vm_t vm, rt_uint32_t colors)
+{
+    ((struct os_desc *)vm->os)->mem.region[0].colors = colors;
+}
+
+static rt_bool_t sim_page_is(void *ptr, rt_uint8_t val)
+{
+    for (rt_size_t i = 0; i < 4096; i++)
+    {
+        if (((rt_uint8_t *)ptr)[i] != val)
+            return RT_FALSE;
+    }
+
+    return RT_TRUE;
+}
+
+static void test_mem_color(void)
+{
+    rt_ubase_t bitmap[VM_DIRTY_WORDS(MEM_BLOCK_SIZE)];
+    rt_uint64_t ram = 0x40000000, ipa;
+    struct mem_color_stat stat;
+    rt_bool_t colored = RT_TRUE;
+    const char *path;
+    rt_ubase_t pa;
+    rt_size_t size, i;
+    rt_uint8_t *page;
+    vm_t vm, src, other;
+
+    SIM_CHECK(mem_color_init(12) == -RT_EINVAL);
+    SIM_CHECK(mem_color_init(64) == -RT_EINVAL);
+    SIM_CHECK(mem_color_init(16) == RT_EOK && mem_color_num() == 16);
+
+    /* one mem_block feeds every color, pages come back zeroed */
+    page = mem_color_alloc(5);
+    SIM_CHECK(page && IS_4K_ALIGN(page) && mem_color_of(page) == 5);
+    SIM_CHECK(sim_page_is(page, 0));
+    mem_color_get_stat(&stat);
+    SIM_CHECK(stat.colors == 16 && stat.blocks == 1 && stat.free[5] == 31 && stat.free[0] == 32);
+    rt_memset(page, 0xAA, 4096);
+    mem_color_free(page);
+    SIM_CHECK(page[8] == 0 && page[4095] == 0);
+    SIM_CHECK(mem_color_alloc(5) == page && sim_page_is(page, 0));
+    mem_color_free(page);
+    SIM_CHECK(mem_color_alloc(16) == RT_NULL);
+
+    /* 8MB of colors 4 to 7, round robin, mapped page by page */
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 8);
+    sim_set_colors(vm, 0xF0);
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK && vm_memory_init(vm->mm) == RT_EOK);
+    SIM_CHECK(vm->mm->mem_used == BYTE(8UL));
+    for (i = 0, ipa = ram; ipa < ram + BYTE(8UL); ipa += 0x1000, i++)
+    {
+        if (s2_translate(vm->mm, ipa, &pa) != RT_EOK || mem_color_of((void *)pa) != 4 + i % 4
+         || sim_s2_ap(vm->mm, ipa, &size) != S2_AP_RW || size != S2_PTE_SIZE)
+            colored = RT_FALSE;
+    }
+    SIM_CHECK(colored);
+    mem_color_get_stat(&stat);
+    SIM_CHECK(stat.blocks == 16 && stat.free[4] == 0 && stat.free[7] == 0 && stat.free[0] == 512);
+
+    /* disjoint colors come from the pages left over */
+    other = sim_vm_create(1, 1, 8);
+    sim_set_colors(other, 0x0F);
+    SIM_CHECK(vm_mm_struct_init(other->mm) == RT_EOK && vm_memory_init(other->mm) == RT_EOK);
+    SIM_CHECK(s2_translate(other->mm, ram + 0x3000, &pa) == RT_EOK && mem_color_of((void *)pa) == 3);
+    mem_color_get_stat(&stat);
+    SIM_CHECK(stat.blocks == 16 && stat.free[0] == 0 && stat.free[8] == 512);
+    sim_vm_free_memory(other);
+    sim_vm_destroy(other);
+
+    /* no color left once masked with those there are */
+    other = sim_vm_create(1, 1, 8);
+    sim_set_colors(other, 0x10000);
+    SIM_CHECK(vm_mm_struct_init(other->mm) == RT_EOK && vm_memory_init(other->mm) == -RT_EINVAL);
+    sim_vm_free_memory(other);
+    sim_vm_destroy(other);
+
+    /* dirty logging, pages are split already */
+    SIM_CHECK(vm_dirty_log_start(vm->mm) == RT_EOK);
+    SIM_CHECK(sim_s2_ap(vm->mm, ram + 0x3000, &size) == S2_AP_RO && size == S2_PTE_SIZE);
+    SIM_CHECK(vm_mem_write_fault(vm->mm, ram + 0x3008) == RT_EOK);
+    SIM_CHECK(sim_s2_ap(vm->mm, ram + 0x3000, &size) == S2_AP_RW);
+    SIM_CHECK(sim_s2_ap(vm->mm, ram + 0x4000, &size) == S2_AP_RO);
+    SIM_CHECK(vm_dirty_log_get(vm->mm, ram, MEM_BLOCK_SIZE, bitmap) == RT_EOK && bitmap[0] == (1UL << 3));
+    vm_dirty_log_stop(vm->mm);
+    SIM_CHECK(sim_s2_ap(vm->mm, ram + 0x4000, &size) == S2_AP_RW && size == S2_PTE_SIZE);
+
+    /* a snapshot of mem_blocks restores into colored pages */
+    src = sim_vm_create(2, 1, 8);
+    sim_set_colors(src, 0);
+    SIM_CHECK(vm_mm_struct_init(src->mm) == RT_EOK && vm_memory_init(src->mm) == RT_EOK);
+    rt_memset(sim_guest_page(src, ram + 0x1000), 0x5A, 3 * 4096);
+    rt_memset(sim_guest_page(src, ram + BYTE(8UL) - 0x1000), 0x33, 4096);
+    src->status = VM_STATUS_SUSPEND;
+    path = sim_img_file("", 0);
+    SIM_CHECK(path && vm_snapshot(src, path) == RT_EOK);
+    vm->vcpus[0]->status = VCPU_STATUS_NEVER_RUN;
+    SIM_CHECK(vm_restore(vm, path) == RT_EOK);
+    for (ipa = ram + 0x1000; ipa < ram + 0x4000; ipa += 0x1000)
+        SIM_CHECK(sim_page_is(sim_guest_page(vm, ipa), 0x5A));
+    SIM_CHECK(sim_page_is(sim_guest_page(vm, ram + BYTE(8UL) - 0x1000), 0x33));
+    SIM_CHECK(sim_page_is(sim_guest_page(vm, ram + 0x4000), 0));
+    unlink(path);
+    sim_vm_free_memory(src);
+    sim_vm_destroy(src);
+
+    /* pages go back to their colors */
+    sim_vm_free_memory(vm);
+    SIM_CHECK(vm->mm->mem_used == 0);
+    mem_color_get_stat(&stat);
+    SIM_CHECK(stat.free[4] == 512 && stat.free[7] == 512);
+    sim_vm_destroy(vm);
+
+    /* as much RAM in pages as the stage 2 tables of a VM can map, not a page more */
+    other = sim_vm_create(1, 1, 62);
+    sim_set_colors(other, 0x0F);
+    SIM_CHECK(vm_mm_struct_init(other->mm) == RT_EOK && vm_memory_init(other->mm) == RT_EOK);
+    SIM_CHECK(s2_table_size(1) == sizeof(rt_ubase_t) * 1024 + 32 * 4096);
+    sim_vm_free_memory(other);
+    sim_vm_destroy(other);
+    other = sim_vm_create(1, 1, 64);
+    sim_set_colors(other, 0x0F);
+    SIM_CHECK(vm_mm_struct_init(other->mm) == -RT_EINVAL);
+    sim_vm_destroy(other);
+    other = sim_vm_create(1, 1, 64);
+    sim_set_colors(other, 0);
+    SIM_CHECK(vm_mm_struct_init(other->mm) == RT_EOK);
+    sim_vm_destroy(other);
+
+    SIM_CHECK(mem_color_init(0) == RT_EOK);
+    sim_arena_reset();
+}
+
+static void test_vm_balloon(void)
+{
+    rt_ubase_t bitmap[VM_DIRTY_WORDS(MEM_BLOCK_SIZE)];
+    rt_uint64_t ram = 0x40000000;
+    struct mem_color_stat stat;
+    rt_ubase_t pa, ppa;
+    rt_size_t size;
+    vm_t vm, child;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 16);
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK && vm_memory_init(vm->mm) == RT_EOK);
+    SIM_CHECK(hvc_call(HVC_FN64_BALLOON_INFO, HVC_BALLOON_GRANULE, 0, 0) == MEM_BLOCK_SIZE);
+    SIM_CHECK(hvc_call(HVC_FN64_BALLOON_INFO, HVC_BALLOON_SIZE, 0, 0) == 0);
+    SIM_CHECK(hvc_call(HVC_FN64_BALLOON_INFO, 3, 0, 0) == SMCCC_RET_INVALID_PARAMETER);
+    vm->mm->balloon_target = BYTE(4UL);
+    SIM_CHECK(hvc_call(HVC_FN64_BALLOON_INFO, HVC_BALLOON_TARGET, 0, 0) == BYTE(4UL));
+
+    /* misaligned, outside or past the end of guest RAM */
+    SIM_CHECK(hvc_call(HVC_FN64_BALLOON_INFLATE, ram + 0x1000, MEM_BLOCK_SIZE, 0)
+              == SMCCC_RET_INVALID_PARAMETER);
+    SIM_CHECK(hvc_call(HVC_FN64_BALLOON_INFLATE, ram, 0x1000, 0) == SMCCC_RET_INVALID_PARAMETER);
+    SIM_CHECK(hvc_call(HVC_FN64_BALLOON_INFLATE, 0x09000000, MEM_BLOCK_SIZE, 0)
+              == SMCCC_RET_INVALID_PARAMETER);
+    SIM_CHECK(hvc_call(HVC_FN64_BALLOON_INFLATE, ram + BYTE(14UL), BYTE(4UL), 0)
+              == SMCCC_RET_INVALID_PARAMETER);
+
+    /* blocks given back are unmapped, twice is once */
+    rt_memset(sim_guest_page(vm, ram + BYTE(4UL)), 0x5A, 4096);
+    SIM_CHECK(hvc_call(HVC_FN64_BALLOON_INFLATE, ram + BYTE(4UL), BYTE(4UL), 0) == SMCCC_RET_SUCCESS);
+    SIM_CHECK(vm->mm->mem_used == BYTE(12UL) && vm->mm->balloon == BYTE(4UL));
+    SIM_CHECK(s2_translate(vm->mm, ram + BYTE(4UL), &pa) != RT_EOK);
+    SIM_CHECK(s2_translate(vm->mm, ram + BYTE(6UL) + 0x1000, &pa) != RT_EOK);
+    SIM_CHECK(s2_translate(vm->mm, ram + BYTE(8UL), &pa) == RT_EOK);
+    SIM_CHECK(sim_mem_block(vm, ram + BYTE(4UL))->ptr == RT_NULL);
+    SIM_CHECK(vm_balloon_inflate(vm->mm, ram + BYTE(4UL), MEM_BLOCK_SIZE) == RT_EOK);
+    SIM_CHECK(vm->mm->balloon == BYTE(4UL));
+
+    /* taken back zeroed, as a block again */
+    SIM_CHECK(hvc_call(HVC_FN64_BALLOON_DEFLATE, ram + BYTE(4UL), MEM_BLOCK_SIZE, 0) == SMCCC_RET_SUCCESS);
+    SIM_CHECK(vm->mm->mem_used == BYTE(14UL) && vm->mm->balloon == BYTE(2UL));
+    SIM_CHECK(sim_page_is(sim_guest_page(vm, ram + BYTE(4UL)), 0));
+    SIM_CHECK(sim_s2_ap(vm->mm, ram + BYTE(4UL), &size) == S2_AP_RW && size == S2_PMD_SIZE);
+
+    /* while logging, RAM taken back is dirty */
+    SIM_CHECK(vm_dirty_log_start(vm->mm) == RT_EOK);
+    SIM_CHECK(vm_balloon_deflate(vm->mm, ram + BYTE(6UL), MEM_BLOCK_SIZE) == RT_EOK);
+    SIM_CHECK(vm_dirty_log_get(vm->mm, ram + BYTE(6UL), MEM_BLOCK_SIZE, bitmap) == RT_EOK);
+    SIM_CHECK(bitmap[0] == ~0UL && bitmap[VM_DIRTY_WORDS(MEM_BLOCK_SIZE) - 1] == ~0UL);
+    vm_dirty_log_stop(vm->mm);
+    SIM_CHECK(vm->mm->mem_used == BYTE(16UL) && vm->mm->balloon == 0);
+
+    /* a clone keeps the holes, a shared block goes with its last user */
+    SIM_CHECK(vm_balloon_inflate(vm->mm, ram + BYTE(8UL), MEM_BLOCK_SIZE) == RT_EOK);
+    child = sim_vm_create(1, 1, 16);
+    SIM_CHECK(vm_mm_struct_init(child->mm) == RT_EOK);
+    SIM_CHECK(vm_memory_clone(child->mm, vm->mm) == RT_EOK);
+    SIM_CHECK(child->mm->balloon == MEM_BLOCK_SIZE);
+    SIM_CHECK(s2_translate(child->mm, ram + BYTE(8UL), &pa) != RT_EOK);
+    SIM_CHECK(s2_translate(vm->mm, ram, &ppa) == RT_EOK);
+    SIM_CHECK(hvc_call(HVC_FN64_BALLOON_INFLATE, ram, MEM_BLOCK_SIZE, 0) == SMCCC_RET_SUCCESS);
+    SIM_CHECK(*sim_mem_block(vm, ram)->ref == 1 && child->mm->mem_used == 0);
+    SIM_CHECK(s2_translate(vm->mm, ram, &pa) == RT_EOK && pa == ppa);
+
+    /* with the pages it copied */
+    SIM_CHECK(vm_mem_write_fault(child->mm, ram + MEM_BLOCK_SIZE + 0x1000) == RT_EOK);
+    SIM_CHECK(child->mm->mem_used == S2_PTE_SIZE);
+    SIM_CHECK(vm_balloon_inflate(child->mm, ram + MEM_BLOCK_SIZE, MEM_BLOCK_SIZE) == RT_EOK);
+    SIM_CHECK(child->mm->mem_used == 0 && child->mm->balloon == BYTE(6UL));
+    sim_vm_free_memory(child);
+    sim_vm_destroy(child);
+    sim_vm_free_memory(vm);
+    SIM_CHECK(vm->mm->mem_used == 0);
+    sim_vm_destroy(vm);
+
+    /* cache colored RAM in pages of the colors it had */
+    SIM_CHECK(mem_color_init(16) == RT_EOK);
+    vm = sim_vm_create(2, 1, 4);
+    sim_set_colors(vm, 0xF0);
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK && vm_memory_init(vm->mm) == RT_EOK);
+    SIM_CHECK(vm_balloon_granule(vm->mm) == S2_PTE_SIZE);
+    mem_color_get_stat(&stat);
+    size = stat.free[7];
+    SIM_CHECK(vm_balloon_inflate(vm->mm, ram + 0x3000, 0x1000) == RT_EOK);
+    SIM_CHECK(s2_translate(vm->mm, ram + 0x3000, &pa) != RT_EOK);
+    SIM_CHECK(s2_translate(vm->mm, ram + 0x4000, &pa) == RT_EOK);
+    mem_color_get_stat(&stat);
+    SIM_CHECK(stat.free[7] == size + 1 && vm->mm->balloon == 0x1000);
+    SIM_CHECK(vm_balloon_deflate(vm->mm, ram + 0x3000, 0x1000) == RT_EOK);
+    SIM_CHECK(s2_translate(vm->mm, ram + 0x3000, &pa) == RT_EOK && mem_color_of((void *)pa) == 7);
+    SIM_CHECK(vm->mm->mem_used == BYTE(4UL) && vm->mm->balloon == 0);
+    sim_set_colors(vm, 0);
+    sim_vm_free_memory(vm);
+    sim_vm_destroy(vm);
+    SIM_CHECK(mem_color_init(0) == RT_EOK);
+    sim_arena_reset();
+}
+
+/* stage 2 memory type and execute never of the leaf at @ipa */
+static rt_uint64_t sim_s2_attr(struct mm_struct *mm, rt_uint64_t ipa, rt_size_t *size)
+{
+    rt_uint64_t *entry = s2_walk(mm, ipa, size);
+
+    return entry ? *entry & ((0b1111UL << 2) | (0b11UL << 53)) : ~0UL;
+}
+
+static void test_vm_mem_regions(void)
+{
+    struct mem_info *mem;
+    rt_ubase_t pa, opa;
+    rt_size_t size;
+    vm_t vm, other, bad;
+
+    /* RAM, a 1MB DMA buffer, write through RAM below it and a shared window */
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    SIM_CHECK(mem_color_init(0) == RT_EOK);
+    vm = sim_vm_create(0, 1, 8);
+    other = sim_vm_create(1, 1, 8);
+    mem = &((struct os_desc *)vm->os)->mem;
+    mem->region[1] = (struct mem_region) { 0x50000000, 1, VM_NORMAL_NC | VM_RW, 0 };
+    mem->region[2] = (struct mem_region) { 0x48000000, 4, VM_NORMAL_WT | VM_RWX, 0 };
+    mem->region[3] = (struct mem_region) { 0x60000000, 2, VM_SHARED | VM_NORMAL_WB | VM_RW, 0 };
+    mem->num = 4;
+
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK && vm_memory_init(vm->mm) == RT_EOK);
+    SIM_CHECK(vm->mm->mem_size == 15 && vm->mm->mem_used == BYTE(13UL));
+    SIM_CHECK(rt_list_entry(vm->mm->vm_area_used.next, struct vm_area, node)->desc.vaddr_start == 0x40000000);
+    SIM_CHECK(rt_list_entry(vm->mm->vm_area_used.prev, struct vm_area, node)->desc.vaddr_start == 0x60000000);
+
+    /* each region in its granule, with its own attributes */
+    SIM_CHECK(sim_s2_attr(vm->mm, 0x40000000, &size) == S2_MEMATTR_NORMAL_WB && size == S2_PMD_SIZE);
+    SIM_CHECK(sim_s2_attr(vm->mm, 0x48200000, &size) == S2_MEMATTR_NORMAL_WT && size == S2_PMD_SIZE);
+    SIM_CHECK(sim_s2_attr(vm->mm, 0x500FF000, &size) == (S2_MEMATTR_NORMAL_NC | S2_XN_NONE)
+              && size == S2_PTE_SIZE);
+    SIM_CHECK(sim_s2_attr(vm->mm, 0x60000000, &size) == (S2_MEMATTR_NORMAL_WB | S2_XN_NONE));
+    SIM_CHECK(s2_translate(vm->mm, 0x50100000, &pa) != RT_EOK);
+    SIM_CHECK(s2_translate(vm->mm, 0x48400000, &pa) != RT_EOK);
+
+    /* lookups stay in one region */
+    SIM_CHECK(vm_ram_area(vm->mm, 0x500FF000, 0x1000) != RT_NULL);
+    SIM_CHECK(vm_ram_area(vm->mm, 0x500FF000, 0x2000) == RT_NULL);
+    SIM_CHECK(vm_ram_area(vm->mm, 0x48400000, 1) == RT_NULL);
+
+    /* the shared window is one for both VMs, the guest cannot balloon it */
+    SIM_CHECK(vm_mm_struct_init(other->mm) == RT_EOK && vm_memory_init(other->mm) == RT_EOK);
+    SIM_CHECK(other->mm->mem_used == BYTE(13UL));
+    SIM_CHECK(hvc_call(HVC_FN64_BALLOON_INFO, HVC_BALLOON_GRANULE, 0, 0) == MEM_BLOCK_SIZE);
+    SIM_CHECK(s2_translate(vm->mm, 0x60001000, &pa) == RT_EOK);
+    SIM_CHECK(s2_translate(other->mm, 0x60001000, &opa) == RT_EOK && pa == opa);
+    SIM_CHECK(s2_translate(other->mm, 0x40001000, &opa) == RT_EOK && pa != opa);
+    SIM_CHECK(vm_balloon_inflate(vm->mm, 0x60000000, MEM_BLOCK_SIZE) == -RT_EINVAL);
+    SIM_CHECK(vm_memory_block(vm->mm, 0x60000000) == RT_NULL);
+
+    /* it outlives the first VM to go */
+    *(rt_uint32_t *)pa = 0xC0DE;
+    sim_vm_free_memory(vm);
+    SIM_CHECK(s2_translate(other->mm, 0x60001000, &opa) == RT_EOK && *(rt_uint32_t *)opa == 0xC0DE);
+
+    /* overlapping regions, a shared window of another size */
+    bad = sim_vm_create(2, 1, 8);
+    mem->region[3].addr = 0x40600000;
+    mem->num = 4;
+    SIM_CHECK(vm_mm_struct_init(bad->mm) == -RT_EINVAL);
+    sim_vm_free_memory(bad);
+    mem->region[3] = (struct mem_region) { 0x60000000, 4, VM_SHARED | VM_NORMAL_WB | VM_RW, 0 };
+    SIM_CHECK(vm_mm_struct_init(bad->mm) == RT_EOK && vm_memory_init(bad->mm) == -RT_EINVAL);
+    sim_vm_free_memory(bad);
+    sim_vm_destroy(bad);
+
+    sim_vm_free_memory(other);
+    sim_vm_destroy(other);
+    sim_vm_destroy(vm);
+    mem->num = 1;
+    sim_arena_reset();
+}
+
+static rt_size_t sim_tc_used(struct mm_struct *mm)
+{
+    rt_size_t n = 0;
+
+    for (rt_size_t i = 0; i < S2_TC_NUM; i++)
+        n += (mm->tc.entry[i].size != 0);
+    return n;
+}
+
+static void test_s2_tc(void)
+{
+    rt_uint64_t ram = 0x40000000;
+    rt_ubase_t pa, pa0, pa1;
+    rt_size_t size;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    vm = sim_vm_create(0, 1, 64);
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK && vm_memory_init(vm->mm) == RT_EOK);
+    SIM_CHECK(sim_tc_used(vm->mm) == 0);
+
+    /* a miss fills a block, the rest of the block hits */
+    SIM_CHECK(s2_translate(vm->mm, ram + 0x1234, &pa0) == RT_EOK);
+    SIM_CHECK(sim_tc_used(vm->mm) == 1 && vm->mm->tc.entry[0].size == S2_PMD_SIZE);
+    SIM_CHECK(s2_translate(vm->mm, ram + MEM_BLOCK_SIZE - 1, &pa) == RT_EOK
+              && pa == pa0 - 0x1234 + MEM_BLOCK_SIZE - 1);
+    SIM_CHECK(sim_tc_used(vm->mm) == 1);
+    SIM_CHECK(s2_lookup(vm->mm, 0x09000000, &size) == 0 && sim_tc_used(vm->mm) == 1);
+
+    /* more blocks than slots, a later one takes the slot over */
+    for (rt_uint64_t ipa = ram; ipa < ram + BYTE(64UL); ipa += MEM_BLOCK_SIZE)
+        SIM_CHECK(s2_translate(vm->mm, ipa + 8, &pa) == RT_EOK && pa == (rt_ubase_t)sim_mem_block(vm, ipa)->ptr + 8);
+    SIM_CHECK(sim_tc_used(vm->mm) == S2_TC_NUM && vm->mm->tc.entry[0].ipa == ram + BYTE(32UL));
+    SIM_CHECK(s2_translate(vm->mm, ram + 0x1234, &pa) == RT_EOK && pa == pa0);
+
+    /* a remap is seen at once */
+    SIM_CHECK(s2_translate(vm->mm, ram + MEM_BLOCK_SIZE, &pa1) == RT_EOK);
+    SIM_CHECK(s2_remap(vm->mm, ram, pa1, S2_AP_RW) == RT_EOK && sim_tc_used(vm->mm) == 0);
+    SIM_CHECK(s2_translate(vm->mm, ram + 0x1234, &pa) == RT_EOK && pa == pa1 + 0x1234);
+    SIM_CHECK(s2_remap(vm->mm, ram, pa0 - 0x1234, S2_AP_RW) == RT_EOK);
+
+    /* split into pages, then unmapped */
+    SIM_CHECK(s2_translate(vm->mm, ram + 0x1234, &pa) == RT_EOK && pa == pa0);
+    SIM_CHECK(s2_split_block(vm->mm, ram) == RT_EOK);
+    SIM_CHECK(s2_lookup(vm->mm, ram + 0x1234, &size) && size == S2_PTE_SIZE);
+    SIM_CHECK(s2_unmap(vm->mm, ram + 0x1000, ram + 0x2000) == RT_EOK);
+    SIM_CHECK(s2_translate(vm->mm, ram + 0x1234, &pa) != RT_EOK);
+    SIM_CHECK(s2_translate(vm->mm, ram + 0x2234, &pa) == RT_EOK && pa == pa0 + 0x1000);
+
+    sim_vm_free_memory(vm);
+    sim_vm_destroy(vm);
+    sim_arena_reset();
+}
+
+static void test_vm_copy_guest(void)
+{
+    static rt_uint8_t src[3 * 4096 + 256], dst[sizeof(src)];
+    rt_uint64_t ram = 0x40000000, win = 0x50000000;
+    struct mem_info *mem;
+    rt_ubase_t pa, ppa;
+    rt_size_t size;
+    vm_t vm, child;
+
+    for (rt_size_t i = 0; i < sizeof(src); i++)
+        src[i] = (rt_uint8_t)(i * 7 + 3);
+
+    /* 8MB in blocks and a 1MB window in pages */
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    SIM_CHECK(mem_color_init(0) == RT_EOK);
+    vm = sim_vm_create(0, 1, 8);
+    child = sim_vm_create(1, 1, 8);
+    mem = &((struct os_desc *)vm->os)->mem;
+    mem->region[1] = (struct mem_region) { win, 1, VM_NORMAL | VM_RW, 0 };
+    mem->num = 2;
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK && vm_memory_init(vm->mm) == RT_EOK);
+
+    /* across pages that are apart in host memory */
+    SIM_CHECK(vm_copy_to_guest(vm->mm, win + 0xF00, src, sizeof(src)) == RT_EOK);
+    for (rt_size_t i = 0; i < sizeof(src); i += 0x80)
+        SIM_CHECK(s2_translate(vm->mm, win + 0xF00 + i, &pa) == RT_EOK && *(rt_uint8_t *)pa == src[i]);
+    SIM_CHECK(vm_copy_from_guest(vm->mm, dst, win + 0xF00, sizeof(src)) == RT_EOK);
+    SIM_CHECK(memcmp(src, dst, sizeof(src)) == 0);
+
+    /* across blocks */
+    SIM_CHECK(vm_copy_to_guest(vm->mm, ram + MEM_BLOCK_SIZE - 0x10, src, 0x40) == RT_EOK);
+    rt_memset(dst, 0, sizeof(dst));
+    SIM_CHECK(vm_copy_from_guest(vm->mm, dst, ram + MEM_BLOCK_SIZE - 0x10, 0x40) == RT_EOK);
+    SIM_CHECK(memcmp(src, dst, 0x40) == 0);
+    SIM_CHECK(s2_translate(vm->mm, ram + MEM_BLOCK_SIZE, &pa) == RT_EOK && *(rt_uint8_t *)pa == src[0x10]);
+
+    /* one region at a time, never past RAM */
+    SIM_CHECK(vm_copy_to_guest(vm->mm, win + BYTE(1UL) - 0x10, src, 0x20) == -RT_EINVAL);
+    SIM_CHECK(vm_copy_from_guest(vm->mm, dst, ram + BYTE(8UL) - 0x10, 0x20) == -RT_EINVAL);
+    SIM_CHECK(vm_copy_from_guest(vm->mm, dst, 0x09000000, 4) == -RT_EINVAL);
+    SIM_CHECK(vm_copy_to_guest(vm->mm, 0x09000000, src, 0) == RT_EOK);
+
+    /* a write to a shared block copies the page, as the guest's would */
+    sim_vm_free_memory(vm);
+    clear_s2_mmu_table(vm->id);
+    clear_s2_mmu_page_group(vm->id);
+    mem->num = 1;
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK && vm_memory_init(vm->mm) == RT_EOK);
+    SIM_CHECK(vm_mm_struct_init(child->mm) == RT_EOK);
+    SIM_CHECK(vm_memory_clone(child->mm, vm->mm) == RT_EOK);
+    SIM_CHECK(s2_translate(vm->mm, ram + 0x1000, &ppa) == RT_EOK);
+    *(rt_uint32_t *)ppa = 0x5A5A5A5A;
+    SIM_CHECK(vm_copy_to_guest(child->mm, ram + 0x1000, src, 4) == RT_EOK);
+    SIM_CHECK(sim_s2_ap(child->mm, ram + 0x1000, &size) == S2_AP_RW && size == S2_PTE_SIZE);
+    SIM_CHECK(s2_translate(child->mm, ram + 0x1000, &pa) == RT_EOK && pa != ppa);
+    SIM_CHECK(memcmp((void *)pa, src, 4) == 0 && *(rt_uint32_t *)ppa == 0x5A5A5A5A);
+    SIM_CHECK(vm_copy_from_guest(child->mm, dst, ram + 0x1000, 4) == RT_EOK && memcmp(dst, src, 4) == 0);
+
+    sim_vm_free_memory(child);
+    sim_vm_free_memory(vm);
+    sim_vm_destroy(child);
+    sim_vm_destroy(vm);
+    sim_arena_reset();
+}
+
+static rt_uint64_t sim_quota_total(const struct mem_quota_stat *stat)
+{
+    return stat->used[VM_MEM_RAM] + stat->used[VM_MEM_VGIC] + stat->used[VM_MEM_VCPU];
+}
+
+static void test_mem_quota(void)
+{
+    struct mem_quota_stat before, stat;
+    struct mem_info *mem;
+    rt_uint64_t vgic;
+    vm_t vm, other;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    SIM_CHECK(mem_color_init(0) == RT_EOK);
+    mem_quota_get_stat(&before);
+
+    /* vgic_init() charges the vGIC of every vCPU to the VM */
+    vm = sim_vm_create(0, 2, 12);
+    other = sim_vm_create(1, 1, 12);
+    vgic = vm->mm->quota.used[VM_MEM_VGIC] + other->mm->quota.used[VM_MEM_VGIC];
+    SIM_CHECK(other->mm->quota.used[VM_MEM_VGIC] > 0);
+    SIM_CHECK(vm->mm->quota.used[VM_MEM_VGIC] > other->mm->quota.used[VM_MEM_VGIC]);
+    mem_quota_get_stat(&stat);
+    SIM_CHECK(stat.used[VM_MEM_VGIC] == before.used[VM_MEM_VGIC] + vgic);
+
+    /* RAM is charged whole before any block, the second VM does not fit */
+    SIM_CHECK(mem_quota_init(sim_quota_total(&stat) + BYTE(20UL)) == RT_EOK);
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK && vm_memory_init(vm->mm) == RT_EOK);
+    SIM_CHECK(vm->mm->quota.used[VM_MEM_RAM] == BYTE(12UL) && vm->mm->mem_used == BYTE(12UL));
+    SIM_CHECK(s2_table_size(vm->id) > s2_table_size(other->id));
+    SIM_CHECK(vm_mm_struct_init(other->mm) == RT_EOK);
+    SIM_CHECK(vm_memory_init(other->mm) == -RT_ENOMEM);
+    SIM_CHECK(other->mm->mem_used == 0 && other->mm->quota.used[VM_MEM_RAM] == 0);
+    mem_quota_get_stat(&stat);
+    SIM_CHECK(stat.denied == before.denied + 1);
+    SIM_CHECK(stat.used[VM_MEM_RAM] == before.used[VM_MEM_RAM] + BYTE(12UL));
+
+    /* charged once, given back with the RAM */
+    SIM_CHECK(vm_memory_init(vm->mm) == RT_EOK && vm->mm->quota.used[VM_MEM_RAM] == BYTE(12UL));
+    sim_vm_free_memory(vm);
+    SIM_CHECK(vm->mm->quota.used[VM_MEM_RAM] == 0);
+    SIM_CHECK(vm_memory_init(other->mm) == RT_EOK && other->mm->quota.used[VM_MEM_RAM] == BYTE(12UL));
+
+    /* the limit of a VM holds its RAM and vGIC, with no budget */
+    SIM_CHECK(mem_quota_init(0) == RT_EOK);
+    clear_s2_mmu_table(vm->id);
+    clear_s2_mmu_page_group(vm->id);
+    mem = &((struct os_desc *)vm->os)->mem;
+    mem->limit = 12;
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK && vm->mm->quota.limit == BYTE(12UL));
+    SIM_CHECK(vm_memory_init(vm->mm) == -RT_ENOMEM && vm->mm->mem_used == 0);
+    sim_vm_free_memory(vm);
+    mem->limit = 13;
+    SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK && vm_memory_init(vm->mm) == RT_EOK);
+    SIM_CHECK(mem_quota_used(&vm->mm->quota) <= BYTE(13UL));
+    mem->limit = 0;
+
+    sim_vm_free_memory(other);
+    sim_vm_free_memory(vm);
+    sim_vm_destroy(other);
+    sim_vm_destroy(vm);
+    mem_quota_get_stat(&stat);
+    SIM_CHECK(sim_quota_total(&stat) == sim_quota_total(&before));
+    sim_arena_reset();
+}
+
+/* create and delete a VM over and over, in the same pool blocks and tables */
+static void test_vm_teardown(void)
+{
+    rt_uint8_t *region = rt_malloc_align(8 * MEM_BLOCK_SIZE, MEM_BLOCK_SIZE);
+    struct mem_quota_stat before, stat;
+    struct mem_pool_stat pool;
+    struct mem_info *mem;
+    rt_uint64_t flush;
+    rt_size_t base;
+    rt_ubase_t pa;
+    vm_t vm;
+
+    sim_sysreg_reset(SIM_NR_LR_DEFAULT);
+    SIM_CHECK(mem_color_init(0) == RT_EOK);
+    SIM_CHECK(mem_pool_init(region, 8 * MEM_BLOCK_SIZE) == RT_EOK);
+    mem_quota_get_stat(&before);
+    base = s2_table_size(3);
+
+    for (rt_size_t round = 0; round < 16; round++)
+    {
+        vm = sim_vm_create(3, 2, 6);
+        mem = &((struct os_desc *)vm->os)->mem;
+        mem->region[1] = (struct mem_region) { 0x50000000, 1, VM_NORMAL | VM_RW, 0 };
+        mem->num = 2;
+
+        /* a new VM of a reused index finds nothing mapped */
+        SIM_CHECK(vm_mm_struct_init(vm->mm) == RT_EOK);
+        SIM_CHECK(s2_translate(vm->mm, 0x40000000, &pa) != RT_EOK);
+        SIM_CHECK(s2_table_size(3) == base);
+
+        SIM_CHECK(vm_memory_init(vm->mm) == RT_EOK);
+        SIM_CHECK(s2_translate(vm->mm, 0x50000000, &pa) == RT_EOK);
+        SIM_CHECK(s2_table_size(3) > base);
+        mem_pool_get_stat(&pool);
+        SIM_CHECK(pool.clean + pool.dirty == 4);
+
+        /* tables, TLB, RAM and vm_areas in one go, the VMID is flushed */
+        flush = sim_stats.tlb_flush;
+        vm_mm_struct_free(vm->mm);
+        SIM_CHECK(sim_stats.tlb_flush == flush + 1);
+        SIM_CHECK(s2_table_size(3) == base);
+        SIM_CHECK(vm->mm->pgd_tbl == RT_NULL && rt_list_isempty(&vm->mm->vm_area_used));
+        SIM_CHECK(vm->mm->mem_used == 0 && vm->mm->quota.used[VM_MEM_RAM] == 0);
+        mem_pool_get_stat(&pool);
+        SIM_CHECK(pool.clean + pool.dirty == 7);    /* one split for 4K pages */
+
+        /* twice is harmless, vm_free() may follow a failed vm_init() */
+        vm_mm_struct_free(vm->mm);
+        sim_vm_destroy(vm);
+        mem->num = 1;
+
+        mem_quota_get_stat(&stat);
+        SIM_CHECK(sim_quota_total(&stat) == sim_quota_total(&before));
+    }
+
+    SIM_CHECK(mem_pool_init(RT_NULL, 0) == RT_EOK);
+    sim_arena_reset();
+}
+
+static const struct
+{
+    const char *name;
+    void (*fn)(void);
+} sim_tests[] =
+{
+    { "vgic_init",              test_vgic_init },
+    { "vgic_inject_one",        test_vgic_inject_one },
+    { "vgic_inject_priority",   test_vgic_inject_priority },
+    { "vgic_halt_wakeup",       test_vgic_halt_wakeup },
+    { "vgic_lr_list_overflow",  test_vgic_lr_list_overflow },
+    { "vgic_context_switch",    test_vgic_context_switch },
+    { "vgic_emulate",           test_vgic_emulate },
+    { "vdev_mmio_dispatch",     test_vdev_mmio_dispatch },
+    { "vdev_coalesced",         test_vdev_coalesced },
+    { "vdev_ioevent",           test_vdev_ioevent },
+    { "mmio_insn_decode",       test_mmio_insn_decode },
+    { "mmio_insn_emulate",      test_mmio_insn_emulate },
+    { "mmio_insn_cache",        test_mmio_insn_cache },
+    { "vpl011",                 test_vpl011 },
+    { "s2_map_block",           test_s2_map_block },
+    { "s2_map_page",            test_s2_map_page },
+    { "s2_unmap",               test_s2_unmap },
+    { "vm_memory_init",         test_vm_memory_init },
+    { "dirty_log",              test_dirty_log },
+    { "mem_pool",               test_mem_pool },
+    { "mem_color",              test_mem_color },
+    { "hvc_dispatch",           test_hvc_dispatch },
+    { "hvc_multicall",          test_hvc_multicall },
+    { "fdt_parse_vms",          test_fdt_parse_vms },
+    { "fdt_gen_guest",          test_fdt_gen_guest },
+    { "os_img_load_file",       test_os_img_load_file },
+    { "vm_snapshot",            test_vm_snapshot },
+    { "vm_clone",               test_vm_clone },
+    { "mem_merge",              test_mem_merge },
+    { "vm_balloon",             test_vm_balloon },
+    { "vm_mem_regions",         test_vm_mem_regions },
+    { "s2_tc",                  test_s2_tc },
+    { "vm_copy_guest",          test_vm_copy_guest },
+    { "mem_quota",              test_mem_quota },
+    { "vm_teardown",            test_vm_teardown },
+};
+
+int main(int argc, char **argv)
+{
+    sim_verbose = (argc > 1 && strcmp(argv[1], "-v") == 0);
+
+    for (rt_size_t i = 0; i < sizeof(sim_tests) / sizeof(sim_tests[0]); i++)
+    {
+        int failed = sim_failed;
+
+        sim_tests[i].fn();
+        printf("[%s] %s\n", failed == sim_failed ? "PASS" : "FAIL", sim_tests[i].name);
+    }
+
+    printf("%d checks, %d failed\n", sim_checked, sim_failed);
+    return sim_failed ? 1 : 0;
+}
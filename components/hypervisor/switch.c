@@ -14,6 +14,11 @@
 #include "virt_arch.h"
 #include "vm.h"
 
+#ifdef RT_HYPERVISOR_BENCH
+#include <gtimer.h>
+#include "hyp_bench.h"
+#endif
+
 rt_bool_t is_vcpu_thread(rt_thread_t tid)
 {
     return tid->vcpu != RT_NULL;
@@ -84,6 +89,10 @@ void switch_hook(rt_thread_t from, rt_thread_t to)
      * According thread switch type to choose different switch handler.
      */
     rt_uint8_t thread_switch_type = this_switch_type(from, to);
+#ifdef RT_HYPERVISOR_BENCH
+    rt_uint64_t stamp = rt_hw_get_cntpct_val();
+#endif
+
     switch (thread_switch_type)
     {
     case HOST_TO_GUEST:
@@ -104,4 +113,13 @@ void switch_hook(rt_thread_t from, rt_thread_t to)
     default:
         break;
     }
+
+#ifdef RT_HYPERVISOR_BENCH
+    if (thread_switch_type == HOST_TO_GUEST)
+        hyp_bench_switch_record(thread_switch_type, to->vcpu, 
+                                rt_hw_get_cntpct_val() - stamp);
+    else if (thread_switch_type == GUEST_TO_HOST)
+        hyp_bench_switch_record(thread_switch_type, from->vcpu, 
+                                rt_hw_get_cntpct_val() - stamp);
+#endif
 }
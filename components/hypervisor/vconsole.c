@@ -6,85 +6,128 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-10-03     Suqier       first version
+ * 2022-11-24     Suqier       emulate PL011, buffered output
+ * 2022-11-28     Suqier       multiplex VM output, attach moves input only
+ * 2022-12-11     Suqier       free the vConsole of a deleted VM
+ * 2022-12-12     Suqier       coalesce guest output
  */
 
+#include <rthw.h>
 #include <rtthread.h>
 #include <rtconfig.h>
 
 // #if defined(RT_USING_DEVICE) && defined(RT_USING_CONSOLE)
-#include "drv_uart.h"
 #include "vconsole.h"
+#include "vpl011.h"
 #include "hypervisor.h"
-#include "vgic.h"
 #include "os.h"
 
-extern struct hypervisor rt_hyp;
+#ifdef RT_USING_DFS
+#include <unistd.h>
+#include <fcntl.h>
+#endif
 
-#define MAX_OS_NUM  3
-extern const struct os_desc os_img[MAX_OS_NUM];
+#define VC_CTRL_B           (0x02)  /* ctrl + B to quit VM */
+#define VC_THREAD_STACK     (2048)
+#define VC_TX_CHUNK         (64)
+#define VC_LINE_MAX         (128)
 
-const static struct vdev_ops vc_ops = 
-{
-    .mmio = console_mmio_handler,
-};
+#ifndef RT_HYPERVISOR_VC_LOG_SIZE
+#define RT_HYPERVISOR_VC_LOG_SIZE   4096
+#endif
+#define VC_LOG_MASK         (RT_HYPERVISOR_VC_LOG_SIZE - 1)
 
-/*  
- * Get Guest OS device information from device tree.
+extern struct hypervisor rt_hyp;
+
+/*
+ * Every VM owns an emulated PL011 and a ring of its recent output, the
+ * physical UART is never handed to a guest. The "vcon" thread drains all
+ * TX FIFOs into the rings and multiplexes them line by line, tagged with
+ * the VM id, onto the UART or a file. Attaching a VM only moves keyboard
+ * input from finsh to that VM.
  */
-void get_vc_mmap_region(vdev_t vc, struct vm *vm)
+struct vconsole
 {
-    struct dev_info *dev    = os_img[vm->os_idx].devs.dev;
+    struct vpl011 uart;
 
-    vc->region->paddr_start = dev->paddr;
-    vc->region->vaddr_start = dev->vaddr;
-    vc->region->vaddr_end   = dev->vaddr + dev->size;
-    vc->region->attr        = DEVICE_MEM;
-}
+    /* recent output, the oldest bytes are overwritten */
+    rt_uint32_t log_head;
+    rt_uint32_t log_tail;
+    rt_uint8_t  log[RT_HYPERVISOR_VC_LOG_SIZE];
+
+    /* pending line, goes out as a whole unless the VM is attached */
+    rt_uint32_t line_len;
+    rt_uint8_t  line[VC_LINE_MAX];
+};
+typedef struct vconsole *vconsole_t;
+
+static struct rt_thread vc_thread;
+static rt_uint8_t vc_stack[VC_THREAD_STACK];
+static struct rt_semaphore vc_sem;
+static struct rt_mutex vc_mux_lock;
+static volatile rt_bool_t vc_detach_req = RT_FALSE;
+
+/* multiplexer sink, the UART unless a file is set */
+static rt_device_t vc_uart = RT_NULL;
+static rt_err_t (*vc_host_rx_ind)(rt_device_t dev, rt_size_t size) = RT_NULL;
+static int vc_mux_fd = -1;
+static rt_uint8_t vc_mux_owner = MAX_VM_NUM;    /* VM of the unfinished line */
+static rt_bool_t vc_mux_bol = RT_TRUE;          /* sink at beginning of line */
 
-static void vc_init(vdev_t vc, struct vm *vm)
+static void vc_tx_notify(vpl011_t uart)
 {
-    RT_ASSERT(vc && vm);
-    
-    /* memory leak */
-    vc->dev = rt_device_find(RT_CONSOLE_DEVICE_NAME);
-    vc->vm = vm;
-    vc->mmap_num = 1;
-    get_vc_mmap_region(vc, vm);
-    rt_list_insert_after(&vm->dev_list, &vc->node);
-    vc->is_open = RT_FALSE;
-    vc->ops = &vc_ops;
+    rt_sem_release(&vc_sem);
 }
 
 rt_err_t vc_create(struct vm *vm)
 {
-    vdev_t vc = (vdev_t)rt_malloc(sizeof(struct vdev));
+    struct dev_info *dev = vm->os->devs.dev;
+    vconsole_t vc;
+
+    if (vm->os->devs.num == 0)  /* Guest OS without UART */
+        return RT_EOK;
 
+    vc = (vconsole_t)rt_malloc(sizeof(struct vconsole));
     if (vc == RT_NULL)
     {
         rt_kputs("[Error] Alloc memory for vConsole failure\n");
         return -RT_ENOMEM;
     }
 
-    vc_init(vc, vm);
+    vpl011_init(&vc->uart, dev->vaddr, dev->size, dev->interrupts[0]);
+    vc->uart.vdev.dev = rt_device_find(RT_CONSOLE_DEVICE_NAME);
+    vc->uart.tx_notify = vc_tx_notify;
+    vc->log_head = vc->log_tail = 0;
+    vc->line_len = 0;
+    vdev_register(vm, &vc->uart.vdev);
+
+    /* output bytes skip emulation in their exit, without it they don't */
+    if (vpl011_coalesce_tx(&vc->uart) != RT_EOK)
+        rt_kprintf("[Info] %dth VM: vConsole output not coalesced\n", vm->id);
     return RT_EOK;
 }
- 
-static vdev_t get_curr_vc(void)
+
+static vconsole_t get_vc(struct vm *vm)
 {
-    if (rt_hyp.curr_vc_idx != MAX_VM_NUM)
-    {
-        struct rt_list_node *pos;
+    struct rt_list_node *pos;
 
-        rt_list_for_each(pos, &rt_hyp.vms[rt_hyp.curr_vc_idx]->dev_list)
-        {
-            vdev_t vdev = rt_list_entry(pos, struct vdev, node);
+    rt_list_for_each(pos, &vm->dev_list)
+    {
+        vdev_t vdev = rt_list_entry(pos, struct vdev, node);
 
-            if (rt_strcmp(vdev->dev->parent.name, RT_CONSOLE_DEVICE_NAME) == 0)
-                return vdev;
-        }
+        if (vdev->dev && rt_strcmp(vdev->dev->parent.name, RT_CONSOLE_DEVICE_NAME) == 0)
+            return rt_container_of(vdev, struct vconsole, uart.vdev);
     }
 
-    return RT_NULL; /* Host console using UART */
+    return RT_NULL;
+}
+
+static vconsole_t get_curr_vc(void)
+{
+    if (rt_hyp.curr_vc_idx != MAX_VM_NUM)
+        return get_vc(rt_hyp.vms[rt_hyp.curr_vc_idx]);
+
+    return RT_NULL; /* keyboard input goes to Host finsh */
 }
 
 /* Justice whether this VM take console now */
@@ -93,75 +136,229 @@ rt_bool_t is_vm_take_console(struct vm *vm)
     return (rt_hyp.curr_vc_idx == vm->id);
 }
 
-void vc_detach(vdev_t vc)
+/* UART RX indication of the attached VM, in ISR. */
+static rt_err_t vc_rx_ind(rt_device_t dev, rt_size_t size)
 {
-    if (vc->dev != RT_NULL)     /* Host console NOT using UART */
+    vconsole_t vc = get_curr_vc();
+    rt_uint8_t buf[16];
+    rt_size_t n;
+
+    while ((n = rt_device_read(dev, 0, buf, sizeof(buf))) > 0)
     {
-        /* close device */
-        finsh_delete_device();  /* clear finsh device and reset flag */
-        rt_device_close(vc->dev);
-        vc->is_open = RT_FALSE;
-        rt_hyp.curr_vc_idx = MAX_VM_NUM;
-        vgic_virq_umount(vc->vm, PL011_UART0_IRQNUM);
+        for (rt_size_t i = 0; i < n; i++)
+        {
+            if (buf[i] == VC_CTRL_B)
+            {
+                if (vc && i)
+                    vpl011_rx_push(&vc->uart, buf, i);
+
+                /* give input back to finsh in vcon, not in ISR */
+                vc_detach_req = RT_TRUE;
+                rt_sem_release(&vc_sem);
+                return RT_EOK;
+            }
+        }
+
+        if (vc)
+            vpl011_rx_push(&vc->uart, buf, n);
     }
 
-    /* attach Host console */
-    rt_console_set_device(RT_CONSOLE_DEVICE_NAME);
-    finsh_set_device(RT_CONSOLE_DEVICE_NAME);
+    return RT_EOK;
+}
+
+void vc_detach(vdev_t vc)
+{
+    rt_base_t level;
+
+    /* the UART stays open, finsh gets its RX indication back */
+    level = rt_hw_interrupt_disable();
+    if (vc_uart)
+        rt_device_set_rx_indicate(vc_uart, vc_host_rx_ind);
+    rt_hyp.curr_vc_idx = MAX_VM_NUM;
+    rt_hw_interrupt_enable(level);
+
     rt_kprintf("\n[Info] Quit %dth VM, back to Host\n", vc->vm->id);
 }
 
 void vc_attach(struct vm *vm)
 {
-    vdev_t vc = get_curr_vc();
-    
-    if (vc == RT_NULL)  /* Host console using UART */
+    vconsole_t curr = get_curr_vc();
+    vconsole_t vc = get_vc(vm);
+    rt_base_t level;
+
+    if (vc == RT_NULL || vc_uart == RT_NULL)
     {
-        /* Close Host console */
-        rt_kprintf("[Info] Close Host console, Change to %dth VM\n", vm->id);
-        rt_console_close_device();
+        rt_kprintf("[Error] %dth VM: no device as %s\n", vm->id, RT_CONSOLE_DEVICE_NAME);
+        return;
     }
-    else    /* It's someone VM vConsole using UART */
-        vc_detach(vc);
 
-    struct rt_list_node *pos;
-    rt_list_for_each(pos, &vm->dev_list)
+    if (curr == RT_NULL)
+        rt_kprintf("[Info] Input to %dth VM, ctrl + B back to Host\n", vm->id);
+    else
+        rt_kprintf("[Info] Input from %dth VM to %dth VM\n", curr->uart.vdev.vm->id, vm->id);
+
+    level = rt_hw_interrupt_disable();
+    if (curr == RT_NULL)
+        vc_host_rx_ind = vc_uart->rx_indicate;
+    rt_hyp.curr_vc_idx = vm->id;
+    rt_device_set_rx_indicate(vc_uart, vc_rx_ind);
+    rt_hw_interrupt_enable(level);
+
+    /* a pending prompt of the VM goes out now */
+    rt_sem_release(&vc_sem);
+}
+
+static void vc_mux_write(const void *buf, rt_size_t size)
+{
+#ifdef RT_USING_DFS
+    if (vc_mux_fd >= 0)
     {
-        vdev_t vdev = rt_list_entry(pos, struct vdev, node);
-        if (rt_strcmp(vdev->dev->parent.name, RT_CONSOLE_DEVICE_NAME) == 0)
-        {
-            vdev->is_open = RT_TRUE;
-            rt_hyp.curr_vc_idx = vm->id;
+        write(vc_mux_fd, buf, size);
+        return;
+    }
+#endif
+    rt_device_write(vc_uart, 0, buf, size);
+}
 
-            /* Allocate device to VM then mount vIRQ */
-            vgic_virq_mount(vm, PL011_UART0_IRQNUM);
-            return;
-        }
+/* Put the pending line of @vm on the sink, "[vmN] " starts every line. */
+static void vc_mux_emit(struct vm *vm, vconsole_t vc)
+{
+    char tag[12];
+
+    if (!vc_mux_bol && vc_mux_owner != vm->id)
+    {
+        vc_mux_write("\n", 1);     /* another VM left its line open */
+        vc_mux_bol = RT_TRUE;
+    }
+    if (vc_mux_bol)
+    {
+        rt_snprintf(tag, sizeof(tag), "[vm%d] ", vm->id);
+        vc_mux_write(tag, rt_strlen(tag));
     }
 
-    rt_kprintf("[Error] %dth VM: no device as %s", vm->id, RT_CONSOLE_DEVICE_NAME);
-    return;
+    vc_mux_write(vc->line, vc->line_len);
+    vc_mux_bol = (vc->line[vc->line_len - 1] == '\n');
+    vc_mux_owner = vm->id;
+    vc->line_len = 0;
 }
 
-void console_mmio_handler(gp_regs_t regs, access_info_t acc)
+/*
+ * Free the vConsole of @vm, already out of rt_hyp.vms. Input goes back to
+ * finsh if @vm had it, and the next VM line starts on a line of its own.
+ */
+void vc_destroy(struct vm *vm)
 {
-    vdev_t vc = get_curr_vc();
-    if (vc == RT_NULL)      /* Host console using UART0 */
+    vconsole_t vc = get_vc(vm);
+    rt_base_t level;
+
+    if (vc == RT_NULL)
         return;
 
-    rt_uint64_t off = acc.addr - vc->region->vaddr_start;
-    unsigned long long *val = regs_xn(regs, acc.srt);
-    struct hw_uart_device *uart = (struct hw_uart_device *)vc->dev->user_data;
+    /* vcon may be draining it */
+    rt_mutex_take(&vc_mux_lock, RT_WAITING_FOREVER);
+    level = rt_hw_interrupt_disable();
+    if (rt_hyp.curr_vc_idx == vm->id)
+    {
+        if (vc_uart)
+            rt_device_set_rx_indicate(vc_uart, vc_host_rx_ind);
+        rt_hyp.curr_vc_idx = MAX_VM_NUM;
+    }
+    rt_hw_interrupt_enable(level);
 
-    if (acc.is_write)
+    if (vc_mux_owner == vm->id)
     {
-        if (*val == 0x2)    /* ctrl + B to quit VM*/
-            vc_detach(vc);
-        else
-            writel(*val, (volatile void *)(uart->hw_base + off));
+        if (!vc_mux_bol)
+            vc_mux_write("\n", 1);
+        vc_mux_owner = MAX_VM_NUM;
+        vc_mux_bol = RT_TRUE;
     }
-    else    /* read */
-        *val = readl((volatile void *)(uart->hw_base + off));
+    vdev_unregister(&vc->uart.vdev);
+    rt_mutex_release(&vc_mux_lock);
+
+    rt_free(vc);
+}
+
+static void vc_log_put(vconsole_t vc, const rt_uint8_t *buf, rt_size_t size)
+{
+    for (rt_size_t i = 0; i < size; i++)
+        vc->log[vc->log_tail++ & VC_LOG_MASK] = buf[i];
+
+    if (vc->log_tail - vc->log_head > RT_HYPERVISOR_VC_LOG_SIZE)
+        vc->log_head = vc->log_tail - RT_HYPERVISOR_VC_LOG_SIZE;
+}
+
+static void vc_drain(struct vm *vm, vconsole_t vc)
+{
+    rt_bool_t attached = is_vm_take_console(vm);
+    rt_uint8_t buf[VC_TX_CHUNK];
+    rt_size_t n;
+
+    while ((n = vpl011_tx_drain(&vc->uart, buf, sizeof(buf))) > 0)
+    {
+        vc_log_put(vc, buf, n);
+
+        /* a file sink still leaves the attached VM its terminal */
+        if (attached && vc_mux_fd >= 0)
+            rt_device_write(vc_uart, 0, buf, n);
+
+        for (rt_size_t i = 0; i < n; i++)
+        {
+            vc->line[vc->line_len++] = buf[i];
+            if (buf[i] == '\n' || vc->line_len == VC_LINE_MAX)
+                vc_mux_emit(vm, vc);
+        }
+    }
+
+    /* prompt and echo of the attached VM can not wait for a newline */
+    if (attached && vc->line_len)
+        vc_mux_emit(vm, vc);
+}
+
+static void vc_thread_entry(void *parameter)
+{
+    while (1)
+    {
+        rt_sem_take(&vc_sem, RT_WAITING_FOREVER);
+
+        if (vc_detach_req)
+        {
+            vconsole_t vc = get_curr_vc();
+
+            vc_detach_req = RT_FALSE;
+            if (vc)
+                vc_detach(&vc->uart.vdev);
+        }
+
+        rt_mutex_take(&vc_mux_lock, RT_WAITING_FOREVER);
+        for (rt_size_t i = 0; i < MAX_VM_NUM; i++)
+        {
+            struct vm *vm = rt_hyp.vms[i];
+            vconsole_t vc;
+
+            if (vm && (vc = get_vc(vm)) != RT_NULL)
+                vc_drain(vm, vc);
+        }
+        rt_mutex_release(&vc_mux_lock);
+    }
+}
+
+rt_err_t vc_server_init(void)
+{
+    rt_err_t ret;
+
+    vc_uart = rt_device_find(RT_CONSOLE_DEVICE_NAME);
+    rt_sem_init(&vc_sem, "vcon", 0, RT_IPC_FLAG_FIFO);
+    rt_mutex_init(&vc_mux_lock, "vcmux", RT_IPC_FLAG_PRIO);
+    ret = rt_thread_init(&vc_thread, "vcon", vc_thread_entry, RT_NULL,
+                        vc_stack, sizeof(vc_stack),
+                        FINSH_THREAD_PRIORITY, THREAD_TIMESLICE);
+    if (ret != RT_EOK)
+    {
+        rt_kprintf("[Error] Init vConsole thread failure\n");
+        return ret;
+    }
+
+    return rt_thread_startup(&vc_thread);
 }
 
 #if defined(RT_USING_FINSH)
@@ -214,6 +411,114 @@ rt_err_t attach_vm(int argc, char **argv)
     return RT_EOK;
 }
 MSH_CMD_EXPORT(attach_vm, attach VM console);
+
+static void vc_log_dump(vconsole_t vc)
+{
+    char buf[VC_TX_CHUNK + 1];
+    rt_uint32_t pos = vc->log_head, n;
+
+    /* vcon may run ahead, restart from the oldest byte still kept */
+    while (pos != vc->log_tail)
+    {
+        rt_enter_critical();
+        if (vc->log_tail - pos > RT_HYPERVISOR_VC_LOG_SIZE)
+            pos = vc->log_head;
+        for (n = 0; n < VC_TX_CHUNK && pos != vc->log_tail; n++)
+            buf[n] = vc->log[pos++ & VC_LOG_MASK];
+        rt_exit_critical();
+
+        buf[n] = '\0';
+        rt_kputs(buf);
+    }
+}
+
+rt_err_t vc_log(int argc, char **argv)
+{
+    /* "i" for VM idx, print its recent output kept by the host */
+    int opt, vm_idx;
+    struct optparse options;
+    vconsole_t vc;
+
+    optparse_init(&options, argv);
+    while ((opt = optparse(&options, "i:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            vm_idx = strtol((const char *)options.optarg, NULL, 10);
+            if (vm_idx < 0 || vm_idx >= MAX_VM_NUM || rt_hyp.vms[vm_idx] == RT_NULL)
+            {
+                rt_kprintf("[Error] %d-th VM: Not use, no console log\n", vm_idx);
+                return -RT_EINVAL;
+            }
+
+            vc = get_vc(rt_hyp.vms[vm_idx]);
+            if (vc == RT_NULL)
+            {
+                rt_kprintf("[Error] %d-th VM: no device as %s\n", vm_idx, RT_CONSOLE_DEVICE_NAME);
+                return -RT_EINVAL;
+            }
+
+            vc_log_dump(vc);
+            rt_kprintf("\n[Info] %d-th VM: %d bytes of console log\n",
+                        vm_idx, vc->log_tail - vc->log_head);
+            break;
+        case '?':
+            rt_kprintf("[Error] %s: %s.\n", argv[0], options.errmsg);
+            return -RT_ERROR;
+        }
+    }
+
+    return RT_EOK;
+}
+MSH_CMD_EXPORT(vc_log, print recent output of a VM console);
+
+rt_err_t vc_mux(int argc, char **argv)
+{
+    /* "f" to multiplex VM output into a file, "u" back to the UART */
+    int opt, fd = -1;
+    struct optparse options;
+
+    optparse_init(&options, argv);
+    while ((opt = optparse(&options, "f:u")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+#ifdef RT_USING_DFS
+            fd = open(options.optarg, O_WRONLY | O_CREAT | O_APPEND, 0);
+            if (fd < 0)
+            {
+                rt_kprintf("[Error] Open %s failure\n", options.optarg);
+                return -RT_ERROR;
+            }
+            break;
+#else
+            rt_kputs("[Error] vConsole file sink needs RT_USING_DFS\n");
+            return -RT_ENOSYS;
+#endif
+        case 'u':
+            fd = -1;
+            break;
+        case '?':
+            rt_kprintf("[Error] %s: %s.\n", argv[0], options.errmsg);
+            return -RT_ERROR;
+        }
+    }
+
+    rt_mutex_take(&vc_mux_lock, RT_WAITING_FOREVER);
+#ifdef RT_USING_DFS
+    if (vc_mux_fd >= 0)
+        close(vc_mux_fd);
+#endif
+    vc_mux_fd = fd;
+    vc_mux_bol = RT_TRUE;
+    rt_mutex_release(&vc_mux_lock);
+
+    rt_kprintf("[Info] VM console output to %s\n", fd >= 0 ? "file" : "UART");
+    return RT_EOK;
+}
+MSH_CMD_EXPORT(vc_mux, set where VM console output goes);
 #endif  /* RT_USING_FINSH */
 
 // #endif  /* RT_USING_DEVICE && RT_USING_CONSOLE */ 
\ No newline at end of file
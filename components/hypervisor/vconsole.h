@@ -6,6 +6,9 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-10-03     Suqier       first version
+ * 2022-11-24     Suqier       emulate PL011, buffered output
+ * 2022-11-28     Suqier       multiplex VM output, attach moves input only
+ * 2022-12-11     Suqier       free the vConsole of a deleted VM
  */
 
 #ifndef __VCONSOLE_H__
@@ -20,14 +23,17 @@
 
 /* vc = vConsole */
 rt_err_t vc_create(struct vm *vm);
+void vc_destroy(struct vm *vm);
+rt_err_t vc_server_init(void);
 
 rt_bool_t is_vm_take_console(struct vm * vm);
 void vc_detach(vdev_t vc);
 void vc_attach(struct vm *vm);
-void console_mmio_handler(gp_regs_t regs, access_info_t acc);
 
 #if defined(RT_USING_FINSH)
 rt_err_t attach_vm(int argc, char **argv);
+rt_err_t vc_log(int argc, char **argv);
+rt_err_t vc_mux(int argc, char **argv);
 #endif  /* RT_USING_FINSH */ 
 void detach_vm(void);
 
@@ -6,8 +6,532 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-06-18     Suqier       first version
+ * 2022-11-23     Suqier       add sorted MMIO index
+ * 2022-11-25     Suqier       add coalesced MMIO
+ * 2022-11-26     Suqier       add ioevent doorbells
+ * 2022-12-12     Suqier       free the old MMIO index after the exits in it
+ * 2022-12-12     Suqier       queue a coalesced write under the lock of "vmmio"
  */
 
+#include <rtthread.h>
+#ifdef RT_USING_DEVICE_IPC
+#include <ipc/completion.h>
+#endif
+
 #include "vdev.h"
+#include "vgic.h"
+#include "vm.h"
+
+#define VDEV_COALESCED_STACK    4096
+
+static struct rt_thread coalesced_thread;
+static rt_uint8_t coalesced_stack[VDEV_COALESCED_STACK];
+static struct rt_semaphore coalesced_sem;
+static rt_list_t coalesced_pending = RT_LIST_OBJECT_INIT(coalesced_pending);
+
+/* The index is built first by vm_init(), refresh it only after that. */
+void vdev_register(struct vm *vm, vdev_t vdev)
+{
+    vdev->vm = vm;
+    rt_list_insert_after(&vm->dev_list, &vdev->node);
+    if (vm->mmio_map)
+        vdev_mmio_rebuild(vm);
+}
+
+void vdev_unregister(vdev_t vdev)
+{
+    vdev_coalesced_unregister(vdev);
+    rt_list_remove(&vdev->node);
+    if (vdev->vm->mmio_map)
+        vdev_mmio_rebuild(vdev->vm);
+}
+
+static rt_bool_t vdev_is_coalesced(vdev_t vdev)
+{
+    struct vdev_coalesced *c = vdev->vm->coalesced;
+
+    for (rt_size_t i = 0; c && i < c->zone_num; i++)
+        if (c->zone[i].vdev == vdev)
+            return RT_TRUE;
+
+    return RT_FALSE;
+}
+
+static void vdev_mmio_add(struct vdev_mmio_map *map, rt_uint64_t start,
+                        rt_uint64_t end, rt_uint8_t type, vdev_t vdev)
+{
+    struct vdev_mmio_range *r;
+    rt_size_t i = map->num;
+
+    /* insertion sort, keeps the index ordered by start address */
+    while (i > 0 && map->range[i - 1].start > start)
+    {
+        map->range[i] = map->range[i - 1];
+        i--;
+    }
+
+    r = &map->range[i];
+    r->start = start;
+    r->end   = end;
+    r->type  = type;
+    r->coalesced = vdev ? vdev_is_coalesced(vdev) : RT_FALSE;
+    r->vdev  = vdev;
+    map->num++;
+}
+
+/* Collect vGICD, vGICR and all regions of open devices. */
+rt_err_t vdev_mmio_rebuild(struct vm *vm)
+{
+    struct vdev_mmio_map *map, *old;
+    struct rt_list_node *pos;
+    rt_size_t num = 2;
+
+    rt_list_for_each(pos, &vm->dev_list)
+        num += rt_list_entry(pos, struct vdev, node)->mmap_num;
+
+    map = (struct vdev_mmio_map *)rt_malloc(sizeof(struct vdev_mmio_map)
+                                + num * sizeof(struct vdev_mmio_range));
+    if (map == RT_NULL)
+    {
+        rt_kprintf("[Error] %dth VM: Alloc memory for MMIO index failure\n", vm->id);
+        return -RT_ENOMEM;
+    }
+
+    map->num = 0;
+    map->last = RT_NULL;
+    vdev_mmio_add(map, vm->vgic->info.gicd_addr, vm->vgic->info.gicd_addr + VGIC_GICD_SIZE,
+                VDEV_MMIO_GICD, RT_NULL);
+    vdev_mmio_add(map, vm->vgic->info.gicr_addr, vm->vgic->info.gicr_addr + VGIC_GICR_SIZE,
+                VDEV_MMIO_GICR, RT_NULL);
+
+    rt_list_for_each(pos, &vm->dev_list)
+    {
+        vdev_t vdev = rt_list_entry(pos, struct vdev, node);
+
+        if (!vdev->is_open)
+            continue;
+
+        for (rt_uint8_t i = 0; i < vdev->mmap_num; i++)
+            vdev_mmio_add(map, vdev->region[i].vaddr_start, vdev->region[i].vaddr_end,
+                        VDEV_MMIO_DEV, vdev);
+    }
+
+    for (rt_size_t i = 1; i < map->num; i++)
+    {
+        if (map->range[i].start < map->range[i - 1].end)
+            rt_kprintf("[Error] %dth VM: MMIO region 0x%08x overlaps 0x%08x\n",
+                    vm->id, map->range[i].start, map->range[i - 1].start);
+    }
+
+    /* an MMIO exit on another core may still look in @old, wait for it */
+    old = __atomic_exchange_n(&vm->mmio_map, map, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&vm->mmio_readers, __ATOMIC_SEQ_CST))
+        rt_thread_yield();
+
+    if (old)
+        rt_free(old);
+
+    return RT_EOK;
+}
+
+void vdev_mmio_free(struct vm *vm)
+{
+    if (vm->mmio_map)
+    {
+        rt_free(vm->mmio_map);
+        vm->mmio_map = RT_NULL;
+    }
+}
+
+static struct vdev_mmio_range *vdev_mmio_find(struct vdev_mmio_map *map, rt_uint64_t addr)
+{
+    struct vdev_mmio_range *r = map->last;
+    rt_size_t lo = 0, hi = map->num;
+
+    if (r && addr >= r->start && addr < r->end)
+        return r;
+
+    /* find the last range starting at or below addr */
+    while (lo < hi)
+    {
+        rt_size_t mid = (lo + hi) / 2;
+
+        if (map->range[mid].start <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0 || addr >= map->range[lo - 1].end)
+        return RT_NULL;
+
+    r = &map->range[lo - 1];
+    map->last = r;
+    return r;
+}
+
+/* tail is published after its entry, head after the entry was replayed */
+rt_inline rt_uint32_t coalesced_count(struct vdev_coalesced *c)
+{
+    return __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE)
+         - __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+}
+
+/* Replay at most @batch queued writes with IRQ masked, as in an MMIO exit. */
+static rt_size_t vdev_coalesced_replay(struct vdev_coalesced *c, rt_size_t batch)
+{
+    struct rt_hw_exp_stack regs;
+    access_info_t acc = { .srt = 0, .is_write = RT_TRUE };
+    rt_size_t n = 0;
+    rt_base_t level;
+
+    level = rt_hw_interrupt_disable();
+    while (n < batch && coalesced_count(c))
+    {
+        struct vdev_coalesced_entry *e = &c->ring[c->head & (VDEV_COALESCED_RING_SIZE - 1)];
+
+        acc.addr = e->addr;
+        acc.size = e->size;
+        regs.x0 = e->data;
+        if (e->vdev->ops->mmio)
+            e->vdev->ops->mmio(e->vdev, &regs, acc);
+        __atomic_store_n(&c->head, c->head + 1, __ATOMIC_RELEASE);
+        n++;
+    }
+    rt_hw_interrupt_enable(level);
+
+    return n;
+}
+
+void vdev_coalesced_flush(struct vm *vm)
+{
+    struct vdev_coalesced *c = vm->coalesced;
+
+    if (c == RT_NULL)
+        return;
+
+    while (vdev_coalesced_replay(c, VDEV_COALESCED_BATCH))
+        ;
+}
+
+/* MMIO exit of a device owning a zone, RT_TRUE if the write is queued. */
+static rt_bool_t vdev_coalesced_mmio(struct vm *vm, vdev_t vdev, gp_regs_t regs,
+                                    access_info_t acc)
+{
+    struct vdev_coalesced *c = vm->coalesced;
+    struct vdev_coalesced_entry *e;
+    rt_bool_t kick;
+    rt_base_t level;
+    rt_size_t i;
+
+    for (i = 0; acc.is_write && i < c->zone_num; i++)
+    {
+        if (c->zone[i].vdev == vdev && acc.addr >= c->zone[i].start
+        && acc.addr < c->zone[i].end)
+            break;
+    }
+
+    /* read or write out of zone, the device must see queued writes first */
+    if (!acc.is_write || i == c->zone_num)
+    {
+        if (coalesced_count(c))
+        {
+            c->sync_flush++;
+            vdev_coalesced_flush(vm);
+        }
+        return RT_FALSE;
+    }
+
+    if (coalesced_count(c) == VDEV_COALESCED_RING_SIZE)
+    {
+        c->sync_flush++;
+        vdev_coalesced_flush(vm);
+    }
+
+    e = &c->ring[c->tail & (VDEV_COALESCED_RING_SIZE - 1)];
+    e->addr = acc.addr;
+    e->data = *regs_xn(regs, acc.srt);
+    e->vdev = vdev;
+    e->size = acc.size;
+    __atomic_store_n(&c->tail, c->tail + 1, __ATOMIC_RELEASE);
+    c->queued++;
+
+    /* the "vmmio" thread takes the ring off and back under the same lock */
+    level = rt_hw_interrupt_disable();
+    kick = rt_list_isempty(&c->node);
+    if (kick)
+        rt_list_insert_before(&coalesced_pending, &c->node);
+    rt_hw_interrupt_enable(level);
+
+    if (kick)
+        rt_sem_release(&coalesced_sem);
+
+    return RT_TRUE;
+}
+
+static void vdev_ioevent_notify(vdev_ioevent_t ioev)
+{
+    ioev->count++;
+
+    switch (ioev->type)
+    {
+    case VDEV_IOEVENT_SEM:
+        rt_sem_release(ioev->obj.sem);
+        break;
+    case VDEV_IOEVENT_EVENT:
+        rt_event_send(ioev->obj.ev.event, ioev->obj.ev.set);
+        break;
+#ifdef RT_USING_DEVICE_IPC
+    case VDEV_IOEVENT_COMPLETION:
+        rt_completion_done(ioev->obj.completion);
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
+/* Signal every ioevent matching a guest write, RT_FALSE if none does. */
+static rt_bool_t vdev_ioevent_signal(struct vm *vm, gp_regs_t regs, access_info_t acc)
+{
+    rt_uint64_t val = *regs_xn(regs, acc.srt);
+    struct rt_list_node *pos;
+    rt_bool_t hit = RT_FALSE;
+
+    rt_list_for_each(pos, &vm->ioevent_list)
+    {
+        vdev_ioevent_t ioev = rt_list_entry(pos, struct vdev_ioevent, node);
+
+        if (ioev->addr < acc.addr)
+            continue;
+        if (ioev->addr > acc.addr)
+            break;
+        if (ioev->datamatch && ioev->data != val)
+            continue;
+
+        /* the backend must see the writes queued before its doorbell */
+        if (!hit && vm->coalesced && coalesced_count(vm->coalesced))
+            vdev_coalesced_flush(vm);
+
+        vdev_ioevent_notify(ioev);
+        hit = RT_TRUE;
+    }
+
+    return hit;
+}
+
+/* Route a trapped MMIO access of current VM, RT_FALSE if nothing claims it. */
+rt_bool_t vdev_mmio_dispatch(gp_regs_t regs, access_info_t acc)
+{
+    vm_t vm = get_curr_vm();
+    struct vdev_mmio_map *map;
+    struct vdev_mmio_range *r;
+    struct vdev_mmio_range hit;
+
+    if (acc.is_write && !rt_list_isempty(&vm->ioevent_list)
+    && vdev_ioevent_signal(vm, regs, acc))
+        return RT_TRUE;
+
+    /* vdev_mmio_rebuild() frees the index only once no exit is in it */
+    __atomic_add_fetch(&vm->mmio_readers, 1, __ATOMIC_SEQ_CST);
+    map = __atomic_load_n(&vm->mmio_map, __ATOMIC_SEQ_CST);
+    r = map ? vdev_mmio_find(map, acc.addr) : RT_NULL;
+    if (r)
+        hit = *r;
+    __atomic_sub_fetch(&vm->mmio_readers, 1, __ATOMIC_RELEASE);
+
+    if (r == RT_NULL)
+        return RT_FALSE;
+    r = &hit;
+
+    switch (r->type)
+    {
+    case VDEV_MMIO_GICD:
+        vm->vgic->ops->emulate(regs, acc, RT_TRUE);
+        break;
+    case VDEV_MMIO_GICR:
+        vm->vgic->ops->emulate(regs, acc, RT_FALSE);
+        break;
+    default:
+        if (r->coalesced && vdev_coalesced_mmio(vm, r->vdev, regs, acc))
+            break;
+        if (r->vdev->ops->mmio)
+            r->vdev->ops->mmio(r->vdev, regs, acc);
+        break;
+    }
+
+    return RT_TRUE;
+}
+
+rt_err_t vdev_coalesced_register(vdev_t vdev, rt_uint64_t start, rt_uint64_t end)
+{
+    struct vm *vm = vdev->vm;
+    struct vdev_coalesced *c = vm->coalesced;
+    struct vdev_coalesced_zone *z;
+    rt_base_t level;
+
+    RT_ASSERT(start < end);
+
+    if (c == RT_NULL)
+    {
+        c = (struct vdev_coalesced *)rt_malloc(sizeof(struct vdev_coalesced));
+        if (c == RT_NULL)
+        {
+            rt_kprintf("[Error] %dth VM: Alloc memory for coalesced MMIO failure\n", vm->id);
+            return -RT_ENOMEM;
+        }
+
+        rt_memset(c, 0, sizeof(struct vdev_coalesced));
+        c->vm = vm;
+        rt_list_init(&c->node);
+        vm->coalesced = c;
+    }
+
+    if (c->zone_num == VDEV_COALESCED_ZONE_MAX)
+        return -RT_EFULL;
+
+    level = rt_hw_interrupt_disable();
+    z = &c->zone[c->zone_num++];
+    z->start = start;
+    z->end = end;
+    z->vdev = vdev;
+    rt_hw_interrupt_enable(level);
+
+    return vm->mmio_map ? vdev_mmio_rebuild(vm) : RT_EOK;
+}
+
+/* Drop all zones of @vdev, its queued writes are replayed first. */
+void vdev_coalesced_unregister(vdev_t vdev)
+{
+    struct vdev_coalesced *c = vdev->vm ? vdev->vm->coalesced : RT_NULL;
+    rt_base_t level;
+    rt_size_t i = 0;
+
+    if (c == RT_NULL)
+        return;
+
+    vdev_coalesced_flush(vdev->vm);
+
+    level = rt_hw_interrupt_disable();
+    while (i < c->zone_num)
+    {
+        if (c->zone[i].vdev == vdev)
+            c->zone[i] = c->zone[--c->zone_num];
+        else
+            i++;
+    }
+    rt_hw_interrupt_enable(level);
+}
+
+void vdev_coalesced_free(struct vm *vm)
+{
+    struct vdev_coalesced *c = vm->coalesced;
+    rt_base_t level;
+
+    if (c == RT_NULL)
+        return;
+
+    vdev_coalesced_flush(vm);
+
+    level = rt_hw_interrupt_disable();
+    rt_list_remove(&c->node);
+    vm->coalesced = RT_NULL;
+    rt_hw_interrupt_enable(level);
+
+    rt_free(c);
+}
+
+rt_err_t vdev_ioevent_register(struct vm *vm, vdev_ioevent_t ioev)
+{
+    struct rt_list_node *pos;
+    rt_base_t level;
+
+#ifndef RT_USING_DEVICE_IPC
+    if (ioev->type == VDEV_IOEVENT_COMPLETION)
+        return -RT_EINVAL;
+#endif
+    if (ioev->type > VDEV_IOEVENT_COMPLETION || ioev->obj.sem == RT_NULL)
+        return -RT_EINVAL;
+
+    ioev->count = 0;
+
+    level = rt_hw_interrupt_disable();
+    rt_list_for_each(pos, &vm->ioevent_list)
+    {
+        vdev_ioevent_t cur = rt_list_entry(pos, struct vdev_ioevent, node);
+
+        if (cur->addr == ioev->addr && cur->datamatch == ioev->datamatch
+        && (!cur->datamatch || cur->data == ioev->data))
+        {
+            rt_hw_interrupt_enable(level);
+            rt_kprintf("[Error] %dth VM: ioevent 0x%08x is busy\n", vm->id, ioev->addr);
+            return -RT_EBUSY;
+        }
+
+        if (cur->addr > ioev->addr)
+            break;
+    }
+    rt_list_insert_before(pos, &ioev->node);
+    rt_hw_interrupt_enable(level);
+
+    return RT_EOK;
+}
+
+void vdev_ioevent_unregister(vdev_ioevent_t ioev)
+{
+    rt_base_t level;
+
+    level = rt_hw_interrupt_disable();
+    rt_list_remove(&ioev->node);
+    rt_hw_interrupt_enable(level);
+}
+
+static void vdev_coalesced_entry(void *parameter)
+{
+    struct vdev_coalesced *c;
+    rt_base_t level;
+
+    while (1)
+    {
+        rt_sem_take(&coalesced_sem, RT_WAITING_FOREVER);
+
+        while (1)
+        {
+            level = rt_hw_interrupt_disable();
+            if (rt_list_isempty(&coalesced_pending))
+            {
+                rt_hw_interrupt_enable(level);
+                break;
+            }
+
+            /*
+             * One batch per turn, round robin among VMs. A ring not yet empty
+             * goes back on the list, so vdev_coalesced_free() can always take
+             * it off there between two batches.
+             */
+            c = rt_list_first_entry(&coalesced_pending, struct vdev_coalesced, node);
+            rt_list_remove(&c->node);
+            vdev_coalesced_replay(c, VDEV_COALESCED_BATCH);
+            if (coalesced_count(c))
+                rt_list_insert_before(&coalesced_pending, &c->node);
+            rt_hw_interrupt_enable(level);
+        }
+    }
+}
+
+rt_err_t vdev_coalesced_init(void)
+{
+    rt_err_t ret;
 
+    rt_sem_init(&coalesced_sem, "vmmio", 0, RT_IPC_FLAG_FIFO);
+    ret = rt_thread_init(&coalesced_thread, "vmmio", vdev_coalesced_entry, RT_NULL,
+                        coalesced_stack, sizeof(coalesced_stack),
+                        FINSH_THREAD_PRIORITY, THREAD_TIMESLICE);
+    if (ret != RT_EOK)
+    {
+        rt_kprintf("[Error] Init coalesced MMIO thread failure\n");
+        return ret;
+    }
 
+    return rt_thread_startup(&coalesced_thread);
+}
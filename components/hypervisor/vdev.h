@@ -6,6 +6,8 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-09-06     Suqier       first version
+ * 2022-11-25     Suqier       add coalesced MMIO
+ * 2022-11-26     Suqier       add ioevent doorbells
  */
 
 #ifndef __VDEV_H__
@@ -19,9 +21,11 @@
 
 #define MAX_MMAP_NUM    2
 
+struct vdev;
+
 struct vdev_ops
 {
-    void (*mmio)(gp_regs_t regs, access_info_t acc);
+    void (*mmio)(struct vdev *vdev, gp_regs_t regs, access_info_t acc);
 };
 
 struct vdev
@@ -38,4 +42,125 @@ struct vdev
 };
 typedef struct vdev *vdev_t;
 
+/*
+ * Per-VM MMIO index, every trapped range of the VM sorted by IPA.
+ * Rebuild it whenever a range appears or goes, e.g. device open/close.
+ */
+enum
+{
+    VDEV_MMIO_GICD = 0,
+    VDEV_MMIO_GICR,
+    VDEV_MMIO_DEV,
+};
+
+struct vdev_mmio_range
+{
+    rt_uint64_t start;      /* [start, end) in IPA */
+    rt_uint64_t end;
+    rt_uint8_t  type;
+    rt_bool_t   coalesced;  /* vdev owns a coalesced zone */
+    vdev_t      vdev;       /* VDEV_MMIO_DEV only */
+};
+
+struct vdev_mmio_map
+{
+    rt_size_t num;
+    struct vdev_mmio_range *last;   /* last hit, a hot device skips the search */
+    struct vdev_mmio_range range[];
+};
+
+/*
+ * Coalesced MMIO: writes into a registered zone need no synchronous result,
+ * they are queued in a per-VM ring and the vCPU resumes at once. The "vmmio"
+ * thread replays them in batches; any other access to the same device
+ * replays the ring first, so the device sees accesses in guest order.
+ * Handlers of such devices may run on a host thread, use @vdev only.
+ */
+#define VDEV_COALESCED_ZONE_MAX     8
+#define VDEV_COALESCED_RING_SIZE    128     /* power of 2 */
+#define VDEV_COALESCED_BATCH        16      /* entries per IRQ off window */
+
+struct vdev_coalesced_entry
+{
+    rt_uint64_t addr;
+    rt_uint64_t data;
+    vdev_t      vdev;
+    rt_uint8_t  size;
+};
+
+struct vdev_coalesced_zone
+{
+    rt_uint64_t start;      /* [start, end) in IPA */
+    rt_uint64_t end;
+    vdev_t      vdev;
+};
+
+struct vdev_coalesced
+{
+    struct vm *vm;
+    rt_list_t node;         /* on the "vmmio" pending list */
+
+    rt_uint32_t head;
+    rt_uint32_t tail;
+    struct vdev_coalesced_entry ring[VDEV_COALESCED_RING_SIZE];
+
+    rt_size_t zone_num;
+    struct vdev_coalesced_zone zone[VDEV_COALESCED_ZONE_MAX];
+
+    rt_uint64_t queued;     /* writes taken by the ring */
+    rt_uint64_t sync_flush; /* replays forced in MMIO exit */
+};
+
+/*
+ * ioevent: a guest write to @addr, of @data only if @datamatch, signals a
+ * host IPC object and the vCPU resumes. The backend thread waiting on it
+ * does the work. Matched writes never reach a device handler, reads and
+ * other values go the normal way.
+ */
+enum
+{
+    VDEV_IOEVENT_SEM = 0,
+    VDEV_IOEVENT_EVENT,
+    VDEV_IOEVENT_COMPLETION,    /* RT_USING_DEVICE_IPC */
+};
+
+struct rt_completion;
+
+struct vdev_ioevent
+{
+    rt_uint64_t addr;       /* IPA */
+    rt_uint64_t data;
+    rt_bool_t   datamatch;
+    rt_uint8_t  type;
+    union
+    {
+        rt_sem_t sem;
+        struct
+        {
+            rt_event_t  event;
+            rt_uint32_t set;
+        } ev;
+        struct rt_completion *completion;
+    } obj;
+
+    rt_uint64_t count;      /* signals sent */
+    rt_list_t node;         /* sorted by addr in vm->ioevent_list */
+};
+typedef struct vdev_ioevent *vdev_ioevent_t;
+
+void vdev_register(struct vm *vm, vdev_t vdev);
+void vdev_unregister(vdev_t vdev);
+rt_err_t vdev_mmio_rebuild(struct vm *vm);
+void vdev_mmio_free(struct vm *vm);
+rt_bool_t vdev_mmio_dispatch(gp_regs_t regs, access_info_t acc);
+
+rt_err_t vdev_coalesced_register(vdev_t vdev, rt_uint64_t start, rt_uint64_t end);
+void vdev_coalesced_unregister(vdev_t vdev);
+void vdev_coalesced_flush(struct vm *vm);
+void vdev_coalesced_free(struct vm *vm);
+rt_err_t vdev_coalesced_init(void);
+
+rt_err_t vdev_ioevent_register(struct vm *vm, vdev_ioevent_t ioev);
+void vdev_ioevent_unregister(vdev_ioevent_t ioev);
+
 #endif  /* __VDEV_H__ */
\ No newline at end of file
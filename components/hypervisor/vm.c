@@ -6,6 +6,13 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-06-01     Suqier       first version
+ * 2022-12-03     Suqier       split vm_init_bare() out for restore
+ * 2022-12-04     Suqier       clone guest RAM in vm_init_bare()
+ * 2022-12-08     Suqier       guest RAM regions
+ * 2022-12-09     Suqier       load the image and DTB with vm_copy_to_guest()
+ * 2022-12-10     Suqier       charge vCPUs and vGIC to the memory quota
+ * 2022-12-11     Suqier       free everything of a deleted VM
+ * 2022-12-12     Suqier       kick a halted vCPU under the lock of vcpu_halt()
  */
 
 #include "rtconfig.h"
@@ -18,9 +25,19 @@
 #include "vtimer.h"
 #include "vgic.h"
 #include "vm.h"
+#include "mem_quota.h"
 #include "os.h"
+#include "hyp_fdt.h"
+
+#define VCPU_STACK_SIZE     4096
+
+/* a vCPU with its arch state, vTimer and thread */
+#define VCPU_MEM_SIZE       (sizeof(struct vcpu) + sizeof(struct vcpu_arch) \
+                            + sizeof(struct vtimer_context) + 2 * sizeof(struct rt_timer) \
+                            + sizeof(struct rt_thread) + VCPU_STACK_SIZE)
 
 extern struct hypervisor rt_hyp;
+extern rt_list_t rt_thread_priority_table[RT_THREAD_PRIORITY_MAX];
 
 const char* vm_status_str[VM_STATUS_UNKNOWN + 1] =
 {
@@ -57,35 +74,54 @@ vcpu_t vcpu_create(vm_t vm, rt_uint32_t vcpu_id)
     struct vcpu_arch *arch;
     rt_thread_t tid;
 
+    if (mem_quota_charge(vm->mm, VM_MEM_VCPU, VCPU_MEM_SIZE))
+        return RT_NULL;
+
     vcpu = (struct vcpu*)rt_malloc(sizeof(struct vcpu));
     arch = (struct vcpu_arch*)rt_malloc(sizeof(struct vcpu_arch));
     if (vcpu == RT_NULL || arch == RT_NULL)
     {
+        rt_free(vcpu);
+        rt_free(arch);
+        mem_quota_uncharge(vm->mm, VM_MEM_VCPU, VCPU_MEM_SIZE);
         rt_kprintf("[Error] create %dth vCPU failure.\n", vcpu_id);
         return RT_NULL;
     }
 
 	rt_memset(name, 0, VM_NAME_SIZE);
 	sprintf(name, "m%d_c%d", vm->id, vcpu_id);
-	tid = rt_thread_create(name, (void *)(vm->os->img.ep), RT_NULL, 
-                        4096, FINSH_THREAD_PRIORITY + 1, THREAD_TIMESLICE);
+	/* vCPU 0 boots with the guest DTB in x0 */
+	tid = rt_thread_create(name, (void *)(vm->os->img.ep),
+                        vcpu_id == 0 ? (void *)vm->os->img.dtb : RT_NULL,
+                        VCPU_STACK_SIZE, FINSH_THREAD_PRIORITY + 1, THREAD_TIMESLICE);
 	if (tid == RT_NULL)
     {
         rt_free(vcpu);
+        rt_free(arch);
+        mem_quota_uncharge(vm->mm, VM_MEM_VCPU, VCPU_MEM_SIZE);
 		return RT_NULL;
     }
 
-    vcpu->affinity = vm->os[vm->os_idx].cpu.affinity[vcpu_id];    /* affinity */
+    vcpu->affinity = vm->os->cpu.affinity[vcpu_id];    /* affinity */
     vcpu->arch = arch;
+    vcpu->vtc = RT_NULL;
     vcpu->status = VCPU_STATUS_NEVER_RUN;
+    vcpu->halted = RT_FALSE;
+    vcpu->halt_poll_ns = 0;
+    rt_memset(&vcpu->stat, 0, sizeof(struct vcpu_stat));
     tid->vcpu = vcpu;
     vcpu->tid = tid;
     vcpu->id = vcpu_id;
     vcpu->vm = vm;
     vm->vcpus[vcpu_id] = vcpu;
     
-    vtimer_ctxt_create(vcpu);
     rt_memset(arch, 0, sizeof(struct vcpu_arch));
+    if (vtimer_ctxt_create(vcpu))
+    {
+        vcpu_free(vcpu);
+        vm->vcpus[vcpu_id] = RT_NULL;
+        return RT_NULL;
+    }
     vcpu_state_init(vcpu);
     vcpu_spsr_init((rt_ubase_t)vcpu->tid->sp);
 
@@ -98,6 +134,9 @@ void vcpu_free(vcpu_t vcpu)
     {
         if (vcpu->tid)
             rt_thread_delete(vcpu->tid);
+        vtimer_ctxt_free(vcpu);
+        mem_quota_uncharge(vcpu->vm->mm, VM_MEM_VCPU, VCPU_MEM_SIZE);
+        rt_free(vcpu->arch);
         rt_free(vcpu);
     }
 }
@@ -116,6 +155,7 @@ rt_err_t vcpus_create(vm_t vm)
                     vcpu_free(vcpu);
                 else
                     continue;
+                vm->vcpus[j] = RT_NULL;     /* vm_free() won't free it again */
             }
 
             rt_kprintf("[Error] %dth VM: Create %dth vCPU failure\n", vm->id, i);
@@ -176,6 +216,170 @@ void vcpu_suspend(vcpu_t vcpu)
     }
 }
 
+/* generic counter ticks <-> ns, without overflow for long blocks */
+static rt_uint64_t vcpu_cnt_to_ns(rt_uint64_t cnt)
+{
+    rt_uint64_t frq = rt_hw_get_gtimer_frq();
+    return (cnt / frq) * 1000000000UL + (cnt % frq) * 1000000000UL / frq;
+}
+
+static rt_uint64_t vcpu_ns_to_cnt(rt_uint64_t ns)
+{
+    return ns * rt_hw_get_gtimer_frq() / 1000000000UL;
+}
+
+/* A vIRQ or an expired vTimer ends WFI. */
+static rt_bool_t vcpu_has_wakeup(vcpu_t vcpu)
+{
+    return vgic_vcpu_pending(vcpu) || vtimer_is_pending(vcpu);
+}
+
+/*
+ * Grow the window while blocks are short enough to be caught by polling,
+ * shrink it once the vCPU idles for longer than polling may cost.
+ */
+static void vcpu_halt_poll_update(vcpu_t vcpu, rt_uint64_t block_ns)
+{
+    rt_uint64_t ns = vcpu->halt_poll_ns;
+
+    if (block_ns <= ns)
+        return;
+
+    if (block_ns > RT_HYPERVISOR_HALT_POLL_NS)
+        ns /= VCPU_HALT_POLL_SHRINK;
+    else
+        ns = ns ? ns * VCPU_HALT_POLL_GROW : VCPU_HALT_POLL_NS_START;
+
+    if (ns > RT_HYPERVISOR_HALT_POLL_NS)
+        ns = RT_HYPERVISOR_HALT_POLL_NS;
+    vcpu->halt_poll_ns = ns;
+}
+
+/* 
+ * Guest executes WFI, runs in its own vCPU thread. Poll for a wakeup event
+ * with IRQ unmasked first, so vgic_inject() can reach the loaded LRs, and
+ * only block the thread if nothing arrives within halt_poll_ns.
+ */
+void vcpu_halt(vcpu_t vcpu)
+{
+    rt_uint64_t start, end;
+    rt_base_t level;
+
+    vcpu->stat.halt_exits++;
+    start = rt_hw_get_cntpct_val();
+
+    if (vcpu->halt_poll_ns)
+    {
+        end = start + vcpu_ns_to_cnt(vcpu->halt_poll_ns);
+
+        __asm__ volatile ("msr daifclr, #2":::"memory");
+        do
+        {
+            if (vcpu_has_wakeup(vcpu))
+            {
+                __asm__ volatile ("msr daifset, #2":::"memory");
+                vcpu->stat.halt_poll_success++;
+                return;
+            }
+        } while (rt_hw_get_cntpct_val() < end);
+        __asm__ volatile ("msr daifset, #2":::"memory");
+
+        vcpu->stat.halt_poll_fail++;
+    }
+
+    /*
+     * vgic_inject() only kicks a vCPU marked halted. It inserts the vIRQ
+     * and tests halted under this lock, the CPU lock on SMP, so a vIRQ
+     * from any core is either seen here or wakes the vCPU up.
+     */
+    level = rt_hw_interrupt_disable();
+    if (vcpu_has_wakeup(vcpu))
+    {
+        rt_hw_interrupt_enable(level);
+        return;
+    }
+    vcpu->halted = RT_TRUE;
+    vcpu_suspend(vcpu);
+    rt_hw_interrupt_enable(level);
+
+    vcpu_halt_poll_update(vcpu, vcpu_cnt_to_ns(rt_hw_get_cntpct_val() - start));
+}
+
+/* Wake up a vCPU blocked in vcpu_halt(), a running one needs nothing. */
+void vcpu_kick(vcpu_t vcpu)
+{
+    rt_base_t level = rt_hw_interrupt_disable();
+
+    if (vcpu->halted)
+    {
+        vcpu->halted = RT_FALSE;
+        vcpu->stat.halt_wakeup++;
+        vcpu_go(vcpu);
+    }
+    rt_hw_interrupt_enable(level);
+}
+
+/* A sibling vCPU preempted while runnable, likely the lock holder. */
+static vcpu_t vcpu_pick_yield_target(vcpu_t vcpu)
+{
+    vm_t vm = vcpu->vm;
+
+    for (rt_size_t n = 1; n <= vm->nr_vcpus; n++)
+    {
+        rt_size_t i = (vm->last_boosted_vcpu + n) % vm->nr_vcpus;
+        vcpu_t target = vm->vcpus[i];
+
+        if (target == RT_NULL || target == vcpu || target->halted)
+            continue;
+        if ((target->tid->stat & RT_THREAD_STAT_MASK) != RT_THREAD_READY)
+            continue;
+        /* only a sibling sharing our ready queue runs next after yield */
+        if (target->tid->current_priority != vcpu->tid->current_priority)
+            continue;
+
+        vm->last_boosted_vcpu = i;
+        return target;
+    }
+
+    return RT_NULL;
+}
+
+/*
+ * Guest executes WFE, mostly spinning on a lock. If its holder is a
+ * preempted sibling vCPU, move that thread to the head of the ready queue
+ * and yield the rest of our time slice to it instead of burning it.
+ */
+void vcpu_on_spin(vcpu_t vcpu)
+{
+    rt_uint64_t start;
+    rt_base_t level;
+    vcpu_t target;
+
+    vcpu->stat.wfe_exits++;
+
+    level = rt_hw_interrupt_disable();
+    target = vcpu_pick_yield_target(vcpu);
+    if (target == RT_NULL)
+    {
+        rt_hw_interrupt_enable(level);
+        vcpu->stat.yield_miss++;
+        return;     /* WFE may complete spuriously, guest re-checks its lock */
+    }
+
+#ifndef RT_USING_SMP
+    rt_list_remove(&target->tid->tlist);
+    rt_list_insert_after(&rt_thread_priority_table[target->tid->current_priority],
+                        &target->tid->tlist);
+#endif
+
+    start = rt_hw_get_cntpct_val();
+    rt_thread_yield();
+    rt_hw_interrupt_enable(level);
+
+    vcpu->stat.directed_yield++;
+    vcpu->stat.yield_ns += vcpu_cnt_to_ns(rt_hw_get_cntpct_val() - start);
+}
+
 void vcpu_shutdown(vcpu_t vcpu)
 {
     /* Turn vcpu->thread into RT_THREAD_CLOSE status and free vCPU resource. */
@@ -252,34 +456,56 @@ struct vcpu *vcpu_get_irq_owner(int ir)
 /*
  * For VM
  */
-rt_err_t os_img_load(vm_t vm)		
+rt_err_t os_img_load(vm_t vm)
 {
-    void *src = (void *)vm->os->img.addr;
-    rt_uint64_t dst_va = vm->os->img.ep;
-    rt_ubase_t dst_pa = 0x0UL;
-    rt_ubase_t count = vm->os->img.size, copy_size;
-    rt_err_t ret;
+#ifdef RT_USING_DFS
+    if (vm->os->img.path)
+        return os_img_load_file(vm, vm->os->img.path);
+#endif
 
-    do
+    if (vm_copy_to_guest(vm->mm, vm->os->img.ep, (const void *)vm->os->img.addr, vm->os->img.size))
     {
-        ret = s2_translate(vm->mm, dst_va, &dst_pa);
-        if (ret)
-        {
-            rt_kprintf("[Error] %dth VM: Load OS img failure\n", vm->id);
-            return ret;
-        }
+        rt_kprintf("[Error] %dth VM: Load OS img failure\n", vm->id);
+        return -RT_ERROR;
+    }
 
-        if (count >= MEM_BLOCK_SIZE)
-            copy_size = MEM_BLOCK_SIZE;
-        else
-            copy_size = count;
+    rt_kprintf("[Info] %dth VM: Load OS img OK\n", vm->id);
+    return RT_EOK;
+}
 
-        rt_memcpy((void *)dst_pa, (const void *)src, copy_size);
-        count -= copy_size;
-        dst_va += copy_size;
-    } while (count > 0);
+/* Guest DTB at img.dtb, generated from the VM's own description. */
+rt_err_t os_dtb_load(vm_t vm)
+{
+    rt_uint64_t ipa = vm->os->img.dtb;
+    void *buf;
+    int size;
 
-    rt_kprintf("[Info] %dth VM: Load OS img OK\n", vm->id);
+    if (ipa == 0)
+        return RT_EOK;
+
+    if (vm_ram_area(vm->mm, ipa, HYP_FDT_GUEST_SIZE) == RT_NULL)
+    {
+        rt_kprintf("[Error] %dth VM: DTB at 0x%lx is out of RAM\n",
+                vm->id, (unsigned long)ipa);
+        return -RT_EINVAL;
+    }
+
+    /* RAM may be in 4K pages, the DTB is built aside and copied in */
+    buf = rt_malloc(HYP_FDT_GUEST_SIZE);
+    if (buf == RT_NULL)
+        return -RT_ENOMEM;
+
+    size = hyp_fdt_gen_guest(vm->os, buf, HYP_FDT_GUEST_SIZE);
+    if (size >= 0 && vm_copy_to_guest(vm->mm, ipa, buf, size))
+        size = -RT_ERROR;
+    rt_free(buf);
+    if (size < 0)
+    {
+        rt_kprintf("[Error] %dth VM: Generate DTB failure\n", vm->id);
+        return size;
+    }
+
+    rt_kprintf("[Info] %dth VM: Load %d bytes DTB OK\n", vm->id, size);
     return RT_EOK;
 }
 
@@ -293,15 +519,34 @@ void vm_config_init(vm_t vm, rt_uint8_t vm_idx)
     rt_hw_spin_lock_init(&vm->vm_lock);
 #endif
     
-    vm->mm->mem_size = vm->os->mem.size;
+    vm->mm->mem_size = 0;   /* all RAM regions, by vm_mm_struct_init() */
     vm->mm->mem_used = 0;
     vm->nr_vcpus = vm->os->cpu.num;
     rt_list_init(&vm->dev_list);
+    rt_list_init(&vm->ioevent_list);
 }
 
-rt_err_t vm_init(vm_t vm)
+/* time since *@t goes to @phase, *@t moves on */
+static void vm_boot_mark(vm_t vm, rt_uint8_t phase, rt_uint64_t *t)
+{
+    rt_uint64_t now = rt_hw_get_cntpct_val();
+
+    vm->boot_ns[phase] = vcpu_cnt_to_ns(now - *t);
+    *t = now;
+}
+
+/* 
+ * Everything but guest RAM content: memory, vCPUs and devices. A restored
+ * VM stops here and reads its RAM from the snapshot. With @from, guest RAM
+ * is shared copy-on-write with that paused VM instead of allocated.
+ */
+rt_err_t vm_init_bare(vm_t vm, vm_t from)
 {
     rt_err_t ret = RT_EOK;
+    rt_uint64_t t = rt_hw_get_cntpct_val();
+
+    rt_memset(vm->boot_ns, 0, sizeof(vm->boot_ns));
+
     /* 
      * It only has memory for struct vm, 
      * It needs more memory for vcpu and device.
@@ -313,31 +558,61 @@ rt_err_t vm_init(vm_t vm)
         rt_kputs("[Error] Allocate memory for VM's pointers failure\n");
         return -RT_ENOMEM;
     }
+    rt_memset(vm->vcpus, 0, sizeof(struct vcpu *) * vm->nr_vcpus);
 
     ret = vm_mm_struct_init(vm->mm);
     if (ret)
         return ret;
 
     /* memory map when vm init */
-    ret = vm_memory_init(vm->mm);
+    if (from)
+        ret = vm_memory_clone(vm->mm, from->mm);
+    else
+        ret = vm_memory_init(vm->mm);
     if (ret)
         return ret;
+    vm_boot_mark(vm, VM_BOOT_MEM, &t);
 
     ret = vcpus_create(vm);
     if (ret)
         return ret;
+    vm_boot_mark(vm, VM_BOOT_VCPU, &t);
     
-    vgic_init(vm);
-    
+    ret = vgic_init(vm);
+    if (ret)
+        return ret;
+
     vc_create(vm);
-    
+    ret = vdev_mmio_rebuild(vm);
+    if (ret)
+        return ret;
+    vm_boot_mark(vm, VM_BOOT_DEV, &t);
+    return RT_EOK;
+}
+
+/* 
+ * Only touches @vm and the stage 2 tables of its own index, so boot_vm
+ * runs it for several VMs at once.
+ */
+rt_err_t vm_init(vm_t vm)
+{
+    rt_err_t ret = RT_EOK;
+    rt_uint64_t t;
+
+    ret = vm_init_bare(vm, RT_NULL);
+    if (ret)
+        return ret;
+    t = rt_hw_get_cntpct_val();
+
     /* allocate memory for device. TBD */
     ret = os_img_load(vm);
     if (ret)
         return ret;
+    vm_boot_mark(vm, VM_BOOT_IMG, &t);
 
-    /* fdt_parse gets vcpus affinity and more. */
-    return RT_EOK;
+    ret = os_dtb_load(vm);
+    vm_boot_mark(vm, VM_BOOT_DTB, &t);
+    return ret;
 }
 
 void vm_go(vm_t vm)
@@ -364,6 +639,14 @@ void vm_suspend(struct vm * vm)
     for (rt_size_t i = 0; i < vm->nr_vcpus; i++)
     {
         vcpu = vm->vcpus[i];
+
+        /* already blocked in WFI, keep vIRQ from waking it up */
+        if (vcpu->halted)
+        {
+            vcpu->halted = RT_FALSE;
+            continue;
+        }
+
         ret = rt_thread_suspend(vcpu->tid);
         if (ret)
         {
@@ -386,24 +669,44 @@ void vm_shutdown(vm_t vm)
         for (rt_size_t i = 0; i < vm->nr_vcpus; i++)
         {
             vcpu_t vcpu = vm->vcpus[i];
-            rt_thread_delete(vcpu->tid);
+            if (vcpu && vcpu->tid)
+            {
+                rt_thread_delete(vcpu->tid);
+                vcpu->tid = RT_NULL;    /* vcpu_free() won't delete it again */
+                vcpu->status = VCPU_STATUS_OFFLINE;
+            }
+            if (vcpu)
+                vtimer_ctxt_stop(vcpu);
         }
 
-        /* 
-         * and release VM memory resource. TBD 
-         */
-
+        /* resources stay until vm_free(), a halted VM still shows in list_vm */
         vm->status = VM_STATUS_OFFLINE;
     }
 }
 
+/*
+ * Free all a VM has, shut down and out of rt_hyp.vms already, up to its
+ * struct vm. Its stage 2 table slot is left clean and its VMID flushed,
+ * so delete_vm() can hand the index to the next VM.
+ */
 void vm_free(vm_t vm)
 {
+    /* MMIO index first, unregistering the vConsole won't rebuild it */
+    vdev_coalesced_free(vm);
+    vdev_mmio_free(vm);
+    vc_destroy(vm);
     vgic_free(vm->vgic);
 
     /* free vCPUs resource */
-    for (rt_size_t i = 0; i < vm->nr_vcpus; i++)
+    for (rt_size_t i = 0; vm->vcpus && i < vm->nr_vcpus; i++)
         vcpu_free(vm->vcpus[i]);
+    rt_free(vm->vcpus);
+    rt_free(vm->arch);
+
+    /* stage 2 tables cleared, guest RAM back to the pool, zeroed there */
+    vm_mm_struct_free(vm->mm);
+    mem_quota_release(vm->mm);
 
-    /* free other resource, like memory resouece & TBD */
+    rt_free(vm->mm);
+    rt_free(vm);
 }
@@ -6,6 +6,9 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-05-30     Suqier       first version
+ * 2022-12-03     Suqier       add vm_init_bare()
+ * 2022-12-04     Suqier       vm_init_bare() clones guest RAM of a VM
+ * 2022-12-12     Suqier       count MMIO exits in the MMIO index
  */
 
 #ifndef __VM_H__
@@ -18,6 +21,7 @@
 
 #define MAX_VCPU_NUM    4      /* per vm */
 #define VM_NAME_SIZE    16
+#define VM_IMG_PATH_SIZE 64
 #define L1_CACHE_BYTES  64
 
 #define VCPU_JUST_CREATE        (0UL)
@@ -43,12 +47,35 @@ enum
     VCPU_STATUS_UNKNOWN,
 };
 
+#ifndef RT_HYPERVISOR_HALT_POLL_NS
+#define RT_HYPERVISOR_HALT_POLL_NS  0
+#endif
+#define VCPU_HALT_POLL_NS_START     (10000)     /* first window after a short block */
+#define VCPU_HALT_POLL_GROW         (2)
+#define VCPU_HALT_POLL_SHRINK       (2)
+
+struct vcpu_stat
+{
+    rt_uint64_t halt_exits;         /* WFI trapped */
+    rt_uint64_t halt_poll_success;  /* woken up while polling */
+    rt_uint64_t halt_poll_fail;     /* polled, then blocked anyway */
+    rt_uint64_t halt_wakeup;        /* blocked and kicked by vIRQ */
+    rt_uint64_t wfe_exits;          /* WFE trapped, guest spins on a lock */
+    rt_uint64_t directed_yield;     /* gave pCPU to a preempted sibling */
+    rt_uint64_t yield_miss;         /* no sibling to yield to */
+    rt_uint64_t yield_ns;           /* spin time handed to siblings */
+};
+
 struct vcpu
 {
     rt_uint32_t id;
     rt_uint32_t affinity;
     rt_uint16_t status;
 
+    rt_bool_t   halted;         /* blocked in WFI, vcpu_kick() wakes it */
+    rt_uint32_t halt_poll_ns;   /* adaptive polling window */
+    struct vcpu_stat stat;
+
     struct vm *vm;
     rt_thread_t tid;
     struct vtimer_context *vtc;
@@ -66,6 +93,17 @@ enum
     VM_STATUS_UNKNOWN,
 };
 
+/* vm_init() phases */
+enum
+{
+    VM_BOOT_MEM = 0,    /* stage 2 table and guest RAM */
+    VM_BOOT_VCPU,
+    VM_BOOT_DEV,        /* vGIC, vConsole and trapped MMIO */
+    VM_BOOT_IMG,
+    VM_BOOT_DTB,
+    VM_BOOT_PHASE_NUM,
+};
+
 struct vm
 {
     rt_uint8_t id;     /* index in hypervisor vms array */ 
@@ -86,6 +124,7 @@ struct vm
     rt_uint8_t nr_vcpus;
     rt_uint32_t vcpu_affinity[MAX_VCPU_NUM];
     vcpu_t *vcpus;
+    rt_uint8_t last_boosted_vcpu;   /* round robin start of directed yield */
 
     /* vGIC */
     struct vgic *vgic;
@@ -94,6 +133,12 @@ struct vm
     
     /* For TTY and so on */
     rt_list_t dev_list;
+    struct vdev_mmio_map *mmio_map;     /* sorted trapped MMIO ranges */
+    rt_uint32_t mmio_readers;           /* MMIO exits looking in mmio_map */
+    struct vdev_coalesced *coalesced;   /* write ring, RT_NULL if no zone */
+    rt_list_t ioevent_list;             /* doorbells, see vdev_ioevent_t */
+
+    rt_uint64_t boot_ns[VM_BOOT_PHASE_NUM]; /* time of each vm_init() phase */
 }__attribute__((aligned(L1_CACHE_BYTES)));
 typedef struct vm *vm_t;
 
@@ -109,6 +154,9 @@ rt_err_t vcpus_create(vm_t vm);
 void vcpu_init(void);
 void vcpu_go(vcpu_t vcpu);
 void vcpu_suspend(vcpu_t vcpu);
+void vcpu_halt(vcpu_t vcpu);
+void vcpu_kick(vcpu_t vcpu);
+void vcpu_on_spin(vcpu_t vcpu);
 void vcpu_shutdown(vcpu_t vcpu);
 void vcpu_free(vcpu_t vcpu);
 void vcpu_fault(vcpu_t vcpu);
@@ -118,7 +166,10 @@ struct vcpu *vcpu_get_irq_owner(int ir);
  * For VM
  */
 rt_err_t os_img_load(vm_t vm);
+rt_err_t os_img_load_file(vm_t vm, const char *path);
+rt_err_t os_dtb_load(vm_t vm);
 void vm_config_init(vm_t vm, rt_uint8_t vm_idx);
+rt_err_t vm_init_bare(vm_t vm, vm_t from);
 rt_err_t vm_init(vm_t vm);
 void vm_go(vm_t vm);
 void vm_suspend(vm_t vm);
@@ -0,0 +1,482 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-12-03     Suqier       first version
+ * 2022-12-04     Suqier       copy VM state for clone_vm
+ * 2022-12-06     Suqier       cache colored guest RAM
+ * 2022-12-08     Suqier       guest RAM regions
+ */
+
+#include <rtthread.h>
+#include <rtconfig.h>
+
+#ifdef RT_USING_DFS
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#include <stage2.h>
+#include <gtimer.h>
+
+#include "mm.h"
+#include "vm.h"
+#include "os.h"
+#include "vtimer.h"
+#include "vm_snap.h"
+
+/*
+ * Snapshot and restore of a paused VM. A vCPU off the guest keeps its
+ * registers in the guest frame on its thread stack and in vcpu_arch, the
+ * vGIC has moved its LRs to lr_list and the vTimer sits in vtimer_context,
+ * so everything is in memory and is written as it is. Restore goes on top
+ * of vm_init_bare(): guest RAM is read straight into the new VM's RAM and
+ * the saved frame replaces the first frame of each vCPU thread.
+ */
+#define SNAP_PAGE_SIZE      (1UL << S2_PTE_SHIFT)
+
+union snap_buf
+{
+    struct vm_snap_vcpu vcpu;
+    struct vm_snap_vgic vgic;
+};
+
+static void snap_virq_save(struct vm_snap_virq *s, const struct virq *virq)
+{
+    s->aff    = virq->aff;
+    s->state  = virq->state;
+    s->prio   = virq->prio;
+    s->cfg    = virq->cfg;
+    s->lr     = virq->lr;
+    s->in_lr  = virq->in_lr;
+    s->enable = virq->enable;
+}
+
+static void snap_virq_load(struct virq *virq, const struct vm_snap_virq *s)
+{
+    virq->aff    = s->aff;
+    virq->state  = s->state;
+    virq->prio   = s->prio;
+    virq->cfg    = s->cfg;
+    virq->lr     = s->lr;
+    virq->in_lr  = s->in_lr;
+    virq->enable = s->enable;
+}
+
+static void snap_vcpu_save(vcpu_t vcpu, struct vm_snap_vcpu *s)
+{
+    struct vcpu_arch *arch = vcpu->arch;
+    vgicr_t gicr = vcpu->vm->vgic->gicr[vcpu->id];
+
+    rt_memset(s, 0, sizeof(struct vm_snap_vcpu));
+    s->status      = vcpu->status;
+    s->fpexc32_el2 = arch->fpexc32_el2;
+    s->hcr_el2     = arch->hcr_el2;
+    s->cptr_el2    = arch->cptr_el2;
+    s->mdcr_el2    = arch->mdcr_el2;
+    rt_memcpy(s->sys_regs, arch->vcpu_ctxt.sys_regs, sizeof(s->sys_regs));
+    rt_memcpy(s->frame, vcpu_guest_frame(vcpu), sizeof(s->frame));
+
+    s->ptimer_ctl  = vcpu->vtc->ptimer.ctl;
+    s->ptimer_tval = vcpu->vtc->ptimer.tval;
+    s->vtimer_ctl  = vcpu->vtc->vtimer.ctl;
+    s->vtimer_tval = vcpu->vtc->vtimer.tval;
+
+    s->gicr_ctlr = gicr->CTLR;
+    s->lr_tail   = gicr->tail;
+    rt_memcpy(s->lr_list, gicr->lr_list, sizeof(s->lr_list));
+    for (rt_size_t i = 0; i < VIRQ_PRIV_NUM; i++)
+        snap_virq_save(&s->virqs[i], &gicr->virqs[i]);
+}
+
+static rt_err_t snap_vcpu_load(vcpu_t vcpu, const struct vm_snap_vcpu *s)
+{
+    struct vcpu_arch *arch = vcpu->arch;
+    vgicr_t gicr = vcpu->vm->vgic->gicr[vcpu->id];
+
+    if (s->lr_tail > GIC_LR_LIST_NUM)
+        return -RT_ERROR;
+
+    arch->fpexc32_el2 = s->fpexc32_el2;
+    arch->hcr_el2     = s->hcr_el2;
+    arch->cptr_el2    = s->cptr_el2;
+    arch->mdcr_el2    = s->mdcr_el2;
+    rt_memcpy(arch->vcpu_ctxt.sys_regs, s->sys_regs, sizeof(s->sys_regs));
+    rt_memcpy(vcpu_guest_frame(vcpu), s->frame, sizeof(s->frame));
+
+    /* the restore hook adds the time since offset to tval, none has passed */
+    vcpu->vtc->ptimer.ctl  = s->ptimer_ctl;
+    vcpu->vtc->ptimer.tval = s->ptimer_tval;
+    vcpu->vtc->vtimer.ctl  = s->vtimer_ctl;
+    vcpu->vtc->vtimer.tval = s->vtimer_tval;
+    vcpu->vtc->offset = rt_hw_get_cntpct_val();
+
+    gicr->CTLR = s->gicr_ctlr;
+    gicr->tail = s->lr_tail;
+    rt_memcpy(gicr->lr_list, s->lr_list, sizeof(gicr->lr_list));
+    for (rt_size_t i = 0; i < VIRQ_PRIV_NUM; i++)
+        snap_virq_load(&gicr->virqs[i], &s->virqs[i]);
+
+    /* the thread is new, vcpu_go() starts it unless it never ran */
+    vcpu->status = s->status == VCPU_STATUS_NEVER_RUN ? VCPU_STATUS_NEVER_RUN : VCPU_STATUS_OFFLINE;
+    vcpu->halted = RT_FALSE;
+    return RT_EOK;
+}
+
+static void snap_vgic_save(vm_t vm, struct vm_snap_vgic *s)
+{
+    struct vgic *vgic = vm->vgic;
+
+    rt_memset(s, 0, sizeof(struct vm_snap_vgic));
+    s->gicd_ctlr    = vgic->gicd->CTLR;
+    s->ich_ap1r_el2 = vgic->ctxt.ich_ap1r_el2;
+    s->icc_sre_el1  = vgic->ctxt.icc_sre_el1;
+    s->icc_ctlr_el1 = vgic->ctxt.icc_ctlr_el1;
+    s->ich_vmcr_el2 = vgic->ctxt.ich_vmcr_el2;
+    s->ich_hcr_el2  = vgic->ctxt.ich_hcr_el2;
+    for (rt_size_t i = 0; i < 128; i++)
+        snap_virq_save(&s->virqs[i], &vgic->gicd->virqs[i]);
+}
+
+static void snap_vgic_load(vm_t vm, const struct vm_snap_vgic *s)
+{
+    struct vgic *vgic = vm->vgic;
+
+    vgic->gicd->CTLR        = s->gicd_ctlr;
+    vgic->ctxt.ich_ap1r_el2 = s->ich_ap1r_el2;
+    vgic->ctxt.icc_sre_el1  = s->icc_sre_el1;
+    vgic->ctxt.icc_ctlr_el1 = s->icc_ctlr_el1;
+    vgic->ctxt.ich_vmcr_el2 = s->ich_vmcr_el2;
+    vgic->ctxt.ich_hcr_el2  = s->ich_hcr_el2;
+    for (rt_size_t i = 0; i < 128; i++)
+        snap_virq_load(&vgic->gicd->virqs[i], &s->virqs[i]);
+}
+
+/*
+ * Copy vCPU, vGIC and vTimer state of the paused @from to @vm, fresh from
+ * vm_init_bare() on the guest RAM of @from. Like a restore from memory.
+ */
+rt_err_t vm_snap_copy(vm_t vm, vm_t from)
+{
+    union snap_buf *buf;
+    rt_err_t ret = RT_EOK;
+
+    if (vm->nr_vcpus != from->nr_vcpus)
+        return -RT_EINVAL;
+
+    buf = (union snap_buf *)rt_malloc(sizeof(union snap_buf));
+    if (buf == RT_NULL)
+        return -RT_ENOMEM;
+
+    for (rt_size_t i = 0; i < vm->nr_vcpus && ret == RT_EOK; i++)
+    {
+        snap_vcpu_save(from->vcpus[i], &buf->vcpu);
+        ret = snap_vcpu_load(vm->vcpus[i], &buf->vcpu);
+    }
+
+    if (ret == RT_EOK)
+    {
+        snap_vgic_save(from, &buf->vgic);
+        snap_vgic_load(vm, &buf->vgic);
+    }
+
+    rt_free(buf);
+    return ret;
+}
+
+#ifdef RT_USING_DFS
+static rt_err_t snap_write(int fd, const void *buf, rt_size_t len)
+{
+    return write(fd, buf, len) == (int)len ? RT_EOK : -RT_EIO;
+}
+
+static rt_err_t snap_read(int fd, void *buf, rt_size_t len)
+{
+    return read(fd, buf, len) == (int)len ? RT_EOK : -RT_EIO;
+}
+
+static rt_err_t snap_write_rec(int fd, rt_uint32_t type, rt_uint64_t arg,
+                            const void *buf, rt_size_t len)
+{
+    struct vm_snap_rec rec = { .type = type, .len = len, .arg = arg };
+
+    if (snap_write(fd, &rec, sizeof(rec)))
+        return -RT_EIO;
+    return len ? snap_write(fd, buf, len) : RT_EOK;
+}
+
+static rt_bool_t snap_page_is_zero(const void *page)
+{
+    const rt_uint64_t *p = (const rt_uint64_t *)page;
+    rt_uint64_t acc = 0;
+
+    for (rt_size_t i = 0; i < SNAP_PAGE_SIZE / sizeof(rt_uint64_t); i++)
+        acc |= p[i];
+    return acc == 0;
+}
+
+/*
+ * Non-zero pages in runs that are contiguous in host memory and stay in
+ * one mem_block, @size gets the bytes written.
+ */
+static rt_err_t snap_ram_save(int fd, struct mm_struct *mm, rt_size_t *size)
+{
+    struct rt_list_node *pos;
+    rt_uint64_t run_ipa = 0;
+    rt_ubase_t run_pa = 0, pa;
+    rt_size_t run_len = 0;
+
+    *size = 0;
+    rt_list_for_each(pos, &mm->vm_area_used)
+    {
+        struct vm_area *vma = rt_list_entry(pos, struct vm_area, node);
+
+        if (!VM_MAP_IS_RAM(vma->flag))
+            continue;
+
+        for (rt_uint64_t ipa = vma->desc.vaddr_start; ipa < vma->desc.vaddr_end; ipa += SNAP_PAGE_SIZE)
+        {
+            rt_bool_t skip = s2_translate(mm, ipa, &pa) || snap_page_is_zero((void *)pa);
+
+            if (run_len && !skip && ipa == run_ipa + run_len && pa == run_pa + run_len
+             && (ipa & (MEM_BLOCK_SIZE - 1)) && ipa != vma->desc.vaddr_start)
+            {
+                run_len += SNAP_PAGE_SIZE;
+                continue;
+            }
+
+            if (run_len)
+            {
+                if (snap_write_rec(fd, VM_SNAP_RAM, run_ipa, (void *)run_pa, run_len))
+                    return -RT_EIO;
+                *size += run_len;
+                run_len = 0;
+            }
+
+            if (!skip)
+            {
+                run_ipa = ipa;
+                run_pa = pa;
+                run_len = SNAP_PAGE_SIZE;
+            }
+        }
+    }
+
+    if (run_len)
+    {
+        if (snap_write_rec(fd, VM_SNAP_RAM, run_ipa, (void *)run_pa, run_len))
+            return -RT_EIO;
+        *size += run_len;
+    }
+
+    return RT_EOK;
+}
+
+/*
+ * A run is read in pieces contiguous in host memory, the whole run in a
+ * new VM of mem_blocks, page by page in cache colored guest RAM.
+ */
+static rt_err_t snap_ram_load(int fd, struct mm_struct *mm, const struct vm_snap_rec *rec)
+{
+    rt_uint64_t ipa = rec->arg, end = rec->arg + rec->len;
+    rt_ubase_t pa, next;
+    rt_size_t len;
+    rt_err_t ret = RT_EOK;
+
+    if ((rec->arg & (MEM_BLOCK_SIZE - 1)) + rec->len > MEM_BLOCK_SIZE
+     || vm_ram_area(mm, rec->arg, rec->len) == RT_NULL)
+        return -RT_ERROR;
+
+    for (; ipa < end && ret == RT_EOK; ipa += len)
+    {
+        if (s2_translate(mm, ipa, &pa))
+            return -RT_ERROR;
+
+        len = SNAP_PAGE_SIZE - (ipa & (SNAP_PAGE_SIZE - 1));
+        while (ipa + len < end && s2_translate(mm, ipa + len, &next) == RT_EOK && next == pa + len)
+            len += SNAP_PAGE_SIZE;
+        if (ipa + len > end)
+            len = end - ipa;
+
+        ret = snap_read(fd, (void *)pa, len);
+    }
+
+    return ret;
+}
+
+rt_err_t vm_snap_read_hdr(const char *path, struct vm_snap_hdr *hdr)
+{
+    int fd = open(path, O_RDONLY, 0);
+    rt_err_t ret;
+
+    if (fd < 0)
+        return -RT_EIO;
+
+    ret = snap_read(fd, hdr, sizeof(struct vm_snap_hdr));
+    close(fd);
+    if (ret == RT_EOK && (hdr->magic != VM_SNAP_MAGIC || hdr->version != VM_SNAP_VERSION))
+        ret = -RT_ERROR;
+
+    return ret;
+}
+
+/* Save a paused @vm to @path. */
+rt_err_t vm_snapshot(vm_t vm, const char *path)
+{
+    struct vm_snap_hdr hdr;
+    union snap_buf *buf;
+    rt_size_t ram = 0;
+    rt_err_t ret = RT_EOK;
+    int fd;
+
+    if (vm->status != VM_STATUS_SUSPEND)
+    {
+        rt_kprintf("[Error] %dth VM: Pause it before snapshot\n", vm->id);
+        return -RT_EBUSY;
+    }
+
+    buf = (union snap_buf *)rt_malloc(sizeof(union snap_buf));
+    if (buf == RT_NULL)
+        return -RT_ENOMEM;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+        rt_free(buf);
+        rt_kprintf("[Error] %dth VM: Open snapshot %s failure\n", vm->id, path);
+        return -RT_EIO;
+    }
+
+    rt_memset(&hdr, 0, sizeof(hdr));
+    hdr.magic    = VM_SNAP_MAGIC;
+    hdr.version  = VM_SNAP_VERSION;
+    hdr.os_idx   = vm->os_idx;
+    hdr.nr_vcpus = vm->nr_vcpus;
+    hdr.mem_addr = vm->os->mem.region[0].addr;
+    hdr.mem_size = vm->mm->mem_size;
+    ret = snap_write(fd, &hdr, sizeof(hdr));
+
+    for (rt_size_t i = 0; ret == RT_EOK && i < vm->nr_vcpus; i++)
+    {
+        snap_vcpu_save(vm->vcpus[i], &buf->vcpu);
+        ret = snap_write_rec(fd, VM_SNAP_VCPU, i, &buf->vcpu, sizeof(buf->vcpu));
+    }
+
+    if (ret == RT_EOK)
+    {
+        snap_vgic_save(vm, &buf->vgic);
+        ret = snap_write_rec(fd, VM_SNAP_VGIC, 0, &buf->vgic, sizeof(buf->vgic));
+    }
+
+    if (ret == RT_EOK)
+        ret = snap_ram_save(fd, vm->mm, &ram);
+    if (ret == RT_EOK)
+        ret = snap_write_rec(fd, VM_SNAP_END, 0, RT_NULL, 0);
+
+    close(fd);
+    rt_free(buf);
+
+    if (ret)
+    {
+        rt_kprintf("[Error] %dth VM: Write snapshot %s failure\n", vm->id, path);
+        return ret;
+    }
+
+    rt_kprintf("[Info] %dth VM: Snapshot to %s OK, %d KB of RAM\n",
+            vm->id, path, (int)(ram >> 10));
+    return RT_EOK;
+}
+
+/*
+ * Load @path into @vm, fresh from vm_init_bare() for the same OS. vCPUs
+ * that had run are left VCPU_STATUS_OFFLINE for vcpu_go().
+ */
+rt_err_t vm_restore(vm_t vm, const char *path)
+{
+    struct vm_snap_hdr hdr;
+    struct vm_snap_rec rec;
+    union snap_buf *buf;
+    rt_uint32_t seen = 0, all = (1U << vm->nr_vcpus) - 1;
+    rt_err_t ret;
+    int fd;
+
+    buf = (union snap_buf *)rt_malloc(sizeof(union snap_buf));
+    if (buf == RT_NULL)
+        return -RT_ENOMEM;
+
+    fd = open(path, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        rt_free(buf);
+        rt_kprintf("[Error] %dth VM: Open snapshot %s failure\n", vm->id, path);
+        return -RT_EIO;
+    }
+
+    ret = snap_read(fd, &hdr, sizeof(hdr));
+    if (ret == RT_EOK && (hdr.magic != VM_SNAP_MAGIC || hdr.version != VM_SNAP_VERSION
+     || hdr.nr_vcpus != vm->nr_vcpus || hdr.mem_addr != vm->os->mem.region[0].addr
+     || hdr.mem_size != vm->mm->mem_size))
+        ret = -RT_ERROR;
+
+    while (ret == RT_EOK)
+    {
+        ret = snap_read(fd, &rec, sizeof(rec));
+        if (ret)
+            break;
+
+        if (rec.type == VM_SNAP_END)
+        {
+            /* the vGIC is bit nr_vcpus */
+            ret = seen == (all | (1U << vm->nr_vcpus)) ? RT_EOK : -RT_ERROR;
+            break;
+        }
+
+        switch (rec.type)
+        {
+        case VM_SNAP_VCPU:
+            if (rec.len != sizeof(buf->vcpu) || rec.arg >= vm->nr_vcpus)
+                ret = -RT_ERROR;
+            else
+                ret = snap_read(fd, &buf->vcpu, rec.len);
+            if (ret == RT_EOK)
+                ret = snap_vcpu_load(vm->vcpus[rec.arg], &buf->vcpu);
+            if (ret == RT_EOK)
+                seen |= 1U << rec.arg;
+            break;
+        case VM_SNAP_VGIC:
+            if (rec.len != sizeof(buf->vgic))
+                ret = -RT_ERROR;
+            else
+                ret = snap_read(fd, &buf->vgic, rec.len);
+            if (ret == RT_EOK)
+            {
+                snap_vgic_load(vm, &buf->vgic);
+                seen |= 1U << vm->nr_vcpus;
+            }
+            break;
+        case VM_SNAP_RAM:
+            ret = snap_ram_load(fd, vm->mm, &rec);
+            break;
+        default:
+            ret = -RT_ERROR;
+            break;
+        }
+    }
+
+    close(fd);
+    rt_free(buf);
+
+    if (ret)
+    {
+        rt_kprintf("[Error] %dth VM: Restore from %s failure\n", vm->id, path);
+        return ret;
+    }
+
+    rt_kprintf("[Info] %dth VM: Restore from %s OK\n", vm->id, path);
+    return RT_EOK;
+}
+
+#endif  /* RT_USING_DFS */
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-12-03     Suqier       first version
+ * 2022-12-04     Suqier       add vm_snap_copy()
+ * 2022-12-08     Suqier       guest RAM regions
+ */
+
+#ifndef __VM_SNAP_H__
+#define __VM_SNAP_H__
+
+#include <rtdef.h>
+#include <virt_arch.h>
+
+#include "vm.h"
+
+/*
+ * VM snapshot file: a header, then records until VM_SNAP_END. Guest RAM
+ * goes in runs of non-zero pages, a restored VM gets zeroed mem_blocks from
+ * the pool, so zero pages cost neither file space nor time. Structures are
+ * dumped as they are, a snapshot only restores on the same build.
+ */
+#define VM_SNAP_MAGIC       (0x50414E53)    /* "SNAP" */
+#define VM_SNAP_VERSION     (1)
+
+struct vm_snap_hdr
+{
+    rt_uint32_t magic;
+    rt_uint32_t version;
+    rt_uint32_t os_idx;
+    rt_uint32_t nr_vcpus;
+    rt_uint64_t mem_addr;       /* first RAM region */
+    rt_uint64_t mem_size;       /* MB, all RAM regions */
+};
+
+enum
+{
+    VM_SNAP_END = 0,
+    VM_SNAP_VCPU,               /* arg: vCPU id */
+    VM_SNAP_VGIC,               /* distributor and vgic_context */
+    VM_SNAP_RAM,                /* arg: IPA, never crosses a mem_block or region */
+};
+
+struct vm_snap_rec
+{
+    rt_uint32_t type;
+    rt_uint32_t len;            /* payload after this header */
+    rt_uint64_t arg;
+};
+
+/* what changes in struct virq while the guest runs */
+struct vm_snap_virq
+{
+    rt_uint64_t aff;
+    rt_uint8_t  state;
+    rt_uint8_t  prio;
+    rt_uint8_t  cfg;
+    rt_uint8_t  lr;
+    rt_uint8_t  in_lr;
+    rt_uint8_t  enable;
+    rt_uint8_t  reserved[2];
+};
+
+struct vm_snap_vcpu
+{
+    rt_uint32_t status;
+    rt_uint32_t fpexc32_el2;
+    rt_uint64_t hcr_el2;
+    rt_uint64_t cptr_el2;
+    rt_uint64_t mdcr_el2;
+    rt_uint64_t sys_regs[NR_VCPU_SYS_REGS];
+    rt_uint64_t frame[VCPU_GUEST_FRAME_SIZE / sizeof(rt_uint64_t)];
+
+    /* vTimer */
+    rt_uint32_t ptimer_ctl;
+    rt_uint32_t ptimer_tval;
+    rt_uint32_t vtimer_ctl;
+    rt_uint32_t vtimer_tval;
+
+    /* redistributor, pending LRs were moved to lr_list on the way out */
+    rt_uint32_t gicr_ctlr;
+    rt_uint32_t lr_tail;
+    rt_uint64_t lr_list[GIC_LR_LIST_NUM];
+    struct vm_snap_virq virqs[VIRQ_PRIV_NUM];
+};
+
+struct vm_snap_vgic
+{
+    rt_uint32_t gicd_ctlr;
+    rt_uint32_t ich_ap1r_el2;
+    rt_uint32_t icc_sre_el1;
+    rt_uint32_t icc_ctlr_el1;
+    rt_uint32_t ich_vmcr_el2;
+    rt_uint32_t ich_hcr_el2;
+    struct vm_snap_virq virqs[128];
+};
+
+rt_err_t vm_snap_copy(vm_t vm, vm_t from);
+rt_err_t vm_snap_read_hdr(const char *path, struct vm_snap_hdr *hdr);
+rt_err_t vm_snapshot(vm_t vm, const char *path);
+rt_err_t vm_restore(vm_t vm, const char *path);
+
+#endif  /* __VM_SNAP_H__ */
@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-11-24     Suqier       first version
+ * 2022-12-12     Suqier       coalesced UART_DR writes
+ * 2022-12-12     Suqier       emulate registers under the lock of the host side
+ */
+
+#include <rthw.h>
+#include <rtthread.h>
+#include <cpuport.h>
+
+#include "vpl011.h"
+#include "vgic.h"
+#include "vm.h"
+
+static const rt_uint8_t vpl011_id[8] =
+{
+    0x11, 0x10, 0x14, 0x00,     /* PL011 r1p5 */
+    0x0D, 0xF0, 0x05, 0xB1,     /* PrimeCell */
+};
+
+rt_inline rt_uint32_t fifo_count(struct vpl011_fifo *f)
+{
+    return f->tail - f->head;
+}
+
+rt_inline rt_bool_t fifo_push(struct vpl011_fifo *f, rt_uint8_t c)
+{
+    if (fifo_count(f) == VPL011_FIFO_SIZE)
+        return RT_FALSE;
+
+    f->buf[f->tail & VPL011_FIFO_MASK] = c;
+    rt_hw_dmb();
+    f->tail++;
+    return RT_TRUE;
+}
+
+rt_inline rt_bool_t fifo_pop(struct vpl011_fifo *f, rt_uint8_t *c)
+{
+    if (fifo_count(f) == 0)
+        return RT_FALSE;
+
+    *c = f->buf[f->head & VPL011_FIFO_MASK];
+    rt_hw_dmb();
+    f->head++;
+    return RT_TRUE;
+}
+
+/*
+ * RX and RT follow "RX FIFO not empty", TX follows "TX FIFO at most half
+ * full", so the guest driver sees a level it can drain in one handler.
+ * The vIRQ is injected on the rising edge of UART_MIS only.
+ */
+static void vpl011_update_irq(vpl011_t uart)
+{
+    rt_uint32_t ris = uart->ris & ~(UART_INT_RX | UART_INT_RT | UART_INT_TX);
+    rt_bool_t line;
+
+    if (fifo_count(&uart->rx))
+        ris |= UART_INT_RX | UART_INT_RT;
+    if (fifo_count(&uart->tx) <= VPL011_FIFO_SIZE / 2)
+        ris |= UART_INT_TX;
+
+    uart->ris = ris;
+    line = (ris & uart->imsc) != 0;
+
+    if (line && !uart->irq_line)
+    {
+        struct vm *vm = uart->vdev.vm;
+        vcpu_t vcpu = vm->vcpus[0];
+
+        vm->vgic->ops->inject(vcpu, vgic_get_virq(vcpu, uart->virq));
+    }
+    uart->irq_line = line;
+}
+
+static rt_uint32_t vpl011_read_fr(vpl011_t uart)
+{
+    rt_uint32_t tx = fifo_count(&uart->tx), rx = fifo_count(&uart->rx);
+    rt_uint32_t fr = 0;
+
+    if (tx == 0)
+        fr |= UART_FR_TXFE;
+    else
+        fr |= UART_FR_BUSY;
+    if (tx == VPL011_FIFO_SIZE)
+        fr |= UART_FR_TXFF;
+    if (rx == 0)
+        fr |= UART_FR_RXFE;
+    if (rx == VPL011_FIFO_SIZE)
+        fr |= UART_FR_RXFF;
+
+    return fr;
+}
+
+static void vpl011_write_dr(vpl011_t uart, rt_uint8_t c)
+{
+    rt_bool_t was_empty = (fifo_count(&uart->tx) == 0);
+
+    /* a full FIFO drops the byte, as the hardware does */
+    if (fifo_push(&uart->tx, c) && was_empty && uart->tx_notify)
+        uart->tx_notify(uart);
+}
+
+static rt_uint32_t vpl011_mmio_read(vpl011_t uart, rt_uint64_t off)
+{
+    rt_uint8_t c;
+
+    switch (off)
+    {
+    case UART_DR:
+        return fifo_pop(&uart->rx, &c) ? c : 0;
+    case UART_FR:
+        return vpl011_read_fr(uart);
+    case UART_IBRD:
+        return uart->ibrd;
+    case UART_FBRD:
+        return uart->fbrd;
+    case UART_LCR_H:
+        return uart->lcr_h;
+    case UART_CR:
+        return uart->cr;
+    case UART_IFLS:
+        return uart->ifls;
+    case UART_IMSC:
+        return uart->imsc;
+    case UART_RIS:
+        return uart->ris;
+    case UART_MIS:
+        return uart->ris & uart->imsc;
+    case UART_DMACR:
+        return uart->dmacr;
+
+    default:
+        if (off >= UART_ID_OFF && off < UART_ID_OFF + sizeof(vpl011_id) * 4)
+            return vpl011_id[(off - UART_ID_OFF) >> 2];
+        return 0;   /* UART_RSR, UART_ILPR and reserved */
+    }
+}
+
+static void vpl011_mmio_write(vpl011_t uart, rt_uint64_t off, rt_uint32_t val)
+{
+    switch (off)
+    {
+    case UART_DR:
+        vpl011_write_dr(uart, (rt_uint8_t)val);
+        break;
+    case UART_IBRD:
+        uart->ibrd = val & 0xFFFF;
+        break;
+    case UART_FBRD:
+        uart->fbrd = val & 0x3F;
+        break;
+    case UART_LCR_H:
+        uart->lcr_h = val & 0xFF;
+        break;
+    case UART_CR:
+        uart->cr = val & 0xFFFF;
+        break;
+    case UART_IFLS:
+        uart->ifls = val & 0x3F;
+        break;
+    case UART_IMSC:
+        uart->imsc = val & UART_INT_ALL;
+        break;
+    case UART_ICR:
+        uart->ris &= ~val;  /* level sources come back in update */
+        break;
+    case UART_DMACR:
+        uart->dmacr = val & 0x7;
+        break;
+
+    default:
+        break;      /* UART_RSR/ECR, read only and reserved */
+    }
+}
+
+/* Every register lives here, the physical UART is never touched. */
+static void vpl011_mmio(vdev_t vdev, gp_regs_t regs, access_info_t acc)
+{
+    vpl011_t uart = rt_container_of(vdev, struct vpl011, vdev);
+    unsigned long long *val = regs_xn(regs, acc.srt);
+    rt_uint64_t off = acc.addr - vdev->region[0].vaddr_start;
+    rt_base_t level;
+
+    /* the host threads update the FIFOs and the level under the same lock */
+    level = rt_hw_interrupt_disable();
+    if (acc.is_write)
+        vpl011_mmio_write(uart, off, (rt_uint32_t)*val);
+    else
+        *val = vpl011_mmio_read(uart, off);
+
+    vpl011_update_irq(uart);
+    rt_hw_interrupt_enable(level);
+}
+
+const static struct vdev_ops vpl011_ops =
+{
+    .mmio = vpl011_mmio,
+};
+
+void vpl011_init(vpl011_t uart, rt_uint64_t ipa, rt_uint64_t size, rt_uint32_t virq)
+{
+    RT_ASSERT(uart);
+
+    rt_memset(uart, 0, sizeof(struct vpl011));
+    uart->vdev.mmap_num = 1;
+    uart->vdev.region[0].vaddr_start = ipa;
+    uart->vdev.region[0].vaddr_end   = ipa + size;
+    uart->vdev.ops = &vpl011_ops;
+    uart->vdev.is_open = RT_TRUE;   /* always trapped */
+
+    uart->virq = virq;
+    uart->cr   = UART_CR_RESET;
+    uart->ifls = UART_IFLS_RESET;
+    uart->ris  = UART_INT_TX;       /* empty TX FIFO */
+}
+
+/*
+ * Queue guest writes to UART_DR as coalesced MMIO, after vdev_register().
+ * A byte still exits but is not emulated there. Any other access, e.g.
+ * polling UART_FR or reading UART_DR, replays the queue first, so the
+ * guest always sees the FIFO level of all it wrote.
+ */
+rt_err_t vpl011_coalesce_tx(vpl011_t uart)
+{
+    rt_uint64_t dr = uart->vdev.region[0].vaddr_start + UART_DR;
+
+    return vdev_coalesced_register(&uart->vdev, dr, dr + sizeof(rt_uint32_t));
+}
+
+/*
+ * Host side, take at most @size bytes of guest output. Runs on a host
+ * thread, under the lock the vCPU's MMIO exit takes too.
+ */
+rt_size_t vpl011_tx_drain(vpl011_t uart, rt_uint8_t *buf, rt_size_t size)
+{
+    rt_size_t n = 0;
+    rt_base_t level;
+
+    level = rt_hw_interrupt_disable();
+    while (n < size && fifo_pop(&uart->tx, &buf[n]))
+        n++;
+    if (n)
+        vpl011_update_irq(uart);
+    rt_hw_interrupt_enable(level);
+
+    return n;
+}
+
+/* Host side, feed guest input. Safe in ISR, bytes beyond the FIFO are lost. */
+rt_size_t vpl011_rx_push(vpl011_t uart, const rt_uint8_t *buf, rt_size_t size)
+{
+    rt_size_t n = 0;
+    rt_base_t level;
+
+    level = rt_hw_interrupt_disable();
+    while (n < size && fifo_push(&uart->rx, buf[n]))
+        n++;
+    if (n)
+        vpl011_update_irq(uart);
+    rt_hw_interrupt_enable(level);
+
+    return n;
+}
+
+rt_size_t vpl011_rx_space(vpl011_t uart)
+{
+    return VPL011_FIFO_SIZE - fifo_count(&uart->rx);
+}
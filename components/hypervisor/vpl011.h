@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-11-24     Suqier       first version
+ * 2022-12-12     Suqier       coalesced UART_DR writes
+ */
+
+#ifndef __VPL011_H__
+#define __VPL011_H__
+
+#include <rtdef.h>
+
+#include "vdev.h"
+
+/* PL011 register offset */
+#define UART_DR             (0x000)
+#define UART_RSR            (0x004)
+#define UART_FR             (0x018)
+#define UART_ILPR           (0x020)
+#define UART_IBRD           (0x024)
+#define UART_FBRD           (0x028)
+#define UART_LCR_H          (0x02C)
+#define UART_CR             (0x030)
+#define UART_IFLS           (0x034)
+#define UART_IMSC           (0x038)
+#define UART_RIS            (0x03C)
+#define UART_MIS            (0x040)
+#define UART_ICR            (0x044)
+#define UART_DMACR          (0x048)
+#define UART_ID_OFF         (0xFE0)     /* PeriphID0..3, CellID0..3 */
+
+/* UART_FR */
+#define UART_FR_BUSY        (1 << 3)
+#define UART_FR_RXFE        (1 << 4)
+#define UART_FR_TXFF        (1 << 5)
+#define UART_FR_RXFF        (1 << 6)
+#define UART_FR_TXFE        (1 << 7)
+
+/* UART_IMSC, UART_RIS, UART_MIS and UART_ICR */
+#define UART_INT_RX         (1 << 4)
+#define UART_INT_TX         (1 << 5)
+#define UART_INT_RT         (1 << 6)
+#define UART_INT_ALL        (0x7FF)
+
+#define UART_CR_RESET       (0x0300)    /* TXE | RXE */
+#define UART_IFLS_RESET     (0x12)      /* half way for both */
+
+/*
+ * Both FIFOs are single producer and single consumer: the guest fills TX
+ * and drains RX through trapped MMIO, the host does the opposite. Sized
+ * above the hardware 32 bytes so a burst of guest output never waits.
+ */
+#define VPL011_FIFO_SIZE    (256)
+#define VPL011_FIFO_MASK    (VPL011_FIFO_SIZE - 1)
+
+struct vpl011_fifo
+{
+    rt_uint32_t head;       /* consumer */
+    rt_uint32_t tail;       /* producer */
+    rt_uint8_t  buf[VPL011_FIFO_SIZE];
+};
+
+struct vpl011
+{
+    struct vdev vdev;
+    rt_uint32_t virq;       /* SPI of the UART seen by guest */
+
+    rt_uint32_t cr, lcr_h, ibrd, fbrd, ifls;
+    rt_uint32_t imsc, ris, dmacr;
+    rt_bool_t   irq_line;   /* last level of UART_MIS != 0 */
+
+    struct vpl011_fifo tx;
+    struct vpl011_fifo rx;
+
+    /* TX FIFO goes from empty to not empty, called in MMIO exit */
+    void (*tx_notify)(struct vpl011 *uart);
+};
+typedef struct vpl011 *vpl011_t;
+
+void vpl011_init(vpl011_t uart, rt_uint64_t ipa, rt_uint64_t size, rt_uint32_t virq);
+rt_err_t vpl011_coalesce_tx(vpl011_t uart);
+rt_size_t vpl011_tx_drain(vpl011_t uart, rt_uint8_t *buf, rt_size_t size);
+rt_size_t vpl011_rx_push(vpl011_t uart, const rt_uint8_t *buf, rt_size_t size);
+rt_size_t vpl011_rx_space(vpl011_t uart);
+
+#endif  /* __VPL011_H__ */
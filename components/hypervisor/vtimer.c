@@ -6,6 +6,7 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-10-06     Suqier       first version
+ * 2022-12-11     Suqier       stop and free vTimers of a deleted VM
  */
 
 #include <cpuport.h>
@@ -71,7 +72,15 @@ rt_err_t vtimer_ctxt_create(vcpu_t vcpu)
                             RT_TIMER_FLAG_PERIODIC | RT_TIMER_FLAG_SOFT_TIMER);
 
         if (!ptimer || !vtimer)
+        {
+            if (ptimer)
+                rt_timer_delete(ptimer);
+            if (vtimer)
+                rt_timer_delete(vtimer);
+            rt_free(vt_ctxt);
+            rt_kprintf("[Error] Create vTimer failure for vcpu-%d.\n", vcpu->id);
             return -RT_ENOMEM;
+        }
         
         vt_ctxt->ptimer.timer = ptimer;
         vt_ctxt->vtimer.timer = vtimer;
@@ -83,6 +92,30 @@ rt_err_t vtimer_ctxt_create(vcpu_t vcpu)
     return RT_EOK;
 }
 
+/* A vCPU going offline leaves no timer running to inject into it. */
+void vtimer_ctxt_stop(vcpu_t vcpu)
+{
+    vt_ctxt_t vt_ctxt = vcpu->vtc;
+
+    if (vt_ctxt == RT_NULL)
+        return;
+    rt_timer_stop(vt_ctxt->ptimer.timer);
+    rt_timer_stop(vt_ctxt->vtimer.timer);
+}
+
+void vtimer_ctxt_free(vcpu_t vcpu)
+{
+    vt_ctxt_t vt_ctxt = vcpu->vtc;
+
+    if (vt_ctxt == RT_NULL)
+        return;
+    vtimer_ctxt_stop(vcpu);
+    rt_timer_delete(vt_ctxt->ptimer.timer);
+    rt_timer_delete(vt_ctxt->vtimer.timer);
+    rt_free(vt_ctxt);
+    vcpu->vtc = RT_NULL;
+}
+
 static void vtimer_handler_cntp_ctl(rt_bool_t is_write, rt_uint64_t *reg_val)
 {
     vcpu_t vcpu = get_curr_vcpu();
@@ -127,6 +160,16 @@ static void vtimer_handler_cntp_tval(rt_bool_t is_write, rt_uint64_t *reg_val)
     }
 }
 
+/* The loaded guest timer has fired and its interrupt is not masked. */
+rt_bool_t vtimer_is_pending(vcpu_t vcpu)
+{
+    rt_uint64_t ctl;
+
+    GET_SYS_REG(CNTP_CTL_EL0, ctl);
+    return (ctl & (CNTP_CTL_ENABLE_MASK | CNTP_CTL_IMASK_MASK | CNTP_CTL_ISTATUS_MASK))
+        == (CNTP_CTL_ENABLE_MASK | CNTP_CTL_ISTATUS_MASK);
+}
+
 void sysreg_vtimer_handler(struct rt_hw_exp_stack *regs, rt_uint64_t reg_name,
                         rt_bool_t is_write, rt_uint32_t srt)
 {
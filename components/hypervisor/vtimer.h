@@ -6,6 +6,7 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-10-06     Suqier       first version
+ * 2022-12-11     Suqier       stop and free vTimers of a deleted VM
  */
 
 #ifndef __VTIMER_H__
@@ -51,6 +52,9 @@ typedef struct vtimer_context *vt_ctxt_t;
 /* emulate EL1 pTimer and vTimer, then inject vIRQ */
 void vtimer_ctxt_init(vt_ctxt_t vtimer_ctxt, vcpu_t vcpu);
 rt_err_t vtimer_ctxt_create(vcpu_t vcpu);
+void vtimer_ctxt_stop(vcpu_t vcpu);
+void vtimer_ctxt_free(vcpu_t vcpu);
+rt_bool_t vtimer_is_pending(vcpu_t vcpu);
 void sysreg_vtimer_handler(struct rt_hw_exp_stack *regs, rt_uint64_t reg_name,
                         rt_bool_t is_write, rt_uint32_t srt);
 
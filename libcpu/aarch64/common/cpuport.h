@@ -13,6 +13,19 @@
 
 #include <rtdef.h>
 
+#ifdef RT_HYPERVISOR_SIM
+/* Host simulation build, barriers only need to stop the compiler. */
+#define __WFI() __asm__ volatile ("":::"memory")
+#define __WFE() __asm__ volatile ("":::"memory")
+#define __SEV() __asm__ volatile ("":::"memory")
+#define __ISB() __asm__ volatile ("":::"memory")
+#define __DSB() __asm__ volatile ("":::"memory")
+#define __DMB() __asm__ volatile ("":::"memory")
+
+rt_inline void rt_hw_isb(void) { __ISB(); }
+rt_inline void rt_hw_dmb(void) { __DMB(); }
+rt_inline void rt_hw_dsb(void) { __DSB(); }
+#else
 #define __WFI() __asm__ volatile ("wfi":::"memory")
 #define __WFE() __asm__ volatile ("wfe":::"memory")
 #define __SEV() __asm__ volatile ("sev")
@@ -34,5 +47,6 @@ rt_inline void rt_hw_dsb(void)
 {
     __asm__ volatile ("dsb sy":::"memory");
 }
+#endif  /* RT_HYPERVISOR_SIM */
 
 #endif /* __CPUPORT_H__ */
@@ -28,8 +28,17 @@ extern int rt_hw_cpu_id(void);
 extern rt_uint64_t rt_cpu_mpidr_early[];
 #endif /* RT_USING_SMP */
 
+#ifdef RT_HYPERVISOR_SIM
+/* GIC CPU interface and ICH_* registers come from the mock in sim_sysreg.c */
+rt_uint64_t sim_sysreg_read(const char *reg);
+void sim_sysreg_write(const char *reg, rt_uint64_t val);
+
+#define GET_GICV3_REG(reg, out) (out) = sim_sysreg_read(reg);
+#define SET_GICV3_REG(reg, in)  sim_sysreg_write(reg, (rt_uint64_t)(in));
+#else
 #define GET_GICV3_REG(reg, out) __asm__ volatile ("mrs %0, " reg:"=r"(out)::"memory");
 #define SET_GICV3_REG(reg, in)  __asm__ volatile ("msr " reg ", %0"::"r"(in):"memory");
+#endif  /* RT_HYPERVISOR_SIM */
 
 #define ICC_CTLR_CBPR_OFF   0
 #define ICC_CTLR_EOI_OFF    1
@@ -13,8 +13,20 @@
 
 #include <rtdef.h>
 
+#ifdef RT_HYPERVISOR_SIM
+/* 
+ * Host simulation build (components/hypervisor/sim), system registers are 
+ * backed by a mock register file keyed by the encoding string below.
+ */
+rt_uint64_t sim_sysreg_read(const char *reg);
+void sim_sysreg_write(const char *reg, rt_uint64_t val);
+
+#define GET_SYS_REG(reg, out) (out) = sim_sysreg_read(reg);
+#define SET_SYS_REG(reg, in)  sim_sysreg_write(reg, (rt_uint64_t)(in));
+#else
 #define GET_SYS_REG(reg, out) __asm__ volatile ("mrs %0, " reg:"=r"(out)::"memory");
 #define SET_SYS_REG(reg, in)  __asm__ volatile ("msr " reg ", %0"::"r"(in):"memory");
+#endif  /* RT_HYPERVISOR_SIM */
 
 /* AArch64 common register. */
 #define CNTFRQ_EL0		"S3_3_C14_C0_0"
@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-11-22     Suqier       first version
+ * 2022-12-04     Suqier       write multicall results through copy-on-write
+ * 2022-12-07     Suqier       memory balloon calls
+ * 2022-12-08     Suqier       multicall entries in any guest RAM region
+ * 2022-12-09     Suqier       multicall entries through the translation cache
+ * 2022-12-12     Suqier       stop a multicall at an entry ballooned out
+ */
+
+#include <rtthread.h>
+#include <os.h>
+#include <vm.h>
+
+#include "stage2.h"
+#include "trap.h"
+
+#define SMCCC_FAST_CALL     (0x80000000U)
+#define SMCCC_OWNER_MASK    (0x3F000000U)
+#define SMCCC_OWNER_ARCH    (0x00000000U)
+#define SMCCC_OWNER_VHYP    (0x06000000U)
+#define SMCCC_FUNC_MASK     (0x0000FFFFU)
+
+/* "RT-Hypervisor" Call UID: 5d6a1b1c-3f2e-4d2a-9b1e-52542d485950 */
+#define HVC_UID_0           (0x1c1b6a5dU)
+#define HVC_UID_1           (0x2a4d2e3fU)
+#define HVC_UID_2           (0x2d54521eU)
+#define HVC_UID_3           (0x50594851U)
+
+static rt_uint64_t hvc_get_version(rt_uint32_t fn, rt_uint64_t arg0,
+                                   rt_uint64_t arg1, rt_uint64_t arg2)
+{
+    return HVC_HYP_VERSION;
+}
+
+#ifdef RT_HYPERVISOR_BENCH
+static rt_uint64_t hvc_bench_null(rt_uint32_t fn, rt_uint64_t arg0,
+                                  rt_uint64_t arg1, rt_uint64_t arg2)
+{
+    return SMCCC_RET_SUCCESS;
+}
+#endif
+
+static rt_uint64_t hvc_multicall(rt_uint32_t fn, rt_uint64_t arg0,
+                                 rt_uint64_t arg1, rt_uint64_t arg2);
+
+/*
+ * Memory balloon. The guest driver polls HVC_BALLOON_TARGET and gives RAM
+ * back or takes it again until HVC_BALLOON_SIZE gets there.
+ */
+static rt_uint64_t hvc_balloon_info(rt_uint32_t fn, rt_uint64_t arg0,
+                                    rt_uint64_t arg1, rt_uint64_t arg2)
+{
+    struct mm_struct *mm = get_curr_vm()->mm;
+
+    switch (arg0)
+    {
+    case HVC_BALLOON_GRANULE:
+        return vm_balloon_granule(mm);
+    case HVC_BALLOON_TARGET:
+        return mm->balloon_target;
+    case HVC_BALLOON_SIZE:
+        return mm->balloon;
+    default:
+        return (rt_uint64_t)SMCCC_RET_INVALID_PARAMETER;
+    }
+}
+
+static rt_uint64_t hvc_balloon(rt_uint32_t fn, rt_uint64_t arg0,
+                               rt_uint64_t arg1, rt_uint64_t arg2)
+{
+    struct mm_struct *mm = get_curr_vm()->mm;
+    rt_err_t ret;
+
+    if (fn == HVC_FN64_BALLOON_INFLATE)
+        ret = vm_balloon_inflate(mm, arg0, arg1);
+    else
+        ret = vm_balloon_deflate(mm, arg0, arg1);
+
+    if (ret == -RT_EINVAL)
+        return (rt_uint64_t)SMCCC_RET_INVALID_PARAMETER;
+    if (ret == -RT_ENOMEM)
+        return (rt_uint64_t)HVC_RET_NO_MEMORY;
+    return ret ? (rt_uint64_t)SMCCC_RET_NOT_SUPPORTED : SMCCC_RET_SUCCESS;
+}
+
+/* Vendor Specific Hypervisor Service, indexed by function number. */
+static hvc_trap_handle hvc_table[HVC_FN64_NR] =
+{
+    [HVC_FN64_GET_VERSION - HVC_FN64_BASE] = hvc_get_version,
+#ifdef RT_HYPERVISOR_BENCH
+    [HVC_FN64_BENCH_NULL  - HVC_FN64_BASE] = hvc_bench_null,
+#endif
+    [HVC_FN64_MULTICALL   - HVC_FN64_BASE] = hvc_multicall,
+    [HVC_FN64_BALLOON_INFO    - HVC_FN64_BASE] = hvc_balloon_info,
+    [HVC_FN64_BALLOON_INFLATE - HVC_FN64_BASE] = hvc_balloon,
+    [HVC_FN64_BALLOON_DEFLATE - HVC_FN64_BASE] = hvc_balloon,
+};
+
+rt_err_t hvc_register(rt_uint32_t fn, hvc_trap_handle handler)
+{
+    if (fn < HVC_FN64_BASE || fn - HVC_FN64_BASE >= HVC_FN64_NR)
+        return -RT_EINVAL;
+
+    if (handler && hvc_table[fn - HVC_FN64_BASE])
+        return -RT_EBUSY;
+
+    hvc_table[fn - HVC_FN64_BASE] = handler;
+    return RT_EOK;
+}
+
+static hvc_trap_handle hvc_find(rt_uint32_t fn)
+{
+    /* only SMC64 fast calls are provided */
+    if (fn < HVC_FN64_BASE || fn - HVC_FN64_BASE >= HVC_FN64_NR)
+        return RT_NULL;
+
+    return hvc_table[fn - HVC_FN64_BASE];
+}
+
+static rt_uint32_t hvc_call_count(void)
+{
+    rt_uint32_t count = 0;
+
+    for (rt_size_t i = 0; i < HVC_FN64_NR; i++)
+        if (hvc_table[i])
+            count++;
+
+    return count;
+}
+
+static rt_int64_t hvc_arch_features(rt_uint32_t fn)
+{
+    switch (fn)
+    {
+    case SMCCC_VERSION_FN:
+    case SMCCC_ARCH_FEATURES_FN:
+    case HVC_VENDOR_CALL_COUNT:
+    case HVC_VENDOR_CALL_UID:
+    case HVC_VENDOR_REVISION:
+        return SMCCC_RET_SUCCESS;
+
+    default:
+        return hvc_find(fn) ? SMCCC_RET_SUCCESS : SMCCC_RET_NOT_SUPPORTED;
+    }
+}
+
+/* Single value calls, both from HVC and from a multicall entry. */
+rt_int64_t hvc_call(rt_uint32_t fn, rt_uint64_t arg0, rt_uint64_t arg1, rt_uint64_t arg2)
+{
+    hvc_trap_handle handler;
+
+    if (!(fn & SMCCC_FAST_CALL))
+        return SMCCC_RET_NOT_SUPPORTED;     /* no yielding calls */
+
+    switch (fn & SMCCC_OWNER_MASK)
+    {
+    case SMCCC_OWNER_ARCH:
+        if (fn == SMCCC_VERSION_FN)
+            return SMCCC_VERSION_1_1;
+        if (fn == SMCCC_ARCH_FEATURES_FN)
+            return hvc_arch_features((rt_uint32_t)arg0);
+        break;
+
+    case SMCCC_OWNER_VHYP:
+        if (fn == HVC_VENDOR_CALL_COUNT)
+            return hvc_call_count();
+
+        handler = hvc_find(fn);
+        if (handler)
+            return (rt_int64_t)handler(fn, arg0, arg1, arg2);
+        break;
+
+    default:
+        break;
+    }
+
+    return SMCCC_RET_NOT_SUPPORTED;
+}
+
+/*
+ * HVC_FN64_MULTICALL: x1 = IPA of struct hvc_multicall array, x2 = count.
+ * Each entry gets its own result, x0 returns how many entries were run.
+ * An entry may balloon out the RAM of later ones, or of itself: the call
+ * stops at the first entry that is gone.
+ */
+static struct hvc_multicall *hvc_guest_ptr(vm_t vm, rt_uint64_t ipa, rt_size_t size)
+{
+    rt_uint64_t leaf;
+    rt_size_t len;
+
+    /* entries are aligned to their size, one never crosses a page */
+    if (vm_ram_area(vm->mm, ipa, size) == RT_NULL)
+        return RT_NULL;
+
+    /* results are written, a shared or logged page takes the guest's path */
+    leaf = s2_lookup(vm->mm, ipa, &len);
+    if (leaf && (leaf & S2_AP_MASK) != S2_AP_RW)
+    {
+        if (vm_mem_write_fault(vm->mm, ipa) != RT_EOK)
+            return RT_NULL;
+        leaf = s2_lookup(vm->mm, ipa, &len);
+    }
+
+    if (leaf == 0)
+        return RT_NULL;
+
+    return (struct hvc_multicall *)S2_LEAF_PA(leaf, len, ipa);
+}
+
+static rt_uint64_t hvc_multicall(rt_uint32_t fn, rt_uint64_t arg0,
+                                 rt_uint64_t arg1, rt_uint64_t arg2)
+{
+    vm_t vm = get_curr_vm();
+    rt_uint64_t ipa = arg0, count = arg1;
+    struct hvc_multicall *mc;
+    rt_int64_t ret;
+
+    if (count == 0 || count > HVC_MULTICALL_MAX
+    || (ipa & (sizeof(struct hvc_multicall) - 1)))
+        return (rt_uint64_t)SMCCC_RET_INVALID_PARAMETER;
+
+    if (hvc_guest_ptr(vm, ipa, count * sizeof(struct hvc_multicall)) == RT_NULL)
+        return (rt_uint64_t)SMCCC_RET_INVALID_PARAMETER;
+
+    for (rt_size_t i = 0; i < count; i++, ipa += sizeof(struct hvc_multicall))
+    {
+        mc = hvc_guest_ptr(vm, ipa, sizeof(struct hvc_multicall));
+        if (mc == RT_NULL)
+            return i;
+
+        /* no nesting */
+        if ((rt_uint32_t)mc->fn == HVC_FN64_MULTICALL)
+            ret = SMCCC_RET_INVALID_PARAMETER;
+        else
+            ret = hvc_call((rt_uint32_t)mc->fn, mc->args[0], mc->args[1], mc->args[2]);
+
+        /* the call may have taken the entry away too, look it up again */
+        mc = hvc_guest_ptr(vm, ipa, sizeof(struct hvc_multicall));
+        if (mc == RT_NULL)
+            return i + 1;
+        mc->ret = ret;
+    }
+
+    return count;
+}
+
+/* Slow path of "HVC #0", the full frame has been saved. */
+void hvc_dispatch(struct rt_hw_exp_stack *regs)
+{
+    rt_uint32_t fn = (rt_uint32_t)regs->x0;
+
+    switch (fn)
+    {
+    case HVC_VENDOR_CALL_UID:
+        regs->x0 = HVC_UID_0;
+        regs->x1 = HVC_UID_1;
+        regs->x2 = HVC_UID_2;
+        regs->x3 = HVC_UID_3;
+        break;
+
+    case HVC_VENDOR_REVISION:
+        regs->x0 = HVC_HYP_VERSION_MAJOR;
+        regs->x1 = HVC_HYP_VERSION_MINOR;
+        break;
+
+    default:
+        regs->x0 = (rt_uint64_t)hvc_call(fn, regs->x1, regs->x2, regs->x3);
+        break;
+    }
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-11-22     Suqier       first version
+ * 2022-12-07     Suqier       memory balloon calls
+ */
+
+#ifndef __HYPERCALL_H__
+#define __HYPERCALL_H__
+
+/*
+ * Paravirtual hypercall ABI, following DEN0028 SMC Calling Convention.
+ * Guest issues "HVC #0" with function ID in W0 and arguments in X1 ~ X3,
+ * result comes back in X0 (and X1 ~ X3 for general queries).
+ *
+ * This header is shared with context_gcc.S, which handles the calls marked
+ * [fast] without saving the full exception frame.
+ */
+
+/* Return value */
+#define SMCCC_RET_SUCCESS           (0)
+#define SMCCC_RET_NOT_SUPPORTED     (-1)
+#define SMCCC_RET_NOT_REQUIRED      (-2)
+#define SMCCC_RET_INVALID_PARAMETER (-3)
+
+/* Arm Architecture Calls */
+#define SMCCC_VERSION_FN            (0x80000000)    /* [fast] */
+#define SMCCC_ARCH_FEATURES_FN      (0x80000001)
+#define SMCCC_VERSION_1_1           (0x10001)
+
+/*
+ * SMC Function Identifier
+ * SMC64: Vendor Specific Hypervisor Service Calls (0xC6000000-0xC600FFFF)
+ */
+#define HVC_FN64_BASE           (0xC6000000)
+#define HVC_FN64(n)             (HVC_FN64_BASE + (n))
+#define HVC_FN64_END            (0xC600FFFF)
+#define HVC_FN64_NR             (32)    /* size of dispatch table */
+
+#define HVC_FN64_GET_VERSION    HVC_FN64(1)     /* [fast] */
+#define HVC_FN64_CREATE_VM      HVC_FN64(2)     /* reserved, host shell only */
+#define HVC_FN64_FREE_VM        HVC_FN64(3)     /* reserved, host shell only */
+#define HVC_FN64_MMAP_VM_MEM    HVC_FN64(4)     /* reserved, host shell only */
+#define HVC_FN64_BENCH_NULL     HVC_FN64(5)     /* [fast] null call for hyp_bench */
+#define HVC_FN64_MULTICALL      HVC_FN64(6)     /* x1: IPA of array, x2: count */
+#define HVC_FN64_BALLOON_INFO   HVC_FN64(7)     /* x1: HVC_BALLOON_* item */
+#define HVC_FN64_BALLOON_INFLATE HVC_FN64(8)    /* x1: IPA, x2: size of RAM given back */
+#define HVC_FN64_BALLOON_DEFLATE HVC_FN64(9)    /* x1: IPA, x2: size of RAM taken back */
+
+/* Items of HVC_FN64_BALLOON_INFO, in bytes */
+#define HVC_BALLOON_GRANULE     (0)     /* IPA and size alignment of inflate and deflate */
+#define HVC_BALLOON_TARGET      (1)     /* RAM the host asks the guest to give back */
+#define HVC_BALLOON_SIZE        (2)     /* RAM given back now */
+
+/* Vendor specific return value */
+#define HVC_RET_NO_MEMORY       (-4)    /* nothing left to deflate with */
+
+/* General Service Queries of Vendor Specific Hypervisor Service */
+#define HVC_VENDOR_CALL_COUNT   (0x8600FF00)
+#define HVC_VENDOR_CALL_UID     (0x8600FF01)
+#define HVC_VENDOR_REVISION     (0x8600FF03)
+
+/* RT-Hypervisor hypercall ABI version, major << 16 | minor */
+#define HVC_HYP_VERSION_MAJOR   (1)
+#define HVC_HYP_VERSION_MINOR   (1)
+#define HVC_HYP_VERSION         ((HVC_HYP_VERSION_MAJOR << 16) | HVC_HYP_VERSION_MINOR)
+
+#define HVC_MULTICALL_MAX       (128)   /* bound the time spent in one exit */
+
+#ifndef __ASSEMBLY__
+
+#include <rtdef.h>
+
+typedef rt_uint64_t (*hvc_trap_handle)(rt_uint32_t fn, rt_uint64_t arg0,
+                                    rt_uint64_t arg1, rt_uint64_t arg2);
+
+/*
+ * One operation of HVC_FN64_MULTICALL, one cache line each, the array
+ * must be aligned to its size and live in guest RAM.
+ */
+struct hvc_multicall
+{
+    rt_uint64_t fn;
+    rt_uint64_t args[3];
+    rt_int64_t  ret;    /* written by hypervisor */
+    rt_uint64_t reserved[3];
+};
+
+struct rt_hw_exp_stack;
+
+void hvc_dispatch(struct rt_hw_exp_stack *regs);
+rt_int64_t hvc_call(rt_uint32_t fn, rt_uint64_t arg0, rt_uint64_t arg1, rt_uint64_t arg2);
+rt_err_t hvc_register(rt_uint32_t fn, hvc_trap_handle handler);
+
+#endif  /* __ASSEMBLY__ */
+
+#endif  /* __HYPERCALL_H__ */
@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-11-27     Suqier       first version
+ */
+
+#include <rtthread.h>
+#include <lib_helpers.h>
+#include <vdev.h>
+
+#include "mmio_insn.h"
+
+#define SP_EL0_REG          "S3_0_C4_C1_0"
+#define SPSR_M_MASK         (0x1F)
+#define SPSR_M_EL1H         (0x05)
+#define MMIO_PAGE_MASK      (0xFFFUL)
+
+rt_inline rt_int64_t sign_extend(rt_uint64_t val, rt_uint32_t bits)
+{
+    rt_uint32_t shift = 64 - bits;
+
+    return (rt_int64_t)(val << shift) >> shift;
+}
+
+/* size and opc of a single register load/store */
+static rt_err_t decode_single(rt_uint32_t insn, struct mmio_insn *d)
+{
+    rt_uint32_t size = insn >> 30, opc = (insn >> 22) & 0x3;
+
+    d->size = 1 << size;
+    if (d->flags & MMIO_INSN_SIMD)
+    {
+        if (opc & 0x2)
+        {
+            if (size != 0)
+                return -RT_ERROR;
+            d->size = 16;       /* Q register */
+        }
+        if (opc & 0x1)
+            d->flags |= MMIO_INSN_LOAD;
+        return RT_EOK;
+    }
+
+    switch (opc)
+    {
+    case 0:     /* STR */
+        break;
+    case 1:     /* LDR, zero extended */
+        d->flags |= MMIO_INSN_LOAD | (size == 3 ? MMIO_INSN_SF : 0);
+        break;
+    case 2:     /* LDRSB/LDRSH/LDRSW to X */
+        if (size == 3)
+            return -RT_ERROR;   /* PRFM */
+        d->flags |= MMIO_INSN_LOAD | MMIO_INSN_SIGN | MMIO_INSN_SF;
+        break;
+    case 3:     /* LDRSB/LDRSH to W */
+        if (size >= 2)
+            return -RT_ERROR;
+        d->flags |= MMIO_INSN_LOAD | MMIO_INSN_SIGN;
+        break;
+    }
+
+    return RT_EOK;
+}
+
+static rt_err_t decode_pair(rt_uint32_t insn, struct mmio_insn *d)
+{
+    rt_uint32_t opc = insn >> 30, idx = (insn >> 23) & 0x3;
+    rt_bool_t load = (insn >> 22) & 0x1;
+
+    d->flags |= MMIO_INSN_PAIR | (load ? MMIO_INSN_LOAD : 0);
+    d->rt2 = (insn >> 10) & 0x1F;
+
+    if (d->flags & MMIO_INSN_SIMD)
+    {
+        if (opc == 3)
+            return -RT_ERROR;
+        d->size = 4 << opc;     /* S, D, Q */
+    }
+    else
+    {
+        switch (opc)
+        {
+        case 0:
+            d->size = 4;
+            break;
+        case 1:
+            if (!load)
+                return -RT_ERROR;   /* STGP */
+            d->size = 4;            /* LDPSW */
+            d->flags |= MMIO_INSN_SIGN | MMIO_INSN_SF;
+            break;
+        case 2:
+            d->size = 8;
+            d->flags |= MMIO_INSN_SF;
+            break;
+        default:
+            return -RT_ERROR;
+        }
+    }
+
+    d->imm = sign_extend((insn >> 15) & 0x7F, 7) * d->size;
+    if (idx == 1)
+        d->flags |= MMIO_INSN_WBACK | MMIO_INSN_POST;
+    else if (idx == 3)
+        d->flags |= MMIO_INSN_WBACK;
+
+    return RT_EOK;
+}
+
+/*
+ * Load/store register and load/store pair classes of A64. Exclusive,
+ * acquire/release and atomic forms are left out, guests do not use them
+ * on device memory.
+ */
+rt_err_t mmio_insn_decode(rt_uint32_t insn, struct mmio_insn *d)
+{
+    rt_memset(d, 0, sizeof(struct mmio_insn));
+    d->rt = insn & 0x1F;
+    d->rn = (insn >> 5) & 0x1F;
+    if ((insn >> 26) & 0x1)
+        d->flags |= MMIO_INSN_SIMD;
+
+    /* LDP/STP/LDNP/STNP */
+    if ((insn & 0x3A000000) == 0x28000000)
+        return decode_pair(insn, d);
+
+    /* unsigned immediate offset */
+    if ((insn & 0x3B000000) == 0x39000000)
+        return decode_single(insn, d);
+
+    /* unscaled, post-index, unprivileged and pre-index with imm9 */
+    if ((insn & 0x3B200000) == 0x38000000)
+    {
+        rt_uint32_t idx = (insn >> 10) & 0x3;
+
+        if (idx == 2 && (d->flags & MMIO_INSN_SIMD))
+            return -RT_ERROR;
+
+        d->imm = sign_extend((insn >> 12) & 0x1FF, 9);
+        if (idx == 1)
+            d->flags |= MMIO_INSN_WBACK | MMIO_INSN_POST;
+        else if (idx == 3)
+            d->flags |= MMIO_INSN_WBACK;
+        return decode_single(insn, d);
+    }
+
+    /* register offset */
+    if ((insn & 0x3B200C00) == 0x38200800)
+        return decode_single(insn, d);
+
+    return -RT_ERROR;
+}
+
+/* Syndrome valid abort, a single GP register without writeback. */
+void mmio_insn_from_esr(rt_uint32_t esr, struct mmio_insn *d)
+{
+    rt_memset(d, 0, sizeof(struct mmio_insn));
+    d->size = 1 << ((esr >> 22) & 0x3);     /* SAS */
+    d->rt = (esr >> 16) & 0x1F;             /* SRT */
+    if (!((esr >> 6) & 0x1))                /* WnR */
+        d->flags |= MMIO_INSN_LOAD;
+    if ((esr >> 21) & 0x1)                  /* SSE */
+        d->flags |= MMIO_INSN_SIGN;
+    if ((esr >> 15) & 0x1)                  /* SF */
+        d->flags |= MMIO_INSN_SF;
+}
+
+/* Q0 ~ Q15 are pushed in descending order right after x1 */
+rt_inline rt_uint8_t *simd_reg(gp_regs_t regs, rt_uint8_t n)
+{
+    return (rt_uint8_t *)regs->fpu + (15 - n) * 16;
+}
+
+static rt_uint64_t get_base(gp_regs_t regs, rt_uint8_t rn)
+{
+    rt_uint64_t val;
+
+    if (rn != 31)
+        return *regs_xn(regs, rn);
+
+    if ((regs->spsr & SPSR_M_MASK) == SPSR_M_EL1H)
+        GET_SYS_REG(SP_EL1, val)
+    else
+        GET_SYS_REG(SP_EL0_REG, val)
+    return val;
+}
+
+static void set_base(gp_regs_t regs, rt_uint8_t rn, rt_uint64_t val)
+{
+    if (rn != 31)
+        *regs_xn(regs, rn) = val;
+    else if ((regs->spsr & SPSR_M_MASK) == SPSR_M_EL1H)
+        SET_SYS_REG(SP_EL1, val)
+    else
+        SET_SYS_REG(SP_EL0_REG, val)
+}
+
+static void store_value(gp_regs_t regs, const struct mmio_insn *d,
+                        rt_uint8_t reg, rt_uint64_t val[2])
+{
+    if (d->flags & MMIO_INSN_SIMD)
+        rt_memcpy(val, simd_reg(regs, reg), d->size);
+    else if (reg != 31)
+        val[0] = *regs_xn(regs, reg);
+
+    if (d->size < 8)
+        val[0] &= (1UL << (d->size * 8)) - 1;
+}
+
+static void load_value(gp_regs_t regs, const struct mmio_insn *d,
+                        rt_uint8_t reg, rt_uint64_t val[2])
+{
+    rt_uint64_t v = val[0];
+
+    if (d->flags & MMIO_INSN_SIMD)
+    {
+        /* a scalar write clears the rest of the vector register */
+        rt_memset(simd_reg(regs, reg), 0, 16);
+        rt_memcpy(simd_reg(regs, reg), val, d->size);
+        return;
+    }
+
+    if (reg == 31)
+        return;     /* XZR */
+
+    if (d->size < 8)
+    {
+        v &= (1UL << (d->size * 8)) - 1;
+        if (d->flags & MMIO_INSN_SIGN)
+            v = sign_extend(v, d->size * 8);
+    }
+    if (!(d->flags & MMIO_INSN_SF))
+        v &= 0xFFFFFFFFUL;
+
+    *regs_xn(regs, reg) = v;
+}
+
+/*
+ * One register of the instruction. Handlers only take the value through
+ * regs_xn(regs, acc.srt), so a scratch frame carries it and a Q register
+ * goes out as two doubleword accesses.
+ */
+static rt_err_t emulate_reg(gp_regs_t regs, const struct mmio_insn *d,
+                        rt_uint8_t reg, rt_uint64_t ipa)
+{
+    struct rt_hw_exp_stack tmp;
+    rt_uint64_t val[2] = { 0, 0 };
+    rt_size_t num = (d->size > 8) ? 2 : 1;
+    access_info_t acc =
+    {
+        .srt      = 0,
+        .is_write = !(d->flags & MMIO_INSN_LOAD),
+        .size     = (d->size > 8) ? 8 : d->size,
+    };
+
+    if ((d->flags & MMIO_INSN_SIMD) && reg > 15)
+        return -RT_ENOSYS;      /* V16 ~ V31 are not in the frame */
+
+    if (acc.is_write)
+        store_value(regs, d, reg, val);
+
+    for (rt_size_t i = 0; i < num; i++)
+    {
+        acc.addr = ipa + i * 8;
+        tmp.x0 = acc.is_write ? val[i] : 0;
+        /* unclaimed address: drop writes, read as zero */
+        vdev_mmio_dispatch(&tmp, acc);
+        val[i] = tmp.x0;
+    }
+
+    if (!acc.is_write)
+        load_value(regs, d, reg, val);
+
+    return RT_EOK;
+}
+
+/*
+ * @ipa and @far locate the faulting element. A pair may fault on either
+ * element, so its start comes from the base register and must stay in
+ * the page of FAR.
+ */
+rt_err_t mmio_insn_emulate(gp_regs_t regs, const struct mmio_insn *d,
+                        rt_uint64_t ipa, rt_uint64_t far)
+{
+    rt_uint64_t base = 0;
+    rt_err_t ret;
+
+    if (d->flags & (MMIO_INSN_PAIR | MMIO_INSN_WBACK))
+        base = get_base(regs, d->rn);
+
+    if (d->flags & MMIO_INSN_PAIR)
+    {
+        rt_uint64_t va = (d->flags & MMIO_INSN_POST) ? base : base + d->imm;
+
+        if ((va & ~MMIO_PAGE_MASK) != (far & ~MMIO_PAGE_MASK)
+         || (va & MMIO_PAGE_MASK) + d->size * 2 > MMIO_PAGE_MASK + 1)
+            return -RT_ERROR;
+
+        ipa = (ipa & ~MMIO_PAGE_MASK) | (va & MMIO_PAGE_MASK);
+        ret = emulate_reg(regs, d, d->rt, ipa);
+        if (ret == RT_EOK)
+            ret = emulate_reg(regs, d, d->rt2, ipa + d->size);
+    }
+    else
+        ret = emulate_reg(regs, d, d->rt, ipa);
+
+    if (ret == RT_EOK && (d->flags & MMIO_INSN_WBACK))
+        set_base(regs, d->rn, base + d->imm);
+
+    return ret;
+}
+
+const struct mmio_insn *mmio_insn_cache_lookup(struct mmio_insn_cache *c,
+                        rt_uint64_t pc, rt_uint64_t ttbr)
+{
+    struct mmio_insn_cache_entry *e;
+
+    e = &c->entry[(pc >> 2) & (MMIO_INSN_CACHE_NUM - 1)];
+    if (e->pa && e->pc == pc && e->ttbr == ttbr
+     && *(volatile rt_uint32_t *)e->pa == e->insn)
+    {
+        c->hit++;
+        return &e->d;
+    }
+
+    c->miss++;
+    return RT_NULL;
+}
+
+void mmio_insn_cache_fill(struct mmio_insn_cache *c, rt_uint64_t pc, rt_uint64_t ttbr,
+                        rt_uint64_t pa, rt_uint32_t insn, const struct mmio_insn *d)
+{
+    struct mmio_insn_cache_entry *e;
+
+    e = &c->entry[(pc >> 2) & (MMIO_INSN_CACHE_NUM - 1)];
+    e->pc = pc;
+    e->ttbr = ttbr;
+    e->pa = pa;
+    e->insn = insn;
+    e->d = *d;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2006-2022, RT-Thread Development Team
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2022-11-27     Suqier       first version
+ */
+
+#ifndef __MMIO_INSN_H__
+#define __MMIO_INSN_H__
+
+#include <rtdef.h>
+#include <armv8.h>
+
+/*
+ * A data abort without a valid syndrome (ISV == 0) comes from LDP/STP,
+ * writeback forms or SIMD&FP registers. The instruction is fetched from
+ * guest memory, decoded into struct mmio_insn and replayed on the vdev and
+ * vGIC handlers element by element.
+ */
+#define MMIO_INSN_LOAD      (1 << 0)
+#define MMIO_INSN_PAIR      (1 << 1)    /* LDP/STP, second element at +size */
+#define MMIO_INSN_SIGN      (1 << 2)    /* sign extend the loaded value */
+#define MMIO_INSN_SF        (1 << 3)    /* 64-bit GP destination */
+#define MMIO_INSN_SIMD      (1 << 4)    /* Vn, only V0 ~ V15 live in the frame */
+#define MMIO_INSN_WBACK     (1 << 5)    /* base register += imm */
+#define MMIO_INSN_POST      (1 << 6)    /* post-index, access at the old base */
+
+struct mmio_insn
+{
+    rt_uint8_t  flags;
+    rt_uint8_t  size;       /* bytes of one element: 1, 2, 4, 8 or 16 */
+    rt_uint8_t  rt;
+    rt_uint8_t  rt2;
+    rt_uint8_t  rn;         /* 31 is SP */
+    rt_int64_t  imm;        /* for writeback and pair address only */
+};
+
+/*
+ * Decoded instructions of recent exits, direct mapped by guest PC. An
+ * entry is only used while the word at @pa is still @insn and the PC is
+ * translated by the same TTBRx_EL1, so fetch and decode are skipped on
+ * the next exit of a driver loop.
+ */
+#define MMIO_INSN_CACHE_NUM     8   /* power of 2 */
+
+struct mmio_insn_cache_entry
+{
+    rt_uint64_t pc;
+    rt_uint64_t ttbr;
+    rt_uint64_t pa;         /* 0: invalid */
+    rt_uint32_t insn;
+    struct mmio_insn d;
+};
+
+struct mmio_insn_cache
+{
+    struct mmio_insn_cache_entry entry[MMIO_INSN_CACHE_NUM];
+    rt_uint64_t hit;
+    rt_uint64_t miss;
+};
+
+rt_err_t mmio_insn_decode(rt_uint32_t insn, struct mmio_insn *d);
+void mmio_insn_from_esr(rt_uint32_t esr, struct mmio_insn *d);
+rt_err_t mmio_insn_emulate(gp_regs_t regs, const struct mmio_insn *d,
+                        rt_uint64_t ipa, rt_uint64_t far);
+
+const struct mmio_insn *mmio_insn_cache_lookup(struct mmio_insn_cache *c,
+                        rt_uint64_t pc, rt_uint64_t ttbr);
+void mmio_insn_cache_fill(struct mmio_insn_cache *c, rt_uint64_t pc, rt_uint64_t ttbr,
+                        rt_uint64_t pa, rt_uint32_t insn, const struct mmio_insn *d);
+
+#endif  /* __MMIO_INSN_H__ */
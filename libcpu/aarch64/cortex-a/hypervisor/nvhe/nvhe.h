@@ -6,6 +6,7 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-08-27     Suqier       first version
+ * 2022-12-12     Suqier       trap guest WFI
  */
 
 #ifndef __NVHE_H__
@@ -20,11 +21,12 @@
  * RW:		64bit by default, can be overridden for 32bit VMs
  * VM:      enable stage 2 translation
  * TSC:		Trap SMC
+ * TWI:		Trap WFI, to halt the vCPU in vcpu_halt()
+ * TWE:		Trap WFE, for directed yield to a preempted sibling vCPU
  * IMO:		Override CPSR.I and enable signaling with VI
  * FMO:		Override CPSR.F and enable signaling with VF
  */
-// #define HCR_GUEST_FLAGS 	(HCR_TSC | HCR_TWI | HCR_VM | HCR_RW)
-#define HCR_GUEST_FLAGS 	(HCR_TSC | HCR_VM | HCR_RW)
+#define HCR_GUEST_FLAGS 	(HCR_TSC | HCR_TWI | HCR_TWE | HCR_VM | HCR_RW)
 #define HCR_GUEST_XMO_FLAGS (HCR_AMO | HCR_IMO | HCR_FMO)
 #define HCR_VIRT_EXCP_MASK 	(HCR_VSE | HCR_VI  | HCR_VF)
 #define HCR_HOST_NVHE_FLAGS (HCR_RW  | HCR_TGE)
@@ -6,6 +6,14 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-06-19     Suqier       first version
+ * 2022-12-02     Suqier       split, merge and write protect for dirty logging
+ * 2022-12-04     Suqier       remap a leaf for copy-on-write
+ * 2022-12-06     Suqier       map 4K aligned ranges in pages
+ * 2022-12-07     Suqier       unmap leaves only, release empty tables, range TLB flush
+ * 2022-12-09     Suqier       translation cache
+ * 2022-12-10     Suqier       table size of a VM
+ * 2022-12-11     Suqier       unmap a whole VM when it is deleted
+ * 2022-12-12     Suqier       no message for each pte table
  */
 
 #include "rtconfig.h"
@@ -50,7 +58,8 @@ void clear_s2_mmu_page(rt_uint8_t vm_idx, void *page_tbl)
 {
     rt_memset(page_tbl, 0, 4096);
 
-    int page_i = page_tbl - (void *)S2_MMUPage_Group[vm_idx];
+    int page_i = ((rt_ubase_t)page_tbl - (rt_ubase_t)S2_MMUPage_Group[vm_idx])
+               / sizeof(struct S2_MMUPage);
     bitmap_clr_bit(&s2_page_bitmap[vm_idx], page_i);
     
     page_tbl = RT_NULL;
@@ -85,6 +94,14 @@ void *alloc_vm_pgd(rt_uint8_t vm_idx)
     return (void *)&S2_MMUTable_Group[vm_idx];
 }
 
+/* bytes of stage 2 tables the VM of @vm_idx uses, its level 1 table too */
+rt_size_t s2_table_size(rt_uint8_t vm_idx)
+{
+    RT_ASSERT(vm_idx >= 0 && vm_idx < MAX_VM_NUM);
+    return sizeof(struct S2_MMUTable)
+        + __builtin_popcount(s2_page_bitmap[vm_idx]) * sizeof(struct S2_MMUPage);
+}
+
 static unsigned long _kernel_free_s2_page(rt_uint8_t vm_idx)
 {
     RT_ASSERT(vm_idx >= 0 && vm_idx < MAX_VM_NUM);
@@ -110,6 +127,108 @@ rt_inline void s2_set_pud(pud_t *pud_ptr, pud_t v) { WRITE_ONCE(*pud_ptr, v); }
 rt_inline void s2_set_pmd(pmd_t *pmd_ptr, pmd_t v) { WRITE_ONCE(*pmd_ptr, v); }
 rt_inline void s2_set_pte(pte_t *pte_ptr, pte_t v) { WRITE_ONCE(*pte_ptr, v); }
 
+/*
+ * Translation cache
+ *
+ * Fills and flushes are made under the lock, with seq odd while entries
+ * change. Hits take no lock, they are good if seq was even and the same
+ * before and after the entry was read.
+ */
+static rt_base_t s2_tc_lock(struct s2_tc *tc)
+{
+    rt_base_t level = rt_hw_interrupt_disable();
+#ifdef RT_USING_SMP
+    rt_hw_spin_lock(&tc->lock);
+#endif
+    __atomic_store_n(&tc->seq, tc->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return level;
+}
+
+static void s2_tc_unlock(struct s2_tc *tc, rt_base_t level)
+{
+    __atomic_store_n(&tc->seq, tc->seq + 1, __ATOMIC_RELEASE);
+#ifdef RT_USING_SMP
+    rt_hw_spin_unlock(&tc->lock);
+#endif
+    rt_hw_interrupt_enable(level);
+}
+
+void s2_tc_init(struct mm_struct *mm)
+{
+    rt_memset(&mm->tc, 0, sizeof(mm->tc));
+#ifdef RT_USING_SMP
+    rt_hw_spin_lock_init(&mm->tc.lock);
+#endif
+}
+
+/* after any change to the table of @mm, before the old output is reused */
+void s2_tc_flush(struct mm_struct *mm)
+{
+    struct s2_tc *tc = &mm->tc;
+    rt_base_t level = s2_tc_lock(tc);
+
+    for (rt_size_t i = 0; i < S2_TC_NUM; i++)
+        tc->entry[i].size = 0;
+    s2_tc_unlock(tc, level);
+}
+
+/* slot of the page or block of 1 << @shift bytes holding @va */
+rt_inline struct s2_tc_entry *s2_tc_slot(struct s2_tc *tc, rt_ubase_t va, rt_size_t shift)
+{
+    return &tc->entry[(va >> shift) & (S2_TC_NUM - 1)];
+}
+
+/* leaf of the 1 << @shift page or block holding @va, 0 if it is not cached */
+rt_inline rt_uint64_t s2_tc_probe(struct s2_tc *tc, rt_ubase_t va, rt_size_t shift)
+{
+    struct s2_tc_entry *e = s2_tc_slot(tc, va, shift);
+
+    if (e->size == (1UL << shift) && e->ipa == RT_ALIGN_DOWN(va, 1UL << shift))
+        return e->leaf;
+    return 0;
+}
+
+/*
+ * Leaf descriptor of @va, 0 if it is not mapped, and in @size the range it
+ * maps. The cache is direct mapped, the slots of a 2M block, a 4K page and
+ * a 1G block holding @va are tried in turn. A miss walks the table.
+ */
+rt_uint64_t s2_lookup(struct mm_struct *mm, rt_ubase_t va, rt_size_t *size)
+{
+    struct s2_tc *tc = &mm->tc;
+    struct s2_tc_entry *e;
+    rt_uint64_t *entry, leaf;
+    rt_uint32_t seq = __atomic_load_n(&tc->seq, __ATOMIC_ACQUIRE);
+    rt_base_t level;
+
+    if ((leaf = s2_tc_probe(tc, va, S2_PMD_SHIFT)))
+        *size = S2_PMD_SIZE;
+    else if ((leaf = s2_tc_probe(tc, va, S2_PTE_SHIFT)))
+        *size = S2_PTE_SIZE;
+    else if ((leaf = s2_tc_probe(tc, va, S2_PUD_SHIFT)))
+        *size = S2_PUD_SIZE;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (leaf && !(seq & 1) && __atomic_load_n(&tc->seq, __ATOMIC_RELAXED) == seq)
+        return leaf;
+
+    /* walked under the lock, a flush after a table change cannot be missed */
+    level = s2_tc_lock(tc);
+    entry = s2_walk(mm, va, size);
+    leaf = entry ? *entry : 0;
+    if (leaf)
+    {
+        e = s2_tc_slot(tc, va, __builtin_ctzl(*size));
+        e->ipa = RT_ALIGN_DOWN(va, *size);
+        e->size = *size;
+        e->leaf = leaf;
+    }
+    s2_tc_unlock(tc, level);
+
+    return leaf;
+}
+
 /* 
  * Map
  */
@@ -147,21 +266,20 @@ static void s2_map_pte(pte_t *pte_tbl, struct mem_desc *desc)
 {
     pte_t *pte_ptr;
     rt_uint64_t pte_attr;
+    rt_uint64_t va = desc->vaddr_start;
+    rt_uint64_t pa = desc->paddr_start;
 
-    pte_ptr = S2_PTE_OFFSET(pte_tbl, desc->vaddr_start);
+    pte_ptr = S2_PTE_OFFSET(pte_tbl, va);
     pte_attr = desc->attr;  /* S2_PAGE_NORMAL, S2_PAGE_DEVICE and so on.*/
 
     do
     {
         if (!(*pte_ptr))
-        {
-            s2_set_pte(pte_ptr, desc->paddr_start | pte_attr);
-            desc->vaddr_start += RT_MM_PAGE_SIZE;
-            desc->paddr_start += RT_MM_PAGE_SIZE;
-        }
+            s2_set_pte(pte_ptr, pa | pte_attr);
 
         pte_ptr++;
-    } while (desc->vaddr_start != desc->vaddr_end);
+        pa += RT_MM_PAGE_SIZE;
+    } while (va += RT_MM_PAGE_SIZE, va != desc->vaddr_end);
 }
 
 static rt_err_t s2_map_pmd(pmd_t *pmd_tbl, struct mem_desc *desc, rt_uint8_t vm_idx)
@@ -169,6 +287,7 @@ static rt_err_t s2_map_pmd(pmd_t *pmd_tbl, struct mem_desc *desc, rt_uint8_t vm_
     pmd_t *pmd_ptr;
     pte_t *pte_tbl;
     rt_uint64_t next, size;
+    struct mem_desc sub;
 
     pmd_ptr = S2_PMD_OFFSET(pmd_tbl, desc->vaddr_start);
     do
@@ -203,11 +322,14 @@ static rt_err_t s2_map_pmd(pmd_t *pmd_tbl, struct mem_desc *desc, rt_uint8_t vm_
 
                 rt_memset(pte_tbl, 0, RT_MM_PAGE_SIZE);
                 pte_tbl = (pte_t *)(MMU_TYPE_TABLE | ((rt_uint64_t)pte_tbl & TABLE_ADDR_MASK));
-                rt_kprintf("[Info] map pte_tbl&attr=0x%016x at pmd_ptr=0x%016x\n", pte_tbl, pmd_ptr);
                 s2_set_pmd(pmd_ptr, (pmd_t)pte_tbl);
             }
 
-            s2_map_pte(pte_tbl, desc);
+            /* only the part of desc covered by this pmd entry */
+            sub = *desc;
+            sub.vaddr_end = next;
+            pte_tbl = (pte_t *)((rt_uint64_t)pte_tbl & TABLE_ADDR_MASK);
+            s2_map_pte(pte_tbl, &sub);
         }
     } while (pmd_ptr++, 
              desc->paddr_start += size, 
@@ -222,6 +344,8 @@ static rt_err_t s2_map_pud(pud_t *pud_tbl, struct mem_desc *desc, rt_uint8_t vm_
     pud_t *pud_ptr;
     pmd_t *pmd_tbl;
     rt_uint64_t next, size;
+    struct mem_desc sub;
+    rt_err_t ret;
 
     pud_ptr = S2_PUD_OFFSET(pud_tbl, desc->vaddr_start);
     do
@@ -259,8 +383,13 @@ static rt_err_t s2_map_pud(pud_t *pud_tbl, struct mem_desc *desc, rt_uint8_t vm_
                 s2_set_pud(pud_ptr, (pud_t)pmd_tbl);
             }
         
+            /* only the part of desc covered by this pud entry */
+            sub = *desc;
+            sub.vaddr_end = next;
             pmd_t pmd_val = (pmd_t)pmd_tbl & TABLE_ADDR_MASK;   /* [47:12] */
-            s2_map_pmd((pmd_t *)pmd_val, desc, vm_idx);
+            ret = s2_map_pmd((pmd_t *)pmd_val, &sub, vm_idx);
+            if (ret)
+                return ret;
         }
     } while (pud_ptr++, 
              desc->paddr_start += size, 
@@ -277,38 +406,58 @@ rt_err_t s2_map(struct mm_struct *mm, struct mem_desc *desc)
 
     RT_ASSERT(desc->paddr_start < S2_PA_SIZE);
     RT_ASSERT((desc->vaddr_start < S2_IPA_SIZE) && (desc->vaddr_end < S2_IPA_SIZE));
-    RT_ASSERT(IS_2M_ALIGN(desc->vaddr_start) && IS_2M_ALIGN(desc->vaddr_end));
+    if ((desc->attr & MMU_TYPE_MASK) == MMU_TYPE_PAGE)
+    {
+        RT_ASSERT(IS_4K_ALIGN(desc->vaddr_start) && IS_4K_ALIGN(desc->vaddr_end));
+    }
+    else
+    {
+        RT_ASSERT(IS_2M_ALIGN(desc->vaddr_start) && IS_2M_ALIGN(desc->vaddr_end));
+    }
 
     rt_uint8_t vm_idx = mm->vm->id;
     pud_t pud_val = (pud_t)mm->pgd_tbl & TABLE_ADDR_MASK;   /* [47:12] */
-    return s2_map_pud((pud_t *)pud_val, desc, vm_idx);
+    rt_err_t ret = s2_map_pud((pud_t *)pud_val, desc, vm_idx);
+
+    s2_tc_flush(mm);
+    return ret;
 }
 
 /* 
  * Unmap
  */
-static void s2_unmap_pte(pte_t *pte_tbl, rt_ubase_t va, rt_ubase_t va_end)
+#define S2_UNMAP_TLBI_MAX   (64)    /* more leaves, the whole VM is flushed */
+
+static rt_bool_t s2_table_empty(rt_uint64_t *tbl)
+{
+    for (rt_size_t i = 0; i < S2_PTE_NUM; i++)
+    {
+        if (tbl[i])
+            return RT_FALSE;
+    }
+
+    return RT_TRUE;
+}
+
+static void s2_unmap_pte(pte_t *pte_tbl, rt_ubase_t va, rt_ubase_t va_end, rt_size_t *leaf)
 {
     pte_t *pte_ptr = S2_PTE_OFFSET(pte_tbl, va);
 
     do
-    {   
-        pte_t *pte_tmp = pte_ptr;
-        pte_ptr++;
-
-        if (*pte_tmp)
+    {
+        if (*pte_ptr)
         {
-            s2_clear_pte(pte_tmp);
-            rt_free(pte_tmp);   /* Heap memory. */
+            s2_clear_pte(pte_ptr);
+            *leaf = S2_PTE_SIZE;
         }
-    } while (va += RT_MM_PAGE_SIZE, va != va_end);
+    } while (pte_ptr++, va += RT_MM_PAGE_SIZE, va != va_end);
 }
 
-static void s2_unmap_pmd(rt_uint8_t vm_idx, pmd_t *pmd_tbl, 
-                        rt_ubase_t va, rt_ubase_t va_end)
+static rt_err_t s2_unmap_pmd(struct mm_struct *mm, pmd_t *pmd_tbl,
+                             rt_ubase_t va, rt_ubase_t va_end, rt_size_t *leaf)
 {
     pmd_t *pmd_ptr = S2_PMD_OFFSET(pmd_tbl, va);
-    pte_t *pte_tbl = RT_NULL;
+    pte_t *pte_tbl;
     rt_uint64_t next;
 
     do
@@ -317,33 +466,38 @@ static void s2_unmap_pmd(rt_uint8_t vm_idx, pmd_t *pmd_tbl,
         if (next > va_end)
             next = va_end;
 
-        if (*pmd_ptr)
+        /* a block partly in the range keeps the rest as pages */
+        if ((*pmd_ptr & MMU_TYPE_MASK) == MMU_TYPE_BLOCK && next - va != S2_PMD_SIZE
+         && s2_split_block(mm, va) != RT_EOK)
+            return -RT_ENOMEM;
+
+        if ((*pmd_ptr & MMU_TYPE_MASK) == MMU_TYPE_BLOCK)
+        {
+            s2_clear_pmd(pmd_ptr);
+            if (*leaf > S2_PMD_SIZE)
+                *leaf = S2_PMD_SIZE;
+        }
+        else if (*pmd_ptr)
         {
-            if ((*pmd_ptr & MMU_TYPE_MASK) == MMU_TYPE_BLOCK)
+            pte_tbl = (pte_t *)(*pmd_ptr & TABLE_ADDR_MASK);
+            s2_unmap_pte(pte_tbl, va, next, leaf);
+            if (s2_table_empty(pte_tbl))
             {
                 s2_clear_pmd(pmd_ptr);
-                rt_free(pmd_ptr);
-            }
-            else
-            {
-                pte_tbl = (pte_t *)(*pmd_ptr & TABLE_ADDR_MASK);
-                s2_unmap_pte(pte_tbl, va, next);
-                if (((va & ~S2_PMD_MASK) == 0) && ((va_end - va) == S2_PMD_SIZE))
-                {
-                    s2_clear_pmd(pmd_ptr);
-                    rt_free(pmd_ptr);   /* Heap memory. */ 
-                    clear_s2_mmu_page(vm_idx, pte_tbl);   /* S2_MMUPage_Group. */
-                }
+                clear_s2_mmu_page(mm->vm->id, pte_tbl);   /* S2_MMUPage_Group. */
             }
         }
     } while (pmd_ptr++, va = next, va != va_end);
+
+    return RT_EOK;
 }
 
-static void s2_unmap_pud(struct mm_struct *mm, rt_ubase_t va, rt_ubase_t va_end)
+static rt_err_t s2_unmap_pud(struct mm_struct *mm, rt_ubase_t va, rt_ubase_t va_end, rt_size_t *leaf)
 {
-    pud_t *pud_ptr = S2_PUD_OFFSET(mm->pgd_tbl, va);
+    pud_t *pud_ptr = S2_PUD_OFFSET((rt_uint64_t)mm->pgd_tbl & TABLE_ADDR_MASK, va);
     pmd_t *pmd_tbl;
     rt_uint64_t next;
+    rt_err_t ret = RT_EOK;
 
     do
     {
@@ -351,66 +505,275 @@ static void s2_unmap_pud(struct mm_struct *mm, rt_ubase_t va, rt_ubase_t va_end)
         if (next > va_end)
             next = va_end;
 
-        if (*pud_ptr)
+        if ((*pud_ptr & MMU_TYPE_MASK) == MMU_TYPE_BLOCK)
+        {
+            /* 1G blocks are never split, unmapped whole or not at all */
+            if (next - va != S2_PUD_SIZE)
+                return -RT_EINVAL;
+            s2_clear_pud(pud_ptr);
+            if (*leaf > S2_PUD_SIZE)
+                *leaf = S2_PUD_SIZE;
+        }
+        else if (*pud_ptr)
         {
             pmd_tbl = (pmd_t *)(*pud_ptr & TABLE_ADDR_MASK);
-            s2_unmap_pmd(mm->vm->id, pmd_tbl, va, next);
-            if (((va & ~S2_PUD_MASK) == 0) && ((va_end - va) == S2_PUD_SIZE))
+            ret = s2_unmap_pmd(mm, pmd_tbl, va, next, leaf);
+            if (s2_table_empty(pmd_tbl))
             {
                 s2_clear_pud(pud_ptr);
-                rt_free(pud_ptr);    /* Heap memory. */ 
-                clear_s2_mmu_page(mm->vm->id , pmd_tbl);    /* S2_MMUPage_Group. */
+                clear_s2_mmu_page(mm->vm->id, pmd_tbl);    /* S2_MMUPage_Group. */
             }
+            if (ret)
+                return ret;
         }
     } while (pud_ptr++, va = next, va != va_end);
 
-    flush_vm_all_tlb(mm->vm);
+    return RT_EOK;
 }
 
+/*
+ * Clear the leaves of [va, va_end), 4K aligned. Tables left empty go back
+ * to the VM. The TLB is flushed by IPA, one TLBI per leaf size step, or
+ * for the whole VM when the range holds too many leaves.
+ */
 rt_err_t s2_unmap(struct mm_struct *mm, rt_ubase_t va, rt_ubase_t va_end)
 {
+    rt_size_t leaf = S2_IPA_SIZE;
+    rt_err_t ret;
+
     if (va == va_end)
         return -RT_EINVAL;
 
-	RT_ASSERT((va < S2_IPA_SIZE) && (va_end <= S2_IPA_SIZE));
-	s2_unmap_pud(mm, va, va_end);
-    return RT_EOK;
+    RT_ASSERT((va < S2_IPA_SIZE) && (va_end <= S2_IPA_SIZE));
+    RT_ASSERT(IS_4K_ALIGN(va) && IS_4K_ALIGN(va_end));
+    ret = s2_unmap_pud(mm, va, va_end, &leaf);
+    s2_tc_flush(mm);
+
+    if (leaf == S2_IPA_SIZE)
+        return ret;     /* nothing was mapped */
+    if ((va_end - va) / leaf <= S2_UNMAP_TLBI_MAX)
+        flush_vm_ipa_range_tlb(mm->vm, RT_ALIGN_DOWN(va, leaf), va_end - RT_ALIGN_DOWN(va, leaf), leaf);
+    else
+        flush_vm_all_tlb(mm->vm);
+    return ret;
 }
 
 /*
- * Translation
+ * Unmap the whole IPA space of a VM going away in one pass: its level 1
+ * table and the pages it took are zeroed in the static groups, without a
+ * walk, and the TLB of its VMID is flushed. The next VM of the same index
+ * starts from clean tables.
  */
-rt_err_t s2_translate(struct mm_struct *mm, rt_uint64_t va, rt_ubase_t *pa)
+void s2_unmap_all(struct mm_struct *mm)
 {
-    rt_uint64_t pte_offset = va & ~TABLE_ADDR_MASK;  /* [47:12] */
-    rt_uint64_t pmd_offset = va & ~L2_BLOCK_OA_MASK; /* [47:21] */
-    rt_uint64_t phy_addr = 0UL;
+    rt_uint8_t vm_idx = mm->vm->id;
+    rt_uint32_t used = s2_page_bitmap[vm_idx];
 
-    pud_t *pud_ptr = RT_NULL;
-    pmd_t *pmd_ptr = RT_NULL;
-    pte_t *pte_ptr = RT_NULL;
+    clear_s2_mmu_table(vm_idx);
+    for (rt_size_t i = 0; i < MMU_TBL_PAGE_NR_MAX; i++)
+    {
+        if (used & (1U << i))
+            rt_memset((void *)&S2_MMUPage_Group[vm_idx][i], 0, sizeof(struct S2_MMUPage));
+    }
+    bitmap_init(&s2_page_bitmap[vm_idx]);
 
-    pud_t pud_val = (rt_uint64_t)mm->pgd_tbl & S2_VA_MASK;
-    pud_ptr = S2_PUD_OFFSET(pud_val, va);
-    if (!pud_ptr)
-        return -RT_ERROR;
+    s2_tc_flush(mm);
+    flush_vm_all_tlb(mm->vm);
+}
 
-    pmd_ptr = S2_PMD_OFFSET((pmd_t *)(*pud_ptr & S2_VA_MASK), va);
-    if (!pmd_ptr)
-        return -RT_ERROR;
+/*
+ * Walk
+ */
+/*
+ * Leaf entry of @va, a 1G/2M block or a 4K page, and in @size the range it
+ * maps. RT_NULL if @va is not mapped, @size is then the hole at that level.
+ */
+rt_uint64_t *s2_walk(struct mm_struct *mm, rt_ubase_t va, rt_size_t *size)
+{
+    pud_t *pud_ptr;
+    pmd_t *pmd_ptr;
+    pte_t *pte_ptr;
+
+    pud_ptr = S2_PUD_OFFSET((rt_uint64_t)mm->pgd_tbl & TABLE_ADDR_MASK, va);
+    *size = S2_PUD_SIZE;
+    if ((*pud_ptr & MMU_TYPE_MASK) == MMU_TYPE_BLOCK)
+        return pud_ptr;
+    if ((*pud_ptr & MMU_TYPE_MASK) != MMU_TYPE_TABLE)
+        return RT_NULL;
 
-    /* 2M mem block */
+    pmd_ptr = S2_PMD_OFFSET(*pud_ptr & TABLE_ADDR_MASK, va);
+    *size = S2_PMD_SIZE;
     if ((*pmd_ptr & MMU_TYPE_MASK) == MMU_TYPE_BLOCK)
+        return pmd_ptr;
+    if ((*pmd_ptr & MMU_TYPE_MASK) != MMU_TYPE_TABLE)
+        return RT_NULL;
+
+    pte_ptr = S2_PTE_OFFSET(*pmd_ptr & TABLE_ADDR_MASK, va);
+    *size = S2_PTE_SIZE;
+    if ((*pte_ptr & MMU_TYPE_MASK) != MMU_TYPE_PAGE)
+        return RT_NULL;
+
+    return pte_ptr;
+}
+
+/* level 2 entry of @va, RT_NULL if there is no level 2 table */
+static pmd_t *s2_walk_pmd(struct mm_struct *mm, rt_ubase_t va)
+{
+    pud_t *pud_ptr = S2_PUD_OFFSET((rt_uint64_t)mm->pgd_tbl & TABLE_ADDR_MASK, va);
+
+    if ((*pud_ptr & MMU_TYPE_MASK) != MMU_TYPE_TABLE)
+        return RT_NULL;
+
+    return S2_PMD_OFFSET(*pud_ptr & TABLE_ADDR_MASK, va);
+}
+
+/*
+ * Split the 2M block at @va into 512 pages with the same attributes, so
+ * they can be protected one by one. A page is left as it is.
+ */
+rt_err_t s2_split_block(struct mm_struct *mm, rt_ubase_t va)
+{
+    pmd_t *pmd_ptr = s2_walk_pmd(mm, va);
+    pte_t *pte_tbl;
+    rt_uint64_t pa, attr;
+
+    if (pmd_ptr == RT_NULL)
+        return -RT_EINVAL;      /* hole or 1G block */
+    if ((*pmd_ptr & MMU_TYPE_MASK) == MMU_TYPE_TABLE)
+        return RT_EOK;
+    if ((*pmd_ptr & MMU_TYPE_MASK) != MMU_TYPE_BLOCK)
+        return -RT_EINVAL;
+
+    pte_tbl = (pte_t *)_kernel_free_s2_page(mm->vm->id);
+    if (pte_tbl == RT_NULL)
+        return -RT_ENOMEM;
+
+    pa = *pmd_ptr & L2_BLOCK_OA_MASK;
+    attr = (*pmd_ptr & ~(L2_BLOCK_OA_MASK | MMU_TYPE_MASK)) | MMU_TYPE_PAGE;
+    for (rt_size_t i = 0; i < S2_PTE_NUM; i++)
+        pte_tbl[i] = (pa + i * S2_PTE_SIZE) | attr;
+
+    /* break before make, no vCPU may see both the block and the table */
+    s2_clear_pmd(pmd_ptr);
+    flush_vm_ipa_tlb(mm->vm, va);
+    s2_set_pmd(pmd_ptr, MMU_TYPE_TABLE | ((rt_uint64_t)pte_tbl & TABLE_ADDR_MASK));
+    s2_tc_flush(mm);
+
+    return RT_EOK;
+}
+
+/*
+ * Undo s2_split_block(), if the pages at @va still map one 2M block with
+ * the same attributes. The page table goes back to the VM.
+ */
+rt_err_t s2_merge_block(struct mm_struct *mm, rt_ubase_t va)
+{
+    pmd_t *pmd_ptr = s2_walk_pmd(mm, va);
+    pte_t *pte_tbl;
+    rt_uint64_t pa, attr;
+
+    if (pmd_ptr == RT_NULL || (*pmd_ptr & MMU_TYPE_MASK) != MMU_TYPE_TABLE)
+        return RT_EOK;
+
+    pte_tbl = (pte_t *)(*pmd_ptr & TABLE_ADDR_MASK);
+    pa = pte_tbl[0] & TABLE_ADDR_MASK;
+    attr = pte_tbl[0] & ~(TABLE_ADDR_MASK | MMU_TYPE_MASK);
+    if ((pte_tbl[0] & MMU_TYPE_MASK) != MMU_TYPE_PAGE || !IS_2M_ALIGN(pa))
+        return -RT_EINVAL;
+
+    for (rt_size_t i = 1; i < S2_PTE_NUM; i++)
+    {
+        if (pte_tbl[i] != ((pa + i * S2_PTE_SIZE) | attr | MMU_TYPE_PAGE))
+            return -RT_EINVAL;
+    }
+
+    s2_clear_pmd(pmd_ptr);
+    flush_vm_ipa_tlb(mm->vm, va);
+    s2_set_pmd(pmd_ptr, pa | attr | MMU_TYPE_BLOCK);
+    clear_s2_mmu_page(mm->vm->id, pte_tbl);
+    s2_tc_flush(mm);
+
+    return RT_EOK;
+}
+
+/*
+ * Set the access permission of [va, va_end) to S2_AP_RO or S2_AP_RW. Blocks
+ * partly in the range are split first, holes are skipped.
+ */
+rt_err_t s2_protect(struct mm_struct *mm, rt_ubase_t va, rt_ubase_t va_end, rt_uint64_t ap)
+{
+    rt_ubase_t start = va;
+    rt_uint64_t *entry;
+    rt_size_t size;
+    rt_err_t ret = RT_EOK;
+
+    RT_ASSERT(IS_4K_ALIGN(va) && IS_4K_ALIGN(va_end));
+
+    while (va < va_end)
     {
-		*pa = (*pmd_ptr & S2_VA_MASK) + pmd_offset;
-    	return RT_EOK;
+        entry = s2_walk(mm, va, &size);
+        if (entry == RT_NULL)
+        {
+            va = RT_ALIGN_DOWN(va, size) + size;
+            continue;
+        }
+
+        if ((va & (size - 1)) || va_end - va < size)
+        {
+            ret = (size == S2_PMD_SIZE) ? s2_split_block(mm, va) : -RT_EINVAL;
+            if (ret)
+                break;
+            continue;
+        }
+
+        WRITE_ONCE(*entry, (*entry & ~S2_AP_MASK) | ap);
+        va += size;
     }
+    s2_tc_flush(mm);
+
+    if (va_end - start == S2_PTE_SIZE)
+        flush_vm_ipa_tlb(mm->vm, start);
+    else
+        flush_vm_all_tlb(mm->vm);
 
-    pte_ptr = S2_PTE_OFFSET((pte_t *)(*pte_ptr & S2_VA_MASK), va);
-    phy_addr = *pte_ptr & S2_VA_MASK;
-    if (phy_addr == 0)
+    return ret;
+}
+
+/*
+ * Point the page or block at @va to @pa with access @ap, attributes stay.
+ * Break before make, the old output address may be gone once it returns.
+ */
+rt_err_t s2_remap(struct mm_struct *mm, rt_ubase_t va, rt_uint64_t pa, rt_uint64_t ap)
+{
+    rt_uint64_t *entry, old, oa_mask;
+    rt_size_t size;
+
+    entry = s2_walk(mm, va, &size);
+    if (entry == RT_NULL || (pa & (size - 1)))
+        return -RT_EINVAL;
+
+    oa_mask = TABLE_ADDR_MASK & ~(size - 1);
+    old = *entry;
+    WRITE_ONCE(*entry, 0);
+    flush_vm_ipa_tlb(mm->vm, va);
+    WRITE_ONCE(*entry, (old & ~(oa_mask | S2_AP_MASK)) | pa | ap);
+    s2_tc_flush(mm);
+
+    return RT_EOK;
+}
+
+/*
+ * Translation
+ */
+rt_err_t s2_translate(struct mm_struct *mm, rt_uint64_t va, rt_ubase_t *pa)
+{
+    rt_uint64_t leaf;
+    rt_size_t size;
+
+    leaf = s2_lookup(mm, va, &size);
+    if (leaf == 0)
         return -RT_ERROR;
-    
-    *pa = phy_addr + pte_offset;
+
+    *pa = S2_LEAF_PA(leaf, size, va);
     return RT_EOK;
 }
\ No newline at end of file
@@ -6,6 +6,11 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-06-19     Suqier       first version
+ * 2022-12-02     Suqier       split, merge and write protect for dirty logging
+ * 2022-12-04     Suqier       remap a leaf for copy-on-write
+ * 2022-12-09     Suqier       translation cache
+ * 2022-12-10     Suqier       table size of a VM
+ * 2022-12-11     Suqier       unmap a whole VM when it is deleted
  */
 
 #ifndef __STAGE2_H__
@@ -75,6 +80,7 @@
 #define S2_SH_IS    (0b11 << 8)
 #define S2_AP_RO	(0b01 << 6)
 #define S2_AP_RW	(0b11 << 6)
+#define S2_AP_MASK	(0b11 << 6)
 
 #define S2_MEMATTR_DEV_nGnRnE	(0b0000 << 2)
 #define S2_MEMATTR_DEV_nGnRE	(0b0001 << 2)
@@ -141,7 +147,11 @@
 
 #define TABLE_ADDR_MASK    (0xFFFFFFFFF000UL)  /* [47:12] */
 #define L1_BLOCK_OA_MASK   (0xFFFFC0000000UL)  /* [47:30] */
-#define L2_BLOCK_OA_MASK   (0xFFFFFFF00000UL)  /* [47:21] */
+#define L2_BLOCK_OA_MASK   (0xFFFFFFE00000UL)  /* [47:21] */
+
+/* output address of @va in the @size page or block of @leaf */
+#define S2_LEAF_PA(leaf, size, va) \
+    (((leaf) & TABLE_ADDR_MASK & ~((rt_uint64_t)(size) - 1)) | ((va) & ((size) - 1)))
 
 #define WRITE_ONCE(x, val)    *(volatile typeof(x) *)&(x) = (val);
 
@@ -155,8 +165,20 @@ void rt_init_s2_mmu_table(void);
 
 
 void *alloc_vm_pgd(rt_uint8_t vm_idx);
+rt_size_t s2_table_size(rt_uint8_t vm_idx);
 rt_err_t s2_map(struct mm_struct *mm, struct mem_desc *desc);
 rt_err_t s2_unmap(struct mm_struct *mm, rt_ubase_t va, rt_ubase_t va_end);
+void s2_unmap_all(struct mm_struct *mm);
 rt_err_t s2_translate(struct mm_struct *mm, rt_uint64_t va, rt_ubase_t *pa);
+rt_uint64_t *s2_walk(struct mm_struct *mm, rt_ubase_t va, rt_size_t *size);
+rt_uint64_t s2_lookup(struct mm_struct *mm, rt_ubase_t va, rt_size_t *size);
+void s2_tc_init(struct mm_struct *mm);
+void s2_tc_flush(struct mm_struct *mm);
+
+/* write protection and copy-on-write, guest RAM may be split into pages on the way */
+rt_err_t s2_split_block(struct mm_struct *mm, rt_ubase_t va);
+rt_err_t s2_merge_block(struct mm_struct *mm, rt_ubase_t va);
+rt_err_t s2_protect(struct mm_struct *mm, rt_ubase_t va, rt_ubase_t va_end, rt_uint64_t ap);
+rt_err_t s2_remap(struct mm_struct *mm, rt_ubase_t va, rt_uint64_t pa, rt_uint64_t ap);
 
 #endif  /* __STAGE2_H__ */
\ No newline at end of file
@@ -6,6 +6,9 @@
  * Change Logs:
  * Date           Author       Notes
  * 2012-06-08     Suqier       first version
+ * 2022-11-27     Suqier       decode data aborts without a valid syndrome
+ * 2022-12-02     Suqier       write faults of dirty page logging
+ * 2022-12-04     Suqier       write faults of copy-on-write pages
  */
 
 #include <bitmap.h>
@@ -16,6 +19,7 @@
 
 #include "virt_arch.h"
 #include "trap.h"
+#include "mmio_insn.h"
 
 extern void rt_hw_trap_error(struct rt_hw_exp_stack *regs);
 
@@ -29,16 +33,17 @@ void ec_unknown_handler(struct rt_hw_exp_stack *regs, rt_uint32_t esr)
 /* for ESR_EC_WFX */
 void ec_wfx_handler(struct rt_hw_exp_stack *regs, rt_uint32_t esr)
 {
-    vcpu_suspend(get_curr_vcpu());
-    rt_kprintf("[Debug] tid->name = %s, curr_el = %d\n", 
-        rt_thread_self()->name, rt_hw_get_current_el());
+    if ((esr & ESR_WFX_TI_MASK) == ESR_WFX_TI_WFE)
+        vcpu_on_spin(get_curr_vcpu());
+    else
+        vcpu_halt(get_curr_vcpu());
 }RT_INSTALL_SYNC_DESC(ec_wfx, ec_wfx_handler, 4);
 
 /* for ESR_EC_HVC64 */
 void ec_hvc64_handler(struct rt_hw_exp_stack *regs, rt_uint32_t esr)
 {
-    rt_kprintf("[Debug] %s, %d\n", __FUNCTION__, __LINE__);
-    while (1) {}
+    /* ELR_EL2 already points to the next instruction of HVC. */
+    hvc_dispatch(regs);
 }RT_INSTALL_SYNC_DESC(ec_hvc64, ec_hvc64_handler, 0);
 
 /* 
@@ -80,95 +85,110 @@ void ec_iabt_low_handler(gp_regs_t regs, rt_uint32_t esr)
     while(1) {}
 }RT_INSTALL_SYNC_DESC(ec_iabt_low, ec_iabt_low_handler, 0);
 
-/* for ESR_EC_DABT_LOW */
-rt_inline rt_bool_t is_fa_in(rt_uint64_t fa, rt_uint64_t base, rt_uint64_t size)
+/*
+ * HPFAR_EL2 holds the page of the faulting IPA, the offset in page is only in
+ * FAR_EL2 which is a guest VA and meaningless when FnV is set.
+ */
+static rt_uint64_t dabt_fault_ipa(rt_uint32_t esr, rt_uint64_t *far)
 {
-    return ((fa >= base) && (fa < base + size));
-}
+    rt_uint64_t hpfar, ipa;
 
-rt_inline rt_bool_t is_access_vgicd(rt_uint64_t fa)
-{
-    const struct os_desc *os = get_curr_vm()->os;
-    rt_uint64_t d = os->arch.vgic.gicd_addr;
-    return is_fa_in(fa, d, VGIC_GICD_SIZE);
+    GET_SYS_REG(HPFAR_EL2, hpfar);
+    ipa = (hpfar & HPFAR_FIPA_MASK) << 8;
+
+    *far = 0;
+    if (ESR_GET_FNV(esr) == ESR_FNV_VALID)
+    {
+        GET_SYS_REG(FAR_EL2, *far);
+        ipa |= *far & 0xFFF;
+    }
+
+    return ipa;
 }
 
-rt_inline rt_bool_t is_access_vgicr(rt_uint64_t fa)
+/* Walk both stages for the guest PC, PAR_EL1 belongs to the guest. */
+static rt_err_t dabt_fetch_insn(rt_uint64_t pc, rt_uint32_t *insn, rt_uint64_t *pa)
 {
-    const struct os_desc *os = get_curr_vm()->os;
-    rt_uint64_t r = os->arch.vgic.gicr_addr;
-    return is_fa_in(fa, r, VGIC_GICR_SIZE);
+    rt_uint64_t par, guest_par;
+
+    GET_SYS_REG(PAR_EL1, guest_par);
+    __asm__ volatile ("at s12e1r, %0"::"r"(pc):"memory");
+    rt_hw_isb();
+    GET_SYS_REG(PAR_EL1, par);
+    SET_SYS_REG(PAR_EL1, guest_par);
+
+    if (par & PAR_F)
+        return -RT_ERROR;
+
+    *pa = (par & PAR_PA_MASK) | (pc & 0xFFF);
+    *insn = *(volatile rt_uint32_t *)*pa;
+    return RT_EOK;
 }
 
-static void vdev_mmio_handler(gp_regs_t regs, access_info_t acc)
+/* ISV == 0, decode the instruction at ELR_EL2, recently used ones are cached */
+static const struct mmio_insn *dabt_decode(gp_regs_t regs, struct mmio_insn *buf)
 {
-    vm_t vm = get_curr_vm();
+    struct mmio_insn_cache *cache = &get_curr_vcpu()->arch->insn_cache;
+    const struct mmio_insn *d;
+    rt_uint64_t pc = regs->pc, ttbr, pa;
+    rt_uint32_t insn;
+
+    if (regs->spsr & PSR_MODE32_BIT)
+        return RT_NULL;     /* AArch32 guest */
+
+    if (bit_get(pc, 55))
+        GET_SYS_REG(EL1_(TTBR1), ttbr)
+    else
+        GET_SYS_REG(EL1_(TTBR0), ttbr)
+
+    d = mmio_insn_cache_lookup(cache, pc, ttbr);
+    if (d)
+        return d;
 
-    /* find base address in virtual device */
-    struct rt_list_node *pos;
-    rt_list_for_each(pos, &vm->dev_list)
+    if (dabt_fetch_insn(pc, &insn, &pa) != RT_EOK)
     {
-        vdev_t vdev = rt_list_entry(pos, struct vdev, node);
-        
-        if (vdev->is_open)
-        {
-            for(rt_uint8_t i = 0; i < vdev->mmap_num; i++)
-            {
-                if ((acc.addr >= vdev->region->vaddr_start)
-                &&  (acc.addr <  vdev->region->vaddr_end))
-                {
-                    if (vdev->ops->mmio)
-                        vdev->ops->mmio(regs, acc);
-
-                    return;
-                }
-            }
-        }
-        else
-            return;
+        rt_kprintf("[Error] Fetch instruction at 0x%016x failure\n", pc);
+        return RT_NULL;
     }
+    if (mmio_insn_decode(insn, buf) != RT_EOK)
+    {
+        rt_kprintf("[Error] Unsupported MMIO instruction 0x%08x\n", insn);
+        return RT_NULL;
+    }
+
+    mmio_insn_cache_fill(cache, pc, ttbr, pa, insn, buf);
+    return buf;
 }
 
+/* for ESR_EC_DABT_LOW */
 void ec_dabt_low_handler(gp_regs_t regs, rt_uint32_t esr)
 {
     rt_uint8_t dfsc = esr & FSC_TYPE_MASK;
-    rt_bool_t is_isv_valid = !!bit_get(esr, ESR_ISV_SHIFT);
-    if ((dfsc == FSC_TRANS || dfsc == FSC_PERM) && is_isv_valid)
+    struct mmio_insn buf;
+    const struct mmio_insn *d = &buf;
+    rt_uint64_t ipa, far;
+
+    if (dfsc == FSC_TRANS || dfsc == FSC_PERM)
     {
-        /* Parse ESR_EL2 register */
-        rt_bool_t is_write, far_valid;
-        rt_uint32_t val, srt;
-        rt_uint64_t fault_addr;
+        ipa = dabt_fault_ipa(esr, &far);
 
-        srt = ESR_GET_SRT(esr);
-        val = ESR_GET_WNR(esr);
-        is_write = (val == ESR_WNR_WRITE) ? RT_TRUE : RT_FALSE;
-        
-        val = ESR_GET_FNV(esr);
-        far_valid = (val == ESR_FNV_VALID) ? RT_TRUE : RT_FALSE;
-        if (far_valid)
+        /* first write to a logged or shared page of guest RAM, let it retry */
+        if (dfsc == FSC_PERM && vm_mem_write_fault(get_curr_vm()->mm, ipa) == RT_EOK)
         {
-            GET_SYS_REG(FAR_EL2, fault_addr);
+            regs->pc -= 4;
+            return;
         }
-        else
-            GET_SYS_REG(HPFAR_EL2, fault_addr);
 
-        access_info_t acc = 
-        {
-            .addr     = fault_addr,
-            .srt      = srt,
-            .is_write = is_write,
-        };
-
-        /* MMIO handler */
-        if(is_access_vgicd(acc.addr))
-            get_curr_vm()->vgic->ops->emulate(regs, acc, RT_TRUE);
-        else if (is_access_vgicr(acc.addr))
-            get_curr_vm()->vgic->ops->emulate(regs, acc, RT_FALSE);
+        /* MMIO handler, vGIC and open vdev regions */
+        if (bit_get(esr, ESR_ISV_SHIFT))
+            mmio_insn_from_esr(esr, &buf);
         else
-            vdev_mmio_handler(regs, acc);
+            d = dabt_decode(regs, &buf);
+
+        if (d && mmio_insn_emulate(regs, d, ipa, far) == RT_EOK)
+            return;
     }
-    else
+
     {
         rt_uint64_t fault_addr;
         GET_SYS_REG(FAR_EL2, fault_addr);
@@ -176,7 +196,7 @@ void ec_dabt_low_handler(gp_regs_t regs, rt_uint32_t esr)
         GET_SYS_REG(HPFAR_EL2, fault_addr);
         rt_kprintf("[Error] HPFAR_EL2 = 0x%016x\n", fault_addr);
 
-        rt_kprintf("[Error] Unsupported Type or ISV invalid, esr = 0x%08x\n", esr);
+        rt_kprintf("[Error] Unsupported data abort, esr = 0x%08x\n", esr);
         vcpu_fault(get_curr_vcpu());
     }
 }RT_INSTALL_SYNC_DESC(ec_dabt_low, ec_dabt_low_handler, 4);
@@ -17,6 +17,7 @@
 
 #include <armv8.h>
 #include "lib_helpers.h"
+#include "hypercall.h"
 
 #ifdef RT_USING_NVHE
 #include "nvhe/nvhe.h"
@@ -49,22 +50,6 @@
 #define ESR_EC_SERROR       (0b101111)
 #define ESR_EC_MAX		    (0b111111)
 
-/*
- * SMC Function Identifier
- * SMC64: Arm Architecture Calls (0xC0000000-0xC000FFFF)
- */
-#define HVC_FN64_BASE           (0xC0000000)
-#define HVC_FN64(n)             (HVC_FN64_BASE + (n))
-#define HVC_FN64_END            (0xC000FFFF)
-
-#define HVC_FN64_GET_VERSION    HVC_FN64(1)
-#define HVC_FN64_CREATE_VM      HVC_FN64(2)
-#define HVC_FN64_FREE_VM        HVC_FN64(3)
-#define HVC_FN64_MMAP_VM_MEM    HVC_FN64(4)
-
-typedef rt_uint64_t (*hvc_trap_handle)(rt_uint32_t fn, rt_uint64_t arg0, 
-                                    rt_uint64_t arg1, rt_uint64_t arg2);
-
 /*
  * Macro for sys64 handler
  */
@@ -111,16 +96,23 @@ typedef rt_uint64_t (*hvc_trap_handle)(rt_uint32_t fn, rt_uint64_t arg0,
 #define ESR_SYSREG_CNTP_CTL_EL0   ESR_SYSREG(3, 3, c14, c2, 1)
 #define ESR_SYSREG_CNTP_CVAL_EL0  ESR_SYSREG(3, 3, c14, c2, 2)
 
+/* ISS for WFI/WFE */
+#define ESR_WFX_TI_MASK     (0b1)
+#define ESR_WFX_TI_WFE      (0b1)   /* otherwise WFI */
+
 /* 
  * ISS for instruction/data abort from low level 
  */
 #define ESR_ISV_SHIFT   (24)
 
 #define ESR_SAS_SHIFT   (22)
-#define ESR_SAS_BYTE    (0x00 << ESR_SAS_SHIFT)
-#define ESR_SAS_HFWD    (0x01 << ESR_SAS_SHIFT)
-#define ESR_SAS_WORD    (0x10 << ESR_SAS_SHIFT)
-#define ESR_SAS_DBWD    (0x11 << ESR_SAS_SHIFT)
+#define ESR_SAS_BYTE    (0b00 << ESR_SAS_SHIFT)
+#define ESR_SAS_HFWD    (0b01 << ESR_SAS_SHIFT)
+#define ESR_SAS_WORD    (0b10 << ESR_SAS_SHIFT)
+#define ESR_SAS_DBWD    (0b11 << ESR_SAS_SHIFT)
+
+#define ESR_SSE_SHIFT   (21)    /* sign extend */
+#define ESR_SF_SHIFT    (15)    /* 64-bit register */
 
 #define ESR_SRT_SHIFT   (16)
 #define ESR_SRT_MASK    (0x1F0000)
@@ -136,6 +128,13 @@ typedef rt_uint64_t (*hvc_trap_handle)(rt_uint32_t fn, rt_uint64_t arg0,
 #define ESR_WNR_MASK    (1 << ESR_WNR_SHIFT)
 #define ESR_GET_WNR(e)  ((e & ESR_WNR_MASK) >> ESR_WNR_SHIFT)
 
+#define HPFAR_FIPA_MASK (0xFFFFFFFFFF0UL)   /* IPA[51:12] in [43:4] */
+
+#define PAR_F           (0x1UL)             /* AT failed */
+#define PAR_PA_MASK     (0xFFFFFFFFF000UL)
+
+#define PSR_MODE32_BIT  (0x10)
+
 #define FSC_MASK        (0x3F)
 #define FSC_TYPE_MASK   (0x3C)
 #define FSC_ADDR        (0x00)  /* Address size fault */
@@ -149,6 +148,7 @@ typedef struct
     rt_uint64_t addr;
     rt_uint32_t srt;
     rt_bool_t   is_write;
+    rt_uint8_t  size;       /* bytes, 1 ~ 8 */
 }access_info_t;
 
 /* Sync excepition handler definition */
@@ -6,8 +6,12 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-06-18     Suqier       first version
+ * 2022-12-10     Suqier       charge vGIC to the memory quota
+ * 2022-12-11     Suqier       vgic_free() frees gicd and gicr too
+ * 2022-12-12     Suqier       inject under the lock of vcpu_halt()
  */
 
+#include <rthw.h>
 #include <rtconfig.h>
 #include <cpuport.h>
 #include <bitmap.h>
@@ -16,10 +20,12 @@
 #include "vgic.h"
 #include "vm.h"
 #include "os.h"
+#include "mm.h"
+#include "mem_quota.h"
 
-#define MAX_OS_NUM  3
-
-extern const struct os_desc os_img[MAX_OS_NUM];
+/* struct vgic of vgic_create(), gicd and a gicr per vCPU */
+#define VGIC_MEM_SIZE(nr_vcpus) \
+    (sizeof(struct vgic) + sizeof(struct vgicd) + (nr_vcpus) * sizeof(struct vgicr))
 
 const static struct vgic_ops vgic_ops = 
 {
@@ -30,7 +36,7 @@ const static struct vgic_ops vgic_ops =
 
 static rt_uint64_t read_idle_lr_reg(void);
 static void vgic_lr_list_sort(struct vcpu *vcpu);
-static void vgic_lr_list_insert(struct vcpu *vcpu, rt_uint64_t lr);
+static rt_bool_t vgic_lr_list_insert(struct vcpu *vcpu, rt_uint64_t lr);
 static void vgic_lr_list_remove(struct vcpu *vcpu, rt_size_t rm_idx);
 
 /* For vGIC create & init */
@@ -91,6 +97,7 @@ void vgicr_init(vgicr_t gicr, struct vcpu *vcpu)
 
     /* get from device tree */ 
     rt_memset((void *)&gicr->lr_list, 0, GIC_LR_LIST_NUM * sizeof(rt_uint64_t));
+    gicr->tail = 0;
 
     for (rt_size_t i = 0; i < VIRQ_PRIV_NUM; i++)
     {
@@ -111,23 +118,26 @@ void vgicr_init(vgicr_t gicr, struct vcpu *vcpu)
         gicr->virqs[i].cfg = 0b10;
 }
 
-static void vgic_info_init(struct vgic_info *info, rt_uint64_t os_idx)
+static void vgic_info_init(struct vgic_info *info, const struct os_desc *os)
 {
-    info->gicd_addr = os_img[os_idx].arch.vgic.gicd_addr;
-    info->gicr_addr = os_img[os_idx].arch.vgic.gicr_addr;
+    info->gicd_addr = os->arch.vgic.gicd_addr;
+    info->gicr_addr = os->arch.vgic.gicr_addr;
 }
 
-void vgic_init(struct vm *vm)
+rt_err_t vgic_init(struct vm *vm)
 {
     RT_ASSERT(vm);
     vgic_t v = vm->vgic;
-    rt_uint64_t os_idx = vm->os_idx;
+
+    if (mem_quota_charge(vm->mm, VM_MEM_VGIC, VGIC_MEM_SIZE(vm->nr_vcpus)))
+        return -RT_ENOMEM;
 
     vgicd_t gicd = (vgicd_t)rt_malloc(sizeof(struct vgicd));
     if (gicd == RT_NULL)
     {
+        mem_quota_uncharge(vm->mm, VM_MEM_VGIC, VGIC_MEM_SIZE(vm->nr_vcpus));
         rt_kputs("[Error] Alloc memory for gicd failure\n");
-        return;
+        return -RT_ENOMEM;
     }
     
     rt_kprintf("0x%08x - 0x%08x\n", gicd, gicd + sizeof(struct vgicd));
@@ -147,7 +157,7 @@ void vgic_init(struct vm *vm)
             break;
     }
 
-    vgic_info_init(&v->info, os_idx);
+    vgic_info_init(&v->info, vm->os);
     rt_memset((void *)&v->ctxt, 0, sizeof(struct vgic_context));
     v->ops = &vgic_ops;
 
@@ -161,13 +171,20 @@ void vgic_init(struct vm *vm)
 	v->ctxt.ich_vmcr_el2 = (GROUP1_INT << ICH_VMCR_VENG_OFF) 
                        | (ICH_VMPR_VAL << ICH_VMPR_OFF);
 	v->ctxt.ich_hcr_el2  = ICH_HCR_EN;
+    return RT_EOK;
 }
 
+/* struct vgic with the gicd and gicr vgic_init() gave it, if it ran */
 void vgic_free(vgic_t v)
 {
+    if (v == RT_NULL)
+        return;
+
+    for (rt_size_t i = 0; i < MAX_VCPU_NUM; i++)
+        rt_free(v->gicr[i]);
+    rt_free(v->gicd);
     v->ops = RT_NULL;
     rt_free(v);
-    v = RT_NULL;
 }
 
 /*  
@@ -476,7 +493,7 @@ static void vgic_gicr_sgi_write_priority(rt_uint64_t off, rt_uint64_t *val)
 
     for (rt_size_t i = 0; i < 4; i++, irq++)
     {
-        virq_t virq = &v->gicr[vcpu_id]->virqs[i];
+        virq_t virq = &v->gicr[vcpu_id]->virqs[irq];
         virq->prio = *val & 0xFFUL;
         v->ops->update(get_curr_vcpu(), virq, UPDATE_PRIO);
         *val = *val >> 8;
@@ -719,9 +736,10 @@ static void vgic_context_save_lr(struct vcpu *vcpu, rt_uint32_t nr_lr)
         if(bit_get(elrsr, i) == 0)
         {
             lr = read_lr(&vcpu->vm->vgic->ctxt, i);
-            vgic_lr_list_insert(vcpu, lr);
-         
-            write_lr(&vcpu->vm->vgic->ctxt, i, 0);
+
+            /* keep it in LR if lr_list has no room, or it would be lost */
+            if (vgic_lr_list_insert(vcpu, lr))
+                write_lr(&vcpu->vm->vgic->ctxt, i, 0);
         }
     }
 }
@@ -758,7 +776,6 @@ void hook_vgic_context_save(struct vcpu *vcpu)
 /* Pick nr_lr vIRQ in lr_list and write it into LR. */
 static void vgic_context_restore_lr(struct vcpu *vcpu, rt_uint32_t nr_lr)
 {
-    rt_size_t rm_idx = 0;
     rt_uint64_t elrsr = read_idle_lr_reg();
     vgicr_t gicr = vcpu->vm->vgic->gicr[vcpu->id]; 
 
@@ -766,18 +783,18 @@ static void vgic_context_restore_lr(struct vcpu *vcpu, rt_uint32_t nr_lr)
     {
         if(bit_get(elrsr, i))   /* find idle LR */
         {   
-            if (GET_LR_RES0(gicr->lr_list[rm_idx]) == 0)
+            /* lr_list[0] is always the highest priority one */
+            if (GET_LR_RES0(gicr->lr_list[0]) == 0)
                 break;
             else
             {
-                write_lr(&vcpu->vm->vgic->ctxt, i, gicr->lr_list[rm_idx]);
-                vgic_lr_list_remove(vcpu, rm_idx);
-                rm_idx++;
+                write_lr(&vcpu->vm->vgic->ctxt, i, gicr->lr_list[0] 
+                        & ~((rt_uint64_t)ICH_LR_RES0_MSK << ICH_LR_RES0_OFF));
+                vgic_lr_list_remove(vcpu, 0);
+                vgic_lr_list_sort(vcpu);
             }
         }
     }
-    
-    vgic_lr_list_sort(vcpu);
 }
 
 static void vgic_context_restore_arp(struct vgic_context *c, rt_uint32_t nr_pr)
@@ -850,7 +867,7 @@ virq_t vgic_get_virq(struct vcpu *vcpu, int ir)
 void vgic_virq_register(struct vm *vm)
 {
     /* Associated Physical Interrupts */
-    const struct devs_info *devs = &os_img[vm->os_idx].devs;
+    const struct devs_info *devs = &vm->os->devs;
 
     for (rt_size_t i = 0; i < devs->num; i++)
     {
@@ -932,7 +949,10 @@ static void rt_swap_lr_reg(rt_uint64_t *a, rt_uint64_t *b)
     *a = temp;
 }
 
-/* output: from big to small (9 -> 0)*/
+/* 
+ * Sift down for a heap keyed by GIC priority, a lower value is a higher
+ * priority, so arr[0] ends up with the most urgent vIRQ.
+ */
 static void 
 lr_list_heap_sort(rt_uint64_t arr[], rt_size_t start, rt_size_t end)
 {
@@ -940,10 +960,10 @@ lr_list_heap_sort(rt_uint64_t arr[], rt_size_t start, rt_size_t end)
     rt_size_t son = dad * 2 + 1;
     while (son <= end)
     {   
-        if (son + 1 <= end && GET_LR_PRIO(arr[son]) < GET_LR_PRIO(arr[son + 1])) 
+        if (son + 1 <= end && GET_LR_PRIO(arr[son]) > GET_LR_PRIO(arr[son + 1])) 
             son++;
         
-        if (GET_LR_PRIO(arr[son]) < GET_LR_PRIO(arr[dad])) 
+        if (GET_LR_PRIO(arr[son]) >= GET_LR_PRIO(arr[dad])) 
             return;
         else
         { 
@@ -957,8 +977,8 @@ lr_list_heap_sort(rt_uint64_t arr[], rt_size_t start, rt_size_t end)
 static void 
 lr_list_heap_create(rt_uint64_t arr[], rt_size_t start, rt_size_t end)
 {
-	for(rt_int16_t i = (end - start) / 2; i >= 0; i--)
-		lr_list_heap_sort(arr, start, end);
+	for(rt_int16_t i = (end - start) / 2; i >= (rt_int16_t)start; i--)
+		lr_list_heap_sort(arr, i, end);
 }
 
 static void vgic_lr_list_sort(struct vcpu *vcpu)
@@ -984,17 +1004,23 @@ static rt_bool_t vgic_is_lr_in_list(struct vcpu *vcpu, rt_uint64_t lr)
     return RT_FALSE;
 }
 
-static void vgic_lr_list_insert(struct vcpu *vcpu, rt_uint64_t lr)
+/* Return RT_TRUE if this vIRQ is recorded in lr_list. */
+static rt_bool_t vgic_lr_list_insert(struct vcpu *vcpu, rt_uint64_t lr)
 {
-    if (!vgic_is_lr_list_full(vcpu) && !vgic_is_lr_in_list(vcpu, lr))
+    if (vgic_is_lr_in_list(vcpu, lr))
+        return RT_TRUE;
+
+    if (!vgic_is_lr_list_full(vcpu))
     {
         vgicr_t gicr = vcpu->vm->vgic->gicr[vcpu->id];
         gicr->lr_list[gicr->tail] = lr;
         gicr->lr_list[gicr->tail] |= (rt_uint64_t)1 << ICH_LR_RES0_OFF;
         gicr->tail++;
+        return RT_TRUE;
     }
-    else
-        vgic_call_maintenance_irq();
+
+    vgic_call_maintenance_irq();
+    return RT_FALSE;
 }
 
 static void vgic_lr_list_remove(struct vcpu *vcpu, rt_size_t rm_idx)
@@ -1036,25 +1062,34 @@ void vgic_inject(struct vcpu *vcpu, virq_t virq)
      *
      * If there's no idle index or no pending interrupt in lr_list, 
      * call maintenance interrupt.
+     *
+     * vcpu_halt() checks for a wakeup and marks the vCPU halted under the
+     * same lock, so an inject from another core lands either before its
+     * check or after it is halted, and kicks it then.
      */
+    rt_base_t level = rt_hw_interrupt_disable();
     rt_uint64_t lr = vgic_get_lr_from_virq(virq);
     
-    if (vgic_is_lr_in_list(vcpu, lr))  /* This lr is already in the list */
+    /* disabled, already in LR or in the list, or the list is full */
+    if (lr == 0 || vgic_is_lr_in_list(vcpu, lr) || !vgic_lr_list_insert(vcpu, lr))
+    {
+        rt_hw_interrupt_enable(level);
         return;
-    else
-        vgic_lr_list_insert(vcpu, lr);
-
-    rt_uint32_t nr_lr = vcpu->vm->vgic->ctxt.nr_lr;
-    rt_uint64_t elrsr = read_idle_lr_reg();
-    vgicr_t gicr = vcpu->vm->vgic->gicr[vcpu->id]; 
-    rt_size_t virq_size = gicr->tail + 1;
+    }
 
-    for (rt_size_t i = 0; i < nr_lr; i++)
-        if(bit_get(elrsr, i) == 0)
-            virq_size++;
+    /*
+     * LRs only hold the vCPU running on this thread, e.g. a device model
+     * injecting from a host thread or ISR must leave it to the restore hook.
+     */
+    if (get_vcpu_by_thread(rt_thread_self()) != vcpu || vcpu->halted)
+    {
+        vcpu_kick(vcpu);
+        rt_hw_interrupt_enable(level);
+        return;
+    }
 
-    if (virq_size > nr_lr + GIC_LR_LIST_NUM)
-        vgic_call_maintenance_irq();
+    /* lr_list overflow has already raised maintenance IRQ in insert */
+    rt_uint32_t nr_lr = vcpu->vm->vgic->ctxt.nr_lr;
 
     /* save all not active LR vIRQ into lr_list first */
     vgic_context_save_lr(vcpu, nr_lr);
@@ -1064,6 +1099,28 @@ void vgic_inject(struct vcpu *vcpu, virq_t virq)
 
     /* pick new vIRQ into LR from lr_list */
     vgic_context_restore_lr(vcpu, nr_lr);
+    rt_hw_interrupt_enable(level);
+}
 
-    vcpu_go(vcpu);
+/* Any vIRQ waiting in lr_list or pending in a loaded LR wakes up WFI. */
+rt_bool_t vgic_vcpu_pending(struct vcpu *vcpu)
+{
+    struct vgic_context *c = &vcpu->vm->vgic->ctxt;
+    rt_uint64_t elrsr, lr;
+
+    if (!vgic_is_lr_list_empty(vcpu))
+        return RT_TRUE;
+
+    elrsr = read_idle_lr_reg();
+    for (rt_size_t i = 0; i < c->nr_lr; i++)
+    {
+        if (bit_get(elrsr, i) == 0)
+        {
+            lr = read_lr(c, i);
+            if ((lr >> ICH_LR_STAT_OFF) & VIRQ_STATUS_PENDING)
+                return RT_TRUE;
+        }
+    }
+
+    return RT_FALSE;
 }
@@ -6,6 +6,7 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-06-18     Suqier       first version
+ * 2022-12-10     Suqier       vgic_init() fails on the memory quota
  */
 
 #ifndef __VGIC_H__
@@ -302,7 +303,7 @@ rt_inline rt_bool_t is_virq_priv(virq_t virq)
 vgic_t vgic_create(void);
 void vgicd_init(struct vm *vm, vgicd_t gicd);       /* using when vgic init in init VM */
 void vgicr_init(vgicr_t gicr, struct vcpu *vcpu);   /* using when create vcpu */
-void vgic_init (struct vm *vm);
+rt_err_t vgic_init (struct vm *vm);
 void vgic_free (vgic_t v);
 
 void hook_vgic_context_save(struct vcpu *vcpu);
@@ -317,6 +318,7 @@ void vgic_virq_umount(struct vm *vm, int ir);
 void vgic_emulate(gp_regs_t regs, access_info_t acc, rt_bool_t gicd);
 void vgic_update(struct vcpu *vcpu, virq_t virq, rt_uint8_t update_id);
 void vgic_inject(struct vcpu *vcpu, virq_t virq);
+rt_bool_t vgic_vcpu_pending(struct vcpu *vcpu);
 #endif  /* BSP_USING_GIC && BSP_USING_GICV3 */
 
 #endif  /* __VGIC_H__ */
@@ -6,6 +6,7 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-05-28     Suqier       first version
+ * 2022-12-12     Suqier       trap guest WFI and WFE
  */
 
 #ifndef __VHE_H__
@@ -38,7 +39,7 @@
 			             HCR_AMO | HCR_SWIO | HCR_TIDCP | HCR_RW | \
 			             HCR_FMO | HCR_IMO | HCR_PTW)
  */
-#define HCR_GUEST_FLAGS 	(HCR_TSC | HCR_IMO | HCR_FMO | HCR_VM | HCR_RW)
+#define HCR_GUEST_FLAGS 	(HCR_TSC | HCR_TWI | HCR_TWE | HCR_IMO | HCR_FMO | HCR_VM | HCR_RW)
 #define HCR_VIRT_EXCP_MASK 	(HCR_VSE | HCR_VI  | HCR_VF)
 #define HCR_HOST_VHE_FLAGS 	(HCR_RW  | HCR_TGE | HCR_E2H)
 
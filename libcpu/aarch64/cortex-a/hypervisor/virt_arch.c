@@ -6,6 +6,9 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-06-21     Suqier       first version
+ * 2022-12-03     Suqier       guest register frame of a vCPU
+ * 2022-12-07     Suqier       flush the stage 2 entries of an IPA range
+ * 2022-12-12     Suqier       guests trap WFI and WFE
  */
 
 #include <cpuport.h>
@@ -70,6 +73,64 @@ void flush_vm_all_tlb(vm_t vm)
         SET_SYS_REG(VTTBR_EL2, old_vttbr);
 }
 
+/* Drop the stage 2 entry of @ipa, and every stage 1&2 entry of the VM. */
+void flush_vm_ipa_tlb(vm_t vm, rt_uint64_t ipa)
+{
+    struct mm_struct *mm = vm->mm;
+    rt_uint64_t vttbr = ((rt_uint64_t)mm->pgd_tbl & S2_VA_MASK) 
+                      | ((rt_uint64_t)vm->id << VMID_SHIFT);
+
+    rt_uint64_t old_vttbr; 
+    GET_SYS_REG(VTTBR_EL2, old_vttbr);
+
+    if (old_vttbr != vttbr)
+        SET_SYS_REG(VTTBR_EL2, vttbr);
+
+	__asm__ volatile (
+		"dsb ishst\n\r"
+		"tlbi ipas2e1is, %0\n\r"
+		"dsb ish\n\r"
+		"tlbi vmalle1is\n\r"
+		"dsb ish\n\r"
+		"isb\n\r"
+		::"r"(ipa >> S2_PTE_SHIFT):"memory"
+	);
+
+    if (old_vttbr != vttbr)
+        SET_SYS_REG(VTTBR_EL2, old_vttbr);
+}
+
+/*
+ * Drop the stage 2 entries of [@ipa, @ipa + @size), one every @stride, the
+ * smallest leaf size in the range, and every stage 1&2 entry of the VM.
+ */
+void flush_vm_ipa_range_tlb(vm_t vm, rt_uint64_t ipa, rt_size_t size, rt_size_t stride)
+{
+    struct mm_struct *mm = vm->mm;
+    rt_uint64_t vttbr = ((rt_uint64_t)mm->pgd_tbl & S2_VA_MASK) 
+                      | ((rt_uint64_t)vm->id << VMID_SHIFT);
+
+    rt_uint64_t old_vttbr; 
+    GET_SYS_REG(VTTBR_EL2, old_vttbr);
+
+    if (old_vttbr != vttbr)
+        SET_SYS_REG(VTTBR_EL2, vttbr);
+
+    __asm__ volatile ("dsb ishst" ::: "memory");
+    for (rt_uint64_t va = ipa; va < ipa + size; va += stride)
+        __asm__ volatile ("tlbi ipas2e1is, %0" :: "r"(va >> S2_PTE_SHIFT) : "memory");
+	__asm__ volatile (
+		"dsb ish\n\r"
+		"tlbi vmalle1is\n\r"
+		"dsb ish\n\r"
+		"isb\n\r"
+		::: "memory"
+	);
+
+    if (old_vttbr != vttbr)
+        SET_SYS_REG(VTTBR_EL2, old_vttbr);
+}
+
 rt_inline rt_uint64_t get_vtcr_el2(void)
 {
 	rt_uint64_t vtcr_val = 0UL;
@@ -79,6 +140,11 @@ rt_inline rt_uint64_t get_vtcr_el2(void)
 	return vtcr_val;
 }
 
+/* a guest WFI must reach vcpu_halt(), a WFE vcpu_on_spin() */
+#if !(HCR_GUEST_FLAGS & HCR_TWI) || !(HCR_GUEST_FLAGS & HCR_TWE)
+#error "HCR_GUEST_FLAGS does not trap WFI and WFE"
+#endif
+
 void vcpu_state_init(struct vcpu *vcpu)
 {
     vm_t vm = vcpu->vm;
@@ -135,6 +201,16 @@ void vcpu_regs_dump(struct vcpu *vcpu)
     rt_kprintf("SPSR_EL1   : 0x%016x\n", c->sys_regs[_SPSR_EL1]);
 }
 
+/* Same place rt_hw_stack_init() builds the first frame of the thread. */
+void *vcpu_guest_frame(struct vcpu *vcpu)
+{
+    rt_thread_t tid = vcpu->tid;
+    rt_ubase_t top = RT_ALIGN_DOWN((rt_ubase_t)tid->stack_addr 
+                                + tid->stack_size - sizeof(rt_ubase_t), 16);
+
+    return (void *)(top - VCPU_GUEST_FRAME_SIZE);
+}
+
 /* 
  * When vCPU sche in 
  */
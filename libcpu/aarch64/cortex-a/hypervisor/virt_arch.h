@@ -6,6 +6,8 @@
  * Change Logs:
  * Date           Author       Notes
  * 2022-06-21     Suqier       first version
+ * 2022-12-03     Suqier       guest register frame of a vCPU
+ * 2022-12-07     Suqier       flush the stage 2 entries of an IPA range
  */
 
 #ifndef __VIRT_H__
@@ -15,6 +17,7 @@
 #include <lib_helpers.h>
 
 #include "vgic.h"
+#include "mmio_insn.h"
 
 #ifndef RT_USING_SMP
 #define RT_CPUS_NR      1
@@ -106,6 +109,9 @@ struct vcpu_arch
 
 	/* Values of trap registers for the host before guest entry. */
 	rt_uint64_t mdcr_el2_host;
+
+	/* decoded instructions of ISV == 0 data aborts */
+	struct mmio_insn_cache insn_cache;
 };
 
 struct vm_arch
@@ -140,9 +146,18 @@ rt_bool_t arm_sve_supported(void);
 
 void __flush_all_tlb(void);
 void flush_vm_all_tlb(struct vm *vm);
+void flush_vm_ipa_tlb(struct vm *vm, rt_uint64_t ipa);
+void flush_vm_ipa_range_tlb(struct vm *vm, rt_uint64_t ipa, rt_size_t size, rt_size_t stride);
+
+/* 
+ * While a vCPU is out of the guest, its guest registers sit at the top of
+ * the thread stack: struct rt_hw_exp_stack up to fpu, then Q0-Q15.
+ */
+#define VCPU_GUEST_FRAME_SIZE   (__builtin_offsetof(struct rt_hw_exp_stack, fpu) + 16 * 16)
 
 void vcpu_state_init(struct vcpu *vcpu);
 void vcpu_regs_dump(struct vcpu *vcpu);
+void *vcpu_guest_frame(struct vcpu *vcpu);
 
 /* Different type of switch handler interface in arch. */
 void host_to_guest_arch_handler(struct vcpu *vcpu);